@@ -1,10 +1,14 @@
 #include "args.h"
 
+#include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "optimizer.h"
+
 static int parse_measure_flag(const char *arg)
 {
   if (strcmp(arg, "all") == 0) {
@@ -23,10 +27,59 @@ static int parse_measure_flag(const char *arg)
     return MEASURE_COMPILE;
   } else if (strcmp(arg, "exec") == 0) {
     return MEASURE_EXEC;
+  } else if (strcmp(arg, "tasks") == 0) {
+    return MEASURE_TASKS;
+  } else if (strcmp(arg, "tasks-json") == 0) {
+    return MEASURE_TASKS_JSON;
+  } else if (strcmp(arg, "slabs") == 0) {
+    return MEASURE_SLABS;
+  } else if (strcmp(arg, "cycles") == 0) {
+    return MEASURE_CYCLES;
+  } else if (strcmp(arg, "heap") == 0) {
+    return MEASURE_HEAP;
   }
   return MEASURE_NONE;
 }
 
+/* Parses a non-negative integer argument, like --quantum, i.e., the
+ * number of loop iterations and calls a task gets before it's pre-
+ * empted, --workers, the number of threads run(...) uses, or --free-
+ * budget, the number of objects freed at a time in lazy mode. */
+static bool parse_count(const char *arg, uint32_t *count)
+{
+  char *end;
+  errno = 0;
+  unsigned long n = strtoul(arg, &end, 10);
+  if (errno != 0 || end == arg || *end != '\0' || arg[0] == '-' ||
+      n > UINT32_MAX) {
+    return false;
+  }
+  *count = (uint32_t) n;
+  return true;
+}
+
+/* Parses the comma-separated names of the passes --passes selects. */
+static bool parse_passes(const char *arg, uint32_t *passes)
+{
+  char *list = strdup(arg);
+  char *save = NULL;
+  bool ok = true;
+
+  *passes = 0;
+  for (char *name = strtok_r(list, ",", &save); name;
+       name = strtok_r(NULL, ",", &save)) {
+    uint32_t pass = find_pass(name);
+    if (!pass) {
+      ok = false;
+      break;
+    }
+    *passes |= pass;
+  }
+
+  free(list);
+  return ok;
+}
+
 ArgParseResult parse_args(int argc, char **argv)
 {
   static const struct option long_opts[] = {
@@ -35,6 +88,13 @@ ArgParseResult parse_args(int argc, char **argv)
       {"ir", no_argument, 0, 'i'},
       {"optimize", no_argument, 0, 'o'},
       {"measure", required_argument, 0, 'm'},
+      {"quantum", required_argument, 0, 'q'},
+      {"workers", required_argument, 0, 'w'},
+      {"free-budget", required_argument, 0, 'f'},
+      {"emit-bytecode", optional_argument, 0, 'e'},
+      {"no-cache", no_argument, 0, 'n'},
+      {"passes", required_argument, 0, 'P'},
+      {"optimize-rounds", required_argument, 0, 'r'},
       {0, 0, 0, 0},
   };
 
@@ -42,10 +102,21 @@ ArgParseResult parse_args(int argc, char **argv)
   int do_parse = 0;
   int do_ir = 0;
   int do_optimize = 0;
+  uint32_t passes = 0;
+  uint32_t listed_passes = 0;
+  bool passes_given = false;
+  uint32_t optimize_rounds = OPTIMIZE_MAX_ROUNDS;
+  int do_emit = 0;
+  char *emit_path = NULL;
+  int no_cache = 0;
   int measure_flags = 0;
+  uint32_t quantum = 0;
+  uint32_t workers = 1;
+  uint32_t free_budget = 0;
 
   int opt, opt_idx = 0;
-  while ((opt = getopt_long(argc, argv, "lpiom", long_opts, &opt_idx)) != -1) {
+  while ((opt = getopt_long(argc, argv, "lpioO::m", long_opts, &opt_idx)) !=
+         -1) {
     switch (opt) {
       case 'l':
         do_lex = 1;
@@ -57,20 +128,101 @@ ArgParseResult parse_args(int argc, char **argv)
         do_ir = 1;
         break;
       case 'o':
-        do_optimize = 1;
+        passes = passes_at_level(OPTIMIZE_MAX_LEVEL);
+        break;
+      case 'O': {
+        int level = OPTIMIZE_MAX_LEVEL;
+        if (optarg) {
+          level = optarg[0] - '0';
+          if (level < 0 || level > OPTIMIZE_MAX_LEVEL || optarg[1] != '\0') {
+            return (ArgParseResult){
+                .args = {0},
+                .is_ok = false,
+                .errcode = -1,
+                .msg = strdup("-O takes a level of 0, 1, or 2")};
+          }
+        }
+        passes = passes_at_level(level);
+        break;
+      }
+      case 'P':
+        if (!parse_passes(optarg, &listed_passes)) {
+          return (ArgParseResult){
+              .args = {0},
+              .is_ok = false,
+              .errcode = -1,
+              .msg = strdup("--passes takes a comma-separated list of fold, "
+                            "copyprop, unreachable, dse, licm, and "
+                            "peephole")};
+        }
+        passes_given = true;
+        break;
+      case 'r':
+        if (!parse_count(optarg, &optimize_rounds) || optimize_rounds == 0) {
+          return (ArgParseResult){
+              .args = {0},
+              .is_ok = false,
+              .errcode = -1,
+              .msg = strdup("--optimize-rounds requires a positive integer")};
+        }
+        break;
+      case 'e':
+        do_emit = 1;
+        emit_path = optarg;
+        break;
+      case 'n':
+        no_cache = 1;
         break;
       case 'm':
         measure_flags |= parse_measure_flag(optarg);
         break;
+      case 'q':
+        if (!parse_count(optarg, &quantum)) {
+          return (ArgParseResult){
+              .args = {0},
+              .is_ok = false,
+              .errcode = -1,
+              .msg = strdup("--quantum requires a non-negative integer")};
+        }
+        break;
+      case 'w':
+        if (!parse_count(optarg, &workers) || workers == 0 ||
+            workers > MAX_WORKERS) {
+          return (ArgParseResult){
+              .args = {0},
+              .is_ok = false,
+              .errcode = -1,
+              .msg = strdup("--workers requires an integer between 1 and 64")};
+        }
+        break;
+      case 'f':
+        if (!parse_count(optarg, &free_budget)) {
+          return (ArgParseResult){
+              .args = {0},
+              .is_ok = false,
+              .errcode = -1,
+              .msg = strdup("--free-budget requires a non-negative integer")};
+        }
+        break;
       default:
         return (ArgParseResult){
             .args = {0},
             .is_ok = false,
             .errcode = -1,
-            .msg = strdup("usage: %s [--lex] [--parse] [--ir] [--optimize]")};
+            .msg = strdup("usage: %s [--lex] [--parse] [--ir] [--optimize] "
+                          "[-O[LEVEL]] [--passes=LIST] "
+                          "[--optimize-rounds=N] "
+                          "[--emit-bytecode[=PATH]] [--no-cache] "
+                          "[--quantum=N] [--workers=N] [--free-budget=N]")};
     }
   }
 
+  /* --passes picks the passes itself, whatever the level says. */
+  if (passes_given) {
+    passes = listed_passes;
+  }
+  do_optimize = passes != 0;
+
   if (do_lex + do_optimize > 1) {
     return (ArgParseResult){
         .args = {0},
@@ -80,7 +232,7 @@ ArgParseResult parse_args(int argc, char **argv)
             strdup("--optimize available only from the parsing stage onwards")};
   }
 
-  if (do_lex + do_parse + do_ir > 1) {
+  if (do_lex + do_parse + do_ir + do_emit > 1) {
     return (ArgParseResult){
         .args = {0},
         .is_ok = false,
@@ -94,7 +246,15 @@ ArgParseResult parse_args(int argc, char **argv)
   args.parse = do_parse;
   args.ir = do_ir;
   args.optimize = do_optimize;
+  args.passes = passes;
+  args.optimize_rounds = optimize_rounds;
+  args.emit_bytecode = do_emit;
+  args.emit_path = emit_path;
+  args.no_cache = no_cache;
   args.measure_flags = measure_flags;
+  args.quantum = quantum;
+  args.workers = workers;
+  args.free_budget = free_budget;
   args.file = argv[optind];
 
   return (ArgParseResult){
@@ -2,13 +2,22 @@
 #define venom_args_h
 
 #include <stdbool.h>
+#include <stdint.h>
 
 typedef struct {
   int lex;
   int parse;
   int ir;
   int optimize;
+  uint32_t passes; /* see PASS_FOLD etc. in optimizer.h */
+  uint32_t optimize_rounds;
+  int emit_bytecode;
+  char *emit_path; /* NULL for the default (see vnmc_path()) */
+  int no_cache;
   int measure_flags;
+  uint32_t quantum;
+  uint32_t workers;
+  uint32_t free_budget;
   char *file;
 } Arguments;
 
@@ -21,6 +30,8 @@ typedef struct {
 
 ArgParseResult parse_args(int argc, char **argv);
 
+#define MAX_WORKERS 64
+
 #define MEASURE_NONE 0
 #define MEASURE_READ_FILE (1 << 0)
 #define MEASURE_LEX (1 << 1)
@@ -30,6 +41,11 @@ ArgParseResult parse_args(int argc, char **argv);
 #define MEASURE_DISASSEMBLE (1 << 5)
 #define MEASURE_COMPILE (1 << 6)
 #define MEASURE_EXEC (1 << 7)
+#define MEASURE_TASKS (1 << 8)
+#define MEASURE_TASKS_JSON (1 << 9)
+#define MEASURE_SLABS (1 << 10)
+#define MEASURE_CYCLES (1 << 11)
+#define MEASURE_HEAP (1 << 12)
 #define MEASURE_ALL                                                       \
   (MEASURE_READ_FILE | MEASURE_LEX | MEASURE_PARSE | MEASURE_LOOP_LABEL | \
    MEASURE_OPTIMIZE | MEASURE_COMPILE | MEASURE_DISASSEMBLE | MEASURE_EXEC)
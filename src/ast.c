@@ -525,6 +525,7 @@ Stmt clone_stmt(const Stmt *stmt)
       }
       clone.as.stmt_fn.parameters = parameters;
       clone.as.stmt_fn.is_async = stmt->as.stmt_fn.is_async;
+      clone.as.stmt_fn.is_gen = stmt->as.stmt_fn.is_gen;
       Stmt body = clone_stmt(stmt->as.stmt_fn.body);
       clone.as.stmt_fn.body = ALLOC(body);
       break;
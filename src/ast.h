@@ -237,6 +237,7 @@ typedef struct {
   char *name;
   Stmt *body;
   bool is_async;
+  bool is_gen; /* whether the body has a yield of its own */
   Span span;
 } StmtFn;
 
@@ -7,12 +7,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <time.h>
 
 #include "ast.h"
 #include "dynarray.h"
+#include "peephole.h"
 #include "table.h"
 #include "util.h"
+#include "vm.h"
 
 typedef struct {
   char *name;
@@ -20,9 +23,14 @@ typedef struct {
 } Builtin;
 
 static Builtin builtins[] = {
-    {"next", 1},    {"send", 2},    {"spawn", 1},   {"run", 1},
-    {"sleep", 1},   {"done", 1},    {"result", 1},  {"len", 1},
-    {"hasattr", 2}, {"getattr", 2}, {"setattr", 3},
+    {"next", 1},       {"send", 2},        {"spawn", 1},
+    {"run", 1},        {"sleep", 1},       {"done", 1},
+    {"result", 1},     {"len", 1},         {"hasattr", 2},
+    {"getattr", 2},    {"setattr", 3},     {"pipe", 0},
+    {"socketpair", 0}, {"listen_unix", 1}, {"connect_unix", 1},
+    {"accept", 1},     {"read_fd", 2},     {"write_fd", 2},
+    {"close_fd", 1},   {"channel", 1},     {"recv", 1},
+    {"gather", 1},     {"select", 1},
 };
 
 Compiler *current_compiler = NULL;
@@ -37,6 +45,16 @@ static void free_table_int(Table_int *table)
   }
 }
 
+static void free_table_function_proto_ptr(Table_FunctionProtoPtr *table)
+{
+  for (size_t i = 0; i < TABLE_MAX; i++) {
+    if (table->indexes[i] != NULL) {
+      Bucket *bucket = table->indexes[i];
+      list_free(bucket);
+    }
+  }
+}
+
 static void free_table_function_ptr(Table_FunctionPtr *table)
 {
   for (size_t i = 0; i < TABLE_MAX; i++) {
@@ -64,8 +82,10 @@ void free_table_struct_blueprints(Table_StructBlueprint *table)
     free_table_int(table->items[i].property_indexes);
     free(table->items[i].property_indexes);
 
-    free_table_function_ptr(table->items[i].methods);
-    free(table->items[i].methods);
+    if (table->items[i].methods) {
+      free_table_function_proto_ptr(table->items[i].methods);
+      free(table->items[i].methods);
+    }
   }
 }
 
@@ -89,18 +109,148 @@ static void free_table_labels(Table_Label *table)
   }
 }
 
+static void free_scope(Scope *scope)
+{
+  dynarray_free(&scope->vars);
+  free(scope->buckets);
+}
+
 void free_compiler(Compiler *compiler)
 {
+  free_scope(&compiler->locals);
+  free_scope(&compiler->globals);
   dynarray_free(&compiler->upvalues);
   dynarray_free(&compiler->loop_depths);
-  free_table_struct_blueprints(compiler->struct_blueprints);
-  free(compiler->struct_blueprints);
-  free_table_functions(compiler->functions);
-  free(compiler->functions);
-  free_table_function_ptr(compiler->builtins);
-  free(compiler->builtins);
-  free_table_labels(compiler->labels);
-  free(compiler->labels);
+  if (compiler->struct_blueprints) {
+    free_table_struct_blueprints(compiler->struct_blueprints);
+    free(compiler->struct_blueprints);
+  }
+  if (compiler->functions) {
+    free_table_functions(compiler->functions);
+    free(compiler->functions);
+  }
+  if (compiler->builtins) {
+    free_table_function_ptr(compiler->builtins);
+    free(compiler->builtins);
+  }
+  if (compiler->labels) {
+    free_table_labels(compiler->labels);
+    free(compiler->labels);
+  }
+}
+
+/* Frees the compilers of the functions being compiled, and that of the
+ * script as well, unless a deferred body is being compiled, since it's
+ * still needed for the rest of them, then. */
+static void free_compilers(void)
+{
+  while (current_compiler && !current_compiler->horizon) {
+    Compiler *c = current_compiler;
+    current_compiler = c->next;
+    free_compiler(c);
+    free(c);
+  }
+}
+
+#define SCOPE_MIN_BUCKETS 16
+
+static size_t scope_bucket(const Scope *scope, const char *name)
+{
+  return hash(name, strlen(name)) & (scope->bucket_count - 1);
+}
+
+static void scope_link(Scope *scope, size_t idx)
+{
+  size_t bucket = scope_bucket(scope, scope->vars.data[idx].name);
+  scope->vars.data[idx].prev = scope->buckets[bucket];
+  scope->buckets[bucket] = idx;
+}
+
+static void scope_grow(Scope *scope)
+{
+  scope->bucket_count =
+      scope->bucket_count ? 2 * scope->bucket_count : SCOPE_MIN_BUCKETS;
+  free(scope->buckets);
+  scope->buckets = malloc(sizeof(int) * scope->bucket_count);
+  for (size_t i = 0; i < scope->bucket_count; i++) {
+    scope->buckets[i] = -1;
+  }
+
+  for (size_t idx = 0; idx < scope->vars.count; idx++) {
+    scope_link(scope, idx);
+  }
+}
+
+static void scope_push(Scope *scope, char *name, int depth)
+{
+  Local local = {.name = name, .depth = depth, .captured = false};
+  dynarray_insert(&scope->vars, local);
+
+  if (scope->vars.count > scope->peak) {
+    scope->peak = scope->vars.count;
+  }
+
+  if (scope->vars.count > scope->bucket_count) {
+    scope_grow(scope);
+  } else {
+    scope_link(scope, scope->vars.count - 1);
+  }
+}
+
+static void scope_pop(Scope *scope)
+{
+  Local local = dynarray_pop(&scope->vars);
+  scope->buckets[scope_bucket(scope, local.name)] = local.prev;
+}
+
+/* Returns the index of the local called 'name', or -1. If there's more
+ * than one, it's the one that came into scope first, i.e., the last in
+ * the chain. */
+static int scope_find(const Scope *scope, const char *name)
+{
+  if (scope->bucket_count == 0) {
+    return -1;
+  }
+
+  int found = -1;
+  for (int idx = scope->buckets[scope_bucket(scope, name)]; idx != -1;
+       idx = scope->vars.data[idx].prev) {
+    if (strcmp(scope->vars.data[idx].name, name) == 0) {
+      found = idx;
+    }
+  }
+  return found;
+}
+
+static Label *resolve_label(const char *name)
+{
+  for (Compiler *c = current_compiler; c; c = c->next) {
+    if (c->labels) {
+      Label *label = table_get(c->labels, name);
+      if (label) {
+        return label;
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Labels always go into the table of the function being compiled, so
+ * that the jumps it patches are its own. */
+static void insert_label(const char *name, Label label)
+{
+  if (!current_compiler->labels) {
+    current_compiler->labels = calloc(1, sizeof(Table_Label));
+  }
+  table_insert(current_compiler->labels, name, label);
+}
+
+static void insert_function(Compiler *compiler, Function func)
+{
+  if (!compiler->functions) {
+    compiler->functions = calloc(1, sizeof(Table_Function));
+  }
+  table_insert(compiler->functions, func.name, func);
 }
 
 void init_chunk(Bytecode *code)
@@ -110,25 +260,106 @@ void init_chunk(Bytecode *code)
 
 void free_chunk(Bytecode *code)
 {
+  if (code->mapping) {
+    for (size_t i = 0; i < code->protos.count; i++) {
+      free(code->protos.data[i]);
+    }
+    dynarray_free(&code->protos);
+    dynarray_free(&code->sp);
+    munmap(code->mapping, code->mapping_size);
+    return;
+  }
+
   dynarray_free(&code->code);
+  dynarray_free(&code->lines);
+
+  for (size_t i = 0; i < code->protos.count; i++) {
+    dynarray_free(&code->protos.data[i]->code);
+    dynarray_free(&code->protos.data[i]->lines);
+    free(code->protos.data[i]->deferred);
+    free(code->protos.data[i]);
+  }
+  dynarray_free(&code->protos);
 
   for (size_t i = 0; i < code->sp.count; i++) {
     free(code->sp.data[i]);
   }
   dynarray_free(&code->sp);
+  free(code->sp_index);
+}
+
+long locate_code(const Bytecode *code, const uint8_t *ip,
+                 const FunctionProto **proto)
+{
+  *proto = NULL;
+  if (ip >= code->code.data && ip < code->code.data + code->code.count) {
+    return ip - code->code.data;
+  }
+
+  for (size_t i = 0; i < code->protos.count; i++) {
+    const DynArray_uint8_t *c = &code->protos.data[i]->code;
+    if (ip >= c->data && ip < c->data + c->count) {
+      *proto = code->protos.data[i];
+      return ip - c->data;
+    }
+  }
+
+  return -1;
+}
+
+uint32_t line_at(const DynArray_LineRun *lines, size_t offset)
+{
+  uint32_t line = 0;
+  for (size_t i = 0; i < lines->count && lines->data[i].offset <= offset; i++) {
+    line = lines->data[i].line;
+  }
+  return line;
+}
+
+#define SP_INDEX_MIN 64
+
+/* Returns the slot of the index where 'string' is, or the empty slot
+ * where it would go. */
+static size_t sp_index_slot(const Bytecode *code, const char *string)
+{
+  size_t mask = code->sp_index_capacity - 1;
+  size_t i = hash(string, strlen(string)) & mask;
+  while (code->sp_index[i] &&
+         strcmp(code->sp.data[code->sp_index[i] - 1], string) != 0) {
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+static void sp_index_grow(Bytecode *code)
+{
+  free(code->sp_index);
+  code->sp_index_capacity = code->sp_index_capacity
+                                ? 2 * code->sp_index_capacity
+                                : SP_INDEX_MIN;
+  code->sp_index = calloc(code->sp_index_capacity, sizeof(uint32_t));
+
+  for (size_t idx = 0; idx < code->sp.count; idx++) {
+    code->sp_index[sp_index_slot(code, code->sp.data[idx])] = idx + 1;
+  }
 }
 
 /* Check if the string is already present in the sp.
  * If not, add it first, and finally return the idx. */
 static uint32_t add_string(Bytecode *code, const char *string)
 {
-  for (size_t idx = 0; idx < code->sp.count; idx++) {
-    if (strcmp(code->sp.data[idx], string) == 0) {
-      return idx;
-    }
+  /* Kept at most half full, so that the probes stay short. */
+  if (2 * (code->sp.count + 1) > code->sp_index_capacity) {
+    sp_index_grow(code);
+  }
+
+  size_t slot = sp_index_slot(code, string);
+  if (code->sp_index[slot]) {
+    return code->sp_index[slot] - 1;
   }
 
   dynarray_insert(&code->sp, own_string(string));
+  code->sp_index[slot] = code->sp.count;
 
   return code->sp.count - 1;
 }
@@ -149,6 +380,11 @@ static void emit_bytes(Bytecode *code, int n, ...)
   va_end(ap);
 }
 
+static void emit_uint16(Bytecode *code, uint16_t idx)
+{
+  emit_bytes(code, 2, (idx >> 8) & 0xFF, idx & 0xFF);
+}
+
 __attribute__((unused)) static void emit_uint32(Bytecode *code, uint32_t idx)
 {
   emit_bytes(code, 4, (idx >> 24) & 0xFF, (idx >> 16) & 0xFF, (idx >> 8) & 0xFF,
@@ -172,6 +408,14 @@ static void emit_double(Bytecode *code, double x)
       (uint8_t) (num.raw & 0xFF));
 }
 
+/* Emits 'op' followed by the index of a string in the sp, or of a lo-
+ * cal on the stack, both of which are 2 bytes wide. */
+static void emit_op16(Bytecode *code, Opcode op, uint16_t idx)
+{
+  emit_byte(code, op);
+  emit_uint16(code, idx);
+}
+
 static int emit_placeholder(Bytecode *code, Opcode op)
 {
   emit_bytes(code, 3, op, 0xFF, 0xFF);
@@ -224,14 +468,18 @@ static void patch_placeholder(Bytecode *code, int op)
   code->code.data[op + 2] = bytes_emitted & 0xFF;
 }
 
-static void add_upvalue(DynArray_int *upvalues, int idx)
+/* Returns where the variable in the slot 'idx' of the enclosing fun-
+ * ction is in the list of what the current function captures, adding
+ * it if it isn't there yet. */
+static int add_upvalue(DynArray_int *upvalues, int idx)
 {
   for (size_t i = 0; i < upvalues->count; i++) {
     if (upvalues->data[i] == idx) {
-      return;
+      return i;
     }
   }
   dynarray_insert(upvalues, idx);
+  return upvalues->count - 1;
 }
 
 static void emit_loop(Bytecode *code, int loop_start)
@@ -321,21 +569,23 @@ static void emit_loop_cleanup(Bytecode *code)
    * current current_compiler->depth. */
   int loop_depth = dynarray_peek(&current_compiler->loop_depths);
 
-  while (current_compiler->locals_count > 0 &&
-         current_compiler->locals[current_compiler->locals_count - 1].depth >
-             loop_depth) {
+  Scope *locals = &current_compiler->locals;
+
+  while (locals->vars.count > 0 &&
+         dynarray_peek(&locals->vars).depth > loop_depth) {
     emit_byte(code, OP_POP);
-    current_compiler->locals_count--;
+    scope_pop(locals);
   }
 }
 
 static void emit_goto_cleanup(Bytecode *code)
 {
   int loop_depth = dynarray_peek(&current_compiler->loop_depths);
-  size_t locals_count = current_compiler->locals_count;
+  size_t locals_count = current_compiler->locals.vars.count;
 
   while (locals_count > 0 &&
-         current_compiler->locals[locals_count - 1].depth > loop_depth) {
+         current_compiler->locals.vars.data[locals_count - 1].depth >
+             loop_depth) {
     emit_byte(code, OP_POP);
     locals_count--;
   }
@@ -352,15 +602,19 @@ static void end_scope(Bytecode *code)
 
   c->depth--;
 
-  while (c->locals_count > 0 &&
-         c->locals[c->locals_count - 1].depth > c->depth) {
+  while (c->locals.vars.count > 0 &&
+         dynarray_peek(&c->locals.vars).depth > c->depth) {
     emit_byte(code, OP_POP);
-    c->locals_count--;
+    scope_pop(&c->locals);
   }
 }
 
 static void patch_jumps(Bytecode *code)
 {
+  if (!current_compiler->labels) {
+    return;
+  }
+
   for (size_t i = 0; i < TABLE_MAX; i++) {
     if (current_compiler->labels->indexes[i]) {
       Label *l = table_get(current_compiler->labels,
@@ -386,7 +640,8 @@ static Function *resolve_builtin(const char *name)
   Compiler *current = current_compiler;
 
   while (current) {
-    Function **f = table_get(current->builtins, name);
+    Function **f =
+        current->builtins ? table_get(current->builtins, name) : NULL;
     if (f) {
       return *f;
     }
@@ -403,10 +658,10 @@ static int resolve_global(Bytecode *code, const char *name)
   Compiler *current = current_compiler;
 
   while (current) {
-    for (size_t idx = 0; idx < current->globals_count; idx++) {
-      if (strcmp(current->globals[idx].name, name) == 0) {
-        return add_string(code, name);
-      }
+    int idx = scope_find(&current->globals, name);
+    if (idx != -1 &&
+        (!current->horizon || (size_t) idx < current->horizon->globals)) {
+      return add_string(code, name);
     }
     current = current->next;
   }
@@ -418,24 +673,21 @@ static int resolve_global(Bytecode *code, const char *name)
  * If it is, return the index, otherwise return -1. */
 static int resolve_local(const char *name)
 {
-  for (size_t idx = 0; idx < current_compiler->locals_count; idx++) {
-    if (strcmp(current_compiler->locals[idx].name, name) == 0) {
-      return idx;
-    }
-  }
-  return -1;
+  return scope_find(&current_compiler->locals, name);
 }
 
+/* Returns the index of the upvalue the variable 'name' of an enclos-
+ * ing function is captured in, i.e., where the closure keeps it, as
+ * opposed to the slot it's in on the stack of that function. */
 static int resolve_upvalue(const char *name)
 {
   Compiler *current = current_compiler->next;
 
   while (current) {
-    for (size_t idx = 0; idx < current->locals_count; idx++) {
-      if (strcmp(current->locals[idx].name, name) == 0) {
-        current->locals[idx].captured = true;
-        return idx;
-      }
+    int idx = scope_find(&current->locals, name);
+    if (idx != -1) {
+      current->locals.vars.data[idx].captured = true;
+      return add_upvalue(&current_compiler->upvalues, idx);
     }
     current = current->next;
   }
@@ -448,7 +700,14 @@ static StructBlueprint *resolve_blueprint(const char *name)
   Compiler *current = current_compiler;
 
   while (current) {
-    StructBlueprint *bp = table_get(current->struct_blueprints, name);
+    StructBlueprint *bp = current->struct_blueprints
+                              ? table_get(current->struct_blueprints, name)
+                              : NULL;
+    if (bp && current->horizon &&
+        (size_t) (bp - current->struct_blueprints->items) >=
+            current->horizon->blueprints) {
+      bp = NULL;
+    }
     if (bp) {
       return bp;
     }
@@ -463,7 +722,13 @@ static Function *resolve_func(const char *name)
   Compiler *current = current_compiler;
 
   while (current) {
-    Function *f = table_get(current->functions, name);
+    Function *f = current->functions ? table_get(current->functions, name)
+                                     : NULL;
+    if (f && current->horizon &&
+        (size_t) (f - current->functions->items) >=
+            current->horizon->functions) {
+      f = NULL;
+    }
     if (f) {
       return f;
     }
@@ -500,7 +765,7 @@ static CompileResult compile_expr_literal(Bytecode *code, const Expr *expr)
     }
     case LIT_STRING: {
       uint32_t str_idx = add_string(code, expr_lit.as.str);
-      emit_bytes(code, 2, OP_STR, str_idx);
+      emit_op16(code, OP_STR, str_idx);
       break;
     }
     case LIT_NULL: {
@@ -527,33 +792,26 @@ static CompileResult compile_expr_variable(Bytecode *code, const Expr *expr)
   /* Try to resolve the variable as local. */
   int idx = resolve_local(expr_var.name);
   if (idx != -1) {
-    emit_bytes(code, 2, OP_DEEPGET, idx);
+    emit_op16(code, OP_DEEPGET, idx);
     return result;
   }
 
   /* Try to resolve the variable as upvalue. */
   int upvalue_idx = resolve_upvalue(expr_var.name);
   if (upvalue_idx != -1) {
-    emit_bytes(code, 2, OP_GET_UPVALUE, upvalue_idx);
-    add_upvalue(&current_compiler->upvalues, upvalue_idx);
+    emit_op16(code, OP_GET_UPVALUE, upvalue_idx);
     return result;
   }
 
   /* Try to resolve the variable as global. */
   int name_idx = resolve_global(code, expr_var.name);
   if (name_idx != -1) {
-    emit_bytes(code, 2, OP_GET_GLOBAL, name_idx);
+    emit_op16(code, OP_GET_GLOBAL, name_idx);
     return result;
   }
 
   alloc_err_str(&result.msg, "Variable '%s' is not defined.", expr_var.name);
-  Compiler *c;
-  while (current_compiler) {
-    c = current_compiler;
-    current_compiler = c->next;
-    free_compiler(c);
-    free(c);
-  }
+  free_compilers();
   result.is_ok = false;
   result.errcode = -1;
   return result;
@@ -595,32 +853,26 @@ static CompileResult compile_expr_unary(Bytecode *code, const Expr *expr)
         /* Try to resolve the variable as local. */
         int idx = resolve_local(var.name);
         if (idx != -1) {
-          emit_bytes(code, 2, OP_DEEPGET_PTR, idx);
+          emit_op16(code, OP_DEEPGET_PTR, idx);
           return result;
         }
 
         /* Try to resolve the variable as upvalue. */
         int upvalue_idx = resolve_upvalue(var.name);
         if (upvalue_idx != -1) {
-          emit_bytes(code, 2, OP_GET_UPVALUE_PTR, upvalue_idx);
+          emit_op16(code, OP_GET_UPVALUE_PTR, upvalue_idx);
           return result;
         }
 
         int name_idx = resolve_global(code, var.name);
         if (name_idx != -1) {
-          emit_bytes(code, 2, OP_GET_GLOBAL_PTR, name_idx);
+          emit_op16(code, OP_GET_GLOBAL_PTR, name_idx);
           return result;
         }
 
         /* The variable is not defined, bail out. */
         alloc_err_str(&result.msg, "Variable '%s' is not defined.", var.name);
-        Compiler *c;
-        while (current_compiler) {
-          c = current_compiler;
-          current_compiler = c->next;
-          free_compiler(c);
-          free(c);
-        }
+        free_compilers();
         result.is_ok = false;
         result.errcode = -1;
         return result;
@@ -641,7 +893,7 @@ static CompileResult compile_expr_unary(Bytecode *code, const Expr *expr)
         /* Add the 'property_name' string to the
          * chunk's sp, and emit OP_GETATTR_PTR. */
         uint32_t property_name_idx = add_string(code, expr_get.property_name);
-        emit_bytes(code, 2, OP_GETATTR_PTR, property_name_idx);
+        emit_op16(code, OP_GETATTR_PTR, property_name_idx);
         break;
       }
       default:
@@ -799,6 +1051,14 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
 
   ExprCall expr_call = expr->as.expr_call;
 
+  /* OP_CALL and OP_CALL_METHOD have one byte for the count. */
+  if (expr_call.arguments.count > UINT8_MAX) {
+    alloc_err_str(&result.msg, "Maximum %d arguments per call.", UINT8_MAX);
+    result.is_ok = false;
+    result.errcode = -1;
+    return result;
+  }
+
   if (expr_call.callee->kind == EXPR_GET) {
     ExprGet expr_get = expr_call.callee->as.expr_get;
 
@@ -824,8 +1084,8 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
       }
     }
 
-    emit_bytes(code, 3, OP_CALL_METHOD, add_string(code, method),
-               expr_call.arguments.count);
+    emit_op16(code, OP_CALL_METHOD, add_string(code, method));
+    emit_byte(code, expr_call.arguments.count);
   } else if (expr_call.callee->kind == EXPR_VARIABLE) {
     ExprVariable var = expr_call.callee->as.expr_variable;
 
@@ -834,13 +1094,7 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
       if (b->paramcount != expr_call.arguments.count) {
         alloc_err_str(&result.msg, "Builtin '%s' requires %ld arguments.",
                       b->name, b->paramcount);
-        Compiler *c;
-        while (current_compiler) {
-          c = current_compiler;
-          current_compiler = c->next;
-          free_compiler(c);
-          free(c);
-        }
+        free_compilers();
         result.is_ok = false;
         result.errcode = -1;
         return result;
@@ -909,6 +1163,114 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
           }
         }
         emit_byte(code, OP_RESULT);
+      } else if (strcmp(b->name, "pipe") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_PIPE);
+      } else if (strcmp(b->name, "socketpair") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_SOCKETPAIR);
+      } else if (strcmp(b->name, "listen_unix") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_LISTEN_UNIX);
+      } else if (strcmp(b->name, "connect_unix") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_CONNECT_UNIX);
+      } else if (strcmp(b->name, "accept") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_ACCEPT);
+      } else if (strcmp(b->name, "read_fd") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_READ_FD);
+      } else if (strcmp(b->name, "write_fd") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_WRITE_FD);
+      } else if (strcmp(b->name, "close_fd") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_CLOSE_FD);
+      } else if (strcmp(b->name, "channel") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_CHANNEL);
+      } else if (strcmp(b->name, "recv") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_RECV);
+      } else if (strcmp(b->name, "gather") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_GATHER);
+      } else if (strcmp(b->name, "select") == 0) {
+        for (size_t i = 0; i < expr_call.arguments.count; i++) {
+          CompileResult arg_result =
+              compile_expr(code, &expr_call.arguments.data[i]);
+          if (!arg_result.is_ok) {
+            return arg_result;
+          }
+        }
+        emit_byte(code, OP_SELECT);
       } else if (strcmp(b->name, "len") == 0) {
         for (size_t i = 0; i < expr_call.arguments.count; i++) {
           CompileResult arg_result =
@@ -933,8 +1295,8 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
         if (!arg_result.is_ok) {
           return arg_result;
         }
-        emit_bytes(
-            code, 2, OP_GETATTR,
+        emit_op16(
+            code, OP_GETATTR,
             add_string(code,
                        expr_call.arguments.data[1].as.expr_literal.as.str));
       } else if (strcmp(b->name, "setattr") == 0) {
@@ -950,8 +1312,8 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
           return arg2_result;
         }
 
-        emit_bytes(
-            code, 2, OP_SETATTR,
+        emit_op16(
+            code, OP_SETATTR,
             add_string(code,
                        expr_call.arguments.data[1].as.expr_literal.as.str));
       }
@@ -963,13 +1325,7 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
     if (f && f->paramcount != expr_call.arguments.count) {
       alloc_err_str(&result.msg, "Function '%s' requires %ld arguments.",
                     f->name, f->paramcount);
-      Compiler *c;
-      while (current_compiler) {
-        c = current_compiler;
-        current_compiler = c->next;
-        free_compiler(c);
-        free(c);
-      }
+      free_compilers();
       result.is_ok = false;
       result.errcode = -1;
       return result;
@@ -1009,25 +1365,18 @@ static CompileResult compile_expr_call(Bytecode *code, const Expr *expr)
     /* Bail out if it's neither local nor a global. */
     if (idx == -1) {
       alloc_err_str(&result.msg, "Function '%s' is not defined.", var.name);
-      Compiler *c;
-      while (current_compiler) {
-        c = current_compiler;
-        current_compiler = c->next;
-        free_compiler(c);
-        free(c);
-      }
+      free_compilers();
       result.is_ok = false;
       result.errcode = -1;
       return result;
     }
 
     if (is_global) {
-      emit_bytes(code, 2, OP_GET_GLOBAL, idx);
+      emit_op16(code, OP_GET_GLOBAL, idx);
     } else if (is_upvalue) {
-      emit_bytes(code, 2, OP_GET_UPVALUE, idx);
-      add_upvalue(&current_compiler->upvalues, idx);
+      emit_op16(code, OP_GET_UPVALUE, idx);
     } else {
-      emit_bytes(code, 2, OP_DEEPGET, idx);
+      emit_op16(code, OP_DEEPGET, idx);
     }
 
     if (f && (f->is_gen || f->is_async)) {
@@ -1064,7 +1413,7 @@ static CompileResult compile_expr_get(Bytecode *code, const Expr *expr)
   }
 
   /* Emit OP_GETATTR with the index of the property name. */
-  emit_bytes(code, 2, OP_GETATTR, add_string(code, expr_get.property_name));
+  emit_op16(code, OP_GETATTR, add_string(code, expr_get.property_name));
 
   return result;
 }
@@ -1127,13 +1476,7 @@ static CompileResult compile_assign_variable(Bytecode *code, ExprAssign e,
   /* Bail out if it's neither local nor a global. */
   if (idx == -1) {
     alloc_err_str(&result.msg, "Variable '%s' is not defined.", expr_var.name);
-    Compiler *c;
-    while (current_compiler) {
-      c = current_compiler;
-      current_compiler = c->next;
-      free_compiler(c);
-      free(c);
-    }
+    free_compilers();
     result.is_ok = false;
     result.errcode = -1;
     return result;
@@ -1149,7 +1492,7 @@ static CompileResult compile_assign_variable(Bytecode *code, ExprAssign e,
       emit_byte(code, OP_DEEPGET);
     }
 
-    emit_byte(code, idx);
+    emit_uint16(code, idx);
 
     /* Compile the right-hand side. */
     CompileResult rhs_result = compile_expr(code, e.rhs);
@@ -1177,7 +1520,7 @@ static CompileResult compile_assign_variable(Bytecode *code, ExprAssign e,
     emit_byte(code, OP_DEEPSET);
   }
 
-  emit_byte(code, idx);
+  emit_uint16(code, idx);
 
   return result;
 }
@@ -1203,7 +1546,7 @@ static CompileResult compile_assign_get(Bytecode *code, ExprAssign e,
 
   if (is_compound) {
     /* Get the property onto the top of the stack. */
-    emit_bytes(code, 2, OP_GETATTR, add_string(code, expr_get.property_name));
+    emit_op16(code, OP_GETATTR, add_string(code, expr_get.property_name));
 
     /* Compile the right-hand side of the assignment. */
     CompileResult rhs_result = compile_expr(code, e.rhs);
@@ -1221,7 +1564,7 @@ static CompileResult compile_assign_get(Bytecode *code, ExprAssign e,
   }
 
   /* Set the property name to the rhs of the get expr. */
-  emit_bytes(code, 2, OP_SETATTR, add_string(code, expr_get.property_name));
+  emit_op16(code, OP_SETATTR, add_string(code, expr_get.property_name));
 
   /* Pop the struct off the stack. */
   emit_byte(code, OP_POP);
@@ -1333,13 +1676,7 @@ static CompileResult compile_expr_assign(Bytecode *code, const Expr *expr)
       break;
     default:
       alloc_err_str(&result.msg, "Invalid assignment.");
-      Compiler *c;
-      while (current_compiler) {
-        c = current_compiler;
-        current_compiler = c->next;
-        free_compiler(c);
-        free(c);
-      }
+      free_compilers();
       result.is_ok = false;
       result.errcode = -1;
       return result;
@@ -1365,13 +1702,7 @@ static CompileResult compile_expr_struct(Bytecode *code, const Expr *expr)
   if (!blueprint) {
     alloc_err_str(&result.msg, "struct '%s' is not defined.\n",
                   expr_struct.name);
-    Compiler *c;
-    while (current_compiler) {
-      c = current_compiler;
-      current_compiler = c->next;
-      free_compiler(c);
-      free(c);
-    }
+    free_compilers();
     result.is_ok = false;
     result.errcode = -1;
     return result;
@@ -1382,13 +1713,7 @@ static CompileResult compile_expr_struct(Bytecode *code, const Expr *expr)
   if (blueprint->property_indexes->count != expr_struct.initializers.count) {
     alloc_err_str(&result.msg, "struct '%s' requires %ld initializers.\n",
                   blueprint->name, blueprint->property_indexes->count);
-    Compiler *c;
-    while (current_compiler) {
-      c = current_compiler;
-      current_compiler = c->next;
-      free_compiler(c);
-      free(c);
-    }
+    free_compilers();
     result.is_ok = false;
     result.errcode = -1;
     return result;
@@ -1404,13 +1729,7 @@ static CompileResult compile_expr_struct(Bytecode *code, const Expr *expr)
     if (!propidx) {
       alloc_err_str(&result.msg, "struct '%s' has no property '%s'",
                     blueprint->name, propname);
-      Compiler *c;
-      while (current_compiler) {
-        c = current_compiler;
-        current_compiler = c->next;
-        free_compiler(c);
-        free(c);
-      }
+      free_compilers();
       result.is_ok = false;
       result.errcode = -1;
       result.span = siexp.span;
@@ -1420,7 +1739,7 @@ static CompileResult compile_expr_struct(Bytecode *code, const Expr *expr)
 
   /* Everything is OK, we emit OP_STRUCT followed by
    * struct's name index in the string pool. */
-  emit_bytes(code, 2, OP_STRUCT, add_string(code, blueprint->name));
+  emit_op16(code, OP_STRUCT, add_string(code, blueprint->name));
 
   /* Finally, we compile the initializers. */
   for (size_t i = 0; i < expr_struct.initializers.count; i++) {
@@ -1460,7 +1779,7 @@ static CompileResult compile_expr_struct_initializer(Bytecode *code,
 
   /* Finally, we emit OP_SETATTR with the property's
    * name index. */
-  emit_bytes(code, 2, OP_SETATTR, add_string(code, property.name));
+  emit_op16(code, OP_SETATTR, add_string(code, property.name));
 
   return result;
 }
@@ -1557,17 +1876,6 @@ static CompileResult compile_expr_conditional(Bytecode *code, const Expr *expr)
   return result;
 }
 
-static void mark_current_function_as_generator(void)
-{
-  Function *f = resolve_func(current_compiler->current_fn->name);
-  if (!f) {
-    return;
-  }
-
-  f->is_gen = true;
-  table_insert(current_compiler->functions, f->name, *f);
-}
-
 static CompileResult compile_expr_yield(Bytecode *code, const Expr *expr)
 {
   CompileResult result = {.is_ok = true,
@@ -1582,7 +1890,6 @@ static CompileResult compile_expr_yield(Bytecode *code, const Expr *expr)
   }
 
   emit_byte(code, OP_YIELD);
-  mark_current_function_as_generator();
 
   return result;
 }
@@ -1608,7 +1915,6 @@ static CompileResult compile_expr_await(Bytecode *code, const Expr *expr)
   }
 
   emit_byte(code, OP_AWAIT);
-  mark_current_function_as_generator();
 
   return result;
 }
@@ -1675,15 +1981,15 @@ static CompileResult compile_stmt_let(Bytecode *code, const Stmt *stmt)
                           .span = stmt->span,
                           .time = 0.0};
 
-  if (current_compiler->locals_count >= 256) {
-    alloc_err_str(&result.msg, "Maximum 256 locals.");
-    Compiler *c;
-    while (current_compiler) {
-      c = current_compiler;
-      current_compiler = c->next;
-      free_compiler(c);
-      free(c);
-    }
+  /* The locals must fit on the VM's stack. The globals are only bound-
+   * ed by the operand of OP_SET_GLOBAL, see below. */
+  bool is_global = current_compiler->depth == 0;
+  Scope *scope =
+      is_global ? &current_compiler->globals : &current_compiler->locals;
+
+  if (!is_global && scope->vars.count >= STACK_MAX) {
+    alloc_err_str(&result.msg, "Maximum %d locals.", STACK_MAX);
+    free_compilers();
     result.is_ok = false;
     result.errcode = -1;
     return result;
@@ -1697,8 +2003,17 @@ static CompileResult compile_stmt_let(Bytecode *code, const Stmt *stmt)
     return expr_result;
   }
 
-  /* Add the variable name to the string pool. */
+  /* Add the variable name to the string pool, where the VM keeps the
+   * global of that name. */
   uint32_t name_idx = add_string(code, s.name);
+  if (is_global && name_idx > UINT16_MAX) {
+    alloc_err_str(&result.msg, "Maximum %d globals and strings.",
+                  UINT16_MAX + 1);
+    free_compilers();
+    result.is_ok = false;
+    result.errcode = -1;
+    return result;
+  }
 
   /* If we're in global scope, emit OP_SET_GLOBAL,
    * otherwise, we want the value to remain on the
@@ -1707,22 +2022,10 @@ static CompileResult compile_stmt_let(Bytecode *code, const Stmt *stmt)
    * ing regarding the number of variables we need
    * to pop off the stack when we do stack cleanup. */
 
-  if (current_compiler->depth == 0) {
-    current_compiler->globals[current_compiler->globals_count++] = (Local){
-        .name = code->sp.data[name_idx],
-        .captured = false,
-        .depth = current_compiler->depth,
-    };
-  } else {
-    current_compiler->locals[current_compiler->locals_count++] = (Local){
-        .name = code->sp.data[name_idx],
-        .captured = false,
-        .depth = current_compiler->depth,
-    };
-  }
+  scope_push(scope, code->sp.data[name_idx], current_compiler->depth);
 
-  if (current_compiler->depth == 0) {
-    emit_bytes(code, 2, OP_SET_GLOBAL, name_idx);
+  if (is_global) {
+    emit_op16(code, OP_SET_GLOBAL, name_idx);
   }
 
   return result;
@@ -1743,16 +2046,16 @@ static CompileResult compile_stmt_expr(Bytecode *code, const Stmt *stmt)
     return expr_result;
   }
 
-  /* If the expression statement was just a call, like:
+  /* If the expression statement was anything but an assignment, like:
    *
    * ...
    * main(4);
    * ...
    *
-   * Pop the return value off the stack, so it does not
-   * interfere with later execution. */
-  if (stmt_expr.expr.kind == EXPR_CALL || stmt_expr.expr.kind == EXPR_AWAIT ||
-      stmt_expr.expr.kind == EXPR_YIELD) {
+   * Pop its value off the stack, so it does not interfere with later
+   * execution. The optimizer leaves such statements behind, too, when
+   * it drops a dead store, but has to keep what's stored. */
+  if (stmt_expr.expr.kind != EXPR_ASSIGN) {
     emit_byte(code, OP_POP);
   }
 
@@ -1850,7 +2153,7 @@ static CompileResult compile_stmt_do_while(Bytecode *code, const Stmt *stmt)
   int loop_start = code->code.count;
 
   Label label = {.location = loop_start, .patch_with = -1};
-  table_insert(current_compiler->labels, stmt_do_while.label, label);
+  insert_label(stmt_do_while.label, label);
 
   dynarray_insert(&current_compiler->loop_depths, current_compiler->depth);
 
@@ -1877,13 +2180,14 @@ static CompileResult compile_stmt_do_while(Bytecode *code, const Stmt *stmt)
   char *exit_label = malloc(len);
   snprintf(exit_label, len, "%s_exit", stmt_do_while.label);
 
-  Label *loop_exit = table_get(current_compiler->labels, exit_label);
+  Label *loop_exit = resolve_label(exit_label);
   if (!loop_exit) {
     Label le = {.location = code->code.count, .patch_with = -1};
-    table_insert(current_compiler->labels, exit_label, le);
+    insert_label(exit_label, le);
   } else {
-    loop_exit->patch_with = code->code.count;
-    table_insert(current_compiler->labels, exit_label, *loop_exit);
+    Label le = *loop_exit;
+    le.patch_with = code->code.count;
+    insert_label(exit_label, le);
   }
 
   free(exit_label);
@@ -1907,7 +2211,7 @@ static CompileResult compile_stmt_while(Bytecode *code, const Stmt *stmt)
   int loop_start = code->code.count;
 
   Label label = {.location = loop_start, .patch_with = -1};
-  table_insert(current_compiler->labels, stmt_while.label, label);
+  insert_label(stmt_while.label, label);
 
   /* We then compile the condition because the VM expects a bool
    * placed on the stack by the time it encounters a conditional
@@ -1945,13 +2249,14 @@ static CompileResult compile_stmt_while(Bytecode *code, const Stmt *stmt)
   char *exit_label = malloc(len);
   snprintf(exit_label, len, "%s_exit", stmt_while.label);
 
-  Label *loop_exit = table_get(current_compiler->labels, exit_label);
+  Label *loop_exit = resolve_label(exit_label);
   if (!loop_exit) {
     Label le = {.location = code->code.count, .patch_with = -1};
-    table_insert(current_compiler->labels, exit_label, le);
+    insert_label(exit_label, le);
   } else {
-    loop_exit->patch_with = code->code.count;
-    table_insert(current_compiler->labels, exit_label, *loop_exit);
+    Label le = *loop_exit;
+    le.patch_with = code->code.count;
+    insert_label(exit_label, le);
   }
 
   /* Finally, we patch the exit jump. */
@@ -1979,11 +2284,7 @@ static CompileResult compile_stmt_for(Bytecode *code, const Stmt *stmt)
   /* Insert the initializer variable name into the current_compiler->locals
    * dynarray, since the condition that follows the initializer ex-
    * pects it to be there. */
-  current_compiler->locals[current_compiler->locals_count++] = (Local){
-      .name = variable.name,
-      .captured = false,
-      .depth = current_compiler->depth,
-  };
+  scope_push(&current_compiler->locals, variable.name, current_compiler->depth);
 
   /* Compile the right-hand side of the initializer first. */
   CompileResult assignment_rhs_result = compile_expr(code, assignment.rhs);
@@ -1996,7 +2297,7 @@ static CompileResult compile_stmt_for(Bytecode *code, const Stmt *stmt)
   int loop_start = code->code.count;
 
   Label label = {.location = loop_start, .patch_with = -1};
-  table_insert(current_compiler->labels, stmt_for.label, label);
+  insert_label(stmt_for.label, label);
 
   /* Compile the conditional expression. */
   CompileResult condition_result = compile_expr(code, &stmt_for.condition);
@@ -2036,9 +2337,9 @@ static CompileResult compile_stmt_for(Bytecode *code, const Stmt *stmt)
 
   /* Patch the loop_start we inserted to point to loop_continuation.
    * This is the place just before the advancement. */
-  Label *ls = table_get(current_compiler->labels, stmt_for.label);
-  ls->location = loop_continuation;
-  table_insert(current_compiler->labels, stmt_for.label, *ls);
+  Label ls = *resolve_label(stmt_for.label);
+  ls.location = loop_continuation;
+  insert_label(stmt_for.label, ls);
 
   /* Mark the loop depth (needed for break and continue). */
   dynarray_insert(&current_compiler->loop_depths, current_compiler->depth);
@@ -2055,20 +2356,21 @@ static CompileResult compile_stmt_for(Bytecode *code, const Stmt *stmt)
   /* Emit backward jump back to the advancement. */
   emit_loop(code, loop_continuation);
 
-  current_compiler->locals_count--;
+  scope_pop(&current_compiler->locals);
 
   int len = lblen(stmt_for.label, 0) + strlen("_exit");
 
   char *exit_label = malloc(len);
   snprintf(exit_label, len, "%s_exit", stmt_for.label);
 
-  Label *loop_exit = table_get(current_compiler->labels, exit_label);
+  Label *loop_exit = resolve_label(exit_label);
   if (!loop_exit) {
     Label l = {.location = code->code.count, .patch_with = -1};
-    table_insert(current_compiler->labels, exit_label, l);
+    insert_label(exit_label, l);
   } else {
-    loop_exit->patch_with = code->code.count;
-    table_insert(current_compiler->labels, exit_label, *loop_exit);
+    Label l = *loop_exit;
+    l.patch_with = code->code.count;
+    insert_label(exit_label, l);
   }
 
   /* Finally, we patch the exit jump. */
@@ -2089,31 +2391,114 @@ Compiler *new_compiler(void)
 
   memset(&compiler, 0, sizeof(Compiler));
 
-  compiler.functions = calloc(1, sizeof(Table_Function));
-  compiler.struct_blueprints = calloc(1, sizeof(Table_StructBlueprint));
-  compiler.builtins = calloc(1, sizeof(Table_FunctionPtr));
-  compiler.labels = calloc(1, sizeof(Table_Label));
+  /* The builtins are looked up through the enclosing compilers, so
+   * only the outermost one needs them. */
+  if (!current_compiler) {
+    compiler.builtins = calloc(1, sizeof(Table_FunctionPtr));
 
-  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
-    Function builtin = {0};
-    builtin.name = builtins[i].name;
-    builtin.paramcount = builtins[i].argcount;
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+      Function builtin = {0};
+      builtin.name = builtins[i].name;
+      builtin.paramcount = builtins[i].argcount;
 
-    table_insert(compiler.builtins, builtin.name, ALLOC(builtin));
+      table_insert(compiler.builtins, builtin.name, ALLOC(builtin));
+    }
   }
 
-  if (current_compiler) {
-    for (size_t i = 0; i < TABLE_MAX; i++) {
-      if (current_compiler->labels->indexes[i]) {
-        Label *label = table_get(current_compiler->labels,
-                                 current_compiler->labels->indexes[i]->key);
-        table_insert(compiler.labels, current_compiler->labels->indexes[i]->key,
-                     *label);
-      }
+  return ALLOC(compiler);
+}
+
+/* Emits the cleanup of the locals, followed by OP_RET, for returning
+ * what's on top of the stack. */
+static void emit_return(Bytecode *code)
+{
+  DynArray_Local *locals = &current_compiler->locals.vars;
+
+  /* Either way, the local goes, and the result takes its slot. */
+  for (int i = locals->count - 1; i >= 0; i--) {
+    if (locals->data[i].captured) {
+      emit_byte(code, OP_CLOSE_UPVALUE);
+    } else {
+      emit_op16(code, OP_DEEPSET, i);
     }
   }
 
-  return ALLOC(compiler);
+  emit_byte(code, OP_RET);
+}
+
+/* A function gets its code emitted into 'code->code' just like the
+ * script does, so its code and line table trade places with those of
+ * the enclosing code while it's being compiled, and back once it is. */
+static void swap_code(Bytecode *code, FunctionProto *proto)
+{
+  DynArray_uint8_t tmp_code = code->code;
+  code->code = proto->code;
+  proto->code = tmp_code;
+
+  DynArray_LineRun tmp_lines = code->lines;
+  code->lines = proto->lines;
+  proto->lines = tmp_lines;
+}
+
+static void elide_refcounts(DynArray_uint8_t *code);
+static uint16_t max_stack_depth(const DynArray_uint8_t *code, size_t base);
+
+/* Makes the compiler of the function 'stmt_fn', in 'enclosing', with
+ * its parameters for its first locals, the current one. */
+static void begin_fn(Compiler *enclosing, const StmtFn *stmt_fn)
+{
+  current_compiler = new_compiler();
+  current_compiler->next = enclosing;
+  current_compiler->depth = enclosing->depth;
+  current_compiler->in_async_fn = stmt_fn->is_async;
+
+  for (size_t i = 0; i < stmt_fn->parameters.count; i++) {
+    scope_push(&current_compiler->locals, stmt_fn->parameters.data[i],
+               current_compiler->depth);
+  }
+}
+
+/* Compiles the body of 'stmt_fn' into the code of 'proto', with the
+ * compiler begin_fn() made for it. */
+static CompileResult compile_fn_body(Bytecode *code, FunctionProto *proto,
+                                     const StmtFn *stmt_fn)
+{
+  swap_code(code, proto);
+
+  CompileResult body_result = compile_stmt(code, stmt_fn->body);
+  if (!body_result.is_ok) {
+    swap_code(code, proto);
+    return body_result;
+  }
+
+  /* A function that doesn't end with a return returns null. */
+  const DynArray_Stmt *body = &stmt_fn->body->as.stmt_block.stmts;
+  if (body->count == 0 || dynarray_peek(body).kind != STMT_RETURN) {
+    emit_byte(code, OP_NULL);
+    emit_return(code);
+  }
+
+  if (code->peephole) {
+    code->peephole_removed += peephole(&code->code, &code->lines);
+  }
+  elide_refcounts(&code->code);
+
+  if (current_compiler->upvalues.count > UINT8_MAX) {
+    alloc_err_str(&body_result.msg, "Maximum %d upvalues per function.",
+                  UINT8_MAX);
+    body_result.is_ok = false;
+    body_result.errcode = -1;
+    swap_code(code, proto);
+    return body_result;
+  }
+
+  proto->upvalue_count = current_compiler->upvalues.count;
+  proto->local_count = current_compiler->locals.peak;
+  proto->max_stack = max_stack_depth(&code->code, proto->paramcount);
+
+  swap_code(code, proto);
+
+  return body_result;
 }
 
 static CompileResult compile_stmt_fn(Bytecode *code, const Stmt *stmt)
@@ -2124,79 +2509,132 @@ static CompileResult compile_stmt_fn(Bytecode *code, const Stmt *stmt)
                           .span = stmt->span,
                           .time = 0.0};
 
-  Compiler *old_compiler = current_compiler;
-  current_compiler = new_compiler();
-  current_compiler->next = old_compiler;
-  current_compiler->depth = old_compiler->depth;
+  if (code->protos.count > UINT16_MAX) {
+    alloc_err_str(&result.msg, "Maximum %d functions.", UINT16_MAX + 1);
+    result.is_ok = false;
+    result.errcode = -1;
+    return result;
+  }
 
-  StmtFn stmt_fn = stmt->as.stmt_fn;
+  const StmtFn *stmt_fn = &stmt->as.stmt_fn;
+  Compiler *enclosing = current_compiler;
 
-  int funcname_idx = add_string(code, stmt_fn.name);
+  if (stmt_fn->parameters.count > UINT8_MAX) {
+    alloc_err_str(&result.msg, "Maximum %d parameters per function.",
+                  UINT8_MAX);
+    result.is_ok = false;
+    result.errcode = -1;
+    return result;
+  }
+
+  int funcname_idx = add_string(code, stmt_fn->name);
 
   Function func = {
       .name = code->sp.data[funcname_idx],
-      .paramcount = stmt_fn.parameters.count,
-      .location = code->code.count + 3,
-      .is_async = stmt_fn.is_async,
-      .is_gen = stmt_fn.is_async,
+      .paramcount = stmt_fn->parameters.count,
+      .is_async = stmt_fn->is_async,
+      .is_gen = stmt_fn->is_gen || stmt_fn->is_async,
   };
 
-  table_insert(current_compiler->next->functions, func.name, func);
+  insert_function(enclosing, func);
+
+  scope_push(enclosing->depth == 0 ? &enclosing->globals : &enclosing->locals,
+             func.name, enclosing->depth);
+
+  FunctionProto *proto = calloc(1, sizeof(FunctionProto));
+  proto->name = func.name;
+  proto->paramcount = func.paramcount;
+
+  uint16_t proto_idx = code->protos.count;
+  dynarray_insert(&code->protos, proto);
+
+  /* The functions at the top level of the script have nothing to cap-
+   * ture, so their bodies can wait until they're called, if ever. */
+  if (!enclosing->next && enclosing->depth == 0) {
+    Deferred deferred = {
+        .fn = stmt_fn,
+        .enclosing = enclosing,
+        .globals = enclosing->globals.vars.count,
+        .functions = enclosing->functions->count,
+        .blueprints = enclosing->struct_blueprints
+                          ? enclosing->struct_blueprints->count
+                          : 0,
+    };
+    proto->deferred = ALLOC(deferred);
+
+    emit_op16(code, OP_CLOSURE, proto_idx);
+    emit_byte(code, 0);
+  } else {
+    begin_fn(enclosing, stmt_fn);
 
-  current_compiler->current_fn = &func;
-  current_compiler->in_async_fn = stmt_fn.is_async;
+    CompileResult body_result = compile_fn_body(code, proto, stmt_fn);
+    if (!body_result.is_ok) {
+      return body_result;
+    }
 
-  Local *array = current_compiler->depth == 0 ? current_compiler->next->globals
-                                              : current_compiler->next->locals;
-  size_t *count = current_compiler->depth == 0
-                      ? &current_compiler->next->globals_count
-                      : &current_compiler->next->locals_count;
-  array[(*count)++] = (Local){
-      .name = func.name,
-      .depth = current_compiler->depth,
-      .captured = false,
-  };
+    emit_op16(code, OP_CLOSURE, proto_idx);
+    emit_byte(code, proto->upvalue_count);
 
-  for (size_t i = 0; i < stmt_fn.parameters.count; i++) {
-    current_compiler->locals[current_compiler->locals_count++] = (Local){
-        .name = stmt_fn.parameters.data[i],
-        .depth = current_compiler->depth,
-        .captured = false,
-    };
-  }
+    for (size_t i = 0; i < current_compiler->upvalues.count; i++) {
+      emit_uint16(code, current_compiler->upvalues.data[i]);
+    }
 
-  /* Emit the jump because we don't want to execute the code
-   * the first time we encounter it. */
-  int jump = emit_placeholder(code, OP_JMP);
+    free_compiler(current_compiler);
+    free(current_compiler);
 
-  /* Compile the function body. */
-  CompileResult body_result = compile_stmt(code, stmt_fn.body);
-  if (!body_result.is_ok) {
-    return body_result;
+    current_compiler = enclosing;
   }
 
-  /* Finally, patch the jump. */
-  patch_placeholder(code, jump);
+  if (enclosing->depth == 0) {
+    emit_op16(code, OP_SET_GLOBAL, add_string(code, func.name));
+  }
 
-  func.upvalue_count = current_compiler->upvalues.count;
+  return result;
+}
 
-  table_insert(current_compiler->functions, func.name, func);
+CompileResult compile_deferred(Bytecode *code, FunctionProto *proto)
+{
+  Deferred *deferred = proto->deferred;
+  Compiler *saved = current_compiler;
 
-  emit_bytes(code, 5, OP_CLOSURE, add_string(code, func.name), func.paramcount,
-             func.location, func.upvalue_count);
+  deferred->enclosing->horizon = deferred;
+  begin_fn(deferred->enclosing, deferred->fn);
 
-  for (size_t i = 0; i < current_compiler->upvalues.count; i++) {
-    emit_byte(code, current_compiler->upvalues.data[i]);
-  }
+  CompileResult result = compile_fn_body(code, proto, deferred->fn);
+
+  /* Whatever is left of the compilers, if it failed, goes along with
+   * the function's own. */
+  free_compilers();
+  deferred->enclosing->horizon = NULL;
+  current_compiler = saved;
 
-  if (current_compiler->depth == 0) {
-    emit_bytes(code, 2, OP_SET_GLOBAL, add_string(code, func.name));
+  if (result.is_ok) {
+    free(deferred);
+    proto->deferred = NULL;
   }
 
-  free_compiler(current_compiler);
-  free(current_compiler);
+  return result;
+}
 
-  current_compiler = old_compiler;
+CompileResult compile_all_deferred(Bytecode *code)
+{
+  CompileResult result = {.is_ok = true,
+                          .errcode = 0,
+                          .msg = NULL,
+                          .chunk = NULL,
+                          .span = {0},
+                          .time = 0.0};
+
+  /* The functions defined in the bodies add protos as they're compiled,
+   * but those are never deferred. */
+  for (size_t i = 0; i < code->protos.count; i++) {
+    if (code->protos.data[i]->deferred) {
+      result = compile_deferred(code, code->protos.data[i]);
+      if (!result.is_ok) {
+        return result;
+      }
+    }
+  }
 
   return result;
 }
@@ -2216,10 +2654,10 @@ static CompileResult compile_stmt_decorator(Bytecode *code, const Stmt *stmt)
     return fn_result;
   }
 
-  emit_bytes(code, 2, OP_GET_GLOBAL,
+  emit_op16(code, OP_GET_GLOBAL,
              add_string(code, stmt_decorator.fn->as.stmt_fn.name));
 
-  emit_bytes(code, 2, OP_GET_GLOBAL, add_string(code, stmt_decorator.name));
+  emit_op16(code, OP_GET_GLOBAL, add_string(code, stmt_decorator.name));
 
   emit_byte(code, OP_CALL);
 
@@ -2235,7 +2673,7 @@ static CompileResult compile_stmt_decorator(Bytecode *code, const Stmt *stmt)
 
   emit_byte(code, argcount);
 
-  emit_bytes(code, 2, OP_SET_GLOBAL,
+  emit_op16(code, OP_SET_GLOBAL,
              add_string(code, stmt_decorator.fn->as.stmt_fn.name));
 
   return result;
@@ -2259,20 +2697,24 @@ static CompileResult compile_stmt_struct(Bytecode *code, const Stmt *stmt)
    * for each property:
    *    4-byte index of the property name in the sp
    *    4-byte index of the property in the 'items' */
-  emit_bytes(code, 3, OP_STRUCT_BLUEPRINT, add_string(code, stmt_struct.name),
-             stmt_struct.properties.count);
+  emit_op16(code, OP_STRUCT_BLUEPRINT, add_string(code, stmt_struct.name));
+  emit_byte(code, stmt_struct.properties.count);
 
   StructBlueprint blueprint = {.name = stmt_struct.name,
                                .property_indexes = calloc(1, sizeof(Table_int)),
-                               .methods = calloc(1, sizeof(Table_Function))};
+                               .methods = NULL};
 
   for (size_t i = 0; i < stmt_struct.properties.count; i++) {
-    emit_byte(code, add_string(code, stmt_struct.properties.data[i]));
+    emit_uint16(code, add_string(code, stmt_struct.properties.data[i]));
     table_insert(blueprint.property_indexes, stmt_struct.properties.data[i], i);
     emit_byte(code, i);
   }
 
   /* Let the compiler know about the blueprint. */
+  if (!current_compiler->struct_blueprints) {
+    current_compiler->struct_blueprints =
+        calloc(1, sizeof(Table_StructBlueprint));
+  }
   table_insert(current_compiler->struct_blueprints, blueprint.name, blueprint);
 
   return result;
@@ -2309,18 +2751,7 @@ static CompileResult compile_stmt_return(Bytecode *code, const Stmt *stmt)
    * [..., <return value>] */
 
   /* Finally, emit OP_RET. */
-
-  size_t deepset_no = current_compiler->locals_count - 1;
-
-  for (int i = current_compiler->locals_count - 1; i >= 0; i--) {
-    if (current_compiler->locals[i].captured) {
-      emit_byte(code, OP_CLOSE_UPVALUE);
-    } else {
-      emit_bytes(code, 2, OP_DEEPSET, deepset_no--);
-    }
-  }
-
-  emit_byte(code, OP_RET);
+  emit_return(code);
 
   return result;
 }
@@ -2329,7 +2760,7 @@ static void emit_named_jump(Bytecode *code, char *label)
 {
   int jmp = emit_placeholder(code, OP_JMP);
   Label exit_label = {.location = jmp, .patch_with = -1};
-  table_insert(current_compiler->labels, label, exit_label);
+  insert_label(label, exit_label);
 }
 
 static CompileResult compile_stmt_break(Bytecode *code, const Stmt *stmt)
@@ -2361,7 +2792,7 @@ static CompileResult compile_stmt_continue(Bytecode *code, const Stmt *stmt)
                           .time = 0.0};
 
   Label *loop_start =
-      table_get(current_compiler->labels, stmt->as.stmt_continue.label);
+      resolve_label(stmt->as.stmt_continue.label);
 
   emit_loop_cleanup(code);
   emit_loop(code, loop_start->location);
@@ -2380,49 +2811,41 @@ static CompileResult compile_stmt_impl(Bytecode *code, const Stmt *stmt)
 
   /* Look up the struct with that name in compiler->structs. */
   StructBlueprint *blueprint =
-      table_get(current_compiler->struct_blueprints, stmt_impl.name);
+      current_compiler->struct_blueprints
+          ? table_get(current_compiler->struct_blueprints, stmt_impl.name)
+          : NULL;
 
   /* If it is not found, bail out. */
   if (!blueprint) {
     alloc_err_str(&result.msg, "struct '%s' is not defined.\n", stmt_impl.name);
-    Compiler *c;
-    while (current_compiler) {
-      c = current_compiler;
-      current_compiler = c->next;
-      free_compiler(c);
-      free(c);
-    }
+    free_compilers();
     result.is_ok = false;
     result.errcode = -1;
     return result;
   }
 
+  /* Each method's proto is the first one compiling it makes. */
+  uint16_t *protos = malloc(sizeof(uint16_t) * (stmt_impl.methods.count + 1));
+
   for (size_t i = 0; i < stmt_impl.methods.count; i++) {
-    StmtFn func = stmt_impl.methods.data[i].as.stmt_fn;
-    Function f = {
-        .name = func.name,
-        .paramcount = func.parameters.count,
-        .location = code->code.count + 3,
-    };
-    table_insert(blueprint->methods, func.name, ALLOC(f));
+    protos[i] = code->protos.count;
     CompileResult method_result =
         compile_stmt(code, &stmt_impl.methods.data[i]);
     if (!method_result.is_ok) {
+      free(protos);
       return method_result;
     }
   }
 
-  emit_bytes(code, 3, OP_IMPL, add_string(code, blueprint->name),
-             stmt_impl.methods.count);
+  emit_op16(code, OP_IMPL, add_string(code, blueprint->name));
+  emit_byte(code, stmt_impl.methods.count);
 
   for (size_t i = 0; i < stmt_impl.methods.count; i++) {
-    StmtFn func = stmt_impl.methods.data[i].as.stmt_fn;
-    Function **f = table_get(blueprint->methods, func.name);
-    emit_byte(code, add_string(code, (*f)->name));
-    emit_byte(code, (*f)->paramcount);
-    emit_byte(code, (*f)->location);
+    emit_uint16(code, protos[i]);
   }
 
+  free(protos);
+
   return result;
 }
 
@@ -2444,8 +2867,6 @@ static CompileResult compile_stmt_yield(Bytecode *code, const Stmt *stmt)
   emit_byte(code, OP_YIELD);
   emit_byte(code, OP_POP);
 
-  mark_current_function_as_generator();
-
   return result;
 }
 
@@ -2483,11 +2904,12 @@ static CompileResult compile_stmt_goto(Bytecode *code, const Stmt *stmt)
 
 static CompileResult compile_stmt_labeled(Bytecode *code, const Stmt *stmt)
 {
-  Label *label =
-      table_get(current_compiler->labels, stmt->as.stmt_labeled.label);
+  Label *label = resolve_label(stmt->as.stmt_labeled.label);
 
   if (label) {
-    label->patch_with = code->code.count;
+    Label l = *label;
+    l.patch_with = code->code.count;
+    insert_label(stmt->as.stmt_labeled.label, l);
     patch_jumps(code);
   }
 
@@ -2551,8 +2973,7 @@ static void collect_labels(const DynArray_Stmt *ast)
       }
       case STMT_LABELED: {
         Label label = {.location = -1, .patch_with = -1};
-        table_insert(current_compiler->labels,
-                     ast->data[i].as.stmt_labeled.label, label);
+        insert_label(ast->data[i].as.stmt_labeled.label, label);
         break;
       }
       default:
@@ -2561,12 +2982,265 @@ static void collect_labels(const DynArray_Stmt *ast)
   }
 }
 
+/* Notes that the code emitted from here on comes from 'line'. */
+static void mark_line(Bytecode *code, size_t line)
+{
+  DynArray_LineRun *lines = &code->lines;
+
+  if (line == 0 || (lines->count > 0 && dynarray_peek(lines).line == line)) {
+    return;
+  }
+
+  if (lines->count > 0 && dynarray_peek(lines).offset == code->code.count) {
+    lines->data[lines->count - 1].line = line;
+  } else {
+    LineRun run = {.offset = code->code.count, .line = line};
+    dynarray_insert(lines, run);
+  }
+}
+
 static CompileResult compile_stmt(Bytecode *code, const Stmt *stmt)
 {
+  mark_line(code, stmt->span.line);
   return stmt_handler[stmt->kind].fn(code, stmt);
 }
 
-CompileResult compile(const DynArray_Stmt *ast)
+size_t instruction_size(const uint8_t *ip)
+{
+  switch (*ip) {
+    case OP_CONST:
+      return 1 + sizeof(double);
+    case OP_CALL_METHOD:
+      return 4;
+    case OP_STRUCT_BLUEPRINT:
+      return 4 + 3 * ip[3];
+    case OP_IMPL:
+    case OP_CLOSURE:
+      return 4 + 2 * ip[3];
+    case OP_JMP:
+    case OP_JZ:
+    case OP_JNZ:
+    case OP_STR:
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_PTR:
+    case OP_DEEPSET:
+    case OP_DEEPGET:
+    case OP_DEEPGET_PTR:
+    case OP_DEEPGET_BORROW:
+    case OP_SETATTR:
+    case OP_GETATTR:
+    case OP_GETATTR_PTR:
+    case OP_GETATTR_BORROW:
+    case OP_STRUCT:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_PTR:
+    case OP_SET_UPVALUE:
+      return 3;
+    case OP_CALL:
+    case OP_ARRAY:
+      return 2;
+    default:
+      return 1;
+  }
+}
+
+/* Returns where the jump at 'i' lands, or -1 if that's outside the
+ * code. */
+static long jump_target(const DynArray_uint8_t *code, size_t i)
+{
+  int16_t offset = (int16_t) ((code->data[i + 1] << 8) | code->data[i + 2]);
+  long target = (long) i + 3 + offset;
+  return target >= 0 && (size_t) target <= code->count ? target : -1;
+}
+
+/* Marks the instructions that can be reached other than by falling
+ * through from the previous one, i.e., the jump targets. */
+static bool *find_jump_targets(const DynArray_uint8_t *code)
+{
+  bool *targets = calloc(code->count + 1, sizeof(bool));
+
+  for (size_t i = 0; i < code->count; i += instruction_size(&code->data[i])) {
+    if (code->data[i] == OP_JMP || code->data[i] == OP_JZ ||
+        code->data[i] == OP_JNZ) {
+      long target = jump_target(code, i);
+      if (target != -1) {
+        targets[target] = true;
+      }
+    }
+  }
+
+  return targets;
+}
+
+/* A local that is pushed only to be consumed by the very next ins-
+ * truction doesn't need its refcount touched at all: OP_DEEPGET in-
+ * crefs it, and OP_GETATTR, OP_LEN, or OP_SUBSCRIPT decref it right
+ * after, and nothing in between can overwrite the slot it came from,
+ * which keeps it alive. This pass looks for such pairs in the emitted
+ * bytecode and turns them into the *_BORROW variants that skip both.
+ *
+ * For OP_SUBSCRIPT, the index comes in between, so only an index th-
+ * at is a constant or another local is allowed. And since the pairs
+ * must always be executed together, a jump that lands in the middle
+ * of one leaves it alone. */
+static void elide_refcounts(DynArray_uint8_t *code)
+{
+  uint8_t *data = code->data;
+  bool *targets = find_jump_targets(code);
+
+  for (size_t i = 0; i < code->count; i += instruction_size(&data[i])) {
+    if (data[i] != OP_DEEPGET) {
+      continue;
+    }
+
+    size_t next = i + instruction_size(&data[i]);
+    if (next >= code->count || targets[next]) {
+      continue;
+    }
+
+    switch (data[next]) {
+      case OP_GETATTR:
+        data[i] = OP_DEEPGET_BORROW;
+        data[next] = OP_GETATTR_BORROW;
+        break;
+      case OP_LEN:
+        data[i] = OP_DEEPGET_BORROW;
+        data[next] = OP_LEN_BORROW;
+        break;
+      case OP_CONST:
+      case OP_DEEPGET: {
+        size_t after = next + instruction_size(&data[next]);
+        if (after < code->count && !targets[after] &&
+            data[after] == OP_SUBSCRIPT) {
+          data[i] = OP_DEEPGET_BORROW;
+          data[after] = OP_SUBSCRIPT_BORROW;
+        }
+        break;
+      }
+      default:
+        break;
+    }
+  }
+
+  free(targets);
+}
+
+/* Returns by how much the instruction at 'ip' changes the depth of the
+ * stack. The calls count as what they leave behind once they return,
+ * and OP_MKGEN as if the function took no arguments, since it can't
+ * tell, which errs on the side of a deeper stack. */
+static int stack_effect(const uint8_t *ip)
+{
+  switch (*ip) {
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NULL:
+    case OP_CONST:
+    case OP_STR:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_PTR:
+    case OP_DEEPGET:
+    case OP_DEEPGET_PTR:
+    case OP_DEEPGET_BORROW:
+    case OP_STRUCT:
+    case OP_CLOSURE:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_PTR:
+    case OP_PIPE:
+    case OP_SOCKETPAIR:
+      return 1;
+    case OP_PRINT:
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_MOD:
+    case OP_EQ:
+    case OP_GT:
+    case OP_LT:
+    case OP_JZ:
+    case OP_JNZ:
+    case OP_BITAND:
+    case OP_BITOR:
+    case OP_BITXOR:
+    case OP_BITSHL:
+    case OP_BITSHR:
+    case OP_SET_GLOBAL:
+    case OP_DEEPSET:
+    case OP_SETATTR:
+    case OP_POP:
+    case OP_STRCAT:
+    case OP_SUBSCRIPT:
+    case OP_SUBSCRIPT_BORROW:
+    case OP_SET_UPVALUE:
+    case OP_CLOSE_UPVALUE:
+    case OP_SEND:
+    case OP_HASATTR:
+    case OP_READ_FD:
+    case OP_WRITE_FD:
+    case OP_ASSERT:
+      return -1;
+    case OP_DEREFSET:
+      return -2;
+    case OP_ARRAYSET:
+      return -3;
+    case OP_ARRAY:
+      return 1 - ip[1];
+    case OP_CALL:
+      return -ip[1];
+    case OP_CALL_METHOD:
+      return -ip[3];
+    default:
+      return 0;
+  }
+}
+
+/* Returns the deepest the stack of a frame running 'code' gets, coun-
+ * ting from the start of the frame, where 'base' objects (the argu-
+ * ments) already are. The code is walked in order, and a jump target
+ * is taken to be as deep as the deepest of the ways into it, which is
+ * enough, since the loops leave the stack the way they found it. */
+static uint16_t max_stack_depth(const DynArray_uint8_t *code, size_t base)
+{
+  long *arrival = malloc(sizeof(long) * (code->count + 1));
+  for (size_t i = 0; i <= code->count; i++) {
+    arrival[i] = -1;
+  }
+
+  long depth = base, max = base;
+  bool falls_through = true;
+
+  for (size_t i = 0; i < code->count; i += instruction_size(&code->data[i])) {
+    const uint8_t *ip = &code->data[i];
+
+    if (arrival[i] != -1 && (!falls_through || arrival[i] > depth)) {
+      depth = arrival[i];
+    }
+
+    depth += stack_effect(ip);
+    if (depth < 0) {
+      depth = 0;
+    }
+    if (depth > max) {
+      max = depth;
+    }
+
+    if (*ip == OP_JMP || *ip == OP_JZ || *ip == OP_JNZ) {
+      long target = jump_target(code, i);
+      if (target > (long) i && depth > arrival[target]) {
+        arrival[target] = depth;
+      }
+    }
+
+    falls_through = *ip != OP_JMP && *ip != OP_RET && *ip != OP_HLT;
+  }
+
+  free(arrival);
+  return max > UINT16_MAX ? UINT16_MAX : (uint16_t) max;
+}
+
+CompileResult compile(const DynArray_Stmt *ast, bool optimized)
 {
   CompileResult result = {.is_ok = true,
                           .errcode = 0,
@@ -2583,6 +3257,7 @@ CompileResult compile(const DynArray_Stmt *ast)
 
   Bytecode *chunk = malloc(sizeof(Bytecode));
   init_chunk(chunk);
+  chunk->peephole = optimized;
 
   for (size_t i = 0; i < ast->count; i++) {
     result = compile_stmt(chunk, &ast->data[i]);
@@ -2595,6 +3270,11 @@ CompileResult compile(const DynArray_Stmt *ast)
 
   dynarray_insert(&chunk->code, OP_HLT);
 
+  if (optimized) {
+    chunk->peephole_removed += peephole(&chunk->code, &chunk->lines);
+  }
+  elide_refcounts(&chunk->code);
+
   clock_gettime(CLOCK_MONOTONIC, &end);
 
   result.chunk = chunk;
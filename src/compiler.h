@@ -22,11 +22,13 @@ typedef enum {
   OP_NOT,
   OP_NEG,
   OP_TRUE,
+  OP_FALSE,
   OP_NULL,
   OP_CONST,
   OP_STR,
   OP_JMP,
   OP_JZ,
+  OP_JNZ,
   OP_BITAND,
   OP_BITOR,
   OP_BITXOR,
@@ -39,9 +41,11 @@ typedef enum {
   OP_DEEPSET,
   OP_DEEPGET,
   OP_DEEPGET_PTR,
+  OP_DEEPGET_BORROW,
   OP_SETATTR,
   OP_GETATTR,
   OP_GETATTR_PTR,
+  OP_GETATTR_BORROW,
   OP_STRUCT,
   OP_STRUCT_BLUEPRINT,
   OP_CLOSURE,
@@ -55,6 +59,7 @@ typedef enum {
   OP_ARRAY,
   OP_ARRAYSET,
   OP_SUBSCRIPT,
+  OP_SUBSCRIPT_BORROW,
   OP_GET_UPVALUE,
   OP_GET_UPVALUE_PTR,
   OP_SET_UPVALUE,
@@ -70,24 +75,58 @@ typedef enum {
   OP_SLEEP,
   OP_DONE,
   OP_RESULT,
+  OP_PIPE,
+  OP_SOCKETPAIR,
+  OP_LISTEN_UNIX,
+  OP_CONNECT_UNIX,
+  OP_ACCEPT,
+  OP_READ_FD,
+  OP_WRITE_FD,
+  OP_CLOSE_FD,
+  OP_CHANNEL,
+  OP_RECV,
+  OP_GATHER,
+  OP_SELECT,
   OP_LEN,
+  OP_LEN_BORROW,
   OP_HASATTR,
   OP_ASSERT,
   OP_HLT,
 } Opcode;
 
+typedef DynArray(FunctionProto *) DynArray_FunctionProto_ptr;
+
+/* The code of the script itself, which runs first, and the protos of
+ * every function in it, in the order they were defined in, which is
+ * what OP_CLOSURE and OP_IMPL refer to them by. */
 typedef struct Bytecode {
   DynArray_uint8_t code;
+  DynArray_LineRun lines;
+  DynArray_FunctionProto_ptr protos;
   DynArray_char_ptr sp; /* string pool */
+  /* An open-addressing index of the string pool, used while compiling:
+   * each slot holds the index of a string plus one, or zero if empty. */
+  uint32_t *sp_index;
+  size_t sp_index_capacity;
+  /* The .vnmc file the code and the strings live in, if the chunk was
+   * loaded from one, rather than compiled (see vnmc.h). */
+  void *mapping;
+  size_t mapping_size;
+  /* Whether the code goes through the peephole pass (see peephole.h),
+   * and how many instructions it has removed so far. */
+  bool peephole;
+  size_t peephole_removed;
 } Bytecode;
 
 typedef Table(int) Table_int;
 typedef Table(Function *) Table_FunctionPtr;
+typedef Table(const FunctionProto *) Table_FunctionProtoPtr;
 
+/* The methods are only known to the VM, once OP_IMPL has run. */
 typedef struct {
   char *name;
   Table_int *property_indexes;
-  Table_FunctionPtr *methods;
+  Table_FunctionProtoPtr *methods;
 } StructBlueprint;
 
 typedef Table(StructBlueprint) Table_StructBlueprint;
@@ -97,8 +136,23 @@ typedef struct {
   char *name;
   int depth;
   bool captured;
+  int prev; /* the previous local in the same bucket, or -1 */
 } Local;
 
+typedef DynArray(Local) DynArray_Local;
+
+/* The locals (or the globals) of a function, along with a hash index
+ * of their names. Each bucket holds the last local whose name hashes
+ * to it, chained to the ones before it, and since the locals go out
+ * of scope in the reverse order from the one they came into it in,
+ * dropping one is just unlinking the head of its bucket. */
+typedef struct {
+  DynArray_Local vars;
+  int *buckets;
+  size_t bucket_count;
+  size_t peak; /* the most there ever were */
+} Scope;
+
 typedef struct {
   int location;
   int patch_with;
@@ -106,21 +160,35 @@ typedef struct {
 
 typedef Table(Label) Table_Label;
 
+/* A function defined at the top level, whose body is compiled only
+ * once it's first called (see compile_deferred()), and how many of the
+ * globals, the functions and the structs of the script were defined
+ * by then, which is all its body gets to see, just like it would if it
+ * were compiled right away. */
+typedef struct Deferred {
+  const StmtFn *fn;
+  struct Compiler *enclosing;
+  size_t globals;
+  size_t functions;
+  size_t blueprints;
+} Deferred;
+
+/* The tables are allocated only once something is inserted into them,
+ * since most functions don't define functions, structs, or loops of
+ * their own, and the builtins are only in the outermost compiler. */
 typedef struct Compiler {
-  Local locals[256];
-  size_t locals_count;
-  Local globals[256];
-  size_t globals_count;
+  Scope locals;
+  Scope globals;
   Table_Function *functions;
   Table_Label *labels;
   DynArray_int loop_depths;
   Table_StructBlueprint *struct_blueprints;
   int depth;
-  Function *current_fn;
   bool in_async_fn;
   struct Compiler *next;
   DynArray_int upvalues;
   Table_FunctionPtr *builtins;
+  const Deferred *horizon; /* set while a deferred body is compiled */
 } Compiler;
 
 typedef struct {
@@ -135,10 +203,35 @@ typedef struct {
 void init_chunk(Bytecode *code);
 void free_chunk(Bytecode *code);
 
+/* Finds the code 'ip' points into, which is either that of one of the
+ * protos, stored in 'proto', or the script's, in which case 'proto' is
+ * set to NULL. Returns the offset of 'ip' in it, or -1 if it's in no-
+ * ne. */
+long locate_code(const Bytecode *code, const uint8_t *ip,
+                 const FunctionProto **proto);
+
+/* Returns the line the instruction at 'offset' was compiled from, or 0
+ * if there's no telling. */
+uint32_t line_at(const DynArray_LineRun *lines, size_t offset);
+
 Compiler *new_compiler(void);
 void free_compiler(Compiler *compiler);
 
-CompileResult compile(const DynArray_Stmt *ast);
+/* Returns the size of the instruction at 'ip', operands included. */
+size_t instruction_size(const uint8_t *ip);
+
+/* Compiles 'ast', and runs the peephole pass over the code if it's
+ * 'optimized'. */
+CompileResult compile(const DynArray_Stmt *ast, bool optimized);
+
+/* Compiles the body of 'proto', which was deferred, with the compiler
+ * that compiled the script, which has to be around until the chunk has
+ * run, and so does the AST. */
+CompileResult compile_deferred(Bytecode *code, FunctionProto *proto);
+
+/* Compiles every body that is still deferred, which is needed before
+ * the chunk can be saved or disassembled, or shared between threads. */
+CompileResult compile_all_deferred(Bytecode *code);
 
 extern Compiler *current_compiler;
 
@@ -26,11 +26,16 @@ DisassembleHandler disassemble_handler[] = {
     [OP_NOT] = {.opcode = "OP_NOT"},
     [OP_NEG] = {.opcode = "OP_NEG"},
     [OP_TRUE] = {.opcode = "OP_TRUE"},
+    [OP_FALSE] = {.opcode = "OP_FALSE"},
     [OP_NULL] = {.opcode = "OP_NULL"},
     [OP_CONST] = {.opcode = "OP_CONST"},
     [OP_STR] = {.opcode = "OP_STR"},
     [OP_STRCAT] = {.opcode = "OP_STRCAT"},
+    [OP_ARRAY] = {.opcode = "OP_ARRAY"},
+    [OP_ARRAYSET] = {.opcode = "OP_ARRAYSET"},
+    [OP_SUBSCRIPT] = {.opcode = "OP_SUBSCRIPT"},
     [OP_JZ] = {.opcode = "OP_JZ"},
+    [OP_JNZ] = {.opcode = "OP_JNZ"},
     [OP_JMP] = {.opcode = "OP_JMP"},
     [OP_SET_GLOBAL] = {.opcode = "OP_SET_GLOBAL"},
     [OP_GET_GLOBAL] = {.opcode = "OP_GET_GLOBAL"},
@@ -38,21 +43,26 @@ DisassembleHandler disassemble_handler[] = {
     [OP_DEEPSET] = {.opcode = "OP_DEEPSET"},
     [OP_DEEPGET] = {.opcode = "OP_DEEPGET"},
     [OP_DEEPGET_PTR] = {.opcode = "OP_DEEPGET_PTR"},
+    [OP_DEEPGET_BORROW] = {.opcode = "OP_DEEPGET_BORROW"},
     [OP_SETATTR] = {.opcode = "OP_SETATTR"},
     [OP_GETATTR] = {.opcode = "OP_GETATTR"},
     [OP_GETATTR_PTR] = {.opcode = "OP_GETATTR_PTR"},
+    [OP_GETATTR_BORROW] = {.opcode = "OP_GETATTR_BORROW"},
     [OP_STRUCT] = {.opcode = "OP_STRUCT"},
     [OP_RET] = {.opcode = "OP_RET"},
     [OP_POP] = {.opcode = "OP_POP"},
     [OP_DEREF] = {.opcode = "OP_DEREF"},
     [OP_DEREFSET] = {.opcode = "OP_DEREFSET"},
     [OP_CALL] = {.opcode = "OP_CALL"},
+    [OP_CALL_METHOD] = {.opcode = "OP_CALL_METHOD"},
     [OP_STRUCT_BLUEPRINT] = {.opcode = "OP_STRUCT_BLUEPRINT"},
     [OP_GET_UPVALUE] = {.opcode = "OP_GET_UPVALUE"},
     [OP_GET_UPVALUE_PTR] = {.opcode = "OP_GET_UPVALUE_PTR"},
     [OP_SET_UPVALUE] = {.opcode = "OP_SET_UPVALUE"},
+    [OP_CLOSE_UPVALUE] = {.opcode = "OP_CLOSE_UPVALUE"},
     [OP_CLOSURE] = {.opcode = "OP_CLOSURE"},
     [OP_IMPL] = {.opcode = "OP_IMPL"},
+    [OP_MKGEN] = {.opcode = "OP_MKGEN"},
     [OP_YIELD] = {.opcode = "OP_YIELD"},
     [OP_RESUME] = {.opcode = "OP_RESUME"},
     [OP_SEND] = {.opcode = "OP_SEND"},
@@ -62,27 +72,122 @@ DisassembleHandler disassemble_handler[] = {
     [OP_SLEEP] = {.opcode = "OP_SLEEP"},
     [OP_DONE] = {.opcode = "OP_DONE"},
     [OP_RESULT] = {.opcode = "OP_RESULT"},
+    [OP_PIPE] = {.opcode = "OP_PIPE"},
+    [OP_SOCKETPAIR] = {.opcode = "OP_SOCKETPAIR"},
+    [OP_LISTEN_UNIX] = {.opcode = "OP_LISTEN_UNIX"},
+    [OP_CONNECT_UNIX] = {.opcode = "OP_CONNECT_UNIX"},
+    [OP_ACCEPT] = {.opcode = "OP_ACCEPT"},
+    [OP_READ_FD] = {.opcode = "OP_READ_FD"},
+    [OP_WRITE_FD] = {.opcode = "OP_WRITE_FD"},
+    [OP_CLOSE_FD] = {.opcode = "OP_CLOSE_FD"},
+    [OP_CHANNEL] = {.opcode = "OP_CHANNEL"},
+    [OP_RECV] = {.opcode = "OP_RECV"},
+    [OP_GATHER] = {.opcode = "OP_GATHER"},
+    [OP_SELECT] = {.opcode = "OP_SELECT"},
     [OP_LEN] = {.opcode = "OP_LEN"},
+    [OP_LEN_BORROW] = {.opcode = "OP_LEN_BORROW"},
+    [OP_SUBSCRIPT_BORROW] = {.opcode = "OP_SUBSCRIPT_BORROW"},
     [OP_HASATTR] = {.opcode = "OP_HASATTR"},
     [OP_ASSERT] = {.opcode = "OP_ASSERT"},
     [OP_HLT] = {.opcode = "OP_HLT"},
 };
 
-DisassembleResult disassemble(Bytecode *code)
+static uint16_t read_uint16(const uint8_t *p)
 {
-#define READ_UINT8() (*++ip)
-#define READ_INT16() (ip += 2, (int16_t) ((ip[-1] << 8) | ip[0]))
+  return (uint16_t) ((p[0] << 8) | p[1]);
+}
 
-#define READ_UINT32() \
-  (ip += 4,           \
-   (uint32_t) ((ip[-3] << 24) | (ip[-2] << 16) | (ip[-1] << 8) | ip[0]))
+size_t disassemble_instruction(const Bytecode *code, const uint8_t *ip)
+{
+  printf("%s", disassemble_handler[*ip].opcode);
+
+  switch (*ip) {
+    case OP_CONST: {
+      union {
+        double d;
+        uint64_t raw;
+      } num = {.raw = 0};
+      for (size_t i = 1; i <= sizeof(double); i++) {
+        num.raw = (num.raw << 8) | ip[i];
+      }
+      printf(" (%.16g)", num.d);
+      return 1 + sizeof(double);
+    }
+    case OP_JMP:
+    case OP_JZ:
+    case OP_JNZ: {
+      int16_t offset = (int16_t) ((ip[1] << 8) | ip[2]);
+      printf(" (offset: %d)", offset);
+      return 3;
+    }
+    case OP_STR:
+      printf(" (value: \"%s\")", code->sp.data[read_uint16(&ip[1])]);
+      return 3;
+    case OP_STRUCT:
+    case OP_SET_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_PTR:
+      printf(" (name: %s)", code->sp.data[read_uint16(&ip[1])]);
+      return 3;
+    case OP_SETATTR:
+    case OP_GETATTR:
+    case OP_GETATTR_PTR:
+    case OP_GETATTR_BORROW:
+      printf(" (property: %s)", code->sp.data[read_uint16(&ip[1])]);
+      return 3;
+    case OP_DEEPGET:
+    case OP_DEEPGET_PTR:
+    case OP_DEEPGET_BORROW:
+    case OP_DEEPSET:
+    case OP_GET_UPVALUE:
+    case OP_GET_UPVALUE_PTR:
+    case OP_SET_UPVALUE:
+      printf(" (idx: %d)", read_uint16(&ip[1]));
+      return 3;
+    case OP_ARRAY:
+      printf(" (count: %d)", ip[1]);
+      return 2;
+    case OP_CALL:
+      printf(" (argcount: %d)", ip[1]);
+      return 2;
+    case OP_CALL_METHOD:
+      printf(" (method: %s, argcount: %d)", code->sp.data[read_uint16(&ip[1])],
+             ip[3]);
+      return 4;
+    case OP_CLOSURE:
+      printf(" (name: %s, upvalue_count: %d)",
+             code->protos.data[read_uint16(&ip[1])]->name, ip[3]);
+      return 4 + 2 * ip[3];
+    case OP_STRUCT_BLUEPRINT:
+      printf(" (name: %s, propcount: %d)", code->sp.data[read_uint16(&ip[1])],
+             ip[3]);
+      return 4 + 3 * ip[3];
+    case OP_IMPL:
+      printf(" (name: %s, method_count: %d)",
+             code->sp.data[read_uint16(&ip[1])], ip[3]);
+      return 4 + 2 * ip[3];
+    default:
+      return 1;
+  }
+}
 
-#define READ_DOUBLE()                                                         \
-  (ip += 8, (double) (((uint64_t) ip[-7] << 56) | ((uint64_t) ip[-6] << 48) | \
-                      ((uint64_t) ip[-5] << 40) | ((uint64_t) ip[-4] << 32) | \
-                      ((uint64_t) ip[-3] << 24) | ((uint64_t) ip[-2] << 16) | \
-                      ((uint64_t) ip[-1] << 8) | (uint64_t) ip[0]))
+static bool disassemble_code(const Bytecode *code,
+                             const DynArray_uint8_t *instructions)
+{
+  for (size_t i = 0; i < instructions->count;) {
+    if (!disassemble_handler[instructions->data[i]].opcode) {
+      return false;
+    }
 
+    printf("%zu: ", i);
+    i += disassemble_instruction(code, &instructions->data[i]);
+    printf("\n");
+  }
+  return true;
+}
+
+DisassembleResult disassemble(Bytecode *code)
+{
   DisassembleResult result = {
       .is_ok = true, .errcode = 0, .msg = NULL, .time = 0.0};
 
@@ -90,99 +195,21 @@ DisassembleResult disassemble(Bytecode *code)
 
   clock_gettime(CLOCK_MONOTONIC, &start);
 
-  for (uint8_t *ip = code->code.data; ip < &code->code.data[code->code.count];
-       ip++) {
-    printf("%ld: ", ip - code->code.data);
-    printf("%s", disassemble_handler[*ip].opcode);
-
-    switch (*ip) {
-      case OP_CONST: {
-        union {
-          double d;
-          uint64_t raw;
-        } num;
-        num.raw = READ_DOUBLE();
-        printf(" (%.16g)", num.d);
-        break;
-      }
-      case OP_CLOSURE: {
-        uint32_t name_idx, paramcount, location, upvalue_count;
-
-        name_idx = READ_UINT32();
-        paramcount = READ_UINT32();
-        location = READ_UINT32();
-        upvalue_count = READ_UINT32();
-
-        printf(" (name: %s, paramcount: %d, location: %d, upvalue_count: %d)",
-               code->sp.data[name_idx], paramcount, location, upvalue_count);
+  bool ok = disassemble_code(code, &code->code);
 
-        for (size_t i = 0; i < upvalue_count; i++) {
-          READ_UINT32();
-        }
-
-        break;
-      }
-      case OP_JMP:
-      case OP_JZ: {
-        int16_t offset = READ_INT16();
-        printf(" (offset: %d)", offset);
-        break;
-      }
-      case OP_DEEPGET:
-      case OP_DEEPGET_PTR:
-      case OP_DEEPSET: {
-        uint32_t idx;
-
-        idx = READ_UINT32();
-
-        printf(" (idx: %d)", idx);
-        break;
-      }
-      case OP_CALL: {
-        uint32_t argcount, callee_idx;
-
-        argcount = READ_UINT32();
-        callee_idx = READ_UINT32();
-
-        printf(" (callee: %s, argcount: %d)", code->sp.data[callee_idx],
-               argcount);
-        break;
-      }
-      case OP_GET_GLOBAL:
-      case OP_SET_GLOBAL: {
-        uint32_t name_idx;
-
-        name_idx = READ_UINT32();
-
-        printf(" (name: %s)", code->sp.data[name_idx]);
-        break;
-      }
-      case OP_GET_UPVALUE:
-      case OP_GET_UPVALUE_PTR:
-      case OP_SET_UPVALUE: {
-        uint32_t idx;
-
-        idx = READ_UINT32();
-
-        printf(" (idx: %d)", idx);
-        break;
-      }
-      case OP_RET: {
-        uint32_t popcount;
-
-        popcount = READ_UINT32();
-
-        printf(" (popcount: %d)", popcount);
-        break;
-      }
-      default:
-        return (DisassembleResult){.is_ok = false,
-                                   .errcode = -1,
-                                   .msg = strdup("Disassembling failed.")};
-        break;
-    }
+  for (size_t i = 0; ok && i < code->protos.count; i++) {
+    const FunctionProto *proto = code->protos.data[i];
+    printf("\nfn %s (paramcount: %d, upvalue_count: %d, locals: %d, "
+           "max_stack: %d):\n",
+           proto->name, proto->paramcount, proto->upvalue_count,
+           proto->local_count, proto->max_stack);
+    ok = disassemble_code(code, &proto->code);
+  }
 
-    printf("\n");
+  if (!ok) {
+    return (DisassembleResult){.is_ok = false,
+                               .errcode = -1,
+                               .msg = strdup("Disassembling failed.")};
   }
 
   clock_gettime(CLOCK_MONOTONIC, &end);
@@ -191,8 +218,4 @@ DisassembleResult disassemble(Bytecode *code)
       (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
 
   return result;
-
-#undef READ_UINT8
-#undef READ_INT16
-#undef READ_UINT32
 }
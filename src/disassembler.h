@@ -2,6 +2,8 @@
 #define venom_disassembler_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "compiler.h"
 
@@ -18,6 +20,10 @@ typedef struct {
 
 DisassembleResult disassemble(Bytecode *code);
 
+/* Prints the instruction at 'ip' and its operands, without a newline,
+ * and returns its size in bytes. */
+size_t disassemble_instruction(const Bytecode *code, const uint8_t *ip);
+
 extern DisassembleHandler disassemble_handler[];
 
 #endif
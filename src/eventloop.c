@@ -0,0 +1,150 @@
+#include "eventloop.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+void init_eventloop(EventLoop *loop)
+{
+  loop->epfd = -1;
+  loop->timerfd = -1;
+  loop->armed_at = 0;
+}
+
+void free_eventloop(EventLoop *loop)
+{
+  if (loop->timerfd != -1) {
+    close(loop->timerfd);
+  }
+  if (loop->epfd != -1) {
+    close(loop->epfd);
+  }
+  init_eventloop(loop);
+}
+
+bool eventloop_open(EventLoop *loop)
+{
+  if (loop->epfd != -1) {
+    return true;
+  }
+
+  loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epfd == -1) {
+    return false;
+  }
+
+  loop->timerfd =
+      timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (loop->timerfd == -1) {
+    int saved = errno;
+    free_eventloop(loop);
+    errno = saved;
+    return false;
+  }
+
+  /* The timerfd is registered with a NULL data pointer, which is
+   * how the waiting code tells it apart from other descriptors. */
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) == -1) {
+    int saved = errno;
+    free_eventloop(loop);
+    errno = saved;
+    return false;
+  }
+
+  return true;
+}
+
+static bool arm_timer(EventLoop *loop, uint64_t deadline)
+{
+  if (loop->armed_at == deadline) {
+    return true;
+  }
+
+  struct itimerspec spec = {
+      .it_interval = {0, 0},
+      .it_value = {.tv_sec = deadline / NSEC_PER_SEC,
+                   .tv_nsec = deadline % NSEC_PER_SEC},
+  };
+
+  if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &spec, NULL) == -1) {
+    return false;
+  }
+
+  loop->armed_at = deadline;
+  return true;
+}
+
+bool eventloop_watch(EventLoop *loop, int fd, bool writable, void *data)
+{
+  if (!eventloop_open(loop)) {
+    return false;
+  }
+
+  struct epoll_event ev = {.events = writable ? EPOLLOUT : EPOLLIN,
+                           .data.ptr = data};
+  return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool eventloop_unwatch(EventLoop *loop, int fd)
+{
+  return epoll_ctl(loop->epfd, EPOLL_CTL_DEL, fd, NULL) == 0;
+}
+
+static void drain_timer(EventLoop *loop)
+{
+  /* Drain the expiration counter so the next wait doesn't return
+   * immediately because of a stale level-triggered readiness. */
+  uint64_t expirations;
+  while (read(loop->timerfd, &expirations, sizeof(expirations)) > 0) {
+  }
+  loop->armed_at = 0;
+}
+
+int eventloop_wait(EventLoop *loop, uint64_t deadline, void **ready, int max)
+{
+  if (!eventloop_open(loop)) {
+    return -1;
+  }
+
+  int timeout = -1;
+  if (deadline == EVENTLOOP_NOW) {
+    timeout = 0;
+  } else if (deadline != EVENTLOOP_FOREVER && !arm_timer(loop, deadline)) {
+    return -1;
+  }
+
+  if (max > EVENTLOOP_MAX_EVENTS) {
+    max = EVENTLOOP_MAX_EVENTS;
+  }
+
+  struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+  int n = epoll_wait(loop->epfd, events, max, timeout);
+  if (n == -1) {
+    /* A signal is as good a reason to re-check the deadlines as
+     * any other, so it's not reported as an error. */
+    return errno == EINTR ? 0 : -1;
+  }
+
+  int count = 0;
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.ptr == NULL) {
+      drain_timer(loop);
+    } else {
+      ready[count++] = events[i].data.ptr;
+    }
+  }
+
+  return count;
+}
+
+uint64_t eventloop_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
@@ -0,0 +1,55 @@
+#ifndef venom_eventloop_h
+#define venom_eventloop_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The event loop is what the async scheduler blocks in when there
+ * is no runnable task. It is a thin wrapper around an epoll inst-
+ * ance with a single timerfd registered on it, which is re-armed
+ * to the earliest pending deadline before every wait, plus what-
+ * ever descriptors the tasks are waiting on to become ready.
+ *
+ * All deadlines are absolute CLOCK_MONOTONIC timestamps in nanos-
+ * econds (see eventloop_now()). */
+typedef struct {
+  int epfd;
+  int timerfd;
+  uint64_t armed_at; /* deadline the timerfd is armed to, 0 if none */
+} EventLoop;
+
+void init_eventloop(EventLoop *loop);
+void free_eventloop(EventLoop *loop);
+
+/* Creates the epoll instance and the timerfd. The loop is set up
+ * lazily, so that programs which never sleep don't pay for the
+ * syscalls. Returns false (and sets errno) on failure. */
+bool eventloop_open(EventLoop *loop);
+
+/* Starts watching 'fd' for readability (or writability, if 'wri-
+ * table' is set). 'data' is what eventloop_wait() reports back
+ * when the descriptor becomes ready, so it must not be NULL. */
+bool eventloop_watch(EventLoop *loop, int fd, bool writable, void *data);
+bool eventloop_unwatch(EventLoop *loop, int fd);
+
+/* Waits until either one of the watched descriptors is ready, or
+ * 'deadline' passes, and stores the data pointers of up to 'max'
+ * ready descriptors in 'ready'.
+ *
+ * EVENTLOOP_NOW polls without blocking, EVENTLOOP_FOREVER blocks
+ * without a timeout. Returns the number of ready descriptors (the
+ * expired timer is not counted; callers compare eventloop_now()
+ * against their deadlines themselves), or -1 (and sets errno) on
+ * failure. */
+int eventloop_wait(EventLoop *loop, uint64_t deadline, void **ready, int max);
+
+uint64_t eventloop_now(void);
+
+#define EVENTLOOP_NOW 0
+#define EVENTLOOP_FOREVER UINT64_MAX
+#define EVENTLOOP_MAX_EVENTS 64
+
+#define NSEC_PER_MSEC 1000000ull
+#define NSEC_PER_SEC 1000000000ull
+
+#endif
@@ -0,0 +1,280 @@
+#include "heapprof.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "disassembler.h"
+
+/* This many of the sites with the highest peaks are reported. */
+#define HEAP_TOP_SITES 10
+
+#define TAGS_MIN 1024
+#define SITES_MIN 64
+
+typedef struct {
+  const uint8_t *ip; /* NULL if the entry is empty */
+  uint8_t type;
+  size_t allocations;
+  size_t live;
+  size_t peak;
+  size_t total;
+} HeapSite;
+
+typedef struct {
+  const void *ptr; /* NULL if the entry is empty */
+  const uint8_t *site;
+  size_t bytes;
+} Tag;
+
+bool heap_profiling;
+
+/* Guards everything below. */
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* An open-addressing table from the instructions to their sites. */
+static HeapSite *sites;
+static size_t site_capacity;
+static size_t site_count;
+
+/* An open-addressing table from the objects to their tags. */
+static Tag *tags;
+static size_t tag_capacity;
+static size_t tag_count;
+
+static size_t live_bytes;
+static size_t peak_bytes;
+static size_t allocations;
+
+static const char *type_names[] = {
+    [OBJ_STRUCT] = "struct",       [OBJ_STRING] = "string",
+    [OBJ_ARRAY] = "array",         [OBJ_CLOSURE] = "closure",
+    [OBJ_GENERATOR] = "generator",
+};
+
+static size_t object_bytes(const ObjHeader *header)
+{
+  switch (header->type) {
+    case OBJ_STRING:
+      return sizeof(String) + strlen(((const String *) header)->value) + 1;
+    case OBJ_ARRAY:
+      return sizeof(Array) + sizeof(Object) * ((const Array *) header)
+                                                  ->elements.capacity;
+    case OBJ_STRUCT:
+      return sizeof(Struct) + sizeof(Table_Object);
+    case OBJ_CLOSURE:
+      return sizeof(Closure) +
+             sizeof(Upvalue *) * ((const Closure *) header)->upvalue_count;
+    case OBJ_GENERATOR:
+      return sizeof(Generator);
+    default:
+      return 0;
+  }
+}
+
+static size_t tag_slot(const void *ptr)
+{
+  /* The objects are at least 16-byte aligned, so the low bits of the
+   * address carry nothing. */
+  return (size_t) (((uintptr_t) ptr >> 4) * 0x9E3779B97F4A7C15ull) &
+         (tag_capacity - 1);
+}
+
+static HeapSite *site_find(const uint8_t *ip)
+{
+  size_t i = (size_t) ((uintptr_t) ip * 0x9E3779B97F4A7C15ull) &
+             (site_capacity - 1);
+  while (sites[i].ip && sites[i].ip != ip) {
+    i = (i + 1) & (site_capacity - 1);
+  }
+  return &sites[i];
+}
+
+static void sites_grow(void)
+{
+  HeapSite *old = sites;
+  size_t old_capacity = site_capacity;
+
+  site_capacity = old_capacity ? 2 * old_capacity : SITES_MIN;
+  sites = calloc(site_capacity, sizeof(HeapSite));
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].ip) {
+      *site_find(old[i].ip) = old[i];
+    }
+  }
+  free(old);
+}
+
+static void tags_insert(Tag tag)
+{
+  size_t i = tag_slot(tag.ptr);
+  while (tags[i].ptr) {
+    i = (i + 1) & (tag_capacity - 1);
+  }
+  tags[i] = tag;
+  ++tag_count;
+}
+
+static void tags_grow(void)
+{
+  Tag *old = tags;
+  size_t old_capacity = tag_capacity;
+
+  tag_capacity = old_capacity ? 2 * old_capacity : TAGS_MIN;
+  tags = calloc(tag_capacity, sizeof(Tag));
+  tag_count = 0;
+
+  for (size_t i = 0; i < old_capacity; i++) {
+    if (old[i].ptr) {
+      tags_insert(old[i]);
+    }
+  }
+  free(old);
+}
+
+void heapprof_start(void)
+{
+  pthread_mutex_lock(&heap_lock);
+  sites_grow();
+  tags_grow();
+  heap_profiling = true;
+  pthread_mutex_unlock(&heap_lock);
+}
+
+void heapprof_stop(void)
+{
+  pthread_mutex_lock(&heap_lock);
+  heap_profiling = false;
+  free(sites);
+  free(tags);
+  sites = NULL;
+  tags = NULL;
+  site_capacity = site_count = tag_capacity = tag_count = 0;
+  live_bytes = peak_bytes = allocations = 0;
+  pthread_mutex_unlock(&heap_lock);
+}
+
+void heapprof_alloc(const uint8_t *site, const ObjHeader *header)
+{
+  size_t bytes = object_bytes(header);
+
+  pthread_mutex_lock(&heap_lock);
+  if (site_capacity > 0) {
+    if (2 * (tag_count + 1) > tag_capacity) {
+      tags_grow();
+    }
+    if (2 * (site_count + 1) > site_capacity) {
+      sites_grow();
+    }
+
+    HeapSite *s = site_find(site);
+    if (!s->ip) {
+      s->ip = site;
+      site_count++;
+    }
+    tags_insert((Tag){.ptr = header, .site = s->ip, .bytes = bytes});
+
+    s->type = header->type;
+    s->allocations++;
+    s->total += bytes;
+    s->live += bytes;
+    if (s->live > s->peak) {
+      s->peak = s->live;
+    }
+
+    allocations++;
+    live_bytes += bytes;
+    if (live_bytes > peak_bytes) {
+      peak_bytes = live_bytes;
+    }
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+void heapprof_free(const void *ptr)
+{
+  pthread_mutex_lock(&heap_lock);
+  if (tag_capacity == 0) {
+    pthread_mutex_unlock(&heap_lock);
+    return;
+  }
+
+  size_t i = tag_slot(ptr);
+  while (tags[i].ptr && tags[i].ptr != ptr) {
+    i = (i + 1) & (tag_capacity - 1);
+  }
+
+  if (tags[i].ptr) {
+    site_find(tags[i].site)->live -= tags[i].bytes;
+    live_bytes -= tags[i].bytes;
+
+    /* Deleting from a linear-probing table without tombstones means
+     * moving back the entries after it that probed past it. */
+    size_t hole = i;
+    for (size_t j = (i + 1) & (tag_capacity - 1); tags[j].ptr;
+         j = (j + 1) & (tag_capacity - 1)) {
+      size_t home = tag_slot(tags[j].ptr);
+      if (((j - home) & (tag_capacity - 1)) >=
+          ((j - hole) & (tag_capacity - 1))) {
+        tags[hole] = tags[j];
+        hole = j;
+      }
+    }
+    tags[hole].ptr = NULL;
+    --tag_count;
+  }
+  pthread_mutex_unlock(&heap_lock);
+}
+
+static int compare_sites(const void *a, const void *b)
+{
+  const HeapSite *x = *(const HeapSite *const *) a;
+  const HeapSite *y = *(const HeapSite *const *) b;
+  if (x->peak != y->peak) {
+    return x->peak < y->peak ? 1 : -1;
+  }
+  if (x->total != y->total) {
+    return x->total < y->total ? 1 : -1;
+  }
+  return 0;
+}
+
+void print_heap_report(const Bytecode *code)
+{
+  pthread_mutex_lock(&heap_lock);
+
+  printf("heap: %zu allocations, %zu bytes peak, %zu bytes live\n",
+         allocations, peak_bytes, live_bytes);
+
+  const HeapSite **order = malloc(sizeof(HeapSite *) * (site_count + 1));
+  size_t count = 0;
+  for (size_t i = 0; i < site_capacity; i++) {
+    if (sites[i].ip) {
+      order[count++] = &sites[i];
+    }
+  }
+  qsort(order, count, sizeof(HeapSite *), compare_sites);
+
+  for (size_t i = 0; i < count && i < HEAP_TOP_SITES; i++) {
+    const HeapSite *s = order[i];
+    const FunctionProto *proto;
+    long offset = locate_code(code, s->ip, &proto);
+
+    printf("heap site %ld: ", offset);
+    disassemble_instruction(code, s->ip);
+    if (proto) {
+      printf(" in %s", proto->name);
+    }
+    printf(" at line %u", line_at(proto ? &proto->lines : &code->lines,
+                                  (size_t) offset));
+    printf(": %s, %zu allocations, %zu bytes peak, %zu bytes live, %zu bytes "
+           "total\n",
+           type_names[s->type], s->allocations, s->peak, s->live, s->total);
+  }
+
+  free(order);
+  pthread_mutex_unlock(&heap_lock);
+}
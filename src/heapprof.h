@@ -0,0 +1,42 @@
+#ifndef venom_heapprof_h
+#define venom_heapprof_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compiler.h"
+#include "object.h"
+
+/* With --measure=heap, every object the VM makes is tagged with the
+ * instruction that made it (OP_STRUCT, OP_ARRAY, OP_STR, OP_STRCAT,
+ * OP_CLOSURE, or OP_MKGEN), so that the bytes allocated
+ * can be traced back to the line of the script that allocates them.
+ * The bytes of an object are what it took when it was made: the slot
+ * and whatever the object owned right then (the characters of a str-
+ * ing, the elements of an array, the properties of a struct, etc.).
+ *
+ * The tags live in a table on the side, which all the threads share
+ * under a lock, so this is meant for finding out where the memory
+ * goes, not for running in production all the time. */
+extern bool heap_profiling;
+
+/* Starts profiling the allocations. */
+void heapprof_start(void);
+
+/* Stops profiling and throws the tags and the counters away. */
+void heapprof_stop(void);
+
+/* Tags the object 'header' is the header of with the instruction at
+ * 'site'. */
+void heapprof_alloc(const uint8_t *site, const ObjHeader *header);
+
+/* Untags 'ptr', if it was tagged, crediting its bytes back to its
+ * site. Called by slab_free() for everything that it frees. */
+void heapprof_free(const void *ptr);
+
+/* Prints the totals, and the sites with the highest peaks, along with
+ * the instructions at them, and the functions and lines those are in. */
+void print_heap_report(const Bytecode *code);
+
+#endif
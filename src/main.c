@@ -1,3 +1,5 @@
+#include <errno.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,12 +12,15 @@
 #include "disassembler.h"
 #include "dynarray.h"
 #include "err.h"
+#include "heapprof.h"
 #include "optimizer.h"
 #include "parser.h"
 #include "semantics.h"
+#include "slab.h"
 #include "tokenizer.h"
 #include "util.h"
 #include "vm.h"
+#include "vnmc.h"
 
 typedef struct {
   bool is_ok;
@@ -23,10 +28,132 @@ typedef struct {
   char *msg;
 } RunResult;
 
+/* Runs 'chunk', whether it was just compiled, or loaded from a .vnmc
+ * file, printing the reports that are taken while it runs. */
+static ExecResult execute(Arguments *args, const Bytecode *chunk)
+{
+  VM vm;
+  init_vm(&vm);
+  vm.quantum = args->quantum;
+  vm.free_budget = args->free_budget;
+  vm.workers = args->workers;
+  vm.measure_tasks =
+      (args->measure_flags & (MEASURE_TASKS | MEASURE_TASKS_JSON)) != 0;
+
+  if (args->measure_flags & MEASURE_HEAP) {
+    heapprof_start();
+  }
+
+  ExecResult exec_result = exec(&vm, chunk);
+
+  if (vm.measure_tasks) {
+    print_task_reports(&vm, args->measure_flags & MEASURE_TASKS_JSON);
+  }
+  /* What's live is what the globals still hold on to at the end. */
+  if (heap_profiling) {
+    collect_garbage(&vm);
+    print_heap_report(chunk);
+  }
+  free_vm(&vm);
+#ifdef DEFERRED_RC
+  zct_flush();
+#endif
+#ifdef CYCLE_GC
+  cycle_flush();
+#endif
+  set_lazy_release(false);
+  if (heap_profiling) {
+    heapprof_stop();
+  }
+
+  return exec_result;
+}
+
+/* The reports on the memory, which are printed last. */
+static void print_memory_reports(Arguments *args)
+{
+  if (args->measure_flags & MEASURE_SLABS) {
+    print_slab_report();
+  }
+
+#ifdef CYCLE_GC
+  if (args->measure_flags & MEASURE_CYCLES) {
+    print_cycle_report();
+  }
+#endif
+}
+
+/* Disassembles or runs 'chunk', which was loaded from a .vnmc file,
+ * and frees it. */
+static RunResult run_chunk(Arguments *args, Bytecode *chunk)
+{
+  RunResult result = {.is_ok = true, .errcode = 0, .msg = NULL};
+
+  if (args->ir) {
+    DisassembleResult disassemble_result = disassemble(chunk);
+    if (!disassemble_result.is_ok) {
+      alloc_err_str(&result.msg, "disassembler: %s\n",
+                    disassemble_result.msg);
+      free(disassemble_result.msg);
+      result.is_ok = false;
+      result.errcode = disassemble_result.errcode;
+    }
+    goto cleanup;
+  }
+
+  ExecResult exec_result = execute(args, chunk);
+  if (!exec_result.is_ok) {
+    alloc_err_str(&result.msg, "vm: %s\n", exec_result.msg);
+    free(exec_result.msg);
+    result.is_ok = false;
+    result.errcode = exec_result.errcode;
+  }
+
+  if (args->measure_flags & MEASURE_EXEC) {
+    printf("exec stage took %.9f sec (100.00%%)\n", exec_result.time);
+  }
+
+cleanup:
+  free_chunk(chunk);
+  free(chunk);
+
+  print_memory_reports(args);
+
+  return result;
+}
+
+/* Returns the chunk in the compile cache at 'path', if there's one
+ * there, and it was compiled from the same source, the same way. */
+static Bytecode *load_cached(const char *path, uint64_t source_hash,
+                             uint32_t flags)
+{
+  /* Unlike a file made with --emit-bytecode, an entry may have been
+   * changed by anyone who can write to the cache, so its checksum is
+   * checked before it's run. A bad entry is compiled over. */
+  LoadVnmcResult load_result = load_vnmc(path, true);
+  if (!load_result.is_ok) {
+    free(load_result.msg);
+    return NULL;
+  }
+
+  /* The key can collide, and the entry may be left over from another
+   * build, so what it was compiled from and by is checked as well. */
+  if (load_result.source_hash != source_hash || load_result.flags != flags ||
+      load_result.build_id != vnmc_build_id()) {
+    free_chunk(load_result.chunk);
+    free(load_result.chunk);
+    return NULL;
+  }
+
+  return load_result.chunk;
+}
+
 static RunResult run(Arguments *args)
 {
   RunResult result = {.is_ok = true, .errcode = 0, .msg = NULL};
+  char *cache_path = NULL;
   double total_all_stages = 0.0;
+  size_t peephole_removed = 0;
 
   ReadFileResult read_file_result = read_file(args->file);
   if (!read_file_result.is_ok) {
@@ -37,6 +164,21 @@ static RunResult run(Arguments *args)
   }
 
   char *source = read_file_result.payload;
+  uint64_t source_hash = hash_source(source);
+  uint32_t flags = vnmc_flags(args->passes);
+
+  /* If the program was compiled before, the front end is skipped. */
+  if (!args->no_cache && !args->lex && !args->parse && !args->emit_bytecode) {
+    cache_path = vnmc_cache_path(source_hash, flags);
+  }
+  if (cache_path) {
+    Bytecode *cached = load_cached(cache_path, source_hash, flags);
+    if (cached) {
+      free(cache_path);
+      free(source);
+      return run_chunk(args, cached);
+    }
+  }
 
   Tokenizer tokenizer;
   init_tokenizer(&tokenizer, source);
@@ -104,27 +246,20 @@ static RunResult run(Arguments *args)
   OptimizeResult optimize_result = {0};
 
   if (args->optimize) {
-    optimize_result = optimize(&labeled_ast);
+    optimize_result =
+        optimize(&labeled_ast, args->passes, args->optimize_rounds);
     total_all_stages += optimize_result.time;
   }
 
   if (args->parse) {
-    if (args->optimize) {
-      print_ast(&optimize_result.payload);
-    } else {
-      print_ast(&labeled_ast);
-    }
+    print_ast(&labeled_ast);
     goto cleanup_after_loop_label;
   }
 
   Compiler *compiler = current_compiler = new_compiler();
 
-  CompileResult compile_result;
-  if (args->optimize) {
-    compile_result = compile(&optimize_result.payload);
-  } else {
-    compile_result = compile(&labeled_ast);
-  }
+  CompileResult compile_result =
+      compile(&labeled_ast, args->passes & PASS_PEEPHOLE);
 
   if (!compile_result.is_ok) {
     char *errctx = mkerrctx(source, &compile_result.span, 3, 3);
@@ -140,6 +275,23 @@ static RunResult run(Arguments *args)
   total_all_stages += compile_result.time;
 
   DisassembleResult disassemble_result = {0};
+
+  /* The bodies of the functions are compiled as they're called, but
+   * all of them are needed to disassemble or save the chunk. */
+  if (args->ir || args->emit_bytecode) {
+    CompileResult deferred_result = compile_all_deferred(chunk);
+    if (!deferred_result.is_ok) {
+      char *errctx = mkerrctx(source, &deferred_result.span, 3, 3);
+      alloc_err_str(&result.msg, "compiler: %s\n%s\n", deferred_result.msg,
+                    errctx);
+      free(errctx);
+      free(deferred_result.msg);
+      result.is_ok = false;
+      result.errcode = deferred_result.errcode;
+      goto cleanup_after_disassemble;
+    }
+  }
+
   if (args->ir) {
     disassemble_result = disassemble(chunk);
     if (!disassemble_result.is_ok) {
@@ -151,23 +303,44 @@ static RunResult run(Arguments *args)
     goto cleanup_after_disassemble;
   }
 
-  VM vm;
-  init_vm(&vm);
+  if (args->emit_bytecode) {
+    char *path =
+        args->emit_path ? strdup(args->emit_path) : vnmc_path(args->file);
+    if (!write_vnmc(path, chunk, source_hash, flags)) {
+      alloc_err_str(&result.msg, "venom: %s: %s\n", path, strerror(errno));
+      result.is_ok = false;
+      result.errcode = -1;
+    }
+    free(path);
+    goto cleanup_after_disassemble;
+  }
 
-  ExecResult exec_result = exec(&vm, chunk);
+  ExecResult exec_result = execute(args, chunk);
   if (!exec_result.is_ok) {
-    alloc_err_str(&result.msg, "vm: %s\n", exec_result.msg);
+    if (exec_result.in_compiler) {
+      char *errctx = mkerrctx(source, &exec_result.span, 3, 3);
+      alloc_err_str(&result.msg, "compiler: %s\n%s\n", exec_result.msg,
+                    errctx);
+      free(errctx);
+    } else {
+      alloc_err_str(&result.msg, "vm: %s\n", exec_result.msg);
+    }
     result.is_ok = false;
     result.errcode = exec_result.errcode;
-    goto cleanup_after_exec; /* just for the symmetry */
+    free(exec_result.msg);
+  } else {
+    total_all_stages += exec_result.time;
   }
 
-  total_all_stages += exec_result.time;
-
-cleanup_after_exec:
-  free_vm(&vm);
-  if (!exec_result.is_ok) {
-    free(exec_result.msg);
+  /* What the run didn't call is compiled only now, for the cache, and
+   * failing to cache is no reason to fail the run. */
+  if (cache_path) {
+    CompileResult deferred_result = compile_all_deferred(chunk);
+    if (deferred_result.is_ok) {
+      write_vnmc(cache_path, chunk, source_hash, flags);
+    } else {
+      free(deferred_result.msg);
+    }
   }
 
 cleanup_after_disassemble:
@@ -180,6 +353,7 @@ cleanup_after_compile:
     free_compiler(compiler);
     free(compiler);
     assert(chunk);
+    peephole_removed = chunk->peephole_removed;
     free_chunk(chunk);
     free(chunk);
   } else {
@@ -200,10 +374,6 @@ cleanup_after_parse:
     free(parse_result.msg);
   }
 
-  if (args->optimize) {
-    free_ast(&optimize_result.payload);
-  }
-
 cleanup_after_lex:
   dynarray_free(&tokenize_result.tokens);
 
@@ -212,6 +382,8 @@ cleanup_after_lex:
   }
 
 cleanup_after_read_file:
+  free(cache_path);
+
   if (read_file_result.is_ok) {
     free(source);
   } else {
@@ -236,6 +408,18 @@ cleanup_after_read_file:
   if (args->measure_flags & MEASURE_OPTIMIZE) {
     printf("optimize stage took %.9f sec (%.2f%%)\n", optimize_result.time,
            (optimize_result.time / total_all_stages) * 100);
+    if (args->optimize) {
+      printf("optimize ran %zu rounds%s\n", optimize_result.rounds,
+             optimize_result.capped ? " (capped)" : "");
+    }
+    for (size_t i = 0; i < optimize_result.pass_count; i++) {
+      const PassStats *pass = &optimize_result.passes[i];
+      printf("optimize pass %s took %.9f sec, changed %zu nodes\n",
+             pass->name, pass->time, pass->changes);
+    }
+    if (args->passes & PASS_PEEPHOLE) {
+      printf("peephole removed %zu instructions\n", peephole_removed);
+    }
   }
 
   if (args->measure_flags & MEASURE_DISASSEMBLE) {
@@ -253,15 +437,48 @@ cleanup_after_read_file:
            (exec_result.time / total_all_stages) * 100);
   }
 
+  print_memory_reports(args);
+
   return result;
 }
 
+/* Runs a program that was compiled with --emit-bytecode, skipping the
+ * front end altogether. */
+static RunResult run_vnmc(Arguments *args)
+{
+  RunResult result = {.is_ok = true, .errcode = 0, .msg = NULL};
+
+  if (args->lex || args->parse || args->emit_bytecode) {
+    alloc_err_str(&result.msg, "venom: %s is already compiled\n",
+                  args->file);
+    result.is_ok = false;
+    result.errcode = -1;
+    return result;
+  }
+
+  LoadVnmcResult load_result = load_vnmc(args->file, false);
+  if (!load_result.is_ok) {
+    alloc_err_str(&result.msg, "venom: %s", load_result.msg);
+    free(load_result.msg);
+    result.is_ok = false;
+    result.errcode = load_result.errcode;
+    return result;
+  }
+
+  return run_chunk(args, load_result.chunk);
+}
+
 int main(int argc, char **argv)
 {
   Arguments args;
   ArgParseResult arg_parse_result;
   RunResult result;
 
+  /* Writing to a pipe or socket whose other end is gone should be
+   * reported by write_fd(...) as a runtime error, instead of kill-
+   * ing the interpreter. */
+  signal(SIGPIPE, SIG_IGN);
+
   arg_parse_result = parse_args(argc, argv);
   if (!arg_parse_result.is_ok) {
     fprintf(stderr, "venom: %s\n", arg_parse_result.msg);
@@ -270,12 +487,27 @@ int main(int argc, char **argv)
   }
 
   args = arg_parse_result.args;
-  result = run(&args);
+  if (args.file && is_vnmc_path(args.file)) {
+    result = run_vnmc(&args);
+  } else {
+    result = run(&args);
+  }
+#ifdef REFCHECK
+  /* Checked before the slabs go, since what leaked keeps them. */
+  bool refs_ok = refcheck_ok() & slab_check_leaks();
+#endif
+  free_slabs();
   if (!result.is_ok) {
     fprintf(stderr, "%s", result.msg);
     free(result.msg);
-    return result.errcode;
   }
 
+#ifdef REFCHECK
+  /* Failed runs included, since errors have objects to release too. */
+  if (!refs_ok) {
+    return 1;
+  }
+#endif
+
   return result.errcode;
 }
@@ -1,6 +1,16 @@
 #include "object.h"
 
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef CYCLE_GC
+#include <time.h>
+#endif
+
+#include "slab.h"
 #include "table.h"
+#include "util.h"
 
 void print_object(const Object *object)
 {
@@ -13,7 +23,7 @@ void print_object(const Object *object)
   } else if (IS_NULL(*object)) {
     printf("null");
   } else if (IS_CLOSURE(*object)) {
-    printf("<fn %s, ref: %d>", AS_CLOSURE(*object)->func->name,
+    printf("<fn %s, ref: %d>", AS_CLOSURE(*object)->proto->name,
            AS_CLOSURE(*object)->refcount);
   } else if (IS_STRING(*object)) {
     String *string = AS_STRING(*object);
@@ -43,13 +53,31 @@ void print_object(const Object *object)
     printf("]");
   } else if (IS_GENERATOR(*object)) {
     Generator *gen = AS_GENERATOR(*object);
-    printf("<gen [%s] [ip: %p]>", gen->fn->func->name, gen->ip);
+    printf("<gen [%s] [ip: %p]>", gen->fn->proto->name, gen->ip);
   } else if (IS_TASK(*object)) {
     Task *task = AS_TASK(*object);
     printf("<task #%d %s>", task->id, task->done ? "done" : "pending");
   } else if (IS_SLEEP(*object)) {
     Sleep *sleep = AS_SLEEP(*object);
-    printf("<sleep %d>", sleep->ticks);
+    printf("<sleep %g ms>", sleep->ms);
+  } else if (IS_IO(*object)) {
+    static const char *kinds[] = {
+        [IO_READ] = "read",
+        [IO_WRITE] = "write",
+        [IO_ACCEPT] = "accept",
+    };
+    Io *io = AS_IO(*object);
+    printf("<io %s fd %d>", kinds[io->kind], io->fd);
+  } else if (IS_CHANNEL(*object)) {
+    Channel *chan = AS_CHANNEL(*object);
+    if (chan->shared) {
+      SharedChannel *shared = chan->shared;
+      pthread_mutex_lock(&shared->lock);
+      printf("<channel %zu/%zu>", shared->count, shared->capacity);
+      pthread_mutex_unlock(&shared->lock);
+    } else {
+      printf("<channel %zu/%zu>", chan->count, chan->capacity);
+    }
   }
 }
 
@@ -57,7 +85,7 @@ static inline bool is_refcounted(const Object *obj)
 {
   return IS_CLOSURE(*obj) || IS_STRUCT(*obj) || IS_STRING(*obj) ||
          IS_ARRAY(*obj) || IS_GENERATOR(*obj) || IS_TASK(*obj) ||
-         IS_SLEEP(*obj);
+         IS_SLEEP(*obj) || IS_IO(*obj) || IS_CHANNEL(*obj);
 }
 
 void free_table_object(const Table_Object *table)
@@ -76,9 +104,1266 @@ void free_table_object(const Table_Object *table)
   }
 }
 
-extern inline void dealloc(Object *obj);
-extern inline void objdecref(Object *obj);
-extern inline void objincref(Object *obj);
+#define COPY_MAX_DEPTH 256
+
+static bool copy_object_impl(const Object *obj, Object *copy, int depth);
+
+#ifdef REFCHECK
+/* Every shared channel there is, for refcheck_verify() to count the
+ * references from their buffers. */
+static pthread_mutex_t shared_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static SharedChannel *shared_channels;
+#endif
+
+static Channel *new_channel_handle(SharedChannel *shared)
+{
+  Channel chan = {.refcount = 1, .type = OBJ_CHANNEL, .shared = shared};
+  return SLAB_ALLOC(SLAB_CHANNEL, chan);
+}
+
+Channel *new_shared_channel(size_t capacity)
+{
+  SharedChannel *shared = calloc(1, sizeof(SharedChannel));
+  pthread_mutex_init(&shared->lock, NULL);
+  shared->handles = 1;
+  shared->buffer = malloc(sizeof(Object) * capacity);
+  shared->capacity = capacity;
+
+#ifdef REFCHECK
+  pthread_mutex_lock(&shared_channels_lock);
+  shared->next = shared_channels;
+  if (shared_channels) {
+    shared_channels->prev = shared;
+  }
+  shared_channels = shared;
+  pthread_mutex_unlock(&shared_channels_lock);
+#endif
+
+  return new_channel_handle(shared);
+}
+
+/* Drops a handle to the shared channel, and the channel itself along
+ * with the last one. Nobody can be parked on it by then, since the
+ * parked tasks hold handles of their own. */
+static void release_shared_channel(SharedChannel *shared)
+{
+  pthread_mutex_lock(&shared->lock);
+  bool last = --shared->handles == 0;
+  pthread_mutex_unlock(&shared->lock);
+  if (!last) {
+    return;
+  }
+
+#ifdef REFCHECK
+  pthread_mutex_lock(&shared_channels_lock);
+  if (shared->prev) {
+    shared->prev->next = shared->next;
+  } else {
+    shared_channels = shared->next;
+  }
+  if (shared->next) {
+    shared->next->prev = shared->prev;
+  }
+  pthread_mutex_unlock(&shared_channels_lock);
+#endif
+
+  for (size_t i = 0; i < shared->count; i++) {
+    objdecref(&shared->buffer[(shared->head + i) % shared->capacity]);
+  }
+  free(shared->buffer);
+  pthread_mutex_destroy(&shared->lock);
+  free(shared);
+}
+
+static ChannelWaiter *waiter_queue_remove(ChannelWaiterQueue *queue,
+                                          const Task *task)
+{
+  ChannelWaiter *prev = NULL;
+  for (ChannelWaiter *w = queue->head; w; prev = w, w = w->next) {
+    if (w->task != task) {
+      continue;
+    }
+    if (prev) {
+      prev->next = w->next;
+    } else {
+      queue->head = w->next;
+    }
+    if (queue->tail == w) {
+      queue->tail = prev;
+    }
+    return w;
+  }
+  return NULL;
+}
+
+void shared_channel_forget(Task *task)
+{
+  SharedChannel *shared = task->blocked_on->shared;
+
+  pthread_mutex_lock(&shared->lock);
+  ChannelWaiter *waiter = waiter_queue_remove(&shared->senders, task);
+  if (!waiter) {
+    waiter = waiter_queue_remove(&shared->receivers, task);
+  }
+  pthread_mutex_unlock(&shared->lock);
+
+  /* Released with the lock dropped, since what a sender was trying
+   * to send may hold a handle to this very channel. */
+  if (waiter) {
+    objdecref(&waiter->value);
+    free(waiter);
+  }
+}
+
+/* Kept out of line: once objdecref is inlined into the copying code,
+ * gcc can't tell which branch of it runs and warns about the others
+ * reading past the object that was just allocated. */
+__attribute__((noinline)) static void discard_partial(Object partial)
+{
+  objdecref(&partial);
+}
+
+static bool copy_closure(const Closure *closure, Object *copy, int depth)
+{
+  Closure c = {.refcount = 1,
+               .type = OBJ_CLOSURE,
+               .proto = closure->proto,
+               .upvalues = malloc(sizeof(Upvalue *) * closure->upvalue_count),
+               .upvalue_count = 0};
+
+  /* The upvalues are closed over copies of the values they refer
+   * to, since the stack slots of any open ones belong to the orig-
+   * inal VM. */
+  for (int i = 0; i < closure->upvalue_count; i++) {
+    Upvalue upvalue = {.next = NULL};
+    if (!copy_object_impl(closure->upvalues[i]->location, &upvalue.closed,
+                          depth + 1)) {
+      discard_partial(CLOSURE_VAL(SLAB_ALLOC(SLAB_CLOSURE, c)));
+      return false;
+    }
+    Upvalue *upvalue_ptr = SLAB_ALLOC(SLAB_UPVALUE, upvalue);
+    upvalue_ptr->location = &upvalue_ptr->closed;
+    c.upvalues[c.upvalue_count++] = upvalue_ptr;
+  }
+
+  *copy = CLOSURE_VAL(SLAB_ALLOC(SLAB_CLOSURE, c));
+  return true;
+}
+
+static bool copy_struct(const Struct *structobj, Object *copy, int depth)
+{
+  Struct s = {.refcount = 1,
+              .type = OBJ_STRUCT,
+              .name = structobj->name,
+              .propcount = structobj->propcount,
+              .properties = calloc(1, sizeof(Table_Object))};
+
+  /* The items are copied at the same indexes, so that the property
+   * indexes of the blueprint still apply. */
+  const Table_Object *from = structobj->properties;
+  for (size_t i = 0; i < from->count; i++) {
+    if (!copy_object_impl(&from->items[i], &s.properties->items[i],
+                          depth + 1)) {
+      discard_partial(STRUCT_VAL(SLAB_ALLOC(SLAB_STRUCT, s)));
+      return false;
+    }
+    s.properties->count++;
+  }
+
+  for (size_t i = 0; i < TABLE_MAX; i++) {
+    for (Bucket *b = from->indexes[i]; b; b = b->next) {
+      list_insert(&s.properties->indexes[i], own_string(b->key), b->value);
+    }
+  }
+
+  *copy = STRUCT_VAL(SLAB_ALLOC(SLAB_STRUCT, s));
+  return true;
+}
+
+static bool copy_object_impl(const Object *obj, Object *copy, int depth)
+{
+  if (depth > COPY_MAX_DEPTH) {
+    return false;
+  }
+
+  if (IS_NUM(*obj) || IS_BOOL(*obj) || IS_NULL(*obj)) {
+    *copy = *obj;
+    return true;
+  } else if (IS_STRING(*obj)) {
+    String s = {.refcount = 1,
+                .type = OBJ_STRING,
+                .value = own_string(AS_STRING(*obj)->value)};
+    *copy = STRING_VAL(SLAB_ALLOC(SLAB_STRING, s));
+    return true;
+  } else if (IS_ARRAY(*obj)) {
+    Array a = {.refcount = 1, .type = OBJ_ARRAY, .elements = {0}};
+    const DynArray_Object *elements = &AS_ARRAY(*obj)->elements;
+    for (size_t i = 0; i < elements->count; i++) {
+      Object element;
+      if (!copy_object_impl(&elements->data[i], &element, depth + 1)) {
+        discard_partial(ARRAY_VAL(SLAB_ALLOC(SLAB_ARRAY, a)));
+        return false;
+      }
+      dynarray_insert(&a.elements, element);
+    }
+    *copy = ARRAY_VAL(SLAB_ALLOC(SLAB_ARRAY, a));
+    return true;
+  } else if (IS_STRUCT(*obj)) {
+    return copy_struct(AS_STRUCT(*obj), copy, depth);
+  } else if (IS_CLOSURE(*obj)) {
+    return copy_closure(AS_CLOSURE(*obj), copy, depth);
+  } else if (IS_GENERATOR(*obj)) {
+    /* Only coroutines that haven't started yet can be copied: once
+     * they're running, their frames point to closures on the stack
+     * of whoever is running them. Their closure is shared rather
+     * than copied, since generators don't own it, which is fine as
+     * long as it doesn't capture anything. */
+    const Generator *gen = AS_GENERATOR(*obj);
+    if (gen->state != STATE_NEW || gen->fn->upvalue_count > 0) {
+      return false;
+    }
+    Generator *g = slab_alloc(SLAB_GENERATOR);
+    g->refcount = 1;
+    g->type = OBJ_GENERATOR;
+    g->flags = 0;
+    g->ip = gen->ip;
+    g->tos = 0;
+    g->fp_count = 0;
+    g->fn = gen->fn;
+    g->state = STATE_NEW;
+    for (size_t i = 0; i < gen->tos; i++) {
+      if (!copy_object_impl(&gen->stack[i], &g->stack[i], depth + 1)) {
+        discard_partial(GENERATOR_VAL(g));
+        return false;
+      }
+      g->tos++;
+    }
+    *copy = GENERATOR_VAL(g);
+    return true;
+  } else if (IS_SLEEP(*obj)) {
+    Sleep sleep = {.refcount = 1, .type = OBJ_SLEEP, .ms = AS_SLEEP(*obj)->ms};
+    *copy = SLEEP_VAL(SLAB_ALLOC(SLAB_SLEEP, sleep));
+    return true;
+  } else if (IS_CHANNEL(*obj) && AS_CHANNEL(*obj)->shared) {
+    /* The copy of a shared channel is another handle to it. */
+    SharedChannel *shared = AS_CHANNEL(*obj)->shared;
+    pthread_mutex_lock(&shared->lock);
+    shared->handles++;
+    pthread_mutex_unlock(&shared->lock);
+    *copy = CHANNEL_VAL(new_channel_handle(shared));
+    return true;
+  }
+
+  /* Pointers, tasks, I/O operations and the channels that aren't sh-
+   * ared are tied to the VM they were made in. */
+  return false;
+}
+
+bool copy_object(const Object *obj, Object *copy)
+{
+  return copy_object_impl(obj, copy, 0);
+}
+
+/* The containers (structs, arrays, and closures) are destroyed in two
+ * steps, so that the cycle collector can release what a whole cycle
+ * refers to before any of it is freed. */
+static void clear_struct(ObjHeader *header)
+{
+  Struct *structobj = (Struct *) header;
+  for (size_t i = 0; i < structobj->properties->count; i++) {
+    objdecref(&structobj->properties->items[i]);
+  }
+  for (size_t i = 0; i < TABLE_MAX; i++) {
+    if (structobj->properties->indexes[i] != NULL) {
+      list_free(structobj->properties->indexes[i]);
+    }
+  }
+  free(structobj->properties);
+}
+
+static void destroy_struct(ObjHeader *header)
+{
+  clear_struct(header);
+  slab_free(SLAB_STRUCT, header);
+}
+
+static void destroy_string(ObjHeader *header)
+{
+  String *string = (String *) header;
+  free(string->value);
+  slab_free(SLAB_STRING, string);
+}
+
+static void clear_array(ObjHeader *header)
+{
+  Array *array = (Array *) header;
+  for (size_t i = 0; i < array->elements.count; i++) {
+    objdecref(&array->elements.data[i]);
+  }
+  dynarray_free(&array->elements);
+}
+
+static void destroy_array(ObjHeader *header)
+{
+  clear_array(header);
+  slab_free(SLAB_ARRAY, header);
+}
+
+static void clear_closure(ObjHeader *header)
+{
+  Closure *closure = (Closure *) header;
+  for (int i = 0; i < closure->upvalue_count; i++) {
+#ifdef DEFERRED_RC
+    /* Upvalues that are still open point into the stack, which isn't
+     * counted. */
+    if (closure->upvalues[i]->location != &closure->upvalues[i]->closed) {
+      continue;
+    }
+#endif
+    objdecref(closure->upvalues[i]->location);
+  }
+  for (int i = 0; i < closure->upvalue_count; i++) {
+    slab_free(SLAB_UPVALUE, closure->upvalues[i]);
+  }
+  free(closure->upvalues);
+}
+
+static void destroy_closure(ObjHeader *header)
+{
+  clear_closure(header);
+  slab_free(SLAB_CLOSURE, header);
+}
+
+static void destroy_generator(ObjHeader *header)
+{
+  Generator *gen = (Generator *) header;
+  for (size_t i = 0; i < gen->tos; i++) {
+    objdecref(&gen->stack[i]);
+  }
+  slab_free(SLAB_GENERATOR, gen);
+}
+
+static void destroy_task(ObjHeader *header)
+{
+  Task *task = (Task *) header;
+  if (task->gen) {
+    Object gen_obj = GENERATOR_VAL(task->gen);
+    objdecref(&gen_obj);
+  }
+  if (task->has_result) {
+    objdecref(&task->result);
+  }
+  if (task->has_send) {
+    objdecref(&task->send_value);
+  }
+  if (task->io) {
+    Object io_obj = IO_VAL(task->io);
+    objdecref(&io_obj);
+  }
+  if (task->blocked_on) {
+    if (task->blocked_on->shared) {
+      shared_channel_forget(task);
+    }
+    Object chan_obj = CHANNEL_VAL(task->blocked_on);
+    objdecref(&chan_obj);
+    objdecref(&task->chan_value);
+  }
+  objdecref(&task->gathered);
+  for (size_t i = 0; i < task->waiters.count; i++) {
+    Object waiter = TASK_VAL(task->waiters.data[i].task);
+    objdecref(&waiter);
+  }
+  dynarray_free(&task->waiters);
+  slab_free(SLAB_TASK, task);
+}
+
+static void destroy_sleep(ObjHeader *header)
+{
+  slab_free(SLAB_SLEEP, header);
+}
+
+static void destroy_io(ObjHeader *header)
+{
+  Io *io = (Io *) header;
+  if (io->kind == IO_READ) {
+    free(io->buf);
+  } else if (io->kind == IO_WRITE) {
+    objdecref(&io->data);
+  }
+  slab_free(SLAB_IO, io);
+}
+
+static void destroy_channel(ObjHeader *header)
+{
+  Channel *chan = (Channel *) header;
+  if (chan->shared) {
+    release_shared_channel(chan->shared);
+  }
+  for (size_t i = 0; i < chan->count; i++) {
+    objdecref(&chan->buffer[(chan->head + i) % chan->capacity]);
+  }
+  free(chan->buffer);
+  slab_free(SLAB_CHANNEL, chan);
+}
+
+const Destructor destructors[] = {
+    [OBJ_STRUCT] = destroy_struct,       [OBJ_STRING] = destroy_string,
+    [OBJ_ARRAY] = destroy_array,         [OBJ_CLOSURE] = destroy_closure,
+    [OBJ_GENERATOR] = destroy_generator, [OBJ_TASK] = destroy_task,
+    [OBJ_SLEEP] = destroy_sleep,         [OBJ_IO] = destroy_io,
+    [OBJ_CHANNEL] = destroy_channel,
+};
+
+typedef DynArray(ObjHeader *) DynArray_ObjHeader_ptr;
+
+/* The objects waiting to be destroyed, and whether one is being de-
+ * stroyed right now, in which case the ones it releases have to wait
+ * for it to finish. */
+static _Thread_local DynArray_ObjHeader_ptr pending;
+static _Thread_local bool releasing;
+static _Thread_local bool lazy_release;
+
+void obj_release(ObjHeader *header)
+{
+  if (releasing || lazy_release) {
+    dynarray_insert(&pending, header);
+    return;
+  }
+
+  releasing = true;
+  destructors[header->type](header);
+  while (pending.count > 0) {
+    ObjHeader *next = pending.data[--pending.count];
+    destructors[next->type](next);
+  }
+  releasing = false;
+}
+
+void release_pending(size_t max)
+{
+  if (releasing) {
+    return;
+  }
+
+  releasing = true;
+  for (size_t i = 0; i < max && pending.count > 0; i++) {
+    ObjHeader *next = pending.data[--pending.count];
+    destructors[next->type](next);
+  }
+  releasing = false;
+
+  if (pending.count == 0) {
+    dynarray_free(&pending);
+    pending = (DynArray_ObjHeader_ptr){0};
+  }
+}
+
+void set_lazy_release(bool lazy)
+{
+  lazy_release = lazy;
+  if (!lazy) {
+    release_pending(SIZE_MAX);
+  }
+}
+
+#ifdef DEFERRED_RC
+/* The table is reconciled once at least this many objects have been
+ * added to it, or as many as there were stack slots to mark the last
+ * time, whichever is more, so that marking costs about a slot for
+ * every object. The objects that turn out to be on the stack are kept
+ * apart from the rest, and only looked at again once ZCT_KEPT_RATIO
+ * times as many objects have been added since, so that objects which
+ * stay on the stack for long don't get looked at every time. */
+#define ZCT_MIN 256
+#define ZCT_KEPT_RATIO 4
+
+/* Each thread has a VM (and so a stack) of its own, see vm.c. */
+static _Thread_local DynArray_ObjHeader_ptr zct;
+static _Thread_local DynArray_ObjHeader_ptr kept;
+static _Thread_local size_t zct_limit = ZCT_MIN;
+static _Thread_local size_t slots_marked;
+static _Thread_local size_t added_since_recheck;
+static _Thread_local bool recheck;
+
+void zct_add(ObjHeader *header)
+{
+  if (!(header->flags & OBJ_IN_ZCT)) {
+    header->flags |= OBJ_IN_ZCT;
+    dynarray_insert(&zct, header);
+  }
+}
+
+bool zct_full(void)
+{
+  return zct.count >= zct_limit;
+}
+
+void zct_mark(const Object *slots, size_t count)
+{
+  uint8_t skipped = recheck ? 0 : OBJ_KEPT;
+  slots_marked += count;
+  for (size_t i = 0; i < count; i++) {
+    ObjHeader *header = obj_header(&slots[i]);
+    if (header && (header->flags & (OBJ_IN_ZCT | skipped)) == OBJ_IN_ZCT) {
+      header->flags |= OBJ_ON_STACK;
+    }
+  }
+}
+
+void zct_recheck(void)
+{
+  recheck = true;
+}
+
+/* Goes through the first 'count' objects of 'table', and frees the ones
+ * that weren't marked and are still at zero. The ones that were marked
+ * are moved to 'kept' (which may be 'table' itself), and the ones that
+ * are no longer at zero are taken out. */
+static size_t reconcile_table(DynArray_ObjHeader_ptr *table, size_t count)
+{
+  size_t left = 0;
+  size_t freed = 0;
+  for (size_t i = 0; i < count; i++) {
+    ObjHeader *header = table->data[i];
+    if (header->refcount > 0) {
+      header->flags &= ~(OBJ_IN_ZCT | OBJ_ON_STACK | OBJ_KEPT);
+    } else if (header->flags & OBJ_ON_STACK) {
+      header->flags = (header->flags & ~OBJ_ON_STACK) | OBJ_KEPT;
+      if (table == &kept) {
+        kept.data[left++] = header;
+      } else {
+        dynarray_insert(&kept, header);
+      }
+    } else {
+      destructors[header->type](header);
+      freed++;
+    }
+  }
+
+  /* What the destructors add to the table wasn't in it when it was
+   * marked, so it has to wait for the next time. The data is looked
+   * up through 'table' on every iteration, since adding may move it. */
+  size_t added = table->count - count;
+  memmove(&table->data[left], &table->data[count],
+          sizeof(ObjHeader *) * added);
+  table->count = left + added;
+  return freed;
+}
+
+size_t zct_reconcile(void)
+{
+  size_t freed = 0;
+  if (recheck) {
+    freed += reconcile_table(&kept, kept.count);
+    added_since_recheck = 0;
+  }
+  added_since_recheck += zct.count;
+  freed += reconcile_table(&zct, zct.count);
+
+  recheck = added_since_recheck >= ZCT_KEPT_RATIO * kept.count;
+  zct_limit = slots_marked > ZCT_MIN ? slots_marked : ZCT_MIN;
+  slots_marked = 0;
+  return freed;
+}
+
+static void flush_table(DynArray_ObjHeader_ptr *table)
+{
+  while (table->count > 0) {
+    ObjHeader *header = table->data[--table->count];
+    header->flags &= ~(OBJ_IN_ZCT | OBJ_KEPT);
+    if (header->refcount == 0) {
+      destructors[header->type](header);
+    }
+  }
+  dynarray_free(table);
+  *table = (DynArray_ObjHeader_ptr){0};
+}
+
+void zct_flush(void)
+{
+  /* The objects freed from 'kept' may add to 'zct', never the other
+   * way around. */
+  flush_table(&kept);
+  flush_table(&zct);
+  zct_limit = ZCT_MIN;
+  slots_marked = 0;
+  added_since_recheck = 0;
+  recheck = false;
+}
+#endif
+
+#ifdef CYCLE_GC
+/* A collection starts once this many containers have been allocated
+ * since the last one, and goes on for up to CYCLE_BUDGET_NS at a time,
+ * taking up to CYCLE_BATCH roots at once. The traversal looks at the
+ * clock after every CYCLE_CLOCK_STEPS objects it goes through. */
+#define CYCLE_ALLOCATIONS 10000
+#define CYCLE_BUDGET_NS 1000000
+#define CYCLE_BATCH 64
+#define CYCLE_CLOCK_STEPS 256
+
+typedef struct {
+  size_t collections;
+  size_t roots;
+  size_t freed;
+  uint64_t pause_ns;
+  uint64_t max_pause_ns;
+  size_t full;
+  uint64_t max_full_ns;
+} CycleStats;
+
+/* Like the slabs, each thread has a collector of its own, since the
+ * objects never cross threads (see copy_object()). */
+static _Thread_local DynArray_ObjHeader_ptr roots;
+static _Thread_local size_t allocations_seen;
+static _Thread_local bool unfinished;
+static _Thread_local CycleStats stats;
+
+/* The roots of a batch that reaches too much to be traced within the
+ * budget (usually because they're part of a big structure that is in
+ * use) are set aside, and the roots set aside are only traced, all at
+ * once and without a budget, after as many containers have been allo-
+ * cated as that took the last time, so that it costs about as much as
+ * the allocations did, like the oldest generation of a generational
+ * collector. */
+static _Thread_local DynArray_ObjHeader_ptr set_aside;
+static _Thread_local size_t set_aside_due;
+static _Thread_local uint64_t deadline;
+static _Thread_local size_t traced;
+
+static pthread_mutex_t totals_lock = PTHREAD_MUTEX_INITIALIZER;
+static CycleStats totals;
+
+void cycle_buffer(ObjHeader *header)
+{
+  header->flags |= OBJ_BUFFERED;
+  dynarray_insert(&roots, header);
+}
+
+static size_t container_allocations(void)
+{
+  return slab_thread_allocations(SLAB_STRUCT) +
+         slab_thread_allocations(SLAB_ARRAY) +
+         slab_thread_allocations(SLAB_CLOSURE);
+}
+
+bool cycle_due(void)
+{
+  if (roots.count == 0 && set_aside.count == 0) {
+    return false;
+  }
+  size_t allocated = container_allocations();
+  if (allocated < allocations_seen) {
+    allocations_seen = allocated;
+  }
+  if (set_aside.count > 0 && allocated >= set_aside_due) {
+    return true;
+  }
+  return roots.count > 0 &&
+         (unfinished || allocated - allocations_seen >= CYCLE_ALLOCATIONS);
+}
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Counts an object the traversal goes through, and tells whether the
+ * budget has run out. */
+static bool out_of_time(void)
+{
+  return ++traced % CYCLE_CLOCK_STEPS == 0 && now_ns() >= deadline;
+}
+
+static bool is_container(const Object *obj)
+{
+  ObjHeader *header = obj_header(obj);
+  return header && ((CONTAINER_TYPES >> header->type) & 1);
+}
+
+/* Appends the containers 'header' refers to to 'out', once for every
+ * reference. Only the upvalues that have been closed over are owned
+ * by the closure, the open ones still belong to the stack. */
+static void children(ObjHeader *header, DynArray_ObjHeader_ptr *out)
+{
+  switch (header->type) {
+    case OBJ_STRUCT: {
+      Table_Object *properties = ((Struct *) header)->properties;
+      for (size_t i = 0; i < properties->count; i++) {
+        if (is_container(&properties->items[i])) {
+          dynarray_insert(out, obj_header(&properties->items[i]));
+        }
+      }
+      break;
+    }
+    case OBJ_ARRAY: {
+      DynArray_Object *elements = &((Array *) header)->elements;
+      for (size_t i = 0; i < elements->count; i++) {
+        if (is_container(&elements->data[i])) {
+          dynarray_insert(out, obj_header(&elements->data[i]));
+        }
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      Closure *closure = (Closure *) header;
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        Upvalue *upvalue = closure->upvalues[i];
+        if (upvalue->location == &upvalue->closed &&
+            is_container(&upvalue->closed)) {
+          dynarray_insert(out, obj_header(&upvalue->closed));
+        }
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static bool is_black(const ObjHeader *header)
+{
+  return !(header->flags & (OBJ_GRAY | OBJ_WHITE));
+}
+
+/* The steps below are the ones from Bacon and Rajan's "Concurrent Cy-
+ * cle Collection in Reference Counted Systems", made iterative, so
+ * that long chains of objects can't overflow the C stack. 'work' is
+ * the worklist, and 'edges' is where children() puts the children.
+ *
+ * First, the references from within everything reachable from the
+ * roots are subtracted from the counts, and everything is colored
+ * gray. An object is only colored once its references have been sub-
+ * tracted, so when the budget runs out halfway, what's gray is exactly
+ * what has to be given back (see restore()). */
+static bool mark_gray(DynArray_ObjHeader_ptr *work,
+                      DynArray_ObjHeader_ptr *edges)
+{
+  while (work->count > 0) {
+    ObjHeader *header = work->data[--work->count];
+    if (header->flags & OBJ_GRAY) {
+      continue;
+    }
+    if (out_of_time()) {
+      return false;
+    }
+    header->flags |= OBJ_GRAY;
+    edges->count = 0;
+    children(header, edges);
+    for (size_t i = 0; i < edges->count; i++) {
+      ObjHeader *child = edges->data[i];
+      --child->refcount;
+      if (!(child->flags & OBJ_GRAY)) {
+        dynarray_insert(work, child);
+      }
+    }
+  }
+  return true;
+}
+
+/* Gives the references from within back to whatever is still in use,
+ * and everything it reaches, and colors it all black again. Like in
+ * mark_gray(), an object is only colored once its references have been
+ * given back, so what's left on 'black' when the budget runs out is
+ * where restore() has to go on from. */
+static bool scan_black(DynArray_ObjHeader_ptr *black,
+                       DynArray_ObjHeader_ptr *edges, bool budgeted)
+{
+  while (black->count > 0) {
+    ObjHeader *header = black->data[--black->count];
+    if (is_black(header)) {
+      continue;
+    }
+    if (budgeted && out_of_time()) {
+      dynarray_insert(black, header);
+      return false;
+    }
+    header->flags &= ~(OBJ_GRAY | OBJ_WHITE);
+    edges->count = 0;
+    children(header, edges);
+    for (size_t i = 0; i < edges->count; i++) {
+      ObjHeader *child = edges->data[i];
+      ++child->refcount;
+      if (!is_black(child)) {
+        dynarray_insert(black, child);
+      }
+    }
+  }
+  return true;
+}
+
+/* Anything gray with a count left is referred to from the outside,
+ * so it's in use. What's left at zero is colored white, for now. */
+static bool scan(DynArray_ObjHeader_ptr *work, DynArray_ObjHeader_ptr *black,
+                 DynArray_ObjHeader_ptr *edges)
+{
+  while (work->count > 0) {
+    ObjHeader *header = work->data[--work->count];
+    if (!(header->flags & OBJ_GRAY)) {
+      continue;
+    }
+    if (out_of_time()) {
+      return false;
+    }
+    if (header->refcount > 0) {
+      dynarray_insert(black, header);
+      if (!scan_black(black, edges, true)) {
+        return false;
+      }
+      continue;
+    }
+    header->flags = (header->flags & ~OBJ_GRAY) | OBJ_WHITE;
+    edges->count = 0;
+    children(header, edges);
+    for (size_t i = 0; i < edges->count; i++) {
+      dynarray_insert(work, edges->data[i]);
+    }
+  }
+  return true;
+}
+
+/* Gives back the references subtracted by a batch the budget ran out
+ * on. Everything gray or white has had its references subtracted, and
+ * can be reached without going through anything black from either a
+ * root of the batch, or what scan_black() had yet to get to. */
+static void restore(DynArray_ObjHeader_ptr *batch,
+                    DynArray_ObjHeader_ptr *black,
+                    DynArray_ObjHeader_ptr *edges)
+{
+  for (size_t i = 0; i < batch->count; i++) {
+    dynarray_insert(black, batch->data[i]);
+  }
+  scan_black(black, edges, false);
+}
+
+/* Whatever is still white is garbage, and goes into 'garbage'. */
+static void collect_white(DynArray_ObjHeader_ptr *work,
+                          DynArray_ObjHeader_ptr *edges,
+                          DynArray_ObjHeader_ptr *garbage)
+{
+  while (work->count > 0) {
+    ObjHeader *header = work->data[--work->count];
+    if (!(header->flags & OBJ_WHITE)) {
+      continue;
+    }
+    header->flags &= ~(OBJ_WHITE | OBJ_BUFFERED);
+    header->flags |= OBJ_GARBAGE;
+    dynarray_insert(garbage, header);
+    edges->count = 0;
+    children(header, edges);
+    for (size_t i = 0; i < edges->count; i++) {
+      dynarray_insert(work, edges->data[i]);
+    }
+  }
+}
+
+static void clear_container(ObjHeader *header)
+{
+  switch (header->type) {
+    case OBJ_STRUCT:
+      clear_struct(header);
+      break;
+    case OBJ_ARRAY:
+      clear_array(header);
+      break;
+    case OBJ_CLOSURE:
+      clear_closure(header);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+static void free_container(ObjHeader *header)
+{
+  switch (header->type) {
+    case OBJ_STRUCT:
+      slab_free(SLAB_STRUCT, header);
+      break;
+    case OBJ_ARRAY:
+      slab_free(SLAB_ARRAY, header);
+      break;
+    case OBJ_CLOSURE:
+      slab_free(SLAB_CLOSURE, header);
+      break;
+    default:
+      assert(0);
+  }
+}
+
+/* Drops what turned out to be garbage from 'buffer'. */
+static void drop_garbage(DynArray_ObjHeader_ptr *buffer)
+{
+  size_t kept = 0;
+  for (size_t i = 0; i < buffer->count; i++) {
+    if (!(buffer->data[i]->flags & OBJ_GARBAGE)) {
+      buffer->data[kept++] = buffer->data[i];
+    }
+  }
+  buffer->count = kept;
+}
+
+/* Runs the trial deletion for the last 'count' of the buffered roots,
+ * and frees the garbage cycles it finds among them. If the budget runs
+ * out before it's done telling what's garbage, the roots are set aside
+ * instead. */
+static void collect_batch(size_t count)
+{
+  DynArray_ObjHeader_ptr batch = {0};
+  DynArray_ObjHeader_ptr work = {0};
+  DynArray_ObjHeader_ptr black = {0};
+  DynArray_ObjHeader_ptr edges = {0};
+  DynArray_ObjHeader_ptr garbage = {0};
+  bool done = true;
+
+  for (size_t i = 0; i < count; i++) {
+    dynarray_insert(&batch, roots.data[--roots.count]);
+  }
+
+  for (size_t i = 0; done && i < batch.count; i++) {
+    dynarray_insert(&work, batch.data[i]);
+    done = mark_gray(&work, &edges);
+  }
+  for (size_t i = 0; done && i < batch.count; i++) {
+    dynarray_insert(&work, batch.data[i]);
+    done = scan(&work, &black, &edges);
+  }
+  if (!done) {
+    restore(&batch, &black, &edges);
+    for (size_t i = 0; i < batch.count; i++) {
+      dynarray_insert(&set_aside, batch.data[i]);
+    }
+    goto out;
+  }
+  for (size_t i = 0; i < batch.count; i++) {
+    dynarray_insert(&work, batch.data[i]);
+    collect_white(&work, &edges, &garbage);
+  }
+
+  /* The roots that turned out to be in use are no longer buffered,
+   * and whatever else was, but is garbage, can't stay in the buffer
+   * either. */
+  for (size_t i = 0; i < batch.count; i++) {
+    batch.data[i]->flags &= ~OBJ_BUFFERED;
+  }
+  if (garbage.count > 0) {
+    drop_garbage(&roots);
+    drop_garbage(&set_aside);
+  }
+
+  /* The garbage is only freed once it no longer refers to anything,
+   * since it refers to itself. */
+  for (size_t i = 0; i < garbage.count; i++) {
+    clear_container(garbage.data[i]);
+  }
+  for (size_t i = 0; i < garbage.count; i++) {
+    free_container(garbage.data[i]);
+  }
+
+  stats.roots += batch.count;
+  stats.freed += garbage.count;
+
+out:
+  dynarray_free(&batch);
+  dynarray_free(&work);
+  dynarray_free(&black);
+  dynarray_free(&edges);
+  dynarray_free(&garbage);
+}
+
+/* Without a budget, the roots are all traced in one batch, so that
+ * nothing is traced more than once. */
+static void collect(uint64_t budget_ns)
+{
+  uint64_t start = now_ns();
+  uint64_t elapsed = 0;
+  size_t batch = budget_ns == UINT64_MAX ? SIZE_MAX : CYCLE_BATCH;
+
+  deadline = budget_ns < UINT64_MAX - start ? start + budget_ns : UINT64_MAX;
+  while (roots.count > 0 && elapsed < budget_ns) {
+    collect_batch(roots.count < batch ? roots.count : batch);
+    elapsed = now_ns() - start;
+  }
+
+  unfinished = roots.count > 0;
+  allocations_seen = container_allocations();
+
+  stats.pause_ns += elapsed;
+  if (budget_ns == UINT64_MAX) {
+    ++stats.full;
+    if (elapsed > stats.max_full_ns) {
+      stats.max_full_ns = elapsed;
+    }
+  } else {
+    ++stats.collections;
+    if (elapsed > stats.max_pause_ns) {
+      stats.max_pause_ns = elapsed;
+    }
+  }
+}
+
+/* Moves the roots that were set aside back into the buffer, to be
+ * traced without a budget. */
+static void collect_set_aside(void)
+{
+  for (size_t i = 0; i < set_aside.count; i++) {
+    dynarray_insert(&roots, set_aside.data[i]);
+  }
+  set_aside.count = 0;
+
+  traced = 0;
+  collect(UINT64_MAX);
+  set_aside_due = container_allocations() +
+                  (traced > CYCLE_ALLOCATIONS ? traced : CYCLE_ALLOCATIONS);
+}
+
+void cycle_collect(void)
+{
+  if (set_aside.count > 0 && container_allocations() >= set_aside_due) {
+    collect_set_aside();
+  } else {
+    collect(CYCLE_BUDGET_NS);
+  }
+}
+
+void cycle_flush(void)
+{
+  if (roots.count > 0 || set_aside.count > 0) {
+    collect_set_aside();
+  }
+  dynarray_free(&roots);
+  roots = (DynArray_ObjHeader_ptr){0};
+  dynarray_free(&set_aside);
+  set_aside = (DynArray_ObjHeader_ptr){0};
+  set_aside_due = 0;
+  unfinished = false;
+
+  pthread_mutex_lock(&totals_lock);
+  totals.collections += stats.collections;
+  totals.roots += stats.roots;
+  totals.freed += stats.freed;
+  totals.pause_ns += stats.pause_ns;
+  if (stats.max_pause_ns > totals.max_pause_ns) {
+    totals.max_pause_ns = stats.max_pause_ns;
+  }
+  totals.full += stats.full;
+  if (stats.max_full_ns > totals.max_full_ns) {
+    totals.max_full_ns = stats.max_full_ns;
+  }
+  pthread_mutex_unlock(&totals_lock);
+  stats = (CycleStats){0};
+}
+
+void print_cycle_report(void)
+{
+  pthread_mutex_lock(&totals_lock);
+  printf("cycles: %zu collections, %zu roots scanned, %zu objects freed, "
+         "%.6f sec paused (max %.6f sec), %zu full (max %.6f sec)\n",
+         totals.collections, totals.roots, totals.freed,
+         totals.pause_ns / 1e9, totals.max_pause_ns / 1e9, totals.full,
+         totals.max_full_ns / 1e9);
+  pthread_mutex_unlock(&totals_lock);
+}
+#endif
+
+#ifdef REFCHECK
+static bool refcheck_failed;
+
+static void adjust(Object *obj, int delta)
+{
+  ObjHeader *header = obj_header(obj);
+  if (header) {
+    header->refcount += delta;
+  }
+}
+
+/* Adds 'delta' to the counts of everything the object holds a refer-
+ * ence to, i.e., everything its destructor releases. */
+static void adjust_refs(void *obj, void *ctx)
+{
+  ObjHeader *header = obj;
+  int delta = *(int *) ctx;
+
+  switch (header->type) {
+    case OBJ_STRUCT: {
+      Table_Object *properties = ((Struct *) header)->properties;
+      for (size_t i = 0; i < properties->count; i++) {
+        adjust(&properties->items[i], delta);
+      }
+      break;
+    }
+    case OBJ_ARRAY: {
+      DynArray_Object *elements = &((Array *) header)->elements;
+      for (size_t i = 0; i < elements->count; i++) {
+        adjust(&elements->data[i], delta);
+      }
+      break;
+    }
+    case OBJ_CLOSURE: {
+      Closure *closure = (Closure *) header;
+      for (int i = 0; i < closure->upvalue_count; i++) {
+        Upvalue *upvalue = closure->upvalues[i];
+#ifdef DEFERRED_RC
+        if (upvalue->location != &upvalue->closed) {
+          continue;
+        }
+#endif
+        adjust(upvalue->location, delta);
+      }
+      break;
+    }
+    case OBJ_GENERATOR: {
+      Generator *gen = (Generator *) header;
+      for (size_t i = 0; i < gen->tos; i++) {
+        adjust(&gen->stack[i], delta);
+      }
+      break;
+    }
+    case OBJ_TASK: {
+      Task *task = (Task *) header;
+      if (task->gen) {
+        task->gen->refcount += delta;
+      }
+      if (task->has_result) {
+        adjust(&task->result, delta);
+      }
+      if (task->has_send) {
+        adjust(&task->send_value, delta);
+      }
+      if (task->io) {
+        task->io->refcount += delta;
+      }
+      if (task->blocked_on) {
+        task->blocked_on->refcount += delta;
+        adjust(&task->chan_value, delta);
+      }
+      adjust(&task->gathered, delta);
+      for (size_t i = 0; i < task->waiters.count; i++) {
+        task->waiters.data[i].task->refcount += delta;
+      }
+      break;
+    }
+    case OBJ_IO: {
+      Io *io = (Io *) header;
+      if (io->kind == IO_WRITE) {
+        adjust(&io->data, delta);
+      }
+      break;
+    }
+    case OBJ_CHANNEL: {
+      Channel *chan = (Channel *) header;
+      for (size_t i = 0; i < chan->count; i++) {
+        adjust(&chan->buffer[(chan->head + i) % chan->capacity], delta);
+      }
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* The shared channels aren't objects of their own, so the refer-
+ * ences from them are counted separately. */
+static void adjust_shared_channels(int delta)
+{
+  pthread_mutex_lock(&shared_channels_lock);
+  for (SharedChannel *shared = shared_channels; shared;
+       shared = shared->next) {
+    for (size_t i = 0; i < shared->count; i++) {
+      adjust(&shared->buffer[(shared->head + i) % shared->capacity], delta);
+    }
+    for (ChannelWaiter *w = shared->senders.head; w; w = w->next) {
+      adjust(&w->value, delta);
+    }
+  }
+  pthread_mutex_unlock(&shared_channels_lock);
+}
+
+static void report_unbalanced(void *obj, void *ctx)
+{
+  ObjHeader *header = obj;
+  if (header->refcount != 0) {
+    fprintf(stderr, "refcheck: the count of the %s at %p is %d %s the "
+            "number of references to it\n", (const char *) ctx, obj,
+            abs(header->refcount),
+            header->refcount > 0 ? "above" : "below");
+    refcheck_failed = true;
+  }
+}
+
+static const SlabKind refcounted_kinds[] = {
+    SLAB_STRING, SLAB_ARRAY, SLAB_STRUCT, SLAB_CLOSURE, SLAB_GENERATOR,
+    SLAB_SLEEP,  SLAB_TASK,  SLAB_IO,     SLAB_CHANNEL,
+};
+
+static const char *const refcounted_names[] = {
+    "string", "array", "struct", "closure", "generator",
+    "sleep",  "task",  "io",     "channel",
+};
+
+#define REFCOUNTED_KINDS \
+  (sizeof(refcounted_kinds) / sizeof(refcounted_kinds[0]))
+
+/* Takes the references away from the counts, which leaves every count
+ * at zero if they were right, and then gives them back. */
+void refcheck_verify(Object *root_refs, size_t count)
+{
+  int delta = -1;
+  for (size_t i = 0; i < REFCOUNTED_KINDS; i++) {
+    slab_for_each_live(refcounted_kinds[i], adjust_refs, &delta);
+  }
+  for (size_t i = 0; i < count; i++) {
+    adjust(&root_refs[i], delta);
+  }
+  adjust_shared_channels(delta);
+
+  for (size_t i = 0; i < REFCOUNTED_KINDS; i++) {
+    slab_for_each_live(refcounted_kinds[i], report_unbalanced,
+                       (void *) refcounted_names[i]);
+  }
+
+  delta = 1;
+  for (size_t i = 0; i < REFCOUNTED_KINDS; i++) {
+    slab_for_each_live(refcounted_kinds[i], adjust_refs, &delta);
+  }
+  for (size_t i = 0; i < count; i++) {
+    adjust(&root_refs[i], delta);
+  }
+  adjust_shared_channels(delta);
+}
+
+bool refcheck_ok(void)
+{
+  return !refcheck_failed;
+}
+
+void refcheck_dead(const ObjHeader *header, const char *file, int line)
+{
+  /* The type is still there, as slab_free() only overwrites the count
+   * and what comes after the header. */
+  static const char *const names[] = {
+      [OBJ_STRUCT] = "struct",       [OBJ_STRING] = "string",
+      [OBJ_ARRAY] = "array",         [OBJ_CLOSURE] = "closure",
+      [OBJ_GENERATOR] = "generator", [OBJ_TASK] = "task",
+      [OBJ_SLEEP] = "sleep",         [OBJ_IO] = "io",
+      [OBJ_CHANNEL] = "channel",
+  };
+  const char *name = header->type < sizeof(names) / sizeof(names[0]) &&
+                             names[header->type]
+                         ? names[header->type]
+                         : "object";
+
+  fprintf(stderr, "refcheck: %s at %p used after it was freed, at %s:%d\n",
+          name, (const void *) header, file, line);
+  abort();
+}
+#endif
+
+extern inline void objdecref_at(Object *obj, const char *file, int line);
+extern inline ObjHeader *obj_header(const Object *obj);
+extern inline void objincref_at(Object *obj, const char *file, int line);
 extern inline const char *get_object_type(const Object *object);
 extern inline ObjectType type(const Object *object);
 
@@ -2,12 +2,14 @@
 #define venom_object_h
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #include "dynarray.h"
+#include "slab.h"
 #include "table.h"
 
 typedef enum {
@@ -22,6 +24,8 @@ typedef enum {
   OBJ_GENERATOR,
   OBJ_TASK,
   OBJ_SLEEP,
+  OBJ_IO,
+  OBJ_CHANNEL,
 } ObjectType;
 
 #ifdef NAN_BOXING
@@ -104,6 +108,8 @@ typedef enum {
 #define TAG_GENERATOR 0x2000000000001
 #define TAG_TASK 0x2000000000002
 #define TAG_SLEEP 0x2000000000003
+#define TAG_IO 0x2000000000004
+#define TAG_CHANNEL 0x2000000000005
 
 typedef uint64_t Object;
 typedef DynArray(Object) DynArray_Object;
@@ -140,22 +146,30 @@ typedef DynArray(Object) DynArray_Object;
 #define GENERATOR_PATTERN (SIGN_BIT | QNAN | TAG_GENERATOR)
 #define TASK_PATTERN (SIGN_BIT | QNAN | TAG_TASK)
 #define SLEEP_PATTERN (SIGN_BIT | QNAN | TAG_SLEEP)
+#define IO_PATTERN (SIGN_BIT | QNAN | TAG_IO)
+#define CHANNEL_PATTERN (SIGN_BIT | QNAN | TAG_CHANNEL)
 
 /* To check whether a value is a struct, we check if it's an object and
- * whether it is tagged as a Struct. */
-#define IS_STRUCT(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == STRUCT_PATTERN)
+ * whether it is tagged as a Struct. Bit 49 is part of the mask, too,
+ * because the tags that have it set reuse the low three bits (e.g.,
+ * TAG_IO and TAG_STRUCT only differ in bit 49). */
+#define IS_STRUCT(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == STRUCT_PATTERN)
 
 /* To check whether a value is a struct, we check if it's an object and
  * whether it is tagged as a String. */
-#define IS_STRING(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == STRING_PATTERN)
+#define IS_STRING(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == STRING_PATTERN)
 
 /* To check whether a value is a struct, we check if it's an object and
  * whether it is tagged as a pointer. */
-#define IS_PTR(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == PTR_PATTERN)
+#define IS_PTR(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == PTR_PATTERN)
 
 /* To check whether a value is an array, we check if it's an object and
  * whether it is tagged as an array. */
-#define IS_ARRAY(value) (((value) & (SIGN_BIT | QNAN | 0x7)) == ARRAY_PATTERN)
+#define IS_ARRAY(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == ARRAY_PATTERN)
 
 /* To check whether a value is a closure, we check if it's an object and
  * whether it is tagged as a closure. */
@@ -170,6 +184,10 @@ typedef DynArray(Object) DynArray_Object;
   (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == TASK_PATTERN)
 #define IS_SLEEP(value) \
   (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == SLEEP_PATTERN)
+#define IS_IO(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == IO_PATTERN)
+#define IS_CHANNEL(value) \
+  (((value) & (SIGN_BIT | QNAN | 0x2000000000007)) == CHANNEL_PATTERN)
 
 /* To convert a value to a boolean, we compare it to TRUE_VAL because
  * if we had a 'false', (false == true) will be false, and we got our
@@ -239,6 +257,15 @@ typedef DynArray(Object) DynArray_Object;
        ? (Sleep *) ((uintptr_t) ((object) &                             \
                                  ~(SIGN_BIT | QNAN | 0x2000000000007))) \
        : NULL)
+#define AS_IO(object)                                                       \
+  ((IS_IO(object)) ? (Io *) ((uintptr_t) ((object) & ~(SIGN_BIT | QNAN |  \
+                                                       0x2000000000007))) \
+                   : NULL)
+#define AS_CHANNEL(object)                                                \
+  ((IS_CHANNEL(object))                                                   \
+       ? (Channel *) ((uintptr_t) ((object) &                             \
+                                   ~(SIGN_BIT | QNAN | 0x2000000000007))) \
+       : NULL)
 
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 
@@ -276,6 +303,10 @@ typedef DynArray(Object) DynArray_Object;
   (Object)(SIGN_BIT | QNAN | ((uint64_t) (uintptr_t) (obj)) | TAG_TASK)
 #define SLEEP_VAL(obj) \
   (Object)(SIGN_BIT | QNAN | ((uint64_t) (uintptr_t) (obj)) | TAG_SLEEP)
+#define IO_VAL(obj) \
+  (Object)(SIGN_BIT | QNAN | ((uint64_t) (uintptr_t) (obj)) | TAG_IO)
+#define CHANNEL_VAL(obj) \
+  (Object)(SIGN_BIT | QNAN | ((uint64_t) (uintptr_t) (obj)) | TAG_CHANNEL)
 
 inline double object2num(Object value)
 {
@@ -308,6 +339,8 @@ typedef struct Upvalue Upvalue;
 typedef struct Generator Generator;
 typedef struct Task Task;
 typedef struct Sleep Sleep;
+typedef struct Io Io;
+typedef struct Channel Channel;
 
 typedef DynArray(struct Object) DynArray_Object;
 
@@ -342,6 +375,8 @@ typedef struct Object {
     Generator *generator;
     Task *task;
     Sleep *sleep;
+    Io *io;
+    Channel *channel;
     /* Since we have five refcounted objects (Struct, String,
      * Array, Closure, Generator), we need a handy way to access
      * their refcounts.
@@ -369,6 +404,8 @@ typedef struct Object {
 #define IS_GENERATOR(object) ((object).type == OBJ_GENERATOR)
 #define IS_TASK(object) ((object).type == OBJ_TASK)
 #define IS_SLEEP(object) ((object).type == OBJ_SLEEP)
+#define IS_IO(object) ((object).type == OBJ_IO)
+#define IS_CHANNEL(object) ((object).type == OBJ_CHANNEL)
 
 #define AS_NUM(object) ((object).as.dval)
 #define AS_BOOL(object) ((object).as.bval)
@@ -383,6 +420,8 @@ typedef struct Object {
 #define AS_GENERATOR(object) ((object).as.generator)
 #define AS_TASK(object) ((object).as.task)
 #define AS_SLEEP(object) ((object).as.sleep)
+#define AS_IO(object) ((object).as.io)
+#define AS_CHANNEL(object) ((object).as.channel)
 
 #define NUM_VAL(thing) ((Object){.type = OBJ_NUMBER, .as.dval = (thing)})
 #define BOOL_VAL(thing) ((Object){.type = OBJ_BOOLEAN, .as.bval = (thing)})
@@ -400,31 +439,69 @@ typedef struct Object {
   ((Object){.type = OBJ_GENERATOR, .as.generator = (thing)})
 #define TASK_VAL(thing) ((Object){.type = OBJ_TASK, .as.task = (thing)})
 #define SLEEP_VAL(thing) ((Object){.type = OBJ_SLEEP, .as.sleep = (thing)})
+#define IO_VAL(thing) ((Object){.type = OBJ_IO, .as.io = (thing)})
+#define CHANNEL_VAL(thing) \
+  ((Object){.type = OBJ_CHANNEL, .as.channel = (thing)})
 #define NULL_VAL ((Object){.type = OBJ_NULL})
 
 #endif
 
 void print_object(const Object *obj);
 
+/* Every refcounted object starts with these, so that the refcount and
+ * the type can be found without knowing what the object is first.
+ * The flags are left for the memory manager to use. */
+#define OBJ_HEADER \
+  int refcount;    \
+  uint8_t type;    \
+  uint8_t flags
+
+typedef struct ObjHeader {
+  OBJ_HEADER;
+} ObjHeader;
+
 typedef struct String {
-  int refcount;
+  OBJ_HEADER;
   char *value;
 } String;
 
 typedef struct Array {
-  int refcount;
+  OBJ_HEADER;
   DynArray_Object elements;
 } Array;
 
+/* What the compiler knows about a function it can call by name. */
 typedef struct Function {
   char *name;
-  size_t location;
   size_t paramcount;
-  int upvalue_count;
   bool is_gen;
   bool is_async;
 } Function;
 
+/* The code from 'offset' on (up to the next run) comes from 'line'. */
+typedef struct {
+  uint32_t offset;
+  uint32_t line;
+} LineRun;
+
+typedef DynArray(LineRun) DynArray_LineRun;
+
+/* A compiled function, with code of its own. The protos belong to the
+ * Bytecode the function was compiled into, and every closure made from
+ * a function points at its proto, rather than at a copy of it. */
+typedef struct FunctionProto {
+  char *name; /* in the string pool */
+  DynArray_uint8_t code;
+  DynArray_LineRun lines;
+  uint8_t paramcount;
+  uint8_t upvalue_count;
+  uint16_t local_count; /* the most locals live at once, params included */
+  uint16_t max_stack;   /* the deepest the frame gets, locals included */
+  /* Set until the body is compiled, which, for the functions defined
+   * at the top level, is only once they're first called. */
+  struct Deferred *deferred;
+} FunctionProto;
+
 typedef struct Upvalue {
   Object *location;
   Object closed;
@@ -432,8 +509,8 @@ typedef struct Upvalue {
 } Upvalue;
 
 typedef struct Closure {
-  int refcount;
-  Function *func;
+  OBJ_HEADER;
+  const FunctionProto *proto;
   Upvalue **upvalues;
   int upvalue_count;
 } Closure;
@@ -466,6 +543,10 @@ inline const char *get_object_type(const Object *object)
     return "task";
   } else if (IS_SLEEP(*object)) {
     return "sleep";
+  } else if (IS_IO(*object)) {
+    return "io";
+  } else if (IS_CHANNEL(*object)) {
+    return "channel";
   }
   assert(0);
 }
@@ -473,8 +554,14 @@ inline const char *get_object_type(const Object *object)
 typedef Table(Object) Table_Object;
 void free_table_object(const Table_Object *table);
 
+/* Makes a deep copy of 'obj' which shares no refcounted objects with
+ * it, so that it can be handed over to another thread. The exception
+ * are shared channels, which get another handle instead. Returns
+ * false if 'obj' is, or contains, something that can't be copied. */
+bool copy_object(const Object *obj, Object *copy);
+
 typedef struct Struct {
-  int refcount;
+  OBJ_HEADER;
   char *name;
   size_t propcount;
   Table_Object *properties;
@@ -494,7 +581,7 @@ typedef enum {
 } GeneratorState;
 
 typedef struct Generator {
-  int refcount;
+  OBJ_HEADER;
   uint8_t *ip;
   Object stack[1024];
   size_t tos;
@@ -505,282 +592,353 @@ typedef struct Generator {
 } Generator;
 
 typedef struct Sleep {
-  int refcount;
-  int ticks;
+  OBJ_HEADER;
+  double ms;
 } Sleep;
 
+typedef enum {
+  IO_READ,
+  IO_WRITE,
+  IO_ACCEPT,
+} IoKind;
+
+/* A file descriptor operation, as returned by read_fd(...), write_-
+ * fd(...), and accept(...). Nothing happens until it's awaited, at
+ * which point the scheduler attempts it without blocking and, if
+ * the descriptor isn't ready, parks the task in the event loop. */
+typedef struct Io {
+  OBJ_HEADER;
+  IoKind kind;
+  int fd;
+  size_t count;   /* IO_READ: the maximum number of bytes to read */
+  char *buf;      /* IO_READ: where they're read into, once attempted */
+  Object data;    /* IO_WRITE: the string being written */
+  size_t written; /* IO_WRITE: how much of 'data' is already written */
+} Io;
+
+typedef enum {
+  WAIT_ONE, /* await */
+  WAIT_ALL, /* gather(...) */
+  WAIT_ANY, /* select(...) */
+} WaitKind;
+
+/* An entry in the list of tasks to notify once a task is done. The
+ * epoch tells apart the wait the entry was made for from any later
+ * ones, so that, e.g., the tasks that lost a select(...) don't wake
+ * the waiter up again when they eventually finish. */
+typedef struct {
+  struct Task *task;
+  uint32_t epoch;
+  size_t index; /* WAIT_ALL: where the result goes in 'gathered' */
+} Waiter;
+
+typedef DynArray(Waiter) DynArray_Waiter;
+
+typedef enum {
+  PHASE_RUNNABLE,
+  PHASE_RUNNING,
+  PHASE_BLOCKED, /* on other tasks, a channel, or a descriptor */
+  PHASE_SLEEPING,
+  PHASE_DONE,
+} TaskPhase;
+
+/* What --measure=tasks reports about a task. The times are in ns,
+ * and 'since' is when the task entered its current phase. */
+typedef struct {
+  bool enabled;
+  TaskPhase phase;
+  uint64_t since;
+  uint64_t cpu_since;          /* thread CPU time when it was resumed */
+  uint64_t instructions_since; /* the VM's count when it was resumed */
+  uint64_t instructions;
+  uint64_t switches; /* how many times it was switched to */
+  uint64_t cpu_ns;
+  uint64_t runnable_ns; /* could have run, but some other task did */
+  uint64_t blocked_ns;
+  uint64_t sleeping_ns;
+  size_t peak_stack; /* the most stack slots it had in use */
+} TaskStats;
+
 typedef struct Task {
-  int refcount;
+  OBJ_HEADER;
   int id;
   Generator *gen;
   bool done;
   bool has_result;
   Object result;
-  struct Task *waiting_on;
-  int wake_tick;
+  DynArray_Waiter waiters; /* who to notify when the task is done */
+  size_t pending;          /* how many tasks this one is waiting for */
+  WaitKind wait_kind;
+  uint32_t wait_epoch;
+  Object gathered; /* WAIT_ALL: the results collected so far */
+  Io *io; /* the operation the task is blocked on, if any */
+  uint64_t wake_at; /* CLOCK_MONOTONIC deadline in ns, see eventloop.h */
   bool has_send;
   Object send_value;
+  bool preempted; /* suspended by the scheduler rather than by itself */
+  struct Channel *blocked_on; /* the channel the task is parked on */
+  struct Task *next_waiter;   /* the next task in the same wait queue */
+  Object chan_value;          /* what a parked sender is trying to send */
+  bool remote;     /* stands in for a job some worker thread is running */
+  struct Job *job; /* the job this task is running, if any (see vm.c) */
+  TaskStats stats;
 } Task;
 
-inline void objincref(Object *obj)
+typedef struct {
+  Task *head;
+  Task *tail;
+} TaskQueue;
+
+/* A task parked on a shared channel, along with the worker whose
+ * mailbox it's woken up through. */
+typedef struct ChannelWaiter {
+  Task *task;
+  struct Worker *worker;
+  Object value; /* the copy a parked sender is trying to send */
+  struct ChannelWaiter *next;
+} ChannelWaiter;
+
+typedef struct {
+  ChannelWaiter *head;
+  ChannelWaiter *tail;
+} ChannelWaiterQueue;
+
+/* The part of a channel the workers of the parallel scheduler share
+ * (see vm.c). Each worker has Channel handles of its own to it, and
+ * everything in it is guarded by 'lock': the buffer, which holds
+ * copies made by the senders that are owned by the channel until a
+ * receiver takes them, and the tasks parked on it, which may belong
+ * to any worker. */
+typedef struct SharedChannel {
+  pthread_mutex_t lock;
+  size_t handles; /* the Channels that refer to it */
+  Object *buffer;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  ChannelWaiterQueue senders;
+  ChannelWaiterQueue receivers;
+#ifdef REFCHECK
+  struct SharedChannel *prev, *next; /* see refcheck_verify() */
+#endif
+} SharedChannel;
+
+/* A bounded FIFO channel. The buffer is a ring of 'capacity' slots,
+ * of which 'count' are used, starting at 'head'. Tasks that can't
+ * make progress (senders when the buffer is full, receivers when
+ * it's empty) are parked in 'senders' and 'receivers' until a task
+ * on the other end hands them the value directly.
+ *
+ * Under --workers=N, the channel is only a handle to a SharedChannel
+ * in 'shared', which has the buffer and the queues instead. */
+typedef struct Channel {
+  OBJ_HEADER;
+  Object *buffer;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  TaskQueue senders;
+  TaskQueue receivers;
+  SharedChannel *shared;
+} Channel;
+
+/* Makes a channel the workers of the parallel scheduler can share,
+ * with a single handle to it. */
+Channel *new_shared_channel(size_t capacity);
+
+/* Takes the task off the queues of the shared channel it's parked
+ * on, if it's still in one. */
+void shared_channel_forget(Task *task);
+
+#ifndef NAN_BOXING
+#define REFCOUNTED_TYPES                                            \
+  ((1u << OBJ_STRUCT) | (1u << OBJ_STRING) | (1u << OBJ_ARRAY) |    \
+   (1u << OBJ_CLOSURE) | (1u << OBJ_GENERATOR) | (1u << OBJ_TASK) | \
+   (1u << OBJ_SLEEP) | (1u << OBJ_IO) | (1u << OBJ_CHANNEL))
+#endif
+
+/* Returns the header of the object 'obj' refers to, or NULL if it
+ * isn't refcounted. */
+inline ObjHeader *obj_header(const Object *obj)
 {
 #ifdef NAN_BOXING
-  if (IS_NUM(*obj)) {
-    return;
-  } else if (IS_STRING(*obj)) {
-    ++AS_STRING(*obj)->refcount;
-  } else if (IS_STRUCT(*obj)) {
-    ++AS_STRUCT(*obj)->refcount;
-  } else if (IS_ARRAY(*obj)) {
-    ++AS_ARRAY(*obj)->refcount;
-  } else if (IS_CLOSURE(*obj)) {
-    ++AS_CLOSURE(*obj)->refcount;
-  } else if (IS_GENERATOR(*obj)) {
-    ++AS_GENERATOR(*obj)->refcount;
-  } else if (IS_TASK(*obj)) {
-    ++AS_TASK(*obj)->refcount;
-  } else if (IS_SLEEP(*obj)) {
-    ++AS_SLEEP(*obj)->refcount;
+  /* Everything with the sign bit and the QNAN pattern set points to
+   * a refcounted object, except for the pointers. */
+  if (IS_OBJ(*obj) && !IS_PTR(*obj)) {
+    return (ObjHeader *) AS_OBJ(*obj);
   }
 #else
-  switch (obj->type) {
-    case OBJ_NUMBER: {
-      return;
-    }
-    case OBJ_STRING:
-    case OBJ_ARRAY:
-    case OBJ_CLOSURE:
-    case OBJ_STRUCT:
-    case OBJ_GENERATOR:
-    case OBJ_TASK:
-    case OBJ_SLEEP: {
-      ++*(obj)->as.refcount;
-      break;
-    }
-
-    default:
-      break;
+  if ((REFCOUNTED_TYPES >> obj->type) & 1) {
+    return (ObjHeader *) obj->as.refcount;
   }
 #endif
+  return NULL;
 }
 
-inline void dealloc(Object *obj);
+#ifdef REFCHECK
+/* With make debug=refcheck, slab_free() leaves this count in the hea-
+ * der of what it frees, which no object in use can have, so that the
+ * object being released again, or taken up again, is reported along
+ * with where it happened, instead of corrupting the slab. */
+#define REFCOUNT_DEAD (-0xdead)
+
+_Noreturn void refcheck_dead(const ObjHeader *header, const char *file,
+                             int line);
+
+#define REFCHECK_LIVE(header, file, line)      \
+  do {                                         \
+    if ((header)->refcount == REFCOUNT_DEAD) { \
+      refcheck_dead((header), (file), (line)); \
+    }                                          \
+  } while (0)
+
+#define objincref(obj) objincref_at((obj), __FILE__, __LINE__)
+#define objdecref(obj) objdecref_at((obj), __FILE__, __LINE__)
+#else
+#define REFCHECK_LIVE(header, file, line) ((void) 0)
+
+#define objincref(obj) objincref_at((obj), NULL, 0)
+#define objdecref(obj) objdecref_at((obj), NULL, 0)
+#endif
 
-inline void objdecref(Object *obj)
+inline void objincref_at(Object *obj, const char *file, int line)
 {
-#ifdef NAN_BOXING
-  if (IS_NUM(*obj)) {
-    return;
-  } else if (IS_STRING(*obj)) {
-    if (--AS_STRING(*obj)->refcount == 0) {
-      dealloc(obj);
-    }
-  } else if (IS_STRUCT(*obj)) {
-    if (--AS_STRUCT(*obj)->refcount == 0) {
-      for (size_t i = 0; i < AS_STRUCT(*obj)->properties->count; i++) {
-        objdecref(&AS_STRUCT(*obj)->properties->items[i]);
-      }
-      dealloc(obj);
-    }
-  } else if (IS_ARRAY(*obj)) {
-    if (--AS_ARRAY(*obj)->refcount == 0) {
-      for (size_t i = 0; i < AS_ARRAY(*obj)->elements.count; i++) {
-        objdecref(&AS_ARRAY(*obj)->elements.data[i]);
-      }
-      dealloc(obj);
-    }
-  } else if (IS_CLOSURE(*obj)) {
-    if (--AS_CLOSURE(*obj)->refcount == 0) {
-      for (int i = 0; i < AS_CLOSURE(*obj)->upvalue_count; i++) {
-        objdecref(AS_CLOSURE(*obj)->upvalues[i]->location);
-      }
-      dealloc(obj);
-    }
-  } else if (IS_GENERATOR(*obj)) {
-    if (--AS_GENERATOR(*obj)->refcount == 0) {
-      for (size_t i = 0; i < AS_GENERATOR(*obj)->tos; i++) {
-        objdecref(&AS_GENERATOR(*obj)->stack[i]);
-      }
-      dealloc(obj);
-    }
-  } else if (IS_TASK(*obj)) {
-    if (--AS_TASK(*obj)->refcount == 0) {
-      dealloc(obj);
-    }
-  } else if (IS_SLEEP(*obj)) {
-    if (--AS_SLEEP(*obj)->refcount == 0) {
-      dealloc(obj);
-    }
+  ObjHeader *header = obj_header(obj);
+  if (header) {
+    REFCHECK_LIVE(header, file, line);
+    ++header->refcount;
   }
+}
 
-#else
+/* Frees what 'header' is the header of, once its refcount drops to
+ * zero, after releasing whatever it refers to. Indexed by the type
+ * stored in the header, see object.c. */
+typedef void (*Destructor)(ObjHeader *header);
+extern const Destructor destructors[];
+
+/* Destroys what 'header' is the header of. The objects it refers to
+ * that drop to zero along the way go on a worklist rather than being
+ * destroyed from within its destructor, so freeing a large structure
+ * takes no more C stack than freeing a single object does. In lazy
+ * mode, everything goes on the worklist, and release_pending() frees
+ * a bounded number of them at a time. */
+void obj_release(ObjHeader *header);
+
+/* Frees up to 'max' objects off the calling thread's worklist. */
+void release_pending(size_t max);
+
+/* Switches the calling thread's lazy mode on or off. Switching it off
+ * frees whatever is left on the worklist. */
+void set_lazy_release(bool lazy);
+
+#ifdef DEFERRED_RC
+/* With deferred refcounting (make opt=deferred_rc), the references
+ * on the VM stack aren't counted, so an object whose count drops to
+ * zero may still be in use. Instead of being freed right away, it is
+ * put in the zero count table (ZCT), and the VM frees what's in the
+ * table at the next safe point (a call, a return, or a yield) where
+ * the table is full, unless it finds the object on one of its stacks
+ * (see reconcile() in vm.c). */
+#define OBJ_IN_ZCT 0x1
+#define OBJ_ON_STACK 0x2
+#define OBJ_KEPT 0x4
+
+void zct_add(ObjHeader *header);
+
+/* Whether the table has grown enough for a reconciliation. */
+bool zct_full(void);
+
+/* Marks the objects in the table that 'slots' refer to as still on
+ * the stack, ahead of zct_reconcile(). The ones that were on the stack
+ * the last time are only marked when they're due to be looked at. */
+void zct_mark(const Object *slots, size_t count);
+
+/* Has the next reconciliation look at the objects that were on the
+ * stack the last time too, even if they're not due yet. */
+void zct_recheck(void);
+
+/* Frees the objects in the table that weren't marked and are still
+ * at zero, and takes the ones that are no longer at zero out. Returns
+ * how many it freed. */
+size_t zct_reconcile(void);
+
+/* Frees everything in the table, for when no stack is left. */
+void zct_flush(void);
+#endif
 
-  switch (obj->type) {
-    case OBJ_NUMBER: {
-      return;
-    }
-    case OBJ_STRING: {
-      if (--*(obj)->as.refcount == 0) {
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_STRUCT: {
-      if (--*(obj)->as.refcount == 0) {
-        for (size_t i = 0; i < AS_STRUCT(*obj)->properties->count; i++) {
-          objdecref(&AS_STRUCT(*obj)->properties->items[i]);
-        }
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_ARRAY: {
-      if (--*(obj)->as.refcount == 0) {
-        for (size_t i = 0; i < AS_ARRAY(*obj)->elements.count; i++) {
-          objdecref(&AS_ARRAY(*obj)->elements.data[i]);
-        }
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_CLOSURE: {
-      if (--*(obj)->as.refcount == 0) {
-        for (int i = 0; i < AS_CLOSURE(*obj)->upvalue_count; i++) {
-          objdecref(AS_CLOSURE(*obj)->upvalues[i]->location);
-        }
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_GENERATOR: {
-      if (--*(obj)->as.refcount == 0) {
-        for (size_t i = 0; i < AS_GENERATOR(*obj)->tos; i++) {
-          objdecref(&AS_GENERATOR(*obj)->stack[i]);
-        }
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_TASK: {
-      if (--*(obj)->as.refcount == 0) {
-        dealloc(obj);
-      }
-      break;
-    }
-    case OBJ_SLEEP: {
-      if (--*(obj)->as.refcount == 0) {
-        dealloc(obj);
-      }
-      break;
-    }
-    default:
-      break;
-  }
+#ifdef REFCHECK
+/* With make debug=refcheck, the VM checks at OP_HLT that the count of
+ * every object in use is the number of references to it, from the
+ * 'root_refs' or from the other objects in use, and reports any object
+ * whose count is off, which is either a leak or a double free in the
+ * making. The counts are left as they were. */
+void refcheck_verify(Object *root_refs, size_t count);
+
+/* Whether refcheck_verify() has found nothing wrong so far. */
+bool refcheck_ok(void);
 #endif
-}
 
-inline void dealloc(Object *obj)
-{
-#ifdef NAN_BOXING
-  if (IS_STRUCT(*obj)) {
-    for (size_t i = 0; i < TABLE_MAX; i++) {
-      if (AS_STRUCT(*obj)->properties->indexes[i] != NULL) {
-        Bucket *bucket = AS_STRUCT(*obj)->properties->indexes[i];
-        list_free(bucket);
-      }
-    }
+#ifdef CYCLE_GC
+#ifdef DEFERRED_RC
+#error "the cycle collector needs the stack references to be counted"
+#endif
 
-    free(AS_STRUCT(*obj)->properties);
-    free(AS_STRUCT(*obj));
-  } else if (IS_STRING(*obj)) {
-    free(AS_STRING(*obj)->value);
-    free(AS_STRING(*obj));
-  } else if (IS_ARRAY(*obj)) {
-    dynarray_free(&AS_ARRAY(*obj)->elements);
-    free(AS_ARRAY(*obj));
-  } else if (IS_CLOSURE(*obj)) {
-    for (int i = 0; i < AS_CLOSURE(*obj)->upvalue_count; i++) {
-      free(AS_CLOSURE(*obj)->upvalues[i]);
-    }
-    free(AS_CLOSURE(*obj)->upvalues);
-    free(AS_CLOSURE(*obj)->func);
-    free(AS_CLOSURE(*obj));
-  } else if (IS_GENERATOR(*obj)) {
-    free(AS_GENERATOR(*obj));
-  } else if (IS_TASK(*obj)) {
-    Task *task = AS_TASK(*obj);
-    if (task->gen) {
-      Object gen_obj = GENERATOR_VAL(task->gen);
-      objdecref(&gen_obj);
-    }
-    if (task->has_result) {
-      objdecref(&task->result);
-    }
-    if (task->has_send) {
-      objdecref(&task->send_value);
-    }
-    free(task);
-  } else if (IS_SLEEP(*obj)) {
-    free(AS_SLEEP(*obj));
+/* Refcounting alone never frees objects that refer to each other, so
+ * with make opt=cycle_gc, a container (a struct, an array, or a clo-
+ * sure, which are the only objects that can be part of a cycle made
+ * by a venom program) whose count drops but doesn't reach zero is
+ * buffered as the possible root of a garbage cycle. Every now and
+ * then, the VM has the collector find out which of the roots are
+ * only kept alive by references from within the containers they
+ * reach, by trial deletion (see cycle_collect() in object.c). */
+#define OBJ_BUFFERED 0x4
+#define OBJ_GRAY 0x8
+#define OBJ_WHITE 0x10
+#define OBJ_GARBAGE 0x20
+
+#define CONTAINER_TYPES \
+  ((1u << OBJ_STRUCT) | (1u << OBJ_ARRAY) | (1u << OBJ_CLOSURE))
+
+void cycle_buffer(ObjHeader *header);
+
+/* Whether enough has been allocated since the last collection, or
+ * the last one ran out of time before it was done, or the roots set
+ * aside are due to be traced. */
+bool cycle_due(void);
+
+/* Collects the buffered roots for up to CYCLE_BUDGET_NS, leaving the
+ * rest for the next time, or the roots set aside, without a budget. */
+void cycle_collect(void);
+
+/* Collects all of the buffered roots, for when the program is done. */
+void cycle_flush(void);
+
+/* Prints what the collectors of all the threads have done so far. */
+void print_cycle_report(void);
+#endif
+
+inline void objdecref_at(Object *obj, const char *file, int line)
+{
+  ObjHeader *header = obj_header(obj);
+  if (header) {
+    REFCHECK_LIVE(header, file, line);
   }
-#else
-  switch (obj->type) {
-    case OBJ_STRUCT: {
-      for (size_t i = 0; i < TABLE_MAX; i++) {
-        if (AS_STRUCT(*obj)->properties->indexes[i] != NULL) {
-          Bucket *bucket = AS_STRUCT(*obj)->properties->indexes[i];
-          list_free(bucket);
-        }
-      }
-
-      free(AS_STRUCT(*obj)->properties);
-      free(AS_STRUCT(*obj));
-      break;
-    }
-    case OBJ_STRING: {
-      free(AS_STRING(*obj)->value);
-      free(AS_STRING(*obj));
-      break;
-    }
-    case OBJ_ARRAY: {
-      dynarray_free(&AS_ARRAY(*obj)->elements);
-      free(AS_ARRAY(*obj));
-      break;
-    }
-    case OBJ_CLOSURE: {
-      for (int i = 0; i < AS_CLOSURE(*obj)->upvalue_count; i++) {
-        free(AS_CLOSURE(*obj)->upvalues[i]);
-      }
-      free(AS_CLOSURE(*obj)->upvalues);
-      free(AS_CLOSURE(*obj)->func);
-      free(AS_CLOSURE(*obj));
-      break;
-    }
-    case OBJ_GENERATOR: {
-      free(AS_GENERATOR(*obj));
-      break;
-    }
-    case OBJ_TASK: {
-      Task *task = AS_TASK(*obj);
-      if (task->gen) {
-        Object gen_obj = GENERATOR_VAL(task->gen);
-        objdecref(&gen_obj);
-      }
-      if (task->has_result) {
-        objdecref(&task->result);
-      }
-      if (task->has_send) {
-        objdecref(&task->send_value);
-      }
-      free(task);
-      break;
+  if (header && --header->refcount == 0) {
+#ifdef DEFERRED_RC
+    zct_add(header);
+#elif defined(CYCLE_GC)
+    /* The collector frees what it has buffered or is collecting. */
+    if (!(header->flags & (OBJ_BUFFERED | OBJ_GARBAGE))) {
+      obj_release(header);
     }
-    case OBJ_SLEEP: {
-      free(AS_SLEEP(*obj));
-      break;
-    }
-    default:
-      break;
+#else
+    obj_release(header);
+#endif
+  }
+#ifdef CYCLE_GC
+  else if (header && ((CONTAINER_TYPES >> header->type) & 1) &&
+           !(header->flags & (OBJ_BUFFERED | OBJ_GARBAGE))) {
+    cycle_buffer(header);
   }
 #endif
 }
@@ -788,24 +946,13 @@ inline void dealloc(Object *obj)
 #ifdef NAN_BOXING
 inline ObjectType type(const Object *obj)
 {
-  if (IS_ARRAY(*obj)) {
-    return OBJ_ARRAY;
+  ObjHeader *header = obj_header(obj);
+  if (header) {
+    return header->type;
   }
   if (IS_BOOL(*obj)) {
     return OBJ_BOOLEAN;
   }
-  if (IS_CLOSURE(*obj)) {
-    return OBJ_CLOSURE;
-  }
-  if (IS_GENERATOR(*obj)) {
-    return OBJ_GENERATOR;
-  }
-  if (IS_TASK(*obj)) {
-    return OBJ_TASK;
-  }
-  if (IS_SLEEP(*obj)) {
-    return OBJ_SLEEP;
-  }
   if (IS_NULL(*obj)) {
     return OBJ_NULL;
   }
@@ -815,12 +962,6 @@ inline ObjectType type(const Object *obj)
   if (IS_PTR(*obj)) {
     return OBJ_PTR;
   }
-  if (IS_STRING(*obj)) {
-    return OBJ_STRING;
-  }
-  if (IS_STRUCT(*obj)) {
-    return OBJ_STRUCT;
-  }
   assert(0);
 }
 #else
@@ -12,782 +12,943 @@
 #include "table.h"
 #include "util.h"
 
-static Expr constant_fold_expr(const Expr *target, bool *is_modified)
-{
-#define HANDLE_OPER(result_type, as_type, expr, oper, literal_kind)        \
-  do {                                                                     \
-    if (strcmp((expr)->op, #oper) == 0) {                                  \
-      result_type folded_const = lhs.as._##as_type oper rhs.as._##as_type; \
-      ExprLiteral folded_expr = {.kind = (literal_kind),                   \
-                                 .as._##result_type = folded_const};       \
-                                                                           \
-      *is_modified = true;                                                 \
-                                                                           \
-      free_expr((expr)->lhs);                                              \
-      free_expr((expr)->rhs);                                              \
-                                                                           \
-      free((expr)->lhs);                                                   \
-      free((expr)->rhs);                                                   \
-      free((expr)->op);                                                    \
-                                                                           \
-      return AS_EXPR_LITERAL(folded_expr);                                 \
-    }                                                                      \
-  } while (0)
-
-#define APPLY_NUMERIC(expr)                           \
-  HANDLE_OPER(double, double, (expr), +, LIT_NUMBER); \
-  HANDLE_OPER(double, double, (expr), -, LIT_NUMBER); \
-  HANDLE_OPER(double, double, (expr), *, LIT_NUMBER); \
-  HANDLE_OPER(double, double, (expr), /, LIT_NUMBER); \
-  HANDLE_OPER(bool, double, (expr), <, LIT_BOOLEAN);  \
-  HANDLE_OPER(bool, double, (expr), >, LIT_BOOLEAN);  \
-  HANDLE_OPER(bool, double, (expr), <=, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, double, (expr), >=, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, double, (expr), ==, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, double, (expr), !=, LIT_BOOLEAN);
-
-#define APPLY_BOOLEAN(expr)                         \
-  HANDLE_OPER(bool, bool, (expr), ==, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, bool, (expr), !=, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, bool, (expr), &&, LIT_BOOLEAN); \
-  HANDLE_OPER(bool, bool, (expr), ||, LIT_BOOLEAN);
-
-#define APPLY(expr)                                                    \
-  do {                                                                 \
-    if ((expr)->lhs->kind == EXPR_LITERAL &&                           \
-        (expr)->rhs->kind == EXPR_LITERAL) {                           \
-      ExprLiteral lhs = (expr)->lhs->as.expr_literal;                  \
-      ExprLiteral rhs = (expr)->rhs->as.expr_literal;                  \
-                                                                       \
-      if (lhs.kind == LIT_NUMBER && rhs.kind == LIT_NUMBER) {          \
-        APPLY_NUMERIC((expr));                                         \
-      } else if (lhs.kind == LIT_BOOLEAN && rhs.kind == LIT_BOOLEAN) { \
-        APPLY_BOOLEAN((expr));                                         \
-      }                                                                \
-    }                                                                  \
-  } while (0)
-
-  if (target->kind == EXPR_BINARY) {
-    const ExprBinary *binexpr = &target->as.expr_binary;
-
-    Expr new_lhs = constant_fold_expr(binexpr->lhs, is_modified);
-    Expr new_rhs = constant_fold_expr(binexpr->rhs, is_modified);
-
-    ExprBinary new_binexpr = {.lhs = ALLOC(new_lhs),
-                              .rhs = ALLOC(new_rhs),
-                              .op = own_string(binexpr->op)};
-
-    APPLY(&new_binexpr);
-
-    return AS_EXPR_BINARY(new_binexpr);
-  } else if (target->kind == EXPR_ASSIGN) {
-    const ExprAssign *assignexpr = &target->as.expr_assign;
-
-    Expr new_rhs = constant_fold_expr(assignexpr->rhs, is_modified);
-
-    Expr lhs = clone_expr(assignexpr->lhs);
-    ExprAssign new_assignexpr = {.op = own_string(assignexpr->op),
-                                 .lhs = ALLOC(lhs),
-                                 .rhs = ALLOC(new_rhs)};
-
-    return AS_EXPR_ASSIGN(new_assignexpr);
-  } else if (target->kind == EXPR_CALL) {
-    const ExprCall *callexpr = &target->as.expr_call;
-
-    DynArray_Expr arguments = {0};
-    for (size_t i = 0; i < callexpr->arguments.count; i++) {
-      Expr *arg = &callexpr->arguments.data[i];
-      Expr folded = constant_fold_expr(arg, is_modified);
-      dynarray_insert(&arguments, folded);
-    }
-
-    Expr callee_expr = clone_expr(callexpr->callee);
-    ExprCall new_call_expr = {.callee = ALLOC(callee_expr),
-                              .arguments = arguments};
-
-    return AS_EXPR_CALL(new_call_expr);
-  } else if (target->kind == EXPR_STRUCT) {
-    const ExprStruct *structexpr = &target->as.expr_struct;
-
-    DynArray_Expr initializers = {0};
-    for (size_t i = 0; i < structexpr->initializers.count; i++) {
-      Expr *initializer = &structexpr->initializers.data[i];
-      Expr folded = constant_fold_expr(initializer, is_modified);
-      dynarray_insert(&initializers, folded);
-    }
-
-    ExprStruct new_struct_expr = {.name = own_string(structexpr->name),
-                                  .initializers = initializers};
-
-    return AS_EXPR_STRUCT(new_struct_expr);
-  } else if (target->kind == EXPR_STRUCT_INITIALIZER) {
-    const ExprStructInitializer *expr_struct_initializer =
-        &target->as.expr_struct_initializer;
-
-    Expr folded =
-        constant_fold_expr(expr_struct_initializer->value, is_modified);
-    Expr cloned_siexpr = clone_expr(expr_struct_initializer->property);
-    ExprStructInitializer new_struct_init_expr = {
-        .value = ALLOC(folded), .property = ALLOC(cloned_siexpr)};
-
-    return AS_EXPR_STRUCT_INITIALIZER(new_struct_init_expr);
-  } else if (target->kind == EXPR_YIELD) {
-    Expr folded = constant_fold_expr(target->as.expr_yield.expr, is_modified);
-    ExprYield yield_expr = {.expr = ALLOC(folded),
-                            .span = target->as.expr_yield.span};
-    return AS_EXPR_YIELD(yield_expr);
-  } else if (target->kind == EXPR_AWAIT) {
-    Expr folded = constant_fold_expr(target->as.expr_await.expr, is_modified);
-    ExprAwait await_expr = {.expr = ALLOC(folded),
-                            .span = target->as.expr_await.span};
-    return AS_EXPR_AWAIT(await_expr);
-  } else if (target->kind == EXPR_LITERAL) {
-    ExprLiteral lit_expr = clone_literal(&target->as.expr_literal);
-    return AS_EXPR_LITERAL(lit_expr);
-  } else if (target->kind == EXPR_VARIABLE) {
-    Expr cloned_target = clone_expr(target);
-    return cloned_target;
-  } else {
-    print_expr(target, 0);
-    assert(0);
-  }
-#undef HANDLE_OPER
-#undef APPLY_NUMERIC
-#undef APPLY_BOOLEAN
-#undef APPLY
+/* The passes below rewrite the AST in place, and count every node they
+ * change, which is how optimize() tells which of the statements have to
+ * be looked at again. */
+
+typedef struct {
+  const char *name;
+  const Expr *value; /* what the name is a copy of, or NULL */
+  int source;        /* for a copy of a variable, the binding it was */
+  int prev;          /* the previous binding in the same bucket, or -1 */
+} Binding;
+
+typedef DynArray(Binding) DynArray_Binding;
+
+/* The names in scope while a pass walks the AST, hashed like the scopes
+ * of the compiler are (see Scope in compiler.h), so that the innermost
+ * binding of a name is found without a scan, and that leaving a scope is
+ * just popping back to where it began. Sets of names are kept in these,
+ * too (see names_add()). */
+typedef struct {
+  DynArray_Binding entries;
+  int *buckets;
+  size_t bucket_count;
+} Bindings;
+
+#define BINDINGS_MIN_BUCKETS 16
+
+static size_t bindings_bucket(const Bindings *b, const char *name)
+{
+  return hash(name, strlen(name)) & (b->bucket_count - 1);
 }
 
-static Stmt constant_fold_stmt(const Stmt *stmt, bool *is_modified)
+static void bindings_link(Bindings *b, size_t idx)
 {
-  switch (stmt->kind) {
-    case STMT_PRINT: {
-      const Expr *expr = &stmt->as.stmt_print.expr;
-
-      Expr folded = constant_fold_expr(expr, is_modified);
-
-      StmtPrint print_stmt = {.expr = folded};
-      return AS_STMT_PRINT(print_stmt);
-    }
-    case STMT_LET: {
-      const Expr *expr = &stmt->as.stmt_let.initializer;
-
-      Expr folded = constant_fold_expr(expr, is_modified);
-      char *name = own_string(stmt->as.stmt_let.name);
-
-      StmtLet let_stmt = {.initializer = folded, .name = name};
-      return AS_STMT_LET(let_stmt);
-    }
-    case STMT_FN: {
-      Stmt body = constant_fold_stmt(stmt->as.stmt_fn.body, is_modified);
-
-      DynArray_char_ptr cloned_params = {0};
-      for (size_t i = 0; i < stmt->as.stmt_fn.parameters.count; i++) {
-        dynarray_insert(&cloned_params,
-                        own_string(stmt->as.stmt_fn.parameters.data[i]));
-      }
-
-      StmtFn fn_stmt = {.body = ALLOC(body),
-                        .parameters = cloned_params,
-                        .name = own_string(stmt->as.stmt_fn.name),
-                        .is_async = stmt->as.stmt_fn.is_async};
-      return AS_STMT_FN(fn_stmt);
-    }
-    case STMT_IF: {
-      Expr condition =
-          constant_fold_expr(&stmt->as.stmt_if.condition, is_modified);
-      Stmt then_branch =
-          constant_fold_stmt(stmt->as.stmt_if.then_branch, is_modified);
-
-      Stmt *else_branch = NULL;
-      if (stmt->as.stmt_if.else_branch) {
-        Stmt s = constant_fold_stmt(stmt->as.stmt_if.else_branch, is_modified);
-        else_branch = ALLOC(s);
-      }
-
-      StmtIf if_stmt = {.condition = condition,
-                        .then_branch = ALLOC(then_branch),
-                        .else_branch = else_branch};
-      return AS_STMT_IF(if_stmt);
-    }
-    case STMT_BLOCK: {
-      DynArray_Stmt stmts = {0};
-      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
-        Stmt folded =
-            constant_fold_stmt(&stmt->as.stmt_block.stmts.data[i], is_modified);
-        dynarray_insert(&stmts, folded);
-      }
-
-      StmtBlock block_stmt = {.depth = stmt->as.stmt_block.depth,
-                              .stmts = stmts};
-      return AS_STMT_BLOCK(block_stmt);
-    }
-    case STMT_ASSERT: {
-      const Expr *expr = &stmt->as.stmt_assert.expr;
+  size_t bucket = bindings_bucket(b, b->entries.data[idx].name);
+  b->entries.data[idx].prev = b->buckets[bucket];
+  b->buckets[bucket] = idx;
+}
 
-      Expr folded = constant_fold_expr(expr, is_modified);
+static void bindings_grow(Bindings *b)
+{
+  b->bucket_count =
+      b->bucket_count ? 2 * b->bucket_count : BINDINGS_MIN_BUCKETS;
+  free(b->buckets);
+  b->buckets = malloc(sizeof(int) * b->bucket_count);
+  for (size_t i = 0; i < b->bucket_count; i++) {
+    b->buckets[i] = -1;
+  }
 
-      StmtAssert assert_stmt = {.expr = folded};
-      return AS_STMT_ASSERT(assert_stmt);
-    }
-    case STMT_DECORATOR: {
-      Stmt fn = constant_fold_stmt(stmt->as.stmt_decorator.fn, is_modified);
+  for (size_t idx = 0; idx < b->entries.count; idx++) {
+    bindings_link(b, idx);
+  }
+}
 
-      StmtDecorator deco_stmt = {
-          .fn = ALLOC(fn), .name = own_string(stmt->as.stmt_decorator.name)};
-      return AS_STMT_DECORATOR(deco_stmt);
-    }
-    case STMT_EXPR: {
-      const Expr *expr = &stmt->as.stmt_expr.expr;
+static void bindings_push(Bindings *b, const char *name, const Expr *value,
+                          int source)
+{
+  Binding binding = {.name = name, .value = value, .source = source};
+  dynarray_insert(&b->entries, binding);
 
-      StmtExpr expr_stmt = {.expr = constant_fold_expr(expr, is_modified)};
-      return AS_STMT_EXPR(expr_stmt);
-    }
-    case STMT_RETURN: {
-      const Expr *expr = &stmt->as.stmt_return.expr;
+  if (b->entries.count > b->bucket_count) {
+    bindings_grow(b);
+  } else {
+    bindings_link(b, b->entries.count - 1);
+  }
+}
 
-      StmtReturn ret_stmt = {.expr = constant_fold_expr(expr, is_modified)};
-      return AS_STMT_RETURN(ret_stmt);
-    }
-    case STMT_YIELD: {
-      const Expr *expr = &stmt->as.stmt_yield.expr;
+static void bindings_pop_to(Bindings *b, size_t mark)
+{
+  while (b->entries.count > mark) {
+    Binding binding = dynarray_pop(&b->entries);
+    b->buckets[bindings_bucket(b, binding.name)] = binding.prev;
+  }
+}
 
-      Expr folded = constant_fold_expr(expr, is_modified);
+/* Returns the index of the innermost binding of 'name', or -1. */
+static int bindings_find(const Bindings *b, const char *name)
+{
+  if (b->bucket_count == 0) {
+    return -1;
+  }
 
-      StmtYield yield_stmt = {.expr = folded};
-      return AS_STMT_YIELD(yield_stmt);
+  for (int idx = b->buckets[bindings_bucket(b, name)]; idx != -1;
+       idx = b->entries.data[idx].prev) {
+    if (strcmp(b->entries.data[idx].name, name) == 0) {
+      return idx;
     }
-    case STMT_WHILE: {
-      const Expr *expr = &stmt->as.stmt_while.condition;
-
-      Expr folded = constant_fold_expr(expr, is_modified);
+  }
+  return -1;
+}
 
-      char *label = own_string(stmt->as.stmt_while.label);
-      Stmt body = constant_fold_stmt(stmt->as.stmt_while.body, is_modified);
+static void bindings_free(Bindings *b)
+{
+  dynarray_free(&b->entries);
+  free(b->buckets);
+}
 
-      StmtWhile while_stmt = {
-          .condition = folded, .body = ALLOC(body), .label = label};
-      return AS_STMT_WHILE(while_stmt);
-    }
-    case STMT_FOR: {
-      const Expr *init = &stmt->as.stmt_for.initializer;
-      const Expr *cond = &stmt->as.stmt_for.condition;
-      const Expr *advancement = &stmt->as.stmt_for.advancement;
-
-      Expr folded_init = constant_fold_expr(init, is_modified);
-      Expr folded_cond = constant_fold_expr(cond, is_modified);
-      Expr folded_advancement = constant_fold_expr(advancement, is_modified);
-
-      Stmt folded_body =
-          constant_fold_stmt(stmt->as.stmt_for.body, is_modified);
-      StmtFor for_stmt = {.initializer = folded_init,
-                          .condition = folded_cond,
-                          .advancement = folded_advancement,
-                          .label = own_string(stmt->as.stmt_for.label),
-                          .body = ALLOC(folded_body)};
-      return AS_STMT_FOR(for_stmt);
-    }
-    case STMT_IMPL: {
-      DynArray_Stmt folded_methods = {0};
-      for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
-        Stmt folded = constant_fold_stmt(&stmt->as.stmt_impl.methods.data[i],
-                                         is_modified);
-        dynarray_insert(&folded_methods, folded);
-      }
+/* The sets own their copies of the names, since the nodes the names
+ * came from may be freed while the sets are still in use. */
+static void names_add(Bindings *names, const char *name)
+{
+  if (bindings_find(names, name) == -1) {
+    bindings_push(names, own_string(name), NULL, -1);
+  }
+}
 
-      StmtImpl impl_stmt = {.methods = folded_methods,
-                            .name = own_string(stmt->as.stmt_impl.name)};
-      return AS_STMT_IMPL(impl_stmt);
-    }
-    case STMT_BREAK: {
-      StmtBreak break_stmt = {.label = own_string(stmt->as.stmt_break.label)};
-      return AS_STMT_BREAK(break_stmt);
-    }
-    case STMT_CONTINUE: {
-      StmtContinue continue_stmt = {
-          .label = own_string(stmt->as.stmt_continue.label)};
-      return AS_STMT_CONTINUE(continue_stmt);
-    }
-    case STMT_USE: {
-      StmtUse use_stmt = {.path = own_string(stmt->as.stmt_use.path)};
-      return AS_STMT_USE(use_stmt);
-    }
-    case STMT_STRUCT: {
-      DynArray_char_ptr properties = {0};
-      for (size_t i = 0; i < stmt->as.stmt_struct.properties.count; i++) {
-        dynarray_insert(&properties, stmt->as.stmt_struct.properties.data[i]);
-      }
+static bool names_has(const Bindings *names, const char *name)
+{
+  return bindings_find(names, name) != -1;
+}
 
-      StmtStruct struct_stmt = {.name = own_string(stmt->as.stmt_struct.name),
-                                .properties = properties};
-      return AS_STMT_STRUCT(struct_stmt);
-    }
-    default:
-      print_stmt(stmt, 0, false);
-      assert(0);
+static void names_free(Bindings *names)
+{
+  for (size_t i = 0; i < names->entries.count; i++) {
+    free((char *) names->entries.data[i].name);
   }
+  bindings_free(names);
 }
 
-static Expr propagate_copies_expr(const Expr *expr, Table_Expr *copies,
-                                  bool *is_modified)
+typedef struct {
+  Bindings copies;   /* the variables in scope, and what they copy */
+  Bindings assigned; /* whatever is assigned, or has its address taken */
+  Bindings globals;  /* whatever is defined at the top level */
+  bool concurrent;   /* whether tasks may run, see defines_coroutine() */
+  size_t changes;
+  size_t temps; /* how many variables licm has made up */
+} Optimizer;
+
+typedef void (*ExprVisitor)(Expr *expr, void *ctx);
+
+/* Calls 'visit' on each of the expressions right inside 'expr'. The
+ * property a struct initializer names is not one of them. */
+static void each_subexpr(Expr *expr, ExprVisitor visit, void *ctx)
 {
   switch (expr->kind) {
-    case EXPR_LITERAL: {
-      return clone_expr(expr);
-    }
-    case EXPR_VARIABLE: {
-      char *name = expr->as.expr_variable.name;
-      Expr *resolved = table_get(copies, name);
-      if (resolved) {
-        *is_modified = true;
-        return clone_expr(resolved);
-      }
-
-      ExprVariable var_expr = {.name = own_string(name)};
-      return AS_EXPR_VARIABLE(var_expr);
+    case EXPR_UNARY: {
+      visit(expr->as.expr_unary.expr, ctx);
+      break;
     }
     case EXPR_BINARY: {
-      const ExprBinary *binexpr = &expr->as.expr_binary;
-
-      Expr new_lhs =
-          propagate_copies_expr(expr->as.expr_binary.lhs, copies, is_modified);
-      Expr new_rhs =
-          propagate_copies_expr(expr->as.expr_binary.rhs, copies, is_modified);
-
-      ExprBinary new_binexpr = {.lhs = ALLOC(new_lhs),
-                                .rhs = ALLOC(new_rhs),
-                                .op = own_string(expr->as.expr_binary.op)};
-      return AS_EXPR_BINARY(new_binexpr);
-    }
-    case EXPR_ASSIGN: {
-      Expr *lhs = expr->as.expr_assign.lhs;
-      if (lhs->kind == EXPR_VARIABLE) {
-        table_remove(copies, lhs->as.expr_variable.name);
-      }
-
-      Expr propagated_rhs =
-          propagate_copies_expr(expr->as.expr_assign.rhs, copies, is_modified);
-
-      Expr cloned_lhs = clone_expr(lhs);
-
-      ExprAssign assign_expr = {.lhs = ALLOC(cloned_lhs),
-                                .rhs = ALLOC(propagated_rhs),
-                                .op = own_string(expr->as.expr_assign.op)};
-      return AS_EXPR_ASSIGN(assign_expr);
+      visit(expr->as.expr_binary.lhs, ctx);
+      visit(expr->as.expr_binary.rhs, ctx);
+      break;
     }
-    case EXPR_ARRAY: {
-      DynArray_Expr elements = {0};
-      for (size_t i = 0; i < expr->as.expr_array.elements.count; i++) {
-        Expr propagated = propagate_copies_expr(
-            &expr->as.expr_array.elements.data[i], copies, is_modified);
-        dynarray_insert(&elements, propagated);
+    case EXPR_CALL: {
+      visit(expr->as.expr_call.callee, ctx);
+      for (size_t i = 0; i < expr->as.expr_call.arguments.count; i++) {
+        visit(&expr->as.expr_call.arguments.data[i], ctx);
       }
-
-      ExprArray array_expr = {.elements = elements};
-      return AS_EXPR_ARRAY(array_expr);
+      break;
     }
     case EXPR_GET: {
-      Expr propagated =
-          propagate_copies_expr(expr->as.expr_get.expr, copies, is_modified);
-
-      ExprGet get_expr = {
-          .op = own_string(expr->as.expr_get.op),
-          .property_name = own_string(expr->as.expr_get.property_name),
-          .expr = ALLOC(propagated)};
-      return AS_EXPR_GET(get_expr);
-    }
-    case EXPR_UNARY: {
-      Expr propagated =
-          propagate_copies_expr(expr->as.expr_unary.expr, copies, is_modified);
-
-      ExprUnary unary_expr = {.op = own_string(expr->as.expr_unary.op),
-                              .expr = ALLOC(propagated)};
-      return AS_EXPR_UNARY(unary_expr);
+      visit(expr->as.expr_get.expr, ctx);
+      break;
     }
-    case EXPR_SUBSCRIPT: {
-      Expr propagated = propagate_copies_expr(expr->as.expr_subscript.index,
-                                              copies, is_modified);
-
-      Expr cloned_expr = clone_expr(expr->as.expr_subscript.expr);
-
-      ExprSubscript subscript_expr = {.index = ALLOC(propagated),
-                                      .expr = ALLOC(cloned_expr)};
-      return AS_EXPR_SUBSCRIPT(subscript_expr);
+    case EXPR_ASSIGN: {
+      visit(expr->as.expr_assign.lhs, ctx);
+      visit(expr->as.expr_assign.rhs, ctx);
+      break;
     }
     case EXPR_STRUCT: {
-      DynArray_Expr initializers = {0};
       for (size_t i = 0; i < expr->as.expr_struct.initializers.count; i++) {
-        Expr propagated = propagate_copies_expr(
-            &expr->as.expr_struct.initializers.data[i], copies, is_modified);
-        dynarray_insert(&initializers, propagated);
+        visit(&expr->as.expr_struct.initializers.data[i], ctx);
       }
-
-      ExprStruct struct_expr = {.name = own_string(expr->as.expr_struct.name),
-                                .initializers = initializers};
-      return AS_EXPR_STRUCT(struct_expr);
+      break;
     }
     case EXPR_STRUCT_INITIALIZER: {
-      Expr propagated = propagate_copies_expr(
-          expr->as.expr_struct_initializer.value, copies, is_modified);
-      Expr cloned_expr = clone_expr(expr->as.expr_struct_initializer.property);
-
-      ExprStructInitializer struct_init_expr = {.value = ALLOC(propagated),
-                                                .property = ALLOC(cloned_expr)};
-      return AS_EXPR_STRUCT_INITIALIZER(struct_init_expr);
+      visit(expr->as.expr_struct_initializer.value, ctx);
+      break;
     }
-    case EXPR_CALL: {
-      DynArray_Expr propagated_args = {0};
-      for (size_t i = 0; i < expr->as.expr_call.arguments.count; i++) {
-        Expr propagated_arg = propagate_copies_expr(
-            &expr->as.expr_call.arguments.data[i], copies, is_modified);
-        dynarray_insert(&propagated_args, propagated_arg);
+    case EXPR_ARRAY: {
+      for (size_t i = 0; i < expr->as.expr_array.elements.count; i++) {
+        visit(&expr->as.expr_array.elements.data[i], ctx);
       }
-      Expr cloned_callee = clone_expr(expr->as.expr_call.callee);
-
-      ExprCall call_expr = {.callee = ALLOC(cloned_callee),
-                            .arguments = propagated_args};
-      return AS_EXPR_CALL(call_expr);
+      break;
+    }
+    case EXPR_SUBSCRIPT: {
+      visit(expr->as.expr_subscript.expr, ctx);
+      visit(expr->as.expr_subscript.index, ctx);
+      break;
+    }
+    case EXPR_CONDITIONAL: {
+      visit(expr->as.expr_conditional.condition, ctx);
+      visit(expr->as.expr_conditional.then_branch, ctx);
+      visit(expr->as.expr_conditional.else_branch, ctx);
+      break;
     }
     case EXPR_YIELD: {
-      Expr propagated =
-          propagate_copies_expr(expr->as.expr_yield.expr, copies, is_modified);
-      ExprYield yield_expr = {.expr = ALLOC(propagated),
-                              .span = expr->as.expr_yield.span};
-      return AS_EXPR_YIELD(yield_expr);
+      visit(expr->as.expr_yield.expr, ctx);
+      break;
     }
     case EXPR_AWAIT: {
-      Expr propagated =
-          propagate_copies_expr(expr->as.expr_await.expr, copies, is_modified);
-      ExprAwait await_expr = {.expr = ALLOC(propagated),
-                              .span = expr->as.expr_await.span};
-      return AS_EXPR_AWAIT(await_expr);
+      visit(expr->as.expr_await.expr, ctx);
+      break;
     }
     default:
-      print_expr(expr, 0);
-      assert(0);
+      break;
   }
 }
 
-static Stmt propagate_copies_stmt(const Stmt *stmt, Table_Expr *copies,
-                                  bool *is_modified)
+/* Calls 'visit' on each of the expressions of 'stmt', and of the state-
+ * ments inside it, the bodies of the functions it defines included. */
+static void each_expr(Stmt *stmt, ExprVisitor visit, void *ctx)
 {
   switch (stmt->kind) {
     case STMT_LET: {
-      const Expr *init = &stmt->as.stmt_let.initializer;
-
-      table_remove(copies, stmt->as.stmt_let.name);
-
-      if (init->kind == EXPR_VARIABLE || init->kind == EXPR_LITERAL) {
-        table_insert(copies, stmt->as.stmt_let.name, clone_expr(init));
-      }
-
-      Expr optimized = propagate_copies_expr(init, copies, is_modified);
-
-      StmtLet let_stmt = {.name = own_string(stmt->as.stmt_let.name),
-                          .initializer = optimized};
-      return AS_STMT_LET(let_stmt);
+      visit(&stmt->as.stmt_let.initializer, ctx);
+      break;
+    }
+    case STMT_EXPR: {
+      visit(&stmt->as.stmt_expr.expr, ctx);
+      break;
     }
     case STMT_PRINT: {
-      Expr expr =
-          propagate_copies_expr(&stmt->as.stmt_print.expr, copies, is_modified);
-
-      StmtPrint print_stmt = {.expr = expr};
-      return AS_STMT_PRINT(print_stmt);
+      visit(&stmt->as.stmt_print.expr, ctx);
+      break;
     }
-    case STMT_FN: {
-      Table_Expr cloned_copies = clone_table_expr(copies);
-      Stmt body = propagate_copies_stmt(stmt->as.stmt_fn.body, &cloned_copies,
-                                        is_modified);
-
-      DynArray_char_ptr cloned_params = {0};
-      for (size_t i = 0; i < stmt->as.stmt_fn.parameters.count; i++) {
-        dynarray_insert(&cloned_params,
-                        own_string(stmt->as.stmt_fn.parameters.data[i]));
-      }
-
-      free_table_expr(&cloned_copies);
-
-      StmtFn fn_stmt = {.body = ALLOC(body),
-                        .parameters = cloned_params,
-                        .name = own_string(stmt->as.stmt_fn.name),
-                        .is_async = stmt->as.stmt_fn.is_async};
-      return AS_STMT_FN(fn_stmt);
+    case STMT_RETURN: {
+      visit(&stmt->as.stmt_return.expr, ctx);
+      break;
+    }
+    case STMT_YIELD: {
+      visit(&stmt->as.stmt_yield.expr, ctx);
+      break;
+    }
+    case STMT_ASSERT: {
+      visit(&stmt->as.stmt_assert.expr, ctx);
+      break;
     }
     case STMT_BLOCK: {
-      Table_Expr cloned_copies = clone_table_expr(copies);
-      DynArray_Stmt optimized = {0};
       for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
-        Stmt s = propagate_copies_stmt(&stmt->as.stmt_block.stmts.data[i],
-                                       &cloned_copies, is_modified);
-
-        dynarray_insert(&optimized, s);
+        each_expr(&stmt->as.stmt_block.stmts.data[i], visit, ctx);
       }
-
-      free_table_expr(&cloned_copies);
-
-      StmtBlock block_stmt = {.stmts = optimized,
-                              .depth = stmt->as.stmt_block.depth};
-      return AS_STMT_BLOCK(block_stmt);
+      break;
     }
-    case STMT_ASSERT: {
-      Expr propagated = propagate_copies_expr(&stmt->as.stmt_assert.expr,
-                                              copies, is_modified);
-
-      StmtAssert assert_stmt = {.expr = propagated};
-      return AS_STMT_ASSERT(assert_stmt);
+    case STMT_IF: {
+      visit(&stmt->as.stmt_if.condition, ctx);
+      each_expr(stmt->as.stmt_if.then_branch, visit, ctx);
+      if (stmt->as.stmt_if.else_branch) {
+        each_expr(stmt->as.stmt_if.else_branch, visit, ctx);
+      }
+      break;
     }
-    case STMT_DECORATOR: {
-      Stmt propagated = propagate_copies_stmt(stmt->as.stmt_decorator.fn,
-                                              copies, is_modified);
-
-      StmtDecorator deco_stmt = {
-          .name = own_string(stmt->as.stmt_decorator.name),
-          .fn = ALLOC(propagated)};
-      return AS_STMT_DECORATOR(deco_stmt);
+    case STMT_WHILE: {
+      visit(&stmt->as.stmt_while.condition, ctx);
+      each_expr(stmt->as.stmt_while.body, visit, ctx);
+      break;
     }
-    case STMT_EXPR: {
-      Expr propagated =
-          propagate_copies_expr(&stmt->as.stmt_expr.expr, copies, is_modified);
-
-      StmtExpr expr_stmt = {.expr = propagated};
-      return AS_STMT_EXPR(expr_stmt);
+    case STMT_DO_WHILE: {
+      each_expr(stmt->as.stmt_do_while.body, visit, ctx);
+      visit(&stmt->as.stmt_do_while.condition, ctx);
+      break;
     }
     case STMT_FOR: {
-      Expr propagated_init = propagate_copies_expr(
-          &stmt->as.stmt_for.initializer, copies, is_modified);
-      Expr propagated_condition = propagate_copies_expr(
-          &stmt->as.stmt_for.condition, copies, is_modified);
-      Expr propagated_advancement = propagate_copies_expr(
-          &stmt->as.stmt_for.advancement, copies, is_modified);
-
-      Table_Expr cloned_copies = clone_table_expr(copies);
-
-      Stmt propagated_body = propagate_copies_stmt(stmt->as.stmt_for.body,
-                                                   &cloned_copies, is_modified);
-
-      free_table_expr(&cloned_copies);
-
-      StmtFor for_stmt = {.initializer = propagated_init,
-                          .condition = propagated_condition,
-                          .advancement = propagated_advancement,
-                          .body = ALLOC(propagated_body),
-                          .label = own_string(stmt->as.stmt_for.label)};
-      return AS_STMT_FOR(for_stmt);
+      visit(&stmt->as.stmt_for.initializer, ctx);
+      visit(&stmt->as.stmt_for.condition, ctx);
+      visit(&stmt->as.stmt_for.advancement, ctx);
+      each_expr(stmt->as.stmt_for.body, visit, ctx);
+      break;
     }
-    case STMT_WHILE: {
-      Expr expr = propagate_copies_expr(&stmt->as.stmt_while.condition, copies,
-                                        is_modified);
-      Table_Expr cloned_copies = clone_table_expr(copies);
-      Stmt body = propagate_copies_stmt(stmt->as.stmt_while.body,
-                                        &cloned_copies, is_modified);
-
-      free_table_expr(&cloned_copies);
-
-      StmtWhile while_stmt = {.body = ALLOC(body),
-                              .condition = expr,
-                              .label = own_string(stmt->as.stmt_while.label)};
-      return AS_STMT_WHILE(while_stmt);
+    case STMT_FN: {
+      each_expr(stmt->as.stmt_fn.body, visit, ctx);
+      break;
     }
-    case STMT_IF: {
-      Expr propagated_condition = propagate_copies_expr(
-          &stmt->as.stmt_if.condition, copies, is_modified);
-      Stmt propagated_then = propagate_copies_stmt(stmt->as.stmt_if.then_branch,
-                                                   copies, is_modified);
-
-      Stmt *propagated_else = NULL;
-      if (stmt->as.stmt_if.else_branch) {
-        Stmt s = propagate_copies_stmt(stmt->as.stmt_if.else_branch, copies,
-                                       is_modified);
-        propagated_else = ALLOC(s);
-      }
-
-      StmtIf if_stmt = {.condition = propagated_condition,
-                        .then_branch = ALLOC(propagated_then),
-                        .else_branch = propagated_else};
-      return AS_STMT_IF(if_stmt);
+    case STMT_DECORATOR: {
+      each_expr(stmt->as.stmt_decorator.fn, visit, ctx);
+      break;
     }
     case STMT_IMPL: {
-      DynArray_Stmt methods = {0};
       for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
-        Stmt propagated = propagate_copies_stmt(
-            &stmt->as.stmt_impl.methods.data[i], copies, is_modified);
-        dynarray_insert(&methods, propagated);
+        each_expr(&stmt->as.stmt_impl.methods.data[i], visit, ctx);
       }
-
-      StmtImpl impl_stmt = {.name = own_string(stmt->as.stmt_impl.name),
-                            .methods = methods};
-      return AS_STMT_IMPL(impl_stmt);
-    }
-    case STMT_RETURN: {
-      Expr propagated = propagate_copies_expr(&stmt->as.stmt_return.expr,
-                                              copies, is_modified);
-
-      StmtReturn ret_stmt = {.expr = propagated};
-      return AS_STMT_RETURN(ret_stmt);
-    }
-    case STMT_BREAK: {
-      StmtBreak break_stmt = {.label = own_string(stmt->as.stmt_break.label)};
-      return AS_STMT_BREAK(break_stmt);
+      break;
     }
-    case STMT_CONTINUE: {
-      StmtContinue continue_stmt = {
-          .label = own_string(stmt->as.stmt_continue.label)};
-      return AS_STMT_CONTINUE(continue_stmt);
+    case STMT_LABELED: {
+      each_expr(stmt->as.stmt_labeled.stmt, visit, ctx);
+      break;
     }
     default:
-      print_stmt(stmt, 0, false);
-      assert(0);
+      break;
   }
 }
 
-bool stmt_may_continue(Stmt *stmt)
+/* Adds what 'expr' assigns to, or takes the address of, to the set. */
+static void note_assigned(Expr *expr, void *ctx)
 {
-  switch (stmt->kind) {
-    case STMT_RETURN:
-    case STMT_CONTINUE:
-    case STMT_BREAK: {
-      return false;
-    }
-    case STMT_IF: {
-      bool then_condition = stmt_may_continue(stmt->as.stmt_if.then_branch);
-      bool else_condition =
-          stmt->as.stmt_if.else_branch
-              ? stmt_may_continue(stmt->as.stmt_if.else_branch)
-              : true;
-      return then_condition || else_condition;
+  Bindings *assigned = ctx;
+
+  const Expr *target = NULL;
+  if (expr->kind == EXPR_ASSIGN) {
+    target = expr->as.expr_assign.lhs;
+  } else if (expr->kind == EXPR_UNARY &&
+             strcmp(expr->as.expr_unary.op, "&") == 0) {
+    target = expr->as.expr_unary.expr;
+  }
+
+  if (target && target->kind == EXPR_VARIABLE) {
+    names_add(assigned, target->as.expr_variable.name);
+  }
+
+  each_subexpr(expr, note_assigned, ctx);
+}
+
+/* Adds every variable 'expr' refers to to the set. */
+static void note_variables(Expr *expr, void *ctx)
+{
+  if (expr->kind == EXPR_VARIABLE) {
+    names_add(ctx, expr->as.expr_variable.name);
+  }
+  each_subexpr(expr, note_variables, ctx);
+}
+
+/* Adds every variable 'expr' takes the address of to the set. */
+static void note_address_taken(Expr *expr, void *ctx)
+{
+  if (expr->kind == EXPR_UNARY && strcmp(expr->as.expr_unary.op, "&") == 0 &&
+      expr->as.expr_unary.expr->kind == EXPR_VARIABLE) {
+    names_add(ctx, expr->as.expr_unary.expr->as.expr_variable.name);
+  }
+  each_subexpr(expr, note_address_taken, ctx);
+}
+
+/* Whether evaluating 'expr' does nothing besides producing its value
+ * (or raising an error), so that it can go if the value isn't used. */
+static bool is_pure_expr(const Expr *expr)
+{
+  switch (expr->kind) {
+    case EXPR_LITERAL:
+    case EXPR_VARIABLE:
+      return true;
+    case EXPR_UNARY:
+      return is_pure_expr(expr->as.expr_unary.expr);
+    case EXPR_BINARY:
+      return is_pure_expr(expr->as.expr_binary.lhs) &&
+             is_pure_expr(expr->as.expr_binary.rhs);
+    case EXPR_GET:
+      return is_pure_expr(expr->as.expr_get.expr);
+    case EXPR_SUBSCRIPT:
+      return is_pure_expr(expr->as.expr_subscript.expr) &&
+             is_pure_expr(expr->as.expr_subscript.index);
+    case EXPR_CONDITIONAL:
+      return is_pure_expr(expr->as.expr_conditional.condition) &&
+             is_pure_expr(expr->as.expr_conditional.then_branch) &&
+             is_pure_expr(expr->as.expr_conditional.else_branch);
+    case EXPR_STRUCT_INITIALIZER:
+      return is_pure_expr(expr->as.expr_struct_initializer.value);
+    case EXPR_ARRAY: {
+      for (size_t i = 0; i < expr->as.expr_array.elements.count; i++) {
+        if (!is_pure_expr(&expr->as.expr_array.elements.data[i])) {
+          return false;
+        }
+      }
+      return true;
     }
-    case STMT_BLOCK: {
-      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
-        if (!stmt_may_continue(&stmt->as.stmt_block.stmts.data[i])) {
+    case EXPR_STRUCT: {
+      for (size_t i = 0; i < expr->as.expr_struct.initializers.count; i++) {
+        if (!is_pure_expr(&expr->as.expr_struct.initializers.data[i])) {
           return false;
         }
       }
       return true;
     }
     default:
-      return true;
+      return false;
   }
 }
 
-Stmt eliminate_unreachable_stmt(Stmt *stmt, bool *is_modified)
+/* Whether there's a label or a goto anywhere in 'stmt', in which case
+ * the order of the statements isn't all there is to the control flow. */
+static bool has_jumps(const Stmt *stmt)
 {
   switch (stmt->kind) {
-    case STMT_FN: {
-      Stmt body =
-          eliminate_unreachable_stmt(stmt->as.stmt_fn.body, is_modified);
-      char *name = own_string(stmt->as.stmt_fn.name);
-
-      DynArray_char_ptr params = {0};
-      for (size_t i = 0; i < stmt->as.stmt_fn.parameters.count; i++) {
-        dynarray_insert(&params,
-                        own_string(stmt->as.stmt_fn.parameters.data[i]));
-      }
-
-      StmtFn stmt_fn = {.name = name,
-                        .parameters = params,
-                        .body = ALLOC(body),
-                        .is_async = stmt->as.stmt_fn.is_async};
-      return AS_STMT_FN(stmt_fn);
-    }
+    case STMT_GOTO:
+    case STMT_LABELED:
+      return true;
     case STMT_BLOCK: {
-      DynArray_Stmt stmts = {0};
-      bool reachable = true;
       for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
-        if (!reachable) {
-          *is_modified = true;
-          continue;
-        }
-
-        Stmt optimized = eliminate_unreachable_stmt(
-            &stmt->as.stmt_block.stmts.data[i], is_modified);
-        if (optimized.kind == STMT_BLOCK &&
-            optimized.as.stmt_block.stmts.count == 0) {
-          continue;
-        }
-
-        if (!stmt_may_continue(&optimized)) {
-          reachable = false;
+        if (has_jumps(&stmt->as.stmt_block.stmts.data[i])) {
+          return true;
         }
-        dynarray_insert(&stmts, optimized);
       }
-
-      StmtBlock stmt_block = {.stmts = stmts,
-                              .depth = stmt->as.stmt_block.depth};
-      return AS_STMT_BLOCK(stmt_block);
+      return false;
     }
-    case STMT_IF: {
-      Expr *condition = &stmt->as.stmt_if.condition;
-      if (condition->kind == EXPR_LITERAL &&
-          condition->as.expr_literal.kind == LIT_BOOLEAN &&
-          !condition->as.expr_literal.as._bool) {
-        DynArray_Stmt stmts = {0};
-
-        /* FIXME */
-        StmtBlock empty = {.stmts = stmts, .depth = 0};
-        return AS_STMT_BLOCK(empty);
+    case STMT_IF:
+      return has_jumps(stmt->as.stmt_if.then_branch) ||
+             (stmt->as.stmt_if.else_branch &&
+              has_jumps(stmt->as.stmt_if.else_branch));
+    case STMT_WHILE:
+      return has_jumps(stmt->as.stmt_while.body);
+    case STMT_DO_WHILE:
+      return has_jumps(stmt->as.stmt_do_while.body);
+    case STMT_FOR:
+      return has_jumps(stmt->as.stmt_for.body);
+    case STMT_FN:
+      return has_jumps(stmt->as.stmt_fn.body);
+    case STMT_DECORATOR:
+      return has_jumps(stmt->as.stmt_decorator.fn);
+    case STMT_IMPL: {
+      for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
+        if (has_jumps(&stmt->as.stmt_impl.methods.data[i])) {
+          return true;
+        }
       }
+      return false;
+    }
+    default:
+      return false;
+  }
+}
+
+static Stmt empty_block(Span span)
+{
+  StmtBlock block = {.stmts = {0}, .depth = 0, .span = span};
+  return AS_STMT_BLOCK(block);
+}
 
-      Stmt then_branch =
-          eliminate_unreachable_stmt(stmt->as.stmt_if.then_branch, is_modified);
+static bool is_empty_block(const Stmt *stmt)
+{
+  return stmt->kind == STMT_BLOCK && stmt->as.stmt_block.stmts.count == 0;
+}
 
-      Stmt *else_branch = NULL;
-      if (stmt->as.stmt_if.else_branch) {
-        Stmt eliminated = eliminate_unreachable_stmt(
-            stmt->as.stmt_if.else_branch, is_modified);
-        else_branch = ALLOC(eliminated);
+/* Replaces 'expr' with 'replacement', which must not be part of it. */
+static void replace_expr(Optimizer *opt, Expr *expr, Expr replacement)
+{
+  free_expr(expr);
+  *expr = replacement;
+  opt->changes++;
+}
+
+static bool is_literal(const Expr *expr, LiteralKind kind)
+{
+  return expr->kind == EXPR_LITERAL && expr->as.expr_literal.kind == kind;
+}
+
+static Expr number_literal(double value, Span span)
+{
+  ExprLiteral literal = {.kind = LIT_NUMBER, .as._double = value, .span = span};
+  return AS_EXPR_LITERAL(literal);
+}
+
+static Expr bool_literal(bool value, Span span)
+{
+  ExprLiteral literal = {.kind = LIT_BOOLEAN, .as._bool = value, .span = span};
+  return AS_EXPR_LITERAL(literal);
+}
+
+/* Folds 'expr', a binary expression, if both of its operands are
+ * literals the operator can be applied to right away. */
+static void fold_binary(Optimizer *opt, Expr *expr)
+{
+  const ExprBinary *binary = &expr->as.expr_binary;
+  const char *op = binary->op;
+  Span span = expr->span;
+
+  if (is_literal(binary->lhs, LIT_NUMBER) &&
+      is_literal(binary->rhs, LIT_NUMBER)) {
+    double a = binary->lhs->as.expr_literal.as._double;
+    double b = binary->rhs->as.expr_literal.as._double;
+
+    if (strcmp(op, "+") == 0) {
+      replace_expr(opt, expr, number_literal(a + b, span));
+    } else if (strcmp(op, "-") == 0) {
+      replace_expr(opt, expr, number_literal(a - b, span));
+    } else if (strcmp(op, "*") == 0) {
+      replace_expr(opt, expr, number_literal(a * b, span));
+    } else if (strcmp(op, "/") == 0) {
+      replace_expr(opt, expr, number_literal(a / b, span));
+    } else if (strcmp(op, "<") == 0) {
+      replace_expr(opt, expr, bool_literal(a < b, span));
+    } else if (strcmp(op, ">") == 0) {
+      replace_expr(opt, expr, bool_literal(a > b, span));
+    } else if (strcmp(op, "<=") == 0) {
+      replace_expr(opt, expr, bool_literal(a <= b, span));
+    } else if (strcmp(op, ">=") == 0) {
+      replace_expr(opt, expr, bool_literal(a >= b, span));
+    } else if (strcmp(op, "==") == 0) {
+      replace_expr(opt, expr, bool_literal(a == b, span));
+    } else if (strcmp(op, "!=") == 0) {
+      replace_expr(opt, expr, bool_literal(a != b, span));
+    }
+  } else if (is_literal(binary->lhs, LIT_BOOLEAN) &&
+             is_literal(binary->rhs, LIT_BOOLEAN)) {
+    bool a = binary->lhs->as.expr_literal.as._bool;
+    bool b = binary->rhs->as.expr_literal.as._bool;
+
+    if (strcmp(op, "==") == 0) {
+      replace_expr(opt, expr, bool_literal(a == b, span));
+    } else if (strcmp(op, "!=") == 0) {
+      replace_expr(opt, expr, bool_literal(a != b, span));
+    } else if (strcmp(op, "&&") == 0) {
+      replace_expr(opt, expr, bool_literal(a && b, span));
+    } else if (strcmp(op, "||") == 0) {
+      replace_expr(opt, expr, bool_literal(a || b, span));
+    }
+  }
+}
+
+static void fold_unary(Optimizer *opt, Expr *expr)
+{
+  const ExprUnary *unary = &expr->as.expr_unary;
+
+  if (strcmp(unary->op, "!") == 0 && is_literal(unary->expr, LIT_BOOLEAN)) {
+    bool value = unary->expr->as.expr_literal.as._bool;
+    replace_expr(opt, expr, bool_literal(!value, expr->span));
+  } else if (strcmp(unary->op, "-") == 0 &&
+             is_literal(unary->expr, LIT_NUMBER)) {
+    double value = unary->expr->as.expr_literal.as._double;
+    replace_expr(opt, expr, number_literal(-value, expr->span));
+  }
+}
+
+/* Replaces 'expr', a conditional, with the branch it takes, if its
+ * condition is a literal. */
+static void fold_conditional(Optimizer *opt, Expr *expr)
+{
+  ExprConditional *conditional = &expr->as.expr_conditional;
+  if (!is_literal(conditional->condition, LIT_BOOLEAN)) {
+    return;
+  }
+
+  bool taken = conditional->condition->as.expr_literal.as._bool;
+  Expr *kept = taken ? conditional->then_branch : conditional->else_branch;
+  Expr *dropped = taken ? conditional->else_branch : conditional->then_branch;
+
+  Expr replacement = *kept;
+  free(kept);
+  free_expr(dropped);
+  free(dropped);
+  free_expr(conditional->condition);
+  free(conditional->condition);
+
+  *expr = replacement;
+  opt->changes++;
+}
+
+static void fold_expr(Expr *expr, void *ctx)
+{
+  Optimizer *opt = ctx;
+
+  each_subexpr(expr, fold_expr, opt);
+
+  switch (expr->kind) {
+    case EXPR_BINARY: {
+      fold_binary(opt, expr);
+      break;
+    }
+    case EXPR_UNARY: {
+      fold_unary(opt, expr);
+      break;
+    }
+    case EXPR_CONDITIONAL: {
+      fold_conditional(opt, expr);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+static void fold_stmt(Optimizer *opt, Stmt *stmt)
+{
+  each_expr(stmt, fold_expr, opt);
+}
+
+static bool is_assigned(const Optimizer *opt, const char *name)
+{
+  return names_has(&opt->assigned, name);
+}
+
+/* Brings 'name' into scope, as a copy of 'value' if it's never assigned
+ * after being initialized with it, and 'value' is a literal, or a var-
+ * iable that's never assigned either. */
+static void bind(Optimizer *opt, const char *name, const Expr *value)
+{
+  if (value && !is_assigned(opt, name)) {
+    if (value->kind == EXPR_LITERAL) {
+      bindings_push(&opt->copies, name, value, -1);
+      return;
+    }
+    if (value->kind == EXPR_VARIABLE &&
+        !is_assigned(opt, value->as.expr_variable.name)) {
+      int source = bindings_find(&opt->copies, value->as.expr_variable.name);
+      bindings_push(&opt->copies, name, value, source);
+      return;
+    }
+  }
+  bindings_push(&opt->copies, name, NULL, -1);
+}
+
+/* Replaces 'expr', a variable, with what it's a copy of, if anything. A
+ * copy of another variable is only used if that variable still means
+ * the same one here, i.e., it isn't shadowed. */
+static void propagate_variable(Optimizer *opt, Expr *expr)
+{
+  int idx = bindings_find(&opt->copies, expr->as.expr_variable.name);
+  if (idx == -1) {
+    return;
+  }
+
+  const Binding *binding = &opt->copies.entries.data[idx];
+  if (!binding->value) {
+    return;
+  }
+  if (binding->value->kind == EXPR_VARIABLE &&
+      bindings_find(&opt->copies, binding->value->as.expr_variable.name) !=
+          binding->source) {
+    return;
+  }
+
+  Expr copy = clone_expr(binding->value);
+  copy.span = expr->span;
+  replace_expr(opt, expr, copy);
+}
+
+static void propagate_expr(Expr *expr, void *ctx)
+{
+  Optimizer *opt = ctx;
+
+  switch (expr->kind) {
+    case EXPR_VARIABLE: {
+      propagate_variable(opt, expr);
+      break;
+    }
+    case EXPR_UNARY: {
+      if (strcmp(expr->as.expr_unary.op, "&") != 0) {
+        propagate_expr(expr->as.expr_unary.expr, opt);
+      }
+      break;
+    }
+    case EXPR_ASSIGN: {
+      /* What's assigned to stays as it is, save for the index. */
+      Expr *lhs = expr->as.expr_assign.lhs;
+      if (lhs->kind == EXPR_SUBSCRIPT) {
+        propagate_expr(lhs->as.expr_subscript.index, opt);
+      }
+      propagate_expr(expr->as.expr_assign.rhs, opt);
+      break;
+    }
+    case EXPR_CALL: {
+      for (size_t i = 0; i < expr->as.expr_call.arguments.count; i++) {
+        propagate_expr(&expr->as.expr_call.arguments.data[i], opt);
       }
+      break;
+    }
+    case EXPR_SUBSCRIPT: {
+      propagate_expr(expr->as.expr_subscript.index, opt);
+      break;
+    }
+    default: {
+      each_subexpr(expr, propagate_expr, opt);
+      break;
+    }
+  }
+}
+
+static void propagate_stmt(Optimizer *opt, Stmt *stmt);
+
+/* Propagates the copies into 'stmt', in a scope of its own. */
+static void propagate_scoped(Optimizer *opt, Stmt *stmt)
+{
+  size_t mark = opt->copies.entries.count;
+  propagate_stmt(opt, stmt);
+  bindings_pop_to(&opt->copies, mark);
+}
+
+static void propagate_fn(Optimizer *opt, StmtFn *fn)
+{
+  bind(opt, fn->name, NULL);
+
+  size_t mark = opt->copies.entries.count;
+  for (size_t i = 0; i < fn->parameters.count; i++) {
+    bind(opt, fn->parameters.data[i], NULL);
+  }
+  propagate_stmt(opt, fn->body);
+  bindings_pop_to(&opt->copies, mark);
+}
 
-      StmtIf stmt_if = {.condition = clone_expr(&stmt->as.stmt_if.condition),
-                        .then_branch = ALLOC(then_branch),
-                        .else_branch = else_branch};
-      return AS_STMT_IF(stmt_if);
+/* Propagates the copies in scope into 'stmt', and leaves whatever it
+ * defines in scope. */
+static void propagate_stmt(Optimizer *opt, Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_LET: {
+      propagate_expr(&stmt->as.stmt_let.initializer, opt);
+      bind(opt, stmt->as.stmt_let.name, &stmt->as.stmt_let.initializer);
+      break;
+    }
+    case STMT_FN: {
+      propagate_fn(opt, &stmt->as.stmt_fn);
+      break;
+    }
+    case STMT_DECORATOR: {
+      propagate_fn(opt, &stmt->as.stmt_decorator.fn->as.stmt_fn);
+      break;
+    }
+    case STMT_IMPL: {
+      size_t mark = opt->copies.entries.count;
+      for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
+        propagate_stmt(opt, &stmt->as.stmt_impl.methods.data[i]);
+      }
+      bindings_pop_to(&opt->copies, mark);
+      break;
+    }
+    case STMT_BLOCK: {
+      size_t mark = opt->copies.entries.count;
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        propagate_stmt(opt, &stmt->as.stmt_block.stmts.data[i]);
+      }
+      bindings_pop_to(&opt->copies, mark);
+      break;
+    }
+    case STMT_IF: {
+      propagate_expr(&stmt->as.stmt_if.condition, opt);
+      propagate_scoped(opt, stmt->as.stmt_if.then_branch);
+      if (stmt->as.stmt_if.else_branch) {
+        propagate_scoped(opt, stmt->as.stmt_if.else_branch);
+      }
+      break;
     }
     case STMT_WHILE: {
-      Expr *condition = &stmt->as.stmt_while.condition;
-      if (condition->kind == EXPR_LITERAL &&
-          condition->as.expr_literal.kind == LIT_BOOLEAN &&
-          !condition->as.expr_literal.as._bool) {
-        DynArray_Stmt stmts = {0};
-
-        /* FIXME */
-        StmtBlock empty = {.stmts = stmts, .depth = 0};
-        return AS_STMT_BLOCK(empty);
+      propagate_expr(&stmt->as.stmt_while.condition, opt);
+      propagate_scoped(opt, stmt->as.stmt_while.body);
+      break;
+    }
+    case STMT_DO_WHILE: {
+      propagate_scoped(opt, stmt->as.stmt_do_while.body);
+      propagate_expr(&stmt->as.stmt_do_while.condition, opt);
+      break;
+    }
+    case STMT_FOR: {
+      /* The initializer defines the variable of the loop. */
+      size_t mark = opt->copies.entries.count;
+      Expr *initializer = &stmt->as.stmt_for.initializer;
+      if (initializer->kind == EXPR_ASSIGN &&
+          initializer->as.expr_assign.lhs->kind == EXPR_VARIABLE) {
+        propagate_expr(initializer->as.expr_assign.rhs, opt);
+        bind(opt, initializer->as.expr_assign.lhs->as.expr_variable.name, NULL);
+      } else {
+        propagate_expr(initializer, opt);
       }
+      propagate_expr(&stmt->as.stmt_for.condition, opt);
+      propagate_expr(&stmt->as.stmt_for.advancement, opt);
+      propagate_scoped(opt, stmt->as.stmt_for.body);
+      bindings_pop_to(&opt->copies, mark);
+      break;
+    }
+    case STMT_LABELED: {
+      propagate_stmt(opt, stmt->as.stmt_labeled.stmt);
+      break;
+    }
+    case STMT_EXPR:
+    case STMT_PRINT:
+    case STMT_RETURN:
+    case STMT_YIELD:
+    case STMT_ASSERT: {
+      each_expr(stmt, propagate_expr, opt);
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-      Stmt body =
-          eliminate_unreachable_stmt(stmt->as.stmt_while.body, is_modified);
+/* Brings what the top-level 'stmt' defines into scope, the same way
+ * propagate_stmt() would, without looking at anything else. */
+static void bind_toplevel(Optimizer *opt, Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_LET: {
+      bind(opt, stmt->as.stmt_let.name, &stmt->as.stmt_let.initializer);
+      break;
+    }
+    case STMT_FN: {
+      bind(opt, stmt->as.stmt_fn.name, NULL);
+      break;
+    }
+    case STMT_DECORATOR: {
+      bind(opt, stmt->as.stmt_decorator.fn->as.stmt_fn.name, NULL);
+      break;
+    }
+    default:
+      break;
+  }
+}
 
-      StmtWhile stmt_while = {
-          .label = own_string(stmt->as.stmt_while.label),
-          .condition = clone_expr(&stmt->as.stmt_while.condition),
-          .body = ALLOC(body)};
-      return AS_STMT_WHILE(stmt_while);
+static bool stmt_may_continue(const Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_RETURN:
+    case STMT_CONTINUE:
+    case STMT_BREAK: {
+      return false;
     }
-    case STMT_FOR: {
-      Expr *condition = &stmt->as.stmt_for.condition;
-      if (condition->kind == EXPR_LITERAL &&
-          condition->as.expr_literal.kind == LIT_BOOLEAN &&
-          !condition->as.expr_literal.as._bool) {
-        DynArray_Stmt stmts = {0};
-
-        /* FIXME */
-        StmtBlock empty = {.stmts = stmts, .depth = 0};
-        return AS_STMT_BLOCK(empty);
+    case STMT_IF: {
+      bool then_condition = stmt_may_continue(stmt->as.stmt_if.then_branch);
+      bool else_condition =
+          stmt->as.stmt_if.else_branch
+              ? stmt_may_continue(stmt->as.stmt_if.else_branch)
+              : true;
+      return then_condition || else_condition;
+    }
+    case STMT_BLOCK: {
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        if (!stmt_may_continue(&stmt->as.stmt_block.stmts.data[i])) {
+          return false;
+        }
+      }
+      return true;
+    }
+    default:
+      return true;
+  }
+}
+
+static void eliminate_unreachable_stmt(Optimizer *opt, Stmt *stmt);
+
+/* Drops the statements that can't be reached, because of the ones be-
+ * fore them, unless a goto can get there, and the empty blocks. */
+static void eliminate_unreachable_block(Optimizer *opt, DynArray_Stmt *stmts)
+{
+  size_t kept = 0;
+  bool reachable = true;
+
+  for (size_t i = 0; i < stmts->count; i++) {
+    Stmt *stmt = &stmts->data[i];
+
+    if (!reachable && has_jumps(stmt)) {
+      reachable = true;
+    }
+    if (reachable) {
+      eliminate_unreachable_stmt(opt, stmt);
+    }
+
+    if (!reachable || is_empty_block(stmt)) {
+      free_stmt(stmt);
+      opt->changes++;
+      continue;
+    }
+
+    if (!stmt_may_continue(stmt)) {
+      reachable = false;
+    }
+    stmts->data[kept++] = *stmt;
+  }
+
+  stmts->count = kept;
+}
+
+static bool is_false(const Expr *expr)
+{
+  return is_literal(expr, LIT_BOOLEAN) && !expr->as.expr_literal.as._bool;
+}
+
+static void eliminate_unreachable_stmt(Optimizer *opt, Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_BLOCK: {
+      eliminate_unreachable_block(opt, &stmt->as.stmt_block.stmts);
+      break;
+    }
+    case STMT_FN: {
+      eliminate_unreachable_stmt(opt, stmt->as.stmt_fn.body);
+      break;
+    }
+    case STMT_DECORATOR: {
+      eliminate_unreachable_stmt(opt, stmt->as.stmt_decorator.fn);
+      break;
+    }
+    case STMT_IMPL: {
+      for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
+        eliminate_unreachable_stmt(opt, &stmt->as.stmt_impl.methods.data[i]);
+      }
+      break;
+    }
+    case STMT_IF: {
+      StmtIf *stmt_if = &stmt->as.stmt_if;
+      if (!is_literal(&stmt_if->condition, LIT_BOOLEAN) ||
+          has_jumps(stmt)) {
+        eliminate_unreachable_stmt(opt, stmt_if->then_branch);
+        if (stmt_if->else_branch) {
+          eliminate_unreachable_stmt(opt, stmt_if->else_branch);
+        }
+        break;
+      }
+
+      /* Only the branch that's taken is left. */
+      bool taken = stmt_if->condition.as.expr_literal.as._bool;
+      Stmt *kept = taken ? stmt_if->then_branch : stmt_if->else_branch;
+      Stmt *dropped = taken ? stmt_if->else_branch : stmt_if->then_branch;
+
+      Stmt replacement = kept ? *kept : empty_block(stmt->span);
+      free(kept);
+      if (dropped) {
+        free_stmt(dropped);
+        free(dropped);
       }
+      free_expr(&stmt_if->condition);
 
-      Stmt body =
-          eliminate_unreachable_stmt(stmt->as.stmt_for.body, is_modified);
+      *stmt = replacement;
+      opt->changes++;
 
-      StmtFor stmt_for = {
-          .label = own_string(stmt->as.stmt_for.label),
-          .initializer = clone_expr(&stmt->as.stmt_for.initializer),
-          .condition = clone_expr(&stmt->as.stmt_for.condition),
-          .advancement = clone_expr(&stmt->as.stmt_for.advancement),
-          .body = ALLOC(body),
-      };
-      return AS_STMT_FOR(stmt_for);
+      eliminate_unreachable_stmt(opt, stmt);
+      break;
+    }
+    case STMT_WHILE: {
+      if (is_false(&stmt->as.stmt_while.condition) && !has_jumps(stmt)) {
+        Span span = stmt->span;
+        free_stmt(stmt);
+        *stmt = empty_block(span);
+        opt->changes++;
+      } else {
+        eliminate_unreachable_stmt(opt, stmt->as.stmt_while.body);
+      }
+      break;
+    }
+    case STMT_DO_WHILE: {
+      eliminate_unreachable_stmt(opt, stmt->as.stmt_do_while.body);
+      break;
+    }
+    case STMT_FOR: {
+      /* The initializer runs even if the body never does, so the loop
+       * only goes if that doesn't do anything either. */
+      const Expr *initializer = &stmt->as.stmt_for.initializer;
+      if (is_false(&stmt->as.stmt_for.condition) && is_pure_expr(
+              initializer->kind == EXPR_ASSIGN ? initializer->as.expr_assign.rhs
+                                               : initializer) &&
+          !has_jumps(stmt)) {
+        Span span = stmt->span;
+        free_stmt(stmt);
+        *stmt = empty_block(span);
+        opt->changes++;
+      } else {
+        eliminate_unreachable_stmt(opt, stmt->as.stmt_for.body);
+      }
+      break;
     }
     default:
-      return clone_stmt(stmt);
+      break;
   }
 }
 
@@ -881,387 +1042,1149 @@ static bool is_equal_expr(const Expr *a, const Expr *b)
              is_equal_expr(a->as.expr_struct_initializer.value,
                            b->as.expr_struct_initializer.value);
     }
-    case EXPR_ARRAY: {
-      return is_equal_expr_list(&a->as.expr_array.elements,
-                                &b->as.expr_array.elements);
+    case EXPR_ARRAY: {
+      return is_equal_expr_list(&a->as.expr_array.elements,
+                                &b->as.expr_array.elements);
+    }
+    case EXPR_SUBSCRIPT: {
+      return is_equal_expr(a->as.expr_subscript.expr,
+                           b->as.expr_subscript.expr) &&
+             is_equal_expr(a->as.expr_subscript.index,
+                           b->as.expr_subscript.index);
+    }
+    case EXPR_CONDITIONAL: {
+      return is_equal_expr(a->as.expr_conditional.condition,
+                           b->as.expr_conditional.condition) &&
+             is_equal_expr(a->as.expr_conditional.then_branch,
+                           b->as.expr_conditional.then_branch) &&
+             is_equal_expr(a->as.expr_conditional.else_branch,
+                           b->as.expr_conditional.else_branch);
+    }
+    case EXPR_YIELD: {
+      return is_equal_expr(a->as.expr_yield.expr, b->as.expr_yield.expr);
+    }
+    case EXPR_AWAIT: {
+      return is_equal_expr(a->as.expr_await.expr, b->as.expr_await.expr);
+    }
+    default:
+      assert(0);
+  }
+
+  return false;
+}
+
+/* Returns the index of what's equal to 'item' in the set, or -1. */
+static int liveset_find(const DynArray_Expr *live, const Expr *item)
+{
+  for (size_t i = 0; i < live->count; i++) {
+    if (is_equal_expr(&live->data[i], item)) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static bool liveset_contains(const DynArray_Expr *live, const Expr *item)
+{
+  return liveset_find(live, item) != -1;
+}
+
+static void liveset_add(DynArray_Expr *live, const Expr *item)
+{
+  if (!liveset_contains(live, item)) {
+    dynarray_insert(live, clone_expr(item));
+  }
+}
+
+static void liveset_remove(DynArray_Expr *live, const Expr *expr)
+{
+  for (size_t i = 0; i < live->count; ++i) {
+    if (is_equal_expr(&live->data[i], expr)) {
+      free_expr(&live->data[i]);
+      live->data[i] = live->data[--live->count];
+      break;
+    }
+  }
+}
+
+static DynArray_Expr liveset_clone(const DynArray_Expr *live)
+{
+  DynArray_Expr clone = {0};
+  for (size_t i = 0; i < live->count; i++) {
+    dynarray_insert(&clone, clone_expr(&live->data[i]));
+  }
+  return clone;
+}
+
+static void liveset_free(DynArray_Expr *live)
+{
+  for (size_t i = 0; i < live->count; i++) {
+    free_expr(&live->data[i]);
+  }
+  dynarray_free(live);
+}
+
+static void collect_live_expr(DynArray_Expr *live, Expr *expr);
+
+static void collect_live_visit(Expr *expr, void *ctx)
+{
+  collect_live_expr(ctx, expr);
+}
+
+static void collect_live_expr(DynArray_Expr *live, Expr *expr)
+{
+  switch (expr->kind) {
+    case EXPR_VARIABLE: {
+      liveset_add(live, expr);
+      break;
+    }
+    case EXPR_ASSIGN: {
+      /* Unless it's just stored into, what's assigned to is read, too:
+       * the variable itself, if the assignment is compound, or else
+       * the object and the index that are stored into. */
+      Expr *lhs = expr->as.expr_assign.lhs;
+      if (lhs->kind != EXPR_VARIABLE ||
+          strcmp(expr->as.expr_assign.op, "=") != 0) {
+        collect_live_expr(live, lhs);
+      }
+      collect_live_expr(live, expr->as.expr_assign.rhs);
+      break;
+    }
+    case EXPR_STRUCT_INITIALIZER: {
+      collect_live_expr(live, expr->as.expr_struct_initializer.value);
+      break;
+    }
+    default: {
+      each_subexpr(expr, collect_live_visit, live);
+      break;
+    }
+  }
+}
+
+static void collect_live_stmt(DynArray_Expr *live, Stmt *stmt)
+{
+  each_expr(stmt, collect_live_visit, live);
+}
+
+/* The locals of a function. Only the stores to those of them that are
+ * neither captured by a function defined in it, nor pointed to, are
+ * ever dropped as dead, and only they are known not to change while a
+ * loop that doesn't assign them runs. */
+typedef struct FnLocals {
+  Bindings locals;
+  Bindings escaping;
+  bool keep_all; /* set if there's a goto in the way */
+  const struct FnLocals *enclosing;
+} FnLocals;
+
+/* Adds the variables the function body 'stmt' defines to the locals,
+ * but not those of the functions defined in it. */
+static void note_locals(FnLocals *ds, Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_LET: {
+      names_add(&ds->locals, stmt->as.stmt_let.name);
+      break;
+    }
+    case STMT_BLOCK: {
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        note_locals(ds, &stmt->as.stmt_block.stmts.data[i]);
+      }
+      break;
+    }
+    case STMT_IF: {
+      note_locals(ds, stmt->as.stmt_if.then_branch);
+      if (stmt->as.stmt_if.else_branch) {
+        note_locals(ds, stmt->as.stmt_if.else_branch);
+      }
+      break;
+    }
+    case STMT_WHILE: {
+      note_locals(ds, stmt->as.stmt_while.body);
+      break;
+    }
+    case STMT_DO_WHILE: {
+      note_locals(ds, stmt->as.stmt_do_while.body);
+      break;
+    }
+    case STMT_FOR: {
+      const Expr *initializer = &stmt->as.stmt_for.initializer;
+      if (initializer->kind == EXPR_ASSIGN &&
+          initializer->as.expr_assign.lhs->kind == EXPR_VARIABLE) {
+        names_add(&ds->locals,
+                  initializer->as.expr_assign.lhs->as.expr_variable.name);
+      }
+      note_locals(ds, stmt->as.stmt_for.body);
+      break;
+    }
+    case STMT_FN:
+    case STMT_DECORATOR:
+    case STMT_IMPL: {
+      /* Whatever the function refers to may be read once it's called. */
+      each_expr(stmt, note_variables, &ds->escaping);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* Whether 'name' is a local that nothing but the function itself can
+ * get at, so that a store to it can go if nothing reads it afterwards.
+ * It isn't if the name is a global, or if an enclosing function has a
+ * local of the same name, which it may refer to, if it comes before the
+ * definition of the local. */
+static bool is_private_local(const Optimizer *opt, const FnLocals *ds,
+                             const char *name)
+{
+  if (ds->keep_all || !names_has(&ds->locals, name) ||
+      names_has(&ds->escaping, name) || names_has(&opt->globals, name)) {
+    return false;
+  }
+  for (const FnLocals *outer = ds->enclosing; outer;
+       outer = outer->enclosing) {
+    if (names_has(&outer->locals, name)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void eliminate_dead_store_fn(Optimizer *opt, const FnLocals *enclosing,
+                                    StmtFn *fn);
+
+static void eliminate_dead_store_stmt(Optimizer *opt, const FnLocals *ds,
+                                      Stmt *stmt, DynArray_Expr *live);
+
+/* Goes backwards through 'stmts', with 'live' being what's read after
+ * them, which it leaves being what's read from before them on. */
+static void eliminate_dead_store_block(Optimizer *opt, const FnLocals *ds,
+                                       DynArray_Stmt *stmts,
+                                       DynArray_Expr *live)
+{
+  for (size_t i = stmts->count; i-- > 0;) {
+    Stmt *stmt = &stmts->data[i];
+    Expr *expr = &stmt->as.stmt_expr.expr;
+
+    if (stmt->kind != STMT_EXPR || expr->kind != EXPR_ASSIGN ||
+        expr->as.expr_assign.lhs->kind != EXPR_VARIABLE ||
+        !is_private_local(opt, ds,
+                          expr->as.expr_assign.lhs->as.expr_variable.name) ||
+        liveset_contains(live, expr->as.expr_assign.lhs)) {
+      eliminate_dead_store_stmt(opt, ds, stmt, live);
+      continue;
+    }
+
+    /* The store is dead, but what's stored may still have to be
+     * evaluated, for what else it does. */
+    ExprAssign *assign = &expr->as.expr_assign;
+    if (is_pure_expr(assign->rhs)) {
+      free_stmt(stmt);
+      memmove(stmt, stmt + 1, sizeof(Stmt) * (stmts->count - i - 1));
+      stmts->count--;
+    } else {
+      Expr rhs = *assign->rhs;
+      free(assign->rhs);
+      free_expr(assign->lhs);
+      free(assign->lhs);
+      free(assign->op);
+      *expr = rhs;
+      collect_live_expr(live, expr);
+    }
+    opt->changes++;
+  }
+}
+
+static void eliminate_dead_store_stmt(Optimizer *opt, const FnLocals *ds,
+                                      Stmt *stmt, DynArray_Expr *live)
+{
+  switch (stmt->kind) {
+    case STMT_EXPR: {
+      Expr *expr = &stmt->as.stmt_expr.expr;
+      if (expr->kind == EXPR_ASSIGN &&
+          expr->as.expr_assign.lhs->kind == EXPR_VARIABLE &&
+          strcmp(expr->as.expr_assign.op, "=") == 0) {
+        liveset_remove(live, expr->as.expr_assign.lhs);
+      }
+      collect_live_expr(live, expr);
+      break;
+    }
+    case STMT_BLOCK: {
+      eliminate_dead_store_block(opt, ds, &stmt->as.stmt_block.stmts, live);
+      break;
+    }
+    case STMT_IF: {
+      DynArray_Expr otherwise = liveset_clone(live);
+      eliminate_dead_store_stmt(opt, ds, stmt->as.stmt_if.then_branch, live);
+      if (stmt->as.stmt_if.else_branch) {
+        eliminate_dead_store_stmt(opt, ds, stmt->as.stmt_if.else_branch,
+                                  &otherwise);
+      }
+      for (size_t i = 0; i < otherwise.count; i++) {
+        liveset_add(live, &otherwise.data[i]);
+      }
+      liveset_free(&otherwise);
+      collect_live_expr(live, &stmt->as.stmt_if.condition);
+      break;
+    }
+    case STMT_WHILE:
+    case STMT_DO_WHILE:
+    case STMT_FOR: {
+      /* Whatever the loop reads is live all the way through it, since
+       * the next iteration may read it. */
+      collect_live_stmt(live, stmt);
+      DynArray_Expr inside = liveset_clone(live);
+      Stmt *body = stmt->kind == STMT_WHILE      ? stmt->as.stmt_while.body
+                   : stmt->kind == STMT_DO_WHILE ? stmt->as.stmt_do_while.body
+                                                 : stmt->as.stmt_for.body;
+      eliminate_dead_store_stmt(opt, ds, body, &inside);
+      liveset_free(&inside);
+      break;
+    }
+    case STMT_FN: {
+      eliminate_dead_store_fn(opt, ds, &stmt->as.stmt_fn);
+      break;
+    }
+    case STMT_DECORATOR: {
+      eliminate_dead_store_fn(opt, ds, &stmt->as.stmt_decorator.fn->as.stmt_fn);
+      break;
+    }
+    case STMT_IMPL: {
+      for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
+        eliminate_dead_store_stmt(opt, ds, &stmt->as.stmt_impl.methods.data[i],
+                                  live);
+      }
+      break;
+    }
+    default: {
+      collect_live_stmt(live, stmt);
+      break;
+    }
+  }
+}
+
+static FnLocals fn_locals(const FnLocals *enclosing, StmtFn *fn)
+{
+  FnLocals ds = {.enclosing = enclosing};
+
+  for (size_t i = 0; i < fn->parameters.count; i++) {
+    names_add(&ds.locals, fn->parameters.data[i]);
+  }
+  note_locals(&ds, fn->body);
+  each_expr(fn->body, note_address_taken, &ds.escaping);
+
+  /* With no telling what runs after what, none of them counts as pri-
+   * vate, but the functions defined in here may still have their own. */
+  ds.keep_all = has_jumps(fn->body);
+
+  return ds;
+}
+
+static void free_fn_locals(FnLocals *ds)
+{
+  names_free(&ds->locals);
+  names_free(&ds->escaping);
+}
+
+static void eliminate_dead_store_fn(Optimizer *opt, const FnLocals *enclosing,
+                                    StmtFn *fn)
+{
+  FnLocals ds = fn_locals(enclosing, fn);
+
+  DynArray_Expr live = {0};
+  eliminate_dead_store_stmt(opt, &ds, fn->body, &live);
+  liveset_free(&live);
+
+  free_fn_locals(&ds);
+}
+
+/* Eliminates the dead stores in the functions the top-level 'stmt' de-
+ * fines. The stores at the top level are to globals, which any of the
+ * functions may read, so they're all kept. */
+static void eliminate_dead_stores(Optimizer *opt, Stmt *stmt)
+{
+  DynArray_Expr live = {0};
+  FnLocals ds = {0};
+  eliminate_dead_store_stmt(opt, &ds, stmt, &live);
+  liveset_free(&live);
+}
+
+/* What a loop does besides computing values, which is what tells which
+ * of the expressions in it are invariant. */
+typedef struct {
+  Bindings written;     /* what it assigns, defines, or points to */
+  bool stores_property; /* into a struct, or through a pointer */
+  bool opaque;          /* whether it calls, yields, or defines anything */
+} LoopEffects;
+
+static bool is_len_call(const Expr *expr)
+{
+  if (expr->kind != EXPR_CALL) {
+    return false;
+  }
+  const ExprCall *call = &expr->as.expr_call;
+  return call->callee->kind == EXPR_VARIABLE &&
+         strcmp(call->callee->as.expr_variable.name, "len") == 0 &&
+         call->arguments.count == 1;
+}
+
+static void note_loop_expr(Expr *expr, void *ctx)
+{
+  LoopEffects *effects = ctx;
+
+  switch (expr->kind) {
+    case EXPR_CALL: {
+      /* len() is compiled to an instruction, rather than called. */
+      effects->opaque |= !is_len_call(expr);
+      break;
+    }
+    case EXPR_YIELD:
+    case EXPR_AWAIT: {
+      effects->opaque = true;
+      break;
+    }
+    case EXPR_ASSIGN: {
+      ExprKind kind = expr->as.expr_assign.lhs->kind;
+      effects->stores_property |=
+          kind != EXPR_VARIABLE && kind != EXPR_SUBSCRIPT;
+      break;
+    }
+    default:
+      break;
+  }
+
+  each_subexpr(expr, note_loop_expr, ctx);
+}
+
+static void note_loop_stmt(LoopEffects *effects, Stmt *stmt)
+{
+  switch (stmt->kind) {
+    case STMT_LET: {
+      names_add(&effects->written, stmt->as.stmt_let.name);
+      break;
+    }
+    case STMT_BLOCK: {
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        note_loop_stmt(effects, &stmt->as.stmt_block.stmts.data[i]);
+      }
+      break;
+    }
+    case STMT_IF: {
+      note_loop_stmt(effects, stmt->as.stmt_if.then_branch);
+      if (stmt->as.stmt_if.else_branch) {
+        note_loop_stmt(effects, stmt->as.stmt_if.else_branch);
+      }
+      break;
+    }
+    case STMT_WHILE: {
+      note_loop_stmt(effects, stmt->as.stmt_while.body);
+      break;
+    }
+    case STMT_DO_WHILE: {
+      note_loop_stmt(effects, stmt->as.stmt_do_while.body);
+      break;
+    }
+    case STMT_FOR: {
+      note_loop_stmt(effects, stmt->as.stmt_for.body);
+      break;
+    }
+    case STMT_FN:
+    case STMT_DECORATOR:
+    case STMT_IMPL:
+    case STMT_STRUCT:
+    case STMT_USE:
+    case STMT_YIELD:
+    case STMT_GOTO:
+    case STMT_LABELED: {
+      effects->opaque = true;
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/* The loop invariants are hoisted out of, and what's been hoisted so
+ * far: each of the expressions goes into a variable of its own, which
+ * the loop then refers to instead. */
+typedef struct {
+  Optimizer *opt;
+  const FnLocals *scope;
+  LoopEffects effects;
+  DynArray_Expr hoisted;
+  DynArray_char_ptr temps;
+  size_t guarded; /* the first one that's only computed if the loop runs */
+  size_t visible; /* how many of them replace_hoisted() may refer to */
+} Licm;
+
+/* Whether the variable 'name' holds the same value all through the
+ * loop: it isn't assigned in it, and it's either never assigned at all,
+ * or a local that nothing else can get at, not even a task that runs
+ * while the loop is preempted. If tasks may run, a global never is,
+ * since any loop may be preempted at the end of an iteration. */
+static bool is_invariant_var(const Licm *licm, const char *name)
+{
+  if (licm->opt->concurrent && names_has(&licm->opt->globals, name)) {
+    return false;
+  }
+  return !names_has(&licm->effects.written, name) &&
+         (!is_assigned(licm->opt, name) ||
+          is_private_local(licm->opt, licm->scope, name));
+}
+
+/* Whether 'expr' evaluates to the same value all through the loop. Its
+ * properties are read as they were when the loop started, as long as
+ * the loop itself doesn't store into any, and no task can while the
+ * loop is preempted. */
+static bool is_invariant(const Licm *licm, const Expr *expr)
+{
+  switch (expr->kind) {
+    case EXPR_LITERAL:
+      return true;
+    case EXPR_VARIABLE:
+      return is_invariant_var(licm, expr->as.expr_variable.name);
+    case EXPR_UNARY: {
+      const char *op = expr->as.expr_unary.op;
+      return strcmp(op, "&") != 0 && strcmp(op, "*") != 0 &&
+             is_invariant(licm, expr->as.expr_unary.expr);
+    }
+    case EXPR_BINARY:
+      return is_invariant(licm, expr->as.expr_binary.lhs) &&
+             is_invariant(licm, expr->as.expr_binary.rhs);
+    case EXPR_GET:
+      return !licm->opt->concurrent && !licm->effects.stores_property &&
+             strcmp(expr->as.expr_get.op, ".") == 0 &&
+             is_invariant(licm, expr->as.expr_get.expr);
+    case EXPR_CALL:
+      /* Neither an array, nor a string ever changes its length. */
+      return is_len_call(expr) &&
+             is_invariant(licm, &expr->as.expr_call.arguments.data[0]);
+    case EXPR_CONDITIONAL:
+      return is_invariant(licm, expr->as.expr_conditional.condition) &&
+             is_invariant(licm, expr->as.expr_conditional.then_branch) &&
+             is_invariant(licm, expr->as.expr_conditional.else_branch);
+    default:
+      return false;
+  }
+}
+
+static Expr variable(const char *name, Span span)
+{
+  ExprVariable var = {.name = own_string(name), .span = span};
+  return AS_EXPR_VARIABLE(var);
+}
+
+/* Moves 'expr' out of the loop, unless something equal to it already
+ * is, and has the loop refer to the variable it goes into instead. */
+static void hoist(Licm *licm, Expr *expr)
+{
+  Span span = expr->span;
+  int idx = liveset_find(&licm->hoisted, expr);
+
+  if (idx == -1) {
+    char name[32];
+    snprintf(name, sizeof(name), "$licm%zu", licm->opt->temps++);
+    idx = licm->hoisted.count;
+    dynarray_insert(&licm->hoisted, *expr);
+    dynarray_insert(&licm->temps, own_string(name));
+  } else {
+    free_expr(expr);
+  }
+
+  *expr = variable(licm->temps.data[idx], span);
+  licm->opt->changes++;
+}
+
+/* Goes through 'expr' in the order it's evaluated in, and hoists what's
+ * invariant, for as long as nothing evaluated before it may fail, so
+ * that computing it earlier fails just like the loop would have. Returns
+ * whether nothing in 'expr' may fail. */
+static bool hoist_leading_expr(Licm *licm, Expr *expr);
+
+/* The same as hoist_leading_expr(), but for what's inside 'expr' only,
+ * which is all there is to hoist if its value is thrown away. */
+static bool hoist_leading_subexprs(Licm *licm, Expr *expr)
+{
+  switch (expr->kind) {
+    case EXPR_LITERAL:
+    case EXPR_VARIABLE:
+      return true;
+    case EXPR_UNARY: {
+      if (strcmp(expr->as.expr_unary.op, "&") != 0) {
+        hoist_leading_expr(licm, expr->as.expr_unary.expr);
+      }
+      return false;
+    }
+    case EXPR_BINARY: {
+      /* The rhs of '&&' and '||' may not be evaluated at all. */
+      const char *op = expr->as.expr_binary.op;
+      if (hoist_leading_expr(licm, expr->as.expr_binary.lhs) &&
+          strcmp(op, "&&") != 0 && strcmp(op, "||") != 0) {
+        hoist_leading_expr(licm, expr->as.expr_binary.rhs);
+      }
+      return false;
+    }
+    case EXPR_GET: {
+      hoist_leading_expr(licm, expr->as.expr_get.expr);
+      return false;
     }
     case EXPR_SUBSCRIPT: {
-      return is_equal_expr(a->as.expr_subscript.expr,
-                           b->as.expr_subscript.expr) &&
-             is_equal_expr(a->as.expr_subscript.index,
-                           b->as.expr_subscript.index);
+      if (hoist_leading_expr(licm, expr->as.expr_subscript.expr)) {
+        hoist_leading_expr(licm, expr->as.expr_subscript.index);
+      }
+      return false;
     }
-    case EXPR_YIELD: {
-      return is_equal_expr(a->as.expr_yield.expr, b->as.expr_yield.expr);
+    case EXPR_CALL: {
+      for (size_t i = 0; i < expr->as.expr_call.arguments.count; i++) {
+        if (!hoist_leading_expr(licm, &expr->as.expr_call.arguments.data[i])) {
+          break;
+        }
+      }
+      return false;
     }
-    case EXPR_AWAIT: {
-      return is_equal_expr(a->as.expr_await.expr, b->as.expr_await.expr);
+    case EXPR_CONDITIONAL: {
+      hoist_leading_expr(licm, expr->as.expr_conditional.condition);
+      return false;
+    }
+    case EXPR_ARRAY: {
+      for (size_t i = 0; i < expr->as.expr_array.elements.count; i++) {
+        if (!hoist_leading_expr(licm, &expr->as.expr_array.elements.data[i])) {
+          return false;
+        }
+      }
+      return true;
     }
     default:
-      assert(0);
+      return false;
   }
+}
 
-  return false;
+static bool hoist_leading_expr(Licm *licm, Expr *expr)
+{
+  if (expr->kind != EXPR_LITERAL && expr->kind != EXPR_VARIABLE &&
+      is_invariant(licm, expr)) {
+    hoist(licm, expr);
+    return true;
+  }
+  return hoist_leading_subexprs(licm, expr);
 }
 
-static bool liveset_contains(DynArray_Expr *live, Expr *item)
+/* The same as hoist_leading_expr(), for the statements the body of the
+ * loop starts with, for as long as they only store into variables. */
+static bool hoist_leading_stmt(Licm *licm, Stmt *stmt)
 {
-  for (size_t i = 0; i < live->count; i++) {
-    if (is_equal_expr(&live->data[i], item)) {
+  switch (stmt->kind) {
+    case STMT_LET:
+      return hoist_leading_expr(licm, &stmt->as.stmt_let.initializer);
+    case STMT_EXPR: {
+      Expr *expr = &stmt->as.stmt_expr.expr;
+      if (expr->kind == EXPR_ASSIGN &&
+          expr->as.expr_assign.lhs->kind == EXPR_VARIABLE) {
+        return hoist_leading_expr(licm, expr->as.expr_assign.rhs) &&
+               strcmp(expr->as.expr_assign.op, "=") == 0;
+      }
+      hoist_leading_subexprs(licm, expr);
+      return false;
+    }
+    case STMT_PRINT: {
+      hoist_leading_expr(licm, &stmt->as.stmt_print.expr);
+      return false;
+    }
+    case STMT_IF: {
+      hoist_leading_expr(licm, &stmt->as.stmt_if.condition);
+      return false;
+    }
+    case STMT_BLOCK: {
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        if (!hoist_leading_stmt(licm, &stmt->as.stmt_block.stmts.data[i])) {
+          return false;
+        }
+      }
       return true;
     }
+    default:
+      return false;
   }
-  return false;
 }
 
-static void collect_live_expr(DynArray_Expr *live, Expr *expr)
+/* Has whatever in 'expr' is equal to one of the first 'visible' ex-
+ * pressions hoisted refer to its variable instead. */
+static void replace_hoisted(Expr *expr, void *ctx)
 {
+  Licm *licm = ctx;
+
+  int idx = liveset_find(&licm->hoisted, expr);
+  if (idx != -1 && (size_t) idx < licm->visible) {
+    replace_expr(licm->opt, expr,
+                 variable(licm->temps.data[idx], expr->span));
+    return;
+  }
+
   switch (expr->kind) {
-    case EXPR_VARIABLE: {
-      dynarray_insert(live, clone_expr(expr));
-      break;
-    }
-    case EXPR_BINARY: {
-      collect_live_expr(live, expr->as.expr_binary.lhs);
-      collect_live_expr(live, expr->as.expr_binary.rhs);
-      break;
-    }
     case EXPR_UNARY: {
-      collect_live_expr(live, expr->as.expr_unary.expr);
-      break;
-    }
-    case EXPR_ARRAY: {
-      for (size_t i = 0; i < expr->as.expr_array.elements.count; i++) {
-        collect_live_expr(live, &expr->as.expr_array.elements.data[i]);
+      if (strcmp(expr->as.expr_unary.op, "&") != 0) {
+        replace_hoisted(expr->as.expr_unary.expr, ctx);
       }
       break;
     }
     case EXPR_ASSIGN: {
-      collect_live_expr(live, expr->as.expr_assign.rhs);
-      break;
-    }
-    case EXPR_GET: {
-      collect_live_expr(live, expr->as.expr_get.expr);
-      break;
-    }
-    case EXPR_STRUCT: {
-      for (size_t i = 0; i < expr->as.expr_struct.initializers.count; i++) {
-        collect_live_expr(live, &expr->as.expr_struct.initializers.data[i]);
+      Expr *lhs = expr->as.expr_assign.lhs;
+      if (lhs->kind == EXPR_SUBSCRIPT) {
+        replace_hoisted(lhs->as.expr_subscript.expr, ctx);
+        replace_hoisted(lhs->as.expr_subscript.index, ctx);
       }
+      replace_hoisted(expr->as.expr_assign.rhs, ctx);
       break;
     }
-    case EXPR_STRUCT_INITIALIZER: {
-      collect_live_expr(live, expr->as.expr_struct_initializer.property);
-      collect_live_expr(live, expr->as.expr_struct_initializer.value);
-      break;
-    }
-    case EXPR_SUBSCRIPT: {
-      collect_live_expr(live, expr->as.expr_subscript.expr);
-      collect_live_expr(live, expr->as.expr_subscript.index);
+    default: {
+      each_subexpr(expr, replace_hoisted, ctx);
       break;
     }
-    case EXPR_CALL: {
-      for (size_t i = 0; i < expr->as.expr_call.arguments.count; i++) {
-        collect_live_expr(live, &expr->as.expr_call.arguments.data[i]);
+  }
+}
+
+typedef struct {
+  const char *name;
+  const Expr *value;
+} Substitution;
+
+/* Replaces the variable in 'ctx' with its value, wherever it's read. */
+static void substitute(Expr *expr, void *ctx)
+{
+  const Substitution *sub = ctx;
+
+  if (expr->kind == EXPR_VARIABLE &&
+      strcmp(expr->as.expr_variable.name, sub->name) == 0) {
+    Expr copy = clone_expr(sub->value);
+    copy.span = expr->span;
+    free_expr(expr);
+    *expr = copy;
+    return;
+  }
+
+  each_subexpr(expr, substitute, ctx);
+}
+
+static bool takes_address(Expr *expr)
+{
+  Bindings taken = {0};
+  note_address_taken(expr, &taken);
+  bool any = taken.entries.count > 0;
+  names_free(&taken);
+  return any;
+}
+
+/* Replaces the loop 'stmt' with a block that computes what's been
+ * hoisted out of it, and then runs it. What the body of a while or a
+ * for loop computes is only computed if the loop runs at least once,
+ * which 'guard' is what tells. */
+static void wrap_loop(Licm *licm, Stmt *stmt, const Expr *guard)
+{
+  StmtBlock block = {.stmts = {0}, .depth = 0, .span = stmt->span};
+
+  for (size_t i = 0; i < licm->hoisted.count; i++) {
+    Expr initializer = licm->hoisted.data[i];
+
+    if (i >= licm->guarded) {
+      Expr condition = clone_expr(guard);
+      ExprLiteral null = {.kind = LIT_NULL, .span = initializer.span};
+      Expr otherwise = AS_EXPR_LITERAL(null);
+      ExprConditional conditional = {.condition = ALLOC(condition),
+                                     .then_branch = ALLOC(initializer),
+                                     .else_branch = ALLOC(otherwise),
+                                     .span = initializer.span};
+      initializer = AS_EXPR_CONDITIONAL(conditional);
+    }
+
+    StmtLet let = {.name = licm->temps.data[i],
+                   .initializer = initializer,
+                   .span = initializer.span};
+    dynarray_insert(&block.stmts, AS_STMT_LET(let));
+  }
+
+  dynarray_insert(&block.stmts, *stmt);
+  *stmt = AS_STMT_BLOCK(block);
+}
+
+/* Hoists the invariant expressions out of the loop 'stmt'. Only those
+ * that are evaluated first thing are: those in the condition of a while
+ * or a for loop, before anything that may fail, and those in the state-
+ * ments the body starts with, which, unless it's a do-while, are only
+ * computed if the condition holds when the loop starts, and that's what
+ * 'guard' is set to. Any expression in the loop that's equal to one of
+ * them then refers to it, too. Returns whether 'guard' was set. */
+static bool hoist_from_loop(Licm *licm, Stmt *stmt, Expr *guard)
+{
+  switch (stmt->kind) {
+    case STMT_WHILE: {
+      StmtWhile *loop = &stmt->as.stmt_while;
+
+      hoist_leading_expr(licm, &loop->condition);
+      licm->guarded = licm->hoisted.count;
+      if (is_pure_expr(&loop->condition)) {
+        hoist_leading_stmt(licm, loop->body);
       }
-      collect_live_expr(live, expr->as.expr_call.callee);
-      break;
+
+      licm->visible = licm->guarded;
+      replace_hoisted(&loop->condition, licm);
+      licm->visible = licm->hoisted.count;
+      each_expr(loop->body, replace_hoisted, licm);
+
+      *guard = clone_expr(&loop->condition);
+      return true;
     }
-    case EXPR_YIELD: {
-      collect_live_expr(live, expr->as.expr_yield.expr);
-      break;
+    case STMT_FOR: {
+      /* What's hoisted is computed before the initializer is. */
+      StmtFor *loop = &stmt->as.stmt_for;
+      ExprAssign *initializer = &loop->initializer.as.expr_assign;
+      if (initializer->rhs->kind != EXPR_LITERAL &&
+          initializer->rhs->kind != EXPR_VARIABLE) {
+        return false;
+      }
+
+      hoist_leading_expr(licm, &loop->condition);
+      licm->guarded = licm->hoisted.count;
+      if (is_pure_expr(&loop->condition) &&
+          !takes_address(&loop->condition)) {
+        hoist_leading_stmt(licm, loop->body);
+      }
+
+      licm->visible = licm->guarded;
+      replace_hoisted(&loop->condition, licm);
+      licm->visible = licm->hoisted.count;
+      replace_hoisted(&loop->advancement, licm);
+      each_expr(loop->body, replace_hoisted, licm);
+
+      /* The condition, as it's first evaluated. */
+      Substitution sub = {.name = initializer->lhs->as.expr_variable.name,
+                          .value = initializer->rhs};
+      *guard = clone_expr(&loop->condition);
+      substitute(guard, &sub);
+      return true;
     }
-    case EXPR_AWAIT: {
-      collect_live_expr(live, expr->as.expr_await.expr);
-      break;
+    case STMT_DO_WHILE: {
+      StmtDoWhile *loop = &stmt->as.stmt_do_while;
+
+      hoist_leading_stmt(licm, loop->body);
+      licm->guarded = licm->hoisted.count;
+
+      licm->visible = licm->hoisted.count;
+      each_expr(loop->body, replace_hoisted, licm);
+      replace_hoisted(&loop->condition, licm);
+      return false;
     }
     default:
-      break;
+      return false;
   }
 }
 
-static void collect_live_stmt(DynArray_Expr *live, Stmt *stmt)
+static void hoist_loop(Optimizer *opt, const FnLocals *scope, Stmt *stmt)
+{
+  Licm licm = {.opt = opt, .scope = scope};
+
+  note_loop_stmt(&licm.effects, stmt);
+  each_expr(stmt, note_loop_expr, &licm.effects);
+  each_expr(stmt, note_assigned, &licm.effects.written);
+
+  Expr guard = {0};
+  bool guarded = !licm.effects.opaque && hoist_from_loop(&licm, stmt, &guard);
+
+  if (licm.hoisted.count > 0) {
+    wrap_loop(&licm, stmt, &guard);
+  }
+  if (guarded) {
+    free_expr(&guard);
+  }
+
+  dynarray_free(&licm.hoisted);
+  dynarray_free(&licm.temps);
+  names_free(&licm.effects.written);
+}
+
+static void hoist_invariant_stmt(Optimizer *opt, const FnLocals *scope,
+                                 Stmt *stmt);
+
+static void hoist_invariant_fn(Optimizer *opt, const FnLocals *enclosing,
+                               StmtFn *fn)
+{
+  FnLocals scope = fn_locals(enclosing, fn);
+  hoist_invariant_stmt(opt, &scope, fn->body);
+  free_fn_locals(&scope);
+}
+
+/* Hoists what's invariant out of the loops in 'stmt', the inner ones
+ * first, so that what they hoist may then be hoisted further out. */
+static void hoist_invariant_stmt(Optimizer *opt, const FnLocals *scope,
+                                 Stmt *stmt)
 {
   switch (stmt->kind) {
-    case STMT_FN: {
-      collect_live_stmt(live, stmt->as.stmt_fn.body);
-      break;
-    }
     case STMT_BLOCK: {
       for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
-        collect_live_stmt(live, &stmt->as.stmt_block.stmts.data[i]);
+        hoist_invariant_stmt(opt, scope, &stmt->as.stmt_block.stmts.data[i]);
       }
       break;
     }
-    case STMT_LET: {
-      collect_live_expr(live, &stmt->as.stmt_let.initializer);
-      break;
-    }
-    case STMT_PRINT: {
-      collect_live_expr(live, &stmt->as.stmt_print.expr);
+    case STMT_IF: {
+      hoist_invariant_stmt(opt, scope, stmt->as.stmt_if.then_branch);
+      if (stmt->as.stmt_if.else_branch) {
+        hoist_invariant_stmt(opt, scope, stmt->as.stmt_if.else_branch);
+      }
       break;
     }
-    case STMT_ASSERT: {
-      collect_live_expr(live, &stmt->as.stmt_assert.expr);
+    case STMT_WHILE:
+    case STMT_DO_WHILE:
+    case STMT_FOR: {
+      Stmt *body = stmt->kind == STMT_WHILE      ? stmt->as.stmt_while.body
+                   : stmt->kind == STMT_DO_WHILE ? stmt->as.stmt_do_while.body
+                                                 : stmt->as.stmt_for.body;
+      hoist_invariant_stmt(opt, scope, body);
+      if (scope && !scope->keep_all) {
+        hoist_loop(opt, scope, stmt);
+      }
       break;
     }
-    case STMT_EXPR: {
-      collect_live_expr(live, &stmt->as.stmt_expr.expr);
+    case STMT_FN: {
+      hoist_invariant_fn(opt, scope, &stmt->as.stmt_fn);
       break;
     }
-    case STMT_RETURN: {
-      collect_live_expr(live, &stmt->as.stmt_return.expr);
+    case STMT_DECORATOR: {
+      hoist_invariant_fn(opt, scope, &stmt->as.stmt_decorator.fn->as.stmt_fn);
       break;
     }
     case STMT_IMPL: {
       for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
-        collect_live_stmt(live, &stmt->as.stmt_impl.methods.data[i]);
+        hoist_invariant_stmt(opt, scope, &stmt->as.stmt_impl.methods.data[i]);
       }
       break;
     }
-    case STMT_DECORATOR: {
-      collect_live_stmt(live, stmt->as.stmt_decorator.fn);
-      break;
-    }
-    case STMT_WHILE: {
-      collect_live_expr(live, &stmt->as.stmt_while.condition);
-      collect_live_stmt(live, stmt->as.stmt_while.body);
-      break;
-    }
-    case STMT_FOR: {
-      collect_live_expr(live, &stmt->as.stmt_for.initializer);
-      collect_live_expr(live, &stmt->as.stmt_for.condition);
-      collect_live_expr(live, &stmt->as.stmt_for.advancement);
-      collect_live_stmt(live, stmt->as.stmt_for.body);
+    default:
       break;
-    }
-    case STMT_IF: {
-      collect_live_expr(live, &stmt->as.stmt_if.condition);
-      collect_live_stmt(live, stmt->as.stmt_if.then_branch);
+  }
+}
 
-      if (stmt->as.stmt_if.else_branch) {
-        collect_live_stmt(live, stmt->as.stmt_if.else_branch);
-      }
+/* Hoists the invariants out of the loops in the functions the top-level
+ * 'stmt' defines. The ones at the top level are left alone, since what
+ * they'd hoist would go into globals. */
+static void hoist_invariants(Optimizer *opt, Stmt *stmt)
+{
+  hoist_invariant_stmt(opt, NULL, stmt);
+}
 
-      break;
-    }
-    case STMT_YIELD: {
-      collect_live_expr(live, &stmt->as.stmt_yield.expr);
-      break;
+typedef struct {
+  const char *name;
+  uint32_t bit;
+  int level; /* the lowest -O level it's run at */
+  void (*run)(Optimizer *opt, Stmt *stmt);
+} Pass;
+
+/* The passes, in the order they're run in. The peephole pass has no
+ * 'run', since it's compile() that runs it. */
+static const Pass pass_registry[PASS_COUNT] = {
+    {"fold", PASS_FOLD, 1, fold_stmt},
+    {"copyprop", PASS_COPYPROP, 1, propagate_stmt},
+    {"unreachable", PASS_UNREACHABLE, 1, eliminate_unreachable_stmt},
+    {"dse", PASS_DSE, 2, eliminate_dead_stores},
+    {"licm", PASS_LICM, 2, hoist_invariants},
+    {"peephole", PASS_PEEPHOLE, 1, NULL},
+};
+
+uint32_t find_pass(const char *name)
+{
+  for (size_t i = 0; i < PASS_COUNT; i++) {
+    if (strcmp(pass_registry[i].name, name) == 0) {
+      return pass_registry[i].bit;
     }
-    default:
-      break;
   }
+  return 0;
 }
 
-void liveset_remove(DynArray_Expr *live, Expr *expr)
+uint32_t passes_at_level(int level)
 {
-  for (size_t i = 0; i < live->count; ++i) {
-    if (is_equal_expr(&live->data[i], expr)) {
-      free_expr(&live->data[i]);
-      live->data[i] = live->data[--live->count];
-      break;
+  uint32_t passes = 0;
+  for (size_t i = 0; i < PASS_COUNT; i++) {
+    if (pass_registry[i].level <= level) {
+      passes |= pass_registry[i].bit;
     }
   }
+  return passes;
 }
 
-DynArray_Stmt eliminate_dead_store_block(DynArray_Stmt *stmts,
-                                         bool *is_modified)
+static double seconds_since(const struct timespec *start)
 {
-  DynArray_Stmt result = {0};
-  DynArray_Expr live = {0};
-  for (int i = (int) stmts->count - 1; i >= 0; i--) {
-    Stmt *stmt = &stmts->data[i];
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-    bool keep = true;
-    switch (stmt->kind) {
-      case STMT_EXPR: {
-        Expr *expr = &stmt->as.stmt_expr.expr;
-
-        if (expr->kind == EXPR_ASSIGN) {
-          Expr *lhs = expr->as.expr_assign.lhs;
-          Expr *rhs = expr->as.expr_assign.rhs;
-          if (!liveset_contains(&live, lhs)) {
-            keep = false;
-            *is_modified = true;
-          } else {
-            collect_live_expr(&live, rhs);
-            liveset_remove(&live, lhs);
-          }
-        } else {
-          collect_live_expr(&live, expr);
-        }
-        break;
-      }
-      case STMT_BLOCK: {
-        DynArray_Stmt cleaned_block =
-            eliminate_dead_store_block(&stmt->as.stmt_block.stmts, is_modified);
-        if (cleaned_block.count == 0) {
-          keep = false;
-        } else {
-          stmt->as.stmt_block.stmts = cleaned_block;
-        }
-        break;
-      }
-      default: {
-        collect_live_stmt(&live, stmt);
-        break;
-      }
-    }
+/* Runs the passes in 'result' over the top-level 'stmt', with the copies
+ * in scope being what the statements before it define, and leaves what
+ * it defines in scope, adding to the stats of each pass. Returns how
+ * many nodes the passes have changed. */
+static size_t optimize_stmt(Optimizer *opt, OptimizeResult *result,
+                            const Pass **passes, Stmt *stmt)
+{
+  size_t before = opt->changes;
+  bool propagated = false;
 
-    if (keep) {
-      dynarray_insert(&result, clone_stmt(stmt));
-    }
+  for (size_t i = 0; i < result->pass_count; i++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t changes = opt->changes;
+
+    passes[i]->run(opt, stmt);
+    propagated |= passes[i]->bit == PASS_COPYPROP;
+
+    result->passes[i].time += seconds_since(&start);
+    result->passes[i].changes += opt->changes - changes;
   }
 
-  for (size_t i = 0, j = result.count - 1; i < j; i++, j--) {
-    Stmt temp = result.data[i];
-    result.data[i] = result.data[j];
-    result.data[j] = temp;
+  if (!propagated) {
+    bind_toplevel(opt, stmt);
   }
 
-  dynarray_free(&live);
+  return opt->changes - before;
+}
 
-  return result;
+/* Whether the top-level 'stmt' defines a variable that's a copy of
+ * something, which the statements after it may have propagated. */
+static bool defines_copy(const Optimizer *opt, const Stmt *stmt)
+{
+  if (stmt->kind != STMT_LET || is_assigned(opt, stmt->as.stmt_let.name)) {
+    return false;
+  }
+
+  const Expr *initializer = &stmt->as.stmt_let.initializer;
+  return initializer->kind == EXPR_LITERAL ||
+         (initializer->kind == EXPR_VARIABLE &&
+          !is_assigned(opt, initializer->as.expr_variable.name));
 }
 
-Stmt eliminate_dead_store_stmt(Stmt *stmt, bool *is_modified)
+/* Whether 'stmt' defines a coroutine or a generator, which run(...)
+ * could make a task out of, or uses a module that might. Tasks can be
+ * preempted in the middle of any loop, even one in a plain function
+ * they call, so with any of them around, licm has to assume that what
+ * other tasks can store into may change while a loop runs. */
+static bool defines_coroutine(const Stmt *stmt)
 {
   switch (stmt->kind) {
-    case STMT_BLOCK: {
-      DynArray_Stmt eliminated =
-          eliminate_dead_store_block(&stmt->as.stmt_block.stmts, is_modified);
-
-      StmtBlock stmt_block = {.stmts = eliminated,
-                              .depth = stmt->as.stmt_block.depth};
-      return AS_STMT_BLOCK(stmt_block);
-    }
     case STMT_FN: {
-      DynArray_char_ptr parameters = {0};
-      for (size_t i = 0; i < stmt->as.stmt_fn.parameters.count; i++) {
-        dynarray_insert(&parameters,
-                        own_string(stmt->as.stmt_fn.parameters.data[i]));
-      }
-
-      Stmt body = eliminate_dead_store_stmt(stmt->as.stmt_fn.body, is_modified);
-
-      StmtFn stmt_fn = {.body = ALLOC(body),
-                        .name = own_string(stmt->as.stmt_fn.name),
-                        .parameters = parameters,
-                        .is_async = stmt->as.stmt_fn.is_async};
-      return AS_STMT_FN(stmt_fn);
-    }
-    case STMT_WHILE: {
-      Expr condition = clone_expr(&stmt->as.stmt_while.condition);
-      Stmt body =
-          eliminate_dead_store_stmt(stmt->as.stmt_while.body, is_modified);
-      char *label = own_string(stmt->as.stmt_while.label);
-
-      StmtWhile stmt_while = {
-          .label = label, .condition = condition, .body = ALLOC(body)};
-      return AS_STMT_WHILE(stmt_while);
-    }
-    case STMT_FOR: {
-      Expr initializer = clone_expr(&stmt->as.stmt_for.initializer);
-      Expr condition = clone_expr(&stmt->as.stmt_for.condition);
-      Expr advancement = clone_expr(&stmt->as.stmt_for.advancement);
-      char *label = own_string(stmt->as.stmt_for.label);
-      Stmt body =
-          eliminate_dead_store_stmt(stmt->as.stmt_for.body, is_modified);
-
-      StmtFor stmt_for = {.initializer = initializer,
-                          .condition = condition,
-                          .advancement = advancement,
-                          .label = label,
-                          .body = ALLOC(body)};
-      return AS_STMT_FOR(stmt_for);
-    }
-    case STMT_DECORATOR: {
-      Stmt fn =
-          eliminate_dead_store_stmt(stmt->as.stmt_decorator.fn, is_modified);
-      char *name = own_string(stmt->as.stmt_decorator.name);
-
-      StmtDecorator stmt_decorator = {.name = name, .fn = ALLOC(fn)};
-      return AS_STMT_DECORATOR(stmt_decorator);
+      const StmtFn *fn = &stmt->as.stmt_fn;
+      return fn->is_async || fn->is_gen || defines_coroutine(fn->body);
     }
+    case STMT_DECORATOR:
+      return defines_coroutine(stmt->as.stmt_decorator.fn);
     case STMT_IMPL: {
-      DynArray_Stmt methods = {0};
       for (size_t i = 0; i < stmt->as.stmt_impl.methods.count; i++) {
-        Stmt eliminated = eliminate_dead_store_stmt(
-            &stmt->as.stmt_impl.methods.data[i], is_modified);
+        if (defines_coroutine(&stmt->as.stmt_impl.methods.data[i])) {
+          return true;
+        }
       }
-      char *name = own_string(stmt->as.stmt_impl.name);
-
-      StmtImpl stmt_impl = {.name = name, .methods = methods};
-      return AS_STMT_IMPL(stmt_impl);
+      return false;
     }
-    case STMT_IF: {
-      Expr condition = clone_expr(&stmt->as.stmt_if.condition);
-      Stmt then_branch =
-          eliminate_dead_store_stmt(stmt->as.stmt_if.then_branch, is_modified);
-
-      Stmt *else_branch = NULL;
-      if (stmt->as.stmt_if.else_branch) {
-        Stmt eliminated_else = eliminate_dead_store_stmt(
-            stmt->as.stmt_if.else_branch, is_modified);
-        else_branch = ALLOC(eliminated_else);
+    case STMT_BLOCK: {
+      for (size_t i = 0; i < stmt->as.stmt_block.stmts.count; i++) {
+        if (defines_coroutine(&stmt->as.stmt_block.stmts.data[i])) {
+          return true;
+        }
       }
-
-      StmtIf stmt_if = {.condition = condition,
-                        .then_branch = ALLOC(then_branch),
-                        .else_branch = else_branch};
-      return AS_STMT_IF(stmt_if);
+      return false;
     }
+    case STMT_IF:
+      return defines_coroutine(stmt->as.stmt_if.then_branch) ||
+             (stmt->as.stmt_if.else_branch &&
+              defines_coroutine(stmt->as.stmt_if.else_branch));
+    case STMT_WHILE:
+      return defines_coroutine(stmt->as.stmt_while.body);
+    case STMT_DO_WHILE:
+      return defines_coroutine(stmt->as.stmt_do_while.body);
+    case STMT_FOR:
+      return defines_coroutine(stmt->as.stmt_for.body);
+    case STMT_LABELED:
+      return defines_coroutine(stmt->as.stmt_labeled.stmt);
+    case STMT_USE:
+      return true;
     default:
-      return clone_stmt(stmt);
+      return false;
   }
 }
 
-OptimizeResult optimize(const DynArray_Stmt *ast)
+OptimizeResult optimize(DynArray_Stmt *ast, uint32_t passes,
+                        size_t max_rounds)
 {
   OptimizeResult result = {
-      .errcode = 0, .is_ok = true, .time = 0.0, .msg = NULL, .payload = {0}};
+      .errcode = 0, .is_ok = true, .time = 0.0, .msg = NULL};
 
-  struct timespec start, end;
+  struct timespec start;
 
   clock_gettime(CLOCK_MONOTONIC, &start);
 
-  bool is_modified;
-  DynArray_Stmt original = clone_ast(ast);
-
-  do {
-    is_modified = false;
-    Table_Expr copies = {0};
+  const Pass *selected[PASS_COUNT];
+  for (size_t i = 0; i < PASS_COUNT; i++) {
+    if ((passes & pass_registry[i].bit) && pass_registry[i].run) {
+      selected[result.pass_count] = &pass_registry[i];
+      result.passes[result.pass_count++].name = pass_registry[i].name;
+    }
+  }
 
-    DynArray_Stmt optimized_ast = {0};
-    for (size_t i = 0; i < original.count; i++) {
-      Stmt folded = constant_fold_stmt(&original.data[i], &is_modified);
-      Stmt propagated = propagate_copies_stmt(&folded, &copies, &is_modified);
-      Stmt unreachable_eliminated =
-          eliminate_unreachable_stmt(&propagated, &is_modified);
-      Stmt dead_store_eliminated =
-          eliminate_dead_store_stmt(&unreachable_eliminated, &is_modified);
+  Optimizer opt = {0};
+
+  /* A global that's defined more than once is as good as assigned. */
+  for (size_t i = 0; i < ast->count; i++) {
+    Stmt *stmt = &ast->data[i];
+    const char *name = stmt->kind == STMT_LET ? stmt->as.stmt_let.name
+                       : stmt->kind == STMT_FN ? stmt->as.stmt_fn.name
+                                               : NULL;
+    if (name) {
+      if (names_has(&opt.globals, name)) {
+        names_add(&opt.assigned, name);
+      }
+      names_add(&opt.globals, name);
+    }
+    each_expr(stmt, note_assigned, &opt.assigned);
+    opt.concurrent = opt.concurrent || defines_coroutine(stmt);
+  }
 
-      dynarray_insert(&optimized_ast, dead_store_eliminated);
+  /* The statements that have to be (re)visited. Each round goes through
+   * them in order, so that the copies the ones before define are in
+   * scope, and a statement stays on for the next round only if one of
+   * the passes has changed it. If it's one that defines a copy, the
+   * statements after it are visited again, too, since they may have
+   * propagated it. */
+  bool *dirty = malloc(sizeof(bool) * ast->count);
+  for (size_t i = 0; i < ast->count; i++) {
+    dirty[i] = true;
+  }
 
-      free_stmt(&folded);
-      free_stmt(&propagated);
-      free_stmt(&unreachable_eliminated);
-    }
+  bool any = ast->count > 0 && result.pass_count > 0;
+  while (any && result.rounds < max_rounds) {
+    any = false;
+    result.rounds++;
+    bindings_pop_to(&opt.copies, 0);
 
-    free_table_expr(&copies);
-    free_ast(&original);
+    bool rest_dirty = false;
+    for (size_t i = 0; i < ast->count; i++) {
+      Stmt *stmt = &ast->data[i];
 
-    original = clone_ast(&optimized_ast);
+      if (!dirty[i] && !rest_dirty) {
+        bind_toplevel(&opt, stmt);
+        continue;
+      }
 
-    free_ast(&optimized_ast);
-  } while (is_modified);
+      dirty[i] = optimize_stmt(&opt, &result, selected, stmt) > 0;
+      if (dirty[i]) {
+        any = true;
+        rest_dirty = rest_dirty || defines_copy(&opt, stmt);
+      }
+    }
+  }
+  result.capped = any;
 
-  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(dirty);
+  bindings_free(&opt.copies);
+  names_free(&opt.assigned);
+  names_free(&opt.globals);
 
-  result.payload = original;
-  result.time =
-      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  result.time = seconds_since(&start);
 
   return result;
 }
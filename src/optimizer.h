@@ -2,17 +2,53 @@
 #define venom_optimizer_h
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "ast.h"
 
+/* The passes, as bits in the mask of those to run. The peephole pass
+ * works on the bytecode, and is run by compile(), not by optimize(). */
+#define PASS_FOLD (1 << 0)
+#define PASS_COPYPROP (1 << 1)
+#define PASS_UNREACHABLE (1 << 2)
+#define PASS_DSE (1 << 3)
+#define PASS_PEEPHOLE (1 << 4)
+#define PASS_LICM (1 << 5)
+
+#define PASS_COUNT 6
+
+/* The most -O goes up to, which is also what --optimize means. */
+#define OPTIMIZE_MAX_LEVEL 2
+
+/* How many rounds optimize() goes through at most, by default. */
+#define OPTIMIZE_MAX_ROUNDS 32
+
+typedef struct {
+  const char *name;
+  double time;
+  size_t changes; /* how many nodes it has rewritten */
+} PassStats;
+
 typedef struct {
-  DynArray_Stmt payload;
   bool is_ok;
   int errcode;
   char *msg;
   double time;
+  size_t rounds;
+  bool capped; /* whether it ran out of rounds before settling */
+  PassStats passes[PASS_COUNT];
+  size_t pass_count;
 } OptimizeResult;
 
-OptimizeResult optimize(const DynArray_Stmt *ast);
+/* Returns the bit of the pass called 'name', or 0 if there's none. */
+uint32_t find_pass(const char *name);
+
+/* Returns the passes that -O'level' runs. */
+uint32_t passes_at_level(int level);
+
+/* Runs 'passes' over 'ast', in place, for 'max_rounds' rounds at most. */
+OptimizeResult optimize(DynArray_Stmt *ast, uint32_t passes,
+                        size_t max_rounds);
 
 #endif
@@ -734,6 +734,8 @@ static ParseFnResult yield_expression(Parser *parser)
                            .span = parser->current.span};
   }
 
+  parser->yields = true;
+
   ParseFnResult expr_result = assignment(parser);
   if (!expr_result.is_ok) {
     return expr_result;
@@ -1586,7 +1588,16 @@ static ParseFnResult function_statement(Parser *parser)
                        .end = parser->previous.span.end}};
   }
 
+  /* Whether a function is a generator has to be known before its body
+   * is compiled, since the calls to it may be compiled first. The yie-
+   * lds in the functions defined in it are theirs, though. */
+  bool enclosing_yields = parser->yields;
+  parser->yields = false;
+
   ParseFnResult body_result = block(parser);
+  bool yields = parser->yields;
+  parser->yields = enclosing_yields;
+
   if (!body_result.is_ok) {
     for (size_t i = 0; i < parameters.count; i++) {
       free(parameters.data[i]);
@@ -1602,6 +1613,7 @@ static ParseFnResult function_statement(Parser *parser)
       .body = ALLOC(body),
       .parameters = parameters,
       .is_async = is_async,
+      .is_gen = yields,
       .span = (Span){.line = is_async ? async_token.span.line
                                       : fn_result.token.span.line,
                      .start = is_async ? async_token.span.start
@@ -1895,6 +1907,8 @@ static ParseFnResult yield_statement(Parser *parser)
                            .span = parser->current.span};
   }
 
+  parser->yields = true;
+
   ParseFnResult expr_result = expression(parser);
   if (!expr_result.is_ok) {
     return expr_result;
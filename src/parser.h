@@ -15,6 +15,7 @@ typedef struct {
   Token current;
   Token previous;
   size_t depth;
+  bool yields; /* whether the function being parsed has yielded yet */
   const DynArray_Token *tokens;
   size_t idx;
 } Parser;
@@ -0,0 +1,304 @@
+#include "peephole.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "dynarray.h"
+
+typedef struct {
+  size_t offset; /* where it was, before anything was removed */
+  size_t size;   /* what it takes now */
+  uint8_t op;
+  bool dead;
+  size_t target; /* the instruction a jump lands on, or the count */
+} Insn;
+
+typedef DynArray(Insn) DynArray_Insn;
+
+static bool is_jump(uint8_t op)
+{
+  return op == OP_JMP || op == OP_JZ || op == OP_JNZ;
+}
+
+/* Whether the instruction just pushes something that can go right away,
+ * without anything happening, if the next one pops it. */
+static bool is_pure_push(uint8_t op)
+{
+  switch (op) {
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NULL:
+    case OP_CONST:
+    case OP_STR:
+    case OP_DEEPGET:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Returns the first instruction from 'i' on that's still there. */
+static size_t next_live(const DynArray_Insn *insns, size_t i)
+{
+  while (i < insns->count && insns->data[i].dead) {
+    i++;
+  }
+  return i;
+}
+
+static size_t offset_of(const DynArray_Insn *insns, size_t code_size,
+                        size_t i)
+{
+  return i < insns->count ? insns->data[i].offset : code_size;
+}
+
+/* Follows the jump at 'i' through the jumps it lands on, and through
+ * a true or false that's tested right away, to where it ends up. */
+static size_t thread_jump(const DynArray_Insn *insns, size_t i)
+{
+  size_t target = next_live(insns, insns->data[i].target);
+
+  for (size_t hops = 0; hops < insns->count && target < insns->count;
+       hops++) {
+    const Insn *t = &insns->data[target];
+    size_t next;
+
+    if (t->op == OP_JMP) {
+      next = next_live(insns, t->target);
+    } else if (t->op == OP_TRUE || t->op == OP_FALSE) {
+      size_t test = next_live(insns, target + 1);
+      if (test == insns->count ||
+          (insns->data[test].op != OP_JZ && insns->data[test].op != OP_JNZ)) {
+        break;
+      }
+      bool jumps = (insns->data[test].op == OP_JZ) == (t->op == OP_FALSE);
+      next = jumps ? next_live(insns, insns->data[test].target)
+                   : next_live(insns, test + 1);
+    } else {
+      break;
+    }
+
+    if (next == target) {
+      break; /* a loop that goes nowhere */
+    }
+    target = next;
+  }
+
+  return target;
+}
+
+/* Marks the instructions that the jumps still there land on. */
+static void find_targets(const DynArray_Insn *insns, bool *targets)
+{
+  for (size_t i = 0; i <= insns->count; i++) {
+    targets[i] = false;
+  }
+  for (size_t i = 0; i < insns->count; i++) {
+    if (!insns->data[i].dead && is_jump(insns->data[i].op)) {
+      targets[next_live(insns, insns->data[i].target)] = true;
+    }
+  }
+}
+
+/* One pass over the code, which returns whether it changed anything. */
+static bool rewrite(DynArray_Insn *insns, size_t code_size, bool *targets)
+{
+  bool changed = false;
+
+  find_targets(insns, targets);
+
+  for (size_t i = next_live(insns, 0); i < insns->count;
+       i = next_live(insns, i + 1)) {
+    Insn *insn = &insns->data[i];
+    size_t j = next_live(insns, i + 1);
+    Insn *next = j < insns->count && !targets[j] ? &insns->data[j] : NULL;
+
+    if (is_jump(insn->op)) {
+      size_t target = thread_jump(insns, i);
+      long distance = (long) offset_of(insns, code_size, target) -
+                      (long) (insn->offset + 3);
+
+      /* Code only ever gets removed, so a jump is never made longer than
+       * it was here. But a conditional jump is never made to go back-
+       * wards, since only OP_JMP counts the iterations of a loop. */
+      if (target != next_live(insns, insn->target) && distance >= INT16_MIN &&
+          distance <= INT16_MAX && (insn->op == OP_JMP || distance >= 0)) {
+        insn->target = target;
+        changed = true;
+      }
+
+      if (target == j) {
+        if (insn->op == OP_JMP) {
+          insn->dead = true;
+        } else {
+          /* It goes on either way, but the condition still has to go. */
+          insn->op = OP_POP;
+          insn->size = 1;
+        }
+        changed = true;
+        continue;
+      }
+    }
+
+    /* What comes after an unconditional jump is dead, until something
+     * jumps there. */
+    if (insn->op == OP_JMP || insn->op == OP_RET) {
+      for (size_t k = j; k < insns->count && !targets[k]; k++) {
+        if (!insns->data[k].dead && insns->data[k].op != OP_HLT) {
+          insns->data[k].dead = true;
+          changed = true;
+        }
+      }
+      continue;
+    }
+
+    if (!next) {
+      continue;
+    }
+
+    if ((insn->op == OP_TRUE || insn->op == OP_FALSE) && next->op == OP_NOT) {
+      insn->op = insn->op == OP_TRUE ? OP_FALSE : OP_TRUE;
+      next->dead = true;
+      changed = true;
+    } else if (insn->op == OP_NOT &&
+               (next->op == OP_JZ || next->op == OP_JNZ)) {
+      next->op = next->op == OP_JZ ? OP_JNZ : OP_JZ;
+      insn->dead = true;
+      changed = true;
+    } else if ((insn->op == OP_TRUE || insn->op == OP_FALSE) &&
+               (next->op == OP_JZ || next->op == OP_JNZ)) {
+      bool jumps = (next->op == OP_JZ) == (insn->op == OP_FALSE);
+      if (jumps) {
+        next->op = OP_JMP;
+      } else {
+        next->dead = true;
+      }
+      insn->dead = true;
+      changed = true;
+    } else if (insn->op == OP_JZ && next->op == OP_JMP &&
+               next_live(insns, insn->target) == next_live(insns, j + 1) &&
+               offset_of(insns, code_size, next->target) > insn->offset &&
+               offset_of(insns, code_size, next->target) - insn->offset - 3 <=
+                   INT16_MAX) {
+      /* An OP_JZ over an OP_JMP is an OP_JNZ to where the latter goes,
+       * as long as that's forwards. It's never the other way around,
+       * since OP_JNZ checks for a bool and OP_JZ doesn't. */
+      insn->op = OP_JNZ;
+      insn->target = next->target;
+      next->dead = true;
+      changed = true;
+    } else if (is_pure_push(insn->op) && next->op == OP_POP) {
+      insn->dead = true;
+      next->dead = true;
+      changed = true;
+    }
+  }
+
+  return changed;
+}
+
+/* Lays out what's left of the code, with the jumps pointed at where
+ * their targets went, and so are the lines. */
+static void relayout(DynArray_uint8_t *code, DynArray_LineRun *lines,
+                     const DynArray_Insn *insns, const long *index)
+{
+  size_t *moved = malloc(sizeof(size_t) * (insns->count + 1));
+  DynArray_uint8_t out = {0};
+
+  for (size_t i = 0; i < insns->count; i++) {
+    const Insn *insn = &insns->data[i];
+    moved[i] = out.count;
+    if (insn->dead) {
+      continue;
+    }
+    dynarray_insert(&out, insn->op);
+    for (size_t k = 1; k < insn->size; k++) {
+      dynarray_insert(&out, code->data[insn->offset + k]);
+    }
+  }
+  moved[insns->count] = out.count;
+
+  for (size_t i = 0; i < insns->count; i++) {
+    const Insn *insn = &insns->data[i];
+    if (!insn->dead && is_jump(insn->op)) {
+      int16_t offset =
+          (int16_t) ((long) moved[insn->target] - (long) (moved[i] + 3));
+      out.data[moved[i] + 1] = (offset >> 8) & 0xFF;
+      out.data[moved[i] + 2] = offset & 0xFF;
+    }
+  }
+
+  /* The runs that now start at the same offset keep the last line, just
+   * like mark_line() would. */
+  size_t count = 0;
+  for (size_t r = 0; r < lines->count; r++) {
+    LineRun run = lines->data[r];
+    if (index[run.offset] == -1) {
+      continue;
+    }
+    run.offset = moved[index[run.offset]];
+
+    if (count > 0 && lines->data[count - 1].offset == run.offset) {
+      lines->data[count - 1].line = run.line;
+    } else if (count == 0 || lines->data[count - 1].line != run.line) {
+      lines->data[count++] = run;
+    }
+  }
+  lines->count = count;
+
+  free(moved);
+  dynarray_free(code);
+  *code = out;
+}
+
+size_t peephole(DynArray_uint8_t *code, DynArray_LineRun *lines)
+{
+  DynArray_Insn insns = {0};
+  long *index = malloc(sizeof(long) * (code->count + 1));
+  for (size_t i = 0; i <= code->count; i++) {
+    index[i] = -1;
+  }
+
+  for (size_t i = 0; i < code->count; i += instruction_size(&code->data[i])) {
+    Insn insn = {.offset = i,
+                 .size = instruction_size(&code->data[i]),
+                 .op = code->data[i]};
+    index[i] = insns.count;
+    dynarray_insert(&insns, insn);
+  }
+  index[code->count] = insns.count;
+
+  /* A jump into the middle of an instruction, or out of the code, means
+   * there's no telling what it does, so it's left alone. */
+  for (size_t i = 0; i < insns.count; i++) {
+    Insn *insn = &insns.data[i];
+    if (is_jump(insn->op)) {
+      int16_t offset = (int16_t) ((code->data[insn->offset + 1] << 8) |
+                                  code->data[insn->offset + 2]);
+      long target = (long) insn->offset + 3 + offset;
+      if (target < 0 || (size_t) target > code->count || index[target] == -1) {
+        free(index);
+        dynarray_free(&insns);
+        return 0;
+      }
+      insn->target = index[target];
+    }
+  }
+
+  bool *targets = malloc(sizeof(bool) * (insns.count + 1));
+  while (rewrite(&insns, code->count, targets)) {
+  }
+  free(targets);
+
+  size_t removed = 0;
+  for (size_t i = 0; i < insns.count; i++) {
+    removed += insns.data[i].dead;
+  }
+
+  relayout(code, lines, &insns, index);
+
+  free(index);
+  dynarray_free(&insns);
+  return removed;
+}
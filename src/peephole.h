@@ -0,0 +1,18 @@
+#ifndef venom_peephole_h
+#define venom_peephole_h
+
+#include <stddef.h>
+
+#include "compiler.h"
+
+/* Cleans up the code of the script or of a function, with -O, once it's
+ * compiled: folds `true !` into OP_FALSE, OP_NOT followed by OP_JZ in-
+ * to OP_JNZ, and a constant followed by a jump that tests it into eith-
+ * er a jump or nothing, drops the pure pushes that are popped right
+ * away, threads the jumps that land on other jumps, and removes the
+ * jumps to the next instruction, and the code no jump reaches. The
+ * jumps and the line table are patched to match. Returns how many in-
+ * structions it removed. */
+size_t peephole(DynArray_uint8_t *code, DynArray_LineRun *lines);
+
+#endif
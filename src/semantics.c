@@ -133,6 +133,7 @@ static LoopLabelResult loop_label_stmt(Stmt *stmt, const char *current)
       labeled_stmt.as.stmt_fn.parameters = parameters;
       labeled_stmt.as.stmt_fn.name = own_string(stmt->as.stmt_fn.name);
       labeled_stmt.as.stmt_fn.is_async = stmt->as.stmt_fn.is_async;
+      labeled_stmt.as.stmt_fn.is_gen = stmt->as.stmt_fn.is_gen;
       labeled_stmt.as.stmt_fn.span = stmt->as.stmt_fn.span;
 
       LoopLabelResult body_result =
@@ -0,0 +1,307 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "heapprof.h"
+#include "object.h"
+#include "vm.h"
+
+/* Slabs are about this big, unless the objects are so large that a
+ * slab wouldn't hold at least SLAB_MIN_SLOTS of them. */
+#define SLAB_BYTES (64 * 1024)
+#define SLAB_MIN_SLOTS 4
+
+#define ROUND_UP(n, to) (((n) + (to) - 1) / (to) * (to))
+#define SLAB_ALIGN alignof(max_align_t)
+
+typedef struct Slab {
+  struct Slab *next;
+} Slab;
+
+/* The slots are laid out right after the header. */
+#define SLAB_HEADER ROUND_UP(sizeof(Slab), SLAB_ALIGN)
+
+/* With make debug=refcheck, a free slot keeps an object header whose
+ * count is REFCOUNT_DEAD (see object.h), which marks it as free, so
+ * that freeing it again, releasing what it held, and telling the slots
+ * in use from the free ones, takes no bookkeeping besides. The type
+ * is left as it was, for objincref() and objdecref() to report. Every
+ * slot has room for it, as none is smaller than SLAB_ALIGN. */
+typedef struct FreeSlot {
+#ifdef REFCHECK
+  ObjHeader header;
+#endif
+  struct FreeSlot *next;
+} FreeSlot;
+
+#ifdef REFCHECK
+#define SLOT_IS_FREE(slot) ((slot)->header.refcount == REFCOUNT_DEAD)
+#endif
+
+typedef struct {
+  const char *name;
+  size_t size;
+  FreeSlot *spill; /* slots threads gave up, see slab_free() */
+  Slab *slabs;
+  size_t slab_count;
+  size_t slot_count;
+  long in_use;
+  size_t allocations;
+} SlabPool;
+
+/* Guards everything in 'pools' but the names and sizes. */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static SlabPool pools[SLAB_KIND_COUNT] = {
+    [SLAB_STRING] = {.name = "String", .size = sizeof(String)},
+    [SLAB_ARRAY] = {.name = "Array", .size = sizeof(Array)},
+    [SLAB_STRUCT] = {.name = "Struct", .size = sizeof(Struct)},
+    [SLAB_CLOSURE] = {.name = "Closure", .size = sizeof(Closure)},
+    [SLAB_UPVALUE] = {.name = "Upvalue", .size = sizeof(Upvalue)},
+    [SLAB_GENERATOR] = {.name = "Generator", .size = sizeof(Generator)},
+    [SLAB_SLEEP] = {.name = "Sleep", .size = sizeof(Sleep)},
+    [SLAB_TASK] = {.name = "Task", .size = sizeof(Task)},
+    [SLAB_IO] = {.name = "Io", .size = sizeof(Io)},
+    [SLAB_CHANNEL] = {.name = "Channel", .size = sizeof(Channel)},
+    [SLAB_FRAME_SNAPSHOT] = {.name = "FrameSnapshot",
+                             .size = sizeof(FrameSnapshot)},
+};
+
+static _Thread_local FreeSlot *free_lists[SLAB_KIND_COUNT];
+static _Thread_local size_t free_counts[SLAB_KIND_COUNT];
+
+/* The threads count their allocations and frees on their own, and
+ * only add them to the totals in 'pools' in slab_flush_thread(). The
+ * frees can outnumber the allocations in a thread that frees what
+ * another one made, hence 'long'. */
+static _Thread_local long thread_in_use[SLAB_KIND_COUNT];
+static _Thread_local size_t thread_allocations[SLAB_KIND_COUNT];
+
+static size_t slot_size(SlabKind kind)
+{
+  return ROUND_UP(pools[kind].size, SLAB_ALIGN);
+}
+
+static size_t slots_per_slab(SlabKind kind)
+{
+  size_t count = SLAB_BYTES / slot_size(kind);
+  return count < SLAB_MIN_SLOTS ? SLAB_MIN_SLOTS : count;
+}
+
+static void slab_grow(SlabKind kind)
+{
+  size_t size = slot_size(kind);
+  size_t count = slots_per_slab(kind);
+
+  /* Before making a new slab, see if some other thread has given up
+   * slots that it freed. */
+  pthread_mutex_lock(&pools_lock);
+  FreeSlot *spill = pools[kind].spill;
+  pools[kind].spill = NULL;
+  pthread_mutex_unlock(&pools_lock);
+
+  if (spill) {
+    free_lists[kind] = spill;
+    for (FreeSlot *slot = spill; slot; slot = slot->next) {
+      ++free_counts[kind];
+    }
+    return;
+  }
+
+  Slab *slab = malloc(SLAB_HEADER + size * count);
+  if (!slab) {
+    fprintf(stderr, "venom: out of memory\n");
+    abort();
+  }
+
+  pthread_mutex_lock(&pools_lock);
+  slab->next = pools[kind].slabs;
+  pools[kind].slabs = slab;
+  pools[kind].slab_count++;
+  pools[kind].slot_count += count;
+  pthread_mutex_unlock(&pools_lock);
+
+  /* Pushed in reverse, so that the slots are handed out in the order
+   * they're laid out in. */
+  char *slots = (char *) slab + SLAB_HEADER;
+  for (size_t i = count; i-- > 0;) {
+    FreeSlot *slot = (FreeSlot *) (slots + i * size);
+#ifdef REFCHECK
+    slot->header.refcount = REFCOUNT_DEAD;
+#endif
+    slot->next = free_lists[kind];
+    free_lists[kind] = slot;
+  }
+  free_counts[kind] += count;
+}
+
+void *slab_alloc(SlabKind kind)
+{
+  if (!free_lists[kind]) {
+    slab_grow(kind);
+  }
+
+  FreeSlot *slot = free_lists[kind];
+  free_lists[kind] = slot->next;
+#ifdef REFCHECK
+  slot->header.refcount = 0;
+#endif
+  --free_counts[kind];
+  ++thread_in_use[kind];
+  ++thread_allocations[kind];
+  return slot;
+}
+
+void slab_free(SlabKind kind, void *ptr)
+{
+  if (heap_profiling) {
+    heapprof_free(ptr);
+  }
+
+  FreeSlot *slot = ptr;
+#ifdef REFCHECK
+  if (SLOT_IS_FREE(slot)) {
+    fprintf(stderr, "refcheck: %s at %p freed twice\n", pools[kind].name,
+            ptr);
+    abort();
+  }
+  slot->header.refcount = REFCOUNT_DEAD;
+#endif
+  slot->next = free_lists[kind];
+  free_lists[kind] = slot;
+  --thread_in_use[kind];
+
+  /* A thread that frees what others made (e.g., a worker running the
+   * tasks somebody else spawned) would otherwise pile up slots while
+   * the others keep making new slabs, so past a couple of slabs' wor-
+   * th, the slots go where everybody can get at them. */
+  if (++free_counts[kind] > 2 * slots_per_slab(kind)) {
+    FreeSlot *tail = slot;
+    while (tail->next) {
+      tail = tail->next;
+    }
+
+    pthread_mutex_lock(&pools_lock);
+    tail->next = pools[kind].spill;
+    pools[kind].spill = free_lists[kind];
+    pthread_mutex_unlock(&pools_lock);
+
+    free_lists[kind] = NULL;
+    free_counts[kind] = 0;
+  }
+}
+
+/* Spills the thread's free lists too, since the slots on them would
+ * otherwise go unused once the thread is gone. */
+void slab_flush_thread(void)
+{
+  pthread_mutex_lock(&pools_lock);
+  for (size_t i = 0; i < SLAB_KIND_COUNT; i++) {
+    pools[i].in_use += thread_in_use[i];
+    pools[i].allocations += thread_allocations[i];
+    thread_in_use[i] = 0;
+    thread_allocations[i] = 0;
+
+    FreeSlot *head = free_lists[i];
+    if (head) {
+      FreeSlot *tail = head;
+      while (tail->next) {
+        tail = tail->next;
+      }
+      tail->next = pools[i].spill;
+      pools[i].spill = head;
+      free_lists[i] = NULL;
+      free_counts[i] = 0;
+    }
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+size_t slab_thread_allocations(SlabKind kind)
+{
+  return thread_allocations[kind];
+}
+
+void print_slab_report(void)
+{
+  slab_flush_thread();
+
+  pthread_mutex_lock(&pools_lock);
+  for (size_t i = 0; i < SLAB_KIND_COUNT; i++) {
+    const SlabPool *pool = &pools[i];
+    printf("slab %s: %zu slabs, %zu slots of %zu bytes, %ld in use, %zu "
+           "allocations\n",
+           pool->name, pool->slab_count, pool->slot_count, slot_size(i),
+           pool->in_use, pool->allocations);
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
+
+#ifdef REFCHECK
+void slab_for_each_live(SlabKind kind, void (*fn)(void *obj, void *ctx),
+                        void *ctx)
+{
+  size_t size = slot_size(kind);
+  size_t count = slots_per_slab(kind);
+
+  for (Slab *slab = pools[kind].slabs; slab; slab = slab->next) {
+    char *slots = (char *) slab + SLAB_HEADER;
+    for (size_t i = 0; i < count; i++) {
+      FreeSlot *slot = (FreeSlot *) (slots + i * size);
+      if (!SLOT_IS_FREE(slot)) {
+        fn(slot, ctx);
+      }
+    }
+  }
+}
+
+bool slab_check_leaks(void)
+{
+  slab_flush_thread();
+
+  bool ok = true;
+  pthread_mutex_lock(&pools_lock);
+  for (size_t i = 0; i < SLAB_KIND_COUNT; i++) {
+    if (pools[i].in_use != 0) {
+      fprintf(stderr, "refcheck: %ld %s object(s) leaked\n", pools[i].in_use,
+              pools[i].name);
+      ok = false;
+    }
+  }
+  pthread_mutex_unlock(&pools_lock);
+  return ok;
+}
+#endif
+
+void free_slabs(void)
+{
+  slab_flush_thread();
+
+  pthread_mutex_lock(&pools_lock);
+  for (size_t i = 0; i < SLAB_KIND_COUNT; i++) {
+    SlabPool *pool = &pools[i];
+    free_lists[i] = NULL;
+    free_counts[i] = 0;
+    pool->spill = NULL;
+
+    /* Dropping the slabs without freeing them makes them unreachable,
+     * so that the leak checkers report them. */
+    if (pool->in_use == 0) {
+      Slab *slab = pool->slabs;
+      while (slab) {
+        Slab *next = slab->next;
+        free(slab);
+        slab = next;
+      }
+    }
+
+    pool->slabs = NULL;
+    pool->slab_count = 0;
+    pool->slot_count = 0;
+  }
+  pthread_mutex_unlock(&pools_lock);
+}
@@ -0,0 +1,70 @@
+#ifndef venom_slab_h
+#define venom_slab_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>  // IWYU pragma: keep
+
+/* The objects the VM makes and throws away all the time come out of
+ * per-type slabs instead of malloc(). A slab is a block of memory
+ * carved up into slots of one size, and the slots that are free are
+ * kept on a free list, which is thread-local, so that the worker
+ * threads (see "parallel scheduler" in vm.c) never have to contend
+ * for it. A slot that is freed goes on the list of whichever thread
+ * frees it, and slabs are only given back to the system at exit. */
+typedef enum {
+  SLAB_STRING,
+  SLAB_ARRAY,
+  SLAB_STRUCT,
+  SLAB_CLOSURE,
+  SLAB_UPVALUE,
+  SLAB_GENERATOR,
+  SLAB_SLEEP,
+  SLAB_TASK,
+  SLAB_IO,
+  SLAB_CHANNEL,
+  SLAB_FRAME_SNAPSHOT,
+  SLAB_KIND_COUNT,
+} SlabKind;
+
+void *slab_alloc(SlabKind kind);
+void slab_free(SlabKind kind, void *ptr);
+
+/* Folds the calling thread's counters into the totals, and hands its
+ * free slots over to the other threads. Threads do it before they
+ * exit, and free_slabs() does it for the main thread. */
+void slab_flush_thread(void);
+
+/* The number of objects of that type the calling thread has allocat-
+ * ed since it last called slab_flush_thread(). */
+size_t slab_thread_allocations(SlabKind kind);
+
+/* Prints the slabs, slots, and slots in use of each type. */
+void print_slab_report(void);
+
+/* Gives the slabs back to the system. The slabs of a type that still
+ * has objects in use are left alone, so that whatever leaked shows
+ * up as a leak, just like it would without the slabs. */
+void free_slabs(void);
+
+#ifdef REFCHECK
+/* With make debug=refcheck, the slots that are free are marked as
+ * such, so that freeing an object twice aborts, and the objects in use
+ * can be found by walking the slabs. */
+
+/* Calls 'fn' on every object of that type that is in use. Only safe
+ * to call while no other thread is allocating. */
+void slab_for_each_live(SlabKind kind, void (*fn)(void *obj, void *ctx),
+                        void *ctx);
+
+/* Reports the types that still have objects in use, and returns
+ * false if there are any. Called at exit, once everything that the
+ * program made should have been freed. */
+bool slab_check_leaks(void);
+#endif
+
+/* Like ALLOC, but for objects that come out of a slab. */
+#define SLAB_ALLOC(kind, obj) \
+  (memcpy(slab_alloc((kind)), &(obj), sizeof((obj))))
+
+#endif
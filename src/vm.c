@@ -1,13 +1,22 @@
 #include "vm.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <setjmp.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "compiler.h"
 
@@ -16,10 +25,17 @@
 #endif
 
 #include "dynarray.h"
+#include "heapprof.h"
 #include "math.h"
 #include "object.h"
+#include "slab.h"
 #include "table.h"
 #include "util.h"
+#include "workqueue.h"
+
+static void pool_stop(VM *vm);
+static uint32_t pool_worker_index(const VM *vm);
+static void channel_wake(Task *task, Object value);
 
 void init_vm(VM *vm)
 {
@@ -27,20 +43,43 @@ void init_vm(VM *vm)
   vm->fp_count = 1;
   vm->fp_stack[0] = (BytecodePtr){0};
   vm->blueprints = calloc(1, sizeof(Table_StructBlueprint));
+  init_eventloop(&vm->loop);
 }
 
 void free_vm(VM *vm)
 {
+  if (vm->pool) {
+    pool_stop(vm);
+  }
+
+  /* Waiters hold a reference to the waiting task, and the waiting
+   * task may hold one to what it's waiting for, so the lists of the
+   * tasks that never finished have to go first. */
+  for (size_t i = 0; i < vm->task_count; i++) {
+    DynArray_Waiter *waiters = &vm->tasks[i]->waiters;
+    for (size_t j = 0; j < waiters->count; j++) {
+      Object waiter = TASK_VAL(waiters->data[j].task);
+      objdecref(&waiter);
+    }
+    waiters->count = 0;
+  }
   for (size_t i = 0; i < vm->task_count; i++) {
     Object task_obj = TASK_VAL(vm->tasks[i]);
     objdecref(&task_obj);
   }
   if (vm->scheduler_frame) {
-    free(vm->scheduler_frame);
+    slab_free(SLAB_FRAME_SNAPSHOT, vm->scheduler_frame);
+  }
+  for (size_t i = 0; i < vm->globals.count; i++) {
+    objdecref(&vm->globals.data[i]);
+  }
+  dynarray_free(&vm->globals);
+  if (vm->blueprints) {
+    free_table_struct_blueprints(vm->blueprints);
+    free(vm->blueprints);
   }
-  free_table_object(&vm->globals);
-  free_table_struct_blueprints(vm->blueprints);
-  free(vm->blueprints);
+  free_eventloop(&vm->loop);
+  dynarray_free(&vm->task_reports);
 }
 
 static inline void push(VM *vm, Object obj)
@@ -58,10 +97,175 @@ static inline Object peek(VM *vm, int n)
   return vm->stack[vm->tos - 1 - n];
 }
 
+/* The references held by the stack are only counted without deferred
+ * refcounting (see DEFERRED_RC in object.h), so:
+ *
+ *  - stack_incref() and stack_decref() are for when a value is put on
+ *    the stack next to wherever else it is, and dropped off of it,
+ *  - to_heap() is for when a value taken off the stack is stored some-
+ *    where else (a global, a property, an array, a task, ...), and
+ *  - to_stack() is for the other way around, and for the new objects,
+ *    which start out with a count of one.
+ *
+ * Under deferred refcounting, the last two are what keeps the counts
+ * right, and the first two do nothing. Otherwise, it's the other way
+ * around, since the reference just changes hands. */
+#ifdef DEFERRED_RC
+#define stack_incref(obj) ((void) (obj))
+#define stack_decref(obj) ((void) (obj))
+#define to_heap(obj) objincref(obj)
+#define to_stack(obj) objdecref(obj)
+#else
+#define stack_incref(obj) objincref(obj)
+#define stack_decref(obj) objdecref(obj)
+#define to_heap(obj) ((void) (obj))
+#define to_stack(obj) ((void) (obj))
+#endif
+
+static inline void push_new(VM *vm, Object obj)
+{
+  push(vm, obj);
+  to_stack(&vm->stack[vm->tos - 1]);
+}
+
+/* With --measure=heap, tags the object that the instruction at 'site'
+ * has just pushed with it. */
+static inline void profile_alloc(VM *vm, const Bytecode *restrict code,
+                                 const uint8_t *site)
+{
+  (void) code;
+  if (heap_profiling) {
+    heapprof_alloc(site, obj_header(&vm->stack[vm->tos - 1]));
+  }
+}
+
+static inline void slots_to_heap(Object *slots, size_t count)
+{
+#ifdef DEFERRED_RC
+  for (size_t i = 0; i < count; i++) {
+    objincref(&slots[i]);
+  }
+#else
+  (void) slots;
+  (void) count;
+#endif
+}
+
+static inline void slots_to_stack(Object *slots, size_t count)
+{
+#ifdef DEFERRED_RC
+  for (size_t i = 0; i < count; i++) {
+    objdecref(&slots[i]);
+  }
+#else
+  (void) slots;
+  (void) count;
+#endif
+}
+
+#ifdef DEFERRED_RC
+static void mark_frames(const BytecodePtr *frames, size_t count)
+{
+  for (size_t i = 0; i < count; i++) {
+    if (frames[i].fn) {
+      Object fn = CLOSURE_VAL(frames[i].fn);
+      zct_mark(&fn, 1);
+    }
+  }
+}
+
+/* At the safe points (see safe_point()), the objects in the zero co-
+ * unt table get checked against the stacks: the running one, the ones
+ * saved by the generators that are being resumed, and the one the
+ * scheduler was started from. Whatever none of them has
+ * on it is garbage. The closures being run are counted as being on
+ * the stack, since OP_CALL doesn't keep them there. */
+static void mark_stacks(VM *vm)
+{
+  zct_mark(vm->stack, vm->tos);
+  mark_frames(vm->fp_stack, vm->fp_count);
+  for (size_t i = 0; i < vm->fs_count; i++) {
+    zct_mark(vm->fs_stack[i]->stack, vm->fs_stack[i]->tos);
+    mark_frames(vm->fs_stack[i]->fp_stack, vm->fs_stack[i]->fp_count);
+  }
+  if (vm->scheduler_frame) {
+    zct_mark(vm->scheduler_frame->stack, vm->scheduler_frame->tos);
+    mark_frames(vm->scheduler_frame->fp_stack,
+                vm->scheduler_frame->fp_count);
+  }
+}
+
+static void reconcile(VM *vm)
+{
+  if (zct_full()) {
+    mark_stacks(vm);
+    zct_reconcile();
+  }
+}
+#else
+#define reconcile(vm) ((void) (vm))
+#endif
+
+/* Frees what has died by the time exec() returns, but is still wait-
+ * ing for the memory manager (in the zero count table, the cycle
+ * collector's buffer, or the worklist of lazy mode), so that whatever
+ * is left is what the VM is still holding on to, e.g., for a report
+ * taken before free_vm(). */
+void collect_garbage(VM *vm)
+{
+#ifdef DEFERRED_RC
+  /* The objects freed along the way drop what they refer to into the
+   * table, to be reconciled the next time around. */
+  do {
+    zct_recheck();
+    mark_stacks(vm);
+  } while (zct_reconcile() > 0);
+#endif
+#ifdef CYCLE_GC
+  cycle_flush();
+#endif
+  release_pending(SIZE_MAX);
+}
+
+/* Calls, returns, yields, and the backward jumps of loops are where
+ * the memory manager gets to run, since every reference is either on
+ * one of the stacks or in an object there. With --free-budget, this
+ * is where the objects that have died since get freed, a few at a
+ * time. */
+static inline void safe_point(VM *vm)
+{
+  if (vm->free_budget) {
+    release_pending(vm->free_budget);
+  }
+  reconcile(vm);
+#ifdef CYCLE_GC
+  if (cycle_due()) {
+    cycle_collect();
+  }
+#endif
+}
+
 static void dealloc_stack(VM *vm)
 {
   for (int i = (int) vm->tos - 1; i >= 0; i--) {
-    objdecref(&vm->stack[i]);
+    stack_decref(&vm->stack[i]);
+  }
+
+  /* The generators that next(...) resumed are the top ones on the
+   * generator stack, one per snapshot of the frame that resumed them,
+   * and each holds a reference (see resume_generator()). The current
+   * task's generator, below them, is the task's. */
+  while (vm->fs_count > 0 && vm->gen_count > 0 &&
+         !(vm->current_task &&
+           vm->gen_stack[vm->gen_count - 1] == vm->current_task->gen)) {
+    FrameSnapshot *fs = vm->fs_stack[--vm->fs_count];
+    for (int i = (int) fs->tos - 1; i >= 0; i--) {
+      stack_decref(&fs->stack[i]);
+    }
+    slab_free(SLAB_FRAME_SNAPSHOT, fs);
+
+    Object gen_obj = GENERATOR_VAL(vm->gen_stack[--vm->gen_count]);
+    objdecref(&gen_obj);
   }
 }
 
@@ -69,7 +273,7 @@ static inline uint64_t clamp(double d)
 {
   if (d < 0.0) {
     return 0;
-  } else if (d > (double) UINT64_MAX) {
+  } else if (d >= (double) UINT64_MAX) {
     return UINT64_MAX;
   } else {
     return (uint64_t) d;
@@ -78,36 +282,36 @@ static inline uint64_t clamp(double d)
 
 #define UNLIKELY(exp) (!!(__builtin_expect((exp), 0)))
 
-#define BINARY_OP_FAST(op)                          \
-  do {                                              \
-    Object *lhs = &vm->stack[vm->tos - 2];          \
-    Object *rhs = &vm->stack[vm->tos - 1];          \
-                                                    \
-    if (UNLIKELY(!IS_NUM(*lhs) || !IS_NUM(*rhs))) { \
-      objdecref(rhs);                               \
-      objdecref(lhs);                               \
-                                                    \
-      RUNTIME_ERROR("operands must be numbers");    \
-    }                                               \
-                                                    \
-    *lhs = NUM_VAL(AS_NUM(*lhs) op AS_NUM(*rhs));   \
-                                                    \
-    vm->tos--;                                      \
+#define BINARY_OP_FAST(op)                                              \
+  do {                                                                  \
+    Object *lhs = &vm->stack[vm->tos - 2];                              \
+    Object *rhs = &vm->stack[vm->tos - 1];                              \
+                                                                        \
+    /* The operands stay on the stack, which the error releases. */     \
+    if (UNLIKELY(!IS_NUM(*lhs) || !IS_NUM(*rhs))) {                     \
+      RUNTIME_ERROR("cannot '" #op "' objects of types: '%s' and '%s'", \
+                    get_object_type(lhs), get_object_type(rhs));        \
+    }                                                                   \
+                                                                        \
+    *lhs = NUM_VAL(AS_NUM(*lhs) op AS_NUM(*rhs));                       \
+                                                                        \
+    vm->tos--;                                                          \
   } while (0)
 
 #define BINARY_OP(op, wrapper)                                          \
   do {                                                                  \
-    Object b = pop(vm);                                                 \
-    Object a = pop(vm);                                                 \
-                                                                        \
-    if (UNLIKELY(!IS_NUM(a) || !IS_NUM(b))) {                           \
-      objdecref(&b);                                                    \
-      objdecref(&a);                                                    \
+    Object *lhs = &vm->stack[vm->tos - 2];                              \
+    Object *rhs = &vm->stack[vm->tos - 1];                              \
                                                                         \
+    /* The operands stay on the stack, which the error releases. */     \
+    if (UNLIKELY(!IS_NUM(*lhs) || !IS_NUM(*rhs))) {                     \
       RUNTIME_ERROR("cannot '" #op "' objects of types: '%s' and '%s'", \
-                    get_object_type(&a), get_object_type(&b));          \
+                    get_object_type(lhs), get_object_type(rhs));        \
     }                                                                   \
                                                                         \
+    Object b = pop(vm);                                                 \
+    Object a = pop(vm);                                                 \
+                                                                        \
     /* No need to decref here as they're nums.  */                      \
                                                                         \
     Object obj = wrapper(AS_NUM(a) op AS_NUM(b));                       \
@@ -121,9 +325,6 @@ static inline uint64_t clamp(double d)
     Object *rhs = &vm->stack[vm->tos - 1];                              \
                                                                         \
     if (UNLIKELY(!IS_NUM(*lhs) || !IS_NUM(*rhs))) {                     \
-      objdecref(lhs);                                                   \
-      objdecref(rhs);                                                   \
-                                                                        \
       RUNTIME_ERROR("cannot '" #op "' objects of types: '%s' and '%s'", \
                     get_object_type(lhs), get_object_type(rhs));        \
     }                                                                   \
@@ -140,17 +341,18 @@ static inline uint64_t clamp(double d)
 
 #define BITWISE_OP(op)                                                  \
   do {                                                                  \
-    Object b = pop(vm);                                                 \
-    Object a = pop(vm);                                                 \
-                                                                        \
-    if (!IS_NUM(a) || !IS_NUM(b)) {                                     \
-      objdecref(&b);                                                    \
-      objdecref(&a);                                                    \
+    Object *lhs = &vm->stack[vm->tos - 2];                              \
+    Object *rhs = &vm->stack[vm->tos - 1];                              \
                                                                         \
+    /* The operands stay on the stack, which the error releases. */     \
+    if (UNLIKELY(!IS_NUM(*lhs) || !IS_NUM(*rhs))) {                     \
       RUNTIME_ERROR("cannot '" #op "' objects of types: '%s' and '%s'", \
-                    get_object_type(&a), get_object_type(&b));          \
+                    get_object_type(lhs), get_object_type(rhs));        \
     }                                                                   \
                                                                         \
+    Object b = pop(vm);                                                 \
+    Object a = pop(vm);                                                 \
+                                                                        \
     uint64_t clamped_a = clamp(AS_NUM(a));                              \
     uint64_t clamped_b = clamp(AS_NUM(b));                              \
                                                                         \
@@ -163,6 +365,11 @@ static inline uint64_t clamp(double d)
 
 #define READ_UINT8() (*++(*ip))
 
+/* The indexes of the strings in the sp and of the locals on the stack
+ * are 2 bytes wide, big endian, like the jump offsets. */
+#define READ_UINT16() \
+  (*ip += 2, (uint16_t) (((*ip)[-1] << 8) | (*ip)[0]))
+
 #define READ_INT16()                               \
   /* ip points to one of the jump instructions and \
    * there is a 2-byte operand (offset) that comes \
@@ -203,7 +410,7 @@ static inline uint64_t clamp(double d)
     printf("fp stack: [");                                     \
                                                                \
     for (size_t i = 1; i < vm->fp_count; i++) {                \
-      printf("<%s (loc: %d)>", vm->fp_stack[i].fn->func->name, \
+      printf("<%s (loc: %d)>", vm->fp_stack[i].fn->proto->name, \
              vm->fp_stack[i].location);                        \
       if (i < vm->fp_count - 1) {                              \
         printf(", ");                                          \
@@ -220,6 +427,18 @@ static inline uint64_t clamp(double d)
     longjmp(vm->trap, -1);                    \
   } while (0)
 
+/* A function whose body failed to compile when it was first called is
+ * reported like any other compile error, but it stops the VM like a
+ * runtime error does. */
+#define COMPILE_ERROR(result)     \
+  do {                            \
+    vm->err_msg = (result).msg;   \
+    vm->err_span = (result).span; \
+    vm->err_in_compiler = true;   \
+    dealloc_stack(vm);            \
+    longjmp(vm->trap, -1);        \
+  } while (0)
+
 static inline bool check_equality(Object *left, Object *right)
 {
 #ifdef NAN_BOXING
@@ -258,7 +477,7 @@ static inline bool check_equality(Object *left, Object *right)
 #endif
 }
 
-static inline uint32_t adjust_idx(VM *vm, uint8_t idx)
+static inline uint32_t adjust_idx(VM *vm, uint16_t idx)
 {
   /* 'idx' is adjusted to be relative to the current fra-
    * me pointer, */
@@ -271,6 +490,40 @@ static inline void push_frame(VM *vm, BytecodePtr frame)
   vm->fp_base = frame.location;
 }
 
+/* Compiles the body of 'proto', if it's yet to be, which is the case
+ * the first time a function defined at the top level is called. */
+static inline void ensure_compiled(VM *vm, const Bytecode *restrict code,
+                                   const FunctionProto *proto)
+{
+  if (proto->deferred) {
+    CompileResult result =
+        compile_deferred((Bytecode *) code, (FunctionProto *) proto);
+    if (!result.is_ok) {
+      COMPILE_ERROR(result);
+    }
+  }
+}
+
+/* Pushes a frame for calling 'c', with its arguments starting at 'loc-
+ * ation' on the stack, and points 'ip' right before the first instru-
+ * ction of 'c', the same as a handler leaves it. */
+static inline void enter_closure(VM *vm, const Bytecode *restrict code,
+                                 Closure *c, size_t location,
+                                 uint8_t *restrict *ip)
+{
+  ensure_compiled(vm, code, c->proto);
+
+  if (vm->fp_count == STACK_MAX ||
+      location + c->proto->max_stack > STACK_MAX) {
+    RUNTIME_ERROR("stack overflow in '%s'", c->proto->name);
+  }
+
+  BytecodePtr frame = {.addr = *ip, .location = location, .fn = c};
+  push_frame(vm, frame);
+
+  *ip = c->proto->code.data - 1;
+}
+
 static inline BytecodePtr pop_frame(VM *vm)
 {
   BytecodePtr frame = vm->fp_stack[--vm->fp_count];
@@ -301,13 +554,17 @@ static inline void handle_op_print(VM *vm, const Bytecode *restrict code,
                                    uint8_t *restrict *ip)
 {
   Object object = pop(vm);
+
+  /* With worker threads, each line must come out in one piece. */
+  flockfile(stdout);
 #ifdef venom_debug_vm
   printf("dbg print :: ");
 #endif
   print_object(&object);
   printf("\n");
+  funlockfile(stdout);
 
-  objdecref(&object);
+  stack_decref(&object);
 }
 
 /* OP_ADD pops two objects off the stack, adds them, and
@@ -351,8 +608,8 @@ static inline void handle_op_mod(VM *vm, const Bytecode *restrict code,
   Object a = pop(vm);
 
   if (!IS_NUM(a) || !IS_NUM(b)) {
-    objdecref(&b);
-    objdecref(&a);
+    stack_decref(&b);
+    stack_decref(&a);
 
     RUNTIME_ERROR("cannot '%%' objects of types: '%s' and '%s'",
                   get_object_type(&a), get_object_type(&b));
@@ -399,7 +656,7 @@ static inline void handle_op_bitnot(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
 
   if (!IS_NUM(obj)) {
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("cannot '~' objects of type: '%s'", get_object_type(&obj));
   }
 
@@ -442,8 +699,8 @@ static inline void handle_op_eq(VM *vm, const Bytecode *restrict code,
 
   bool eq = check_equality(&a, &b);
 
-  objdecref(&a);
-  objdecref(&b);
+  stack_decref(&a);
+  stack_decref(&b);
 
   push(vm, BOOL_VAL(eq));
 }
@@ -475,7 +732,7 @@ static inline void handle_op_not(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
 
   if (!IS_BOOL(obj)) {
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("cannot '!' objects of type: '%s'", get_object_type(&obj));
   }
 
@@ -491,7 +748,7 @@ static inline void handle_op_neg(VM *vm, const Bytecode *restrict code,
   Object original = pop(vm);
 
   if (!IS_NUM(original)) {
-    objdecref(&original);
+    stack_decref(&original);
     RUNTIME_ERROR("cannot '-' objects of type: '%s'",
                   get_object_type(&original));
   }
@@ -507,6 +764,15 @@ static inline void handle_op_true(VM *vm, const Bytecode *restrict code,
   push(vm, BOOL_VAL(true));
 }
 
+/* OP_FALSE pushes a bool object ('false') on the stack.
+ * The compiler emits `true !` for it, which the peep-
+ * hole pass folds into this. */
+static inline void handle_op_false(VM *vm, const Bytecode *restrict code,
+                                   uint8_t *restrict *ip)
+{
+  push(vm, BOOL_VAL(false));
+}
+
 /* OP_NULL pushes a null object on the stack. */
 static inline void handle_op_null(VM *vm, const Bytecode *restrict code,
                                   uint8_t *restrict *ip)
@@ -538,16 +804,35 @@ static inline void handle_op_const(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_str(VM *vm, const Bytecode *restrict code,
                                  uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
-
-  String s = {.refcount = 1, .value = own_string(code->sp.data[idx])};
-  push(vm, STRING_VAL(ALLOC(s)));
+  const uint8_t *site = *ip;
+  uint16_t idx = READ_UINT16();
+
+  String s = {.refcount = 1,
+              .type = OBJ_STRING,
+              .value = own_string(code->sp.data[idx])};
+  push_new(vm, STRING_VAL(SLAB_ALLOC(SLAB_STRING, s)));
+  profile_alloc(vm, code, site);
 }
 
 /* OP_JZ reads a signed 2-byte offset (that could be ne-
  * gative), pops an object off the stack, and increments
  * the instruction pointer by the offset, if and only if
  * the popped object was 'false'. */
+static void scheduler_preempt_current(VM *vm, const Bytecode *restrict code,
+                                      uint8_t *restrict *ip);
+
+/* Charges the current task for a back-edge or a call, and preempts
+ * it once it has used up its time slice (see --quantum). The budg-
+ * et stays at zero whenever preemption is off, so outside of a pre-
+ * emptive run(...) this is just one well-predicted branch. */
+static inline void charge_budget(VM *vm, const Bytecode *restrict code,
+                                 uint8_t *restrict *ip)
+{
+  if (UNLIKELY(vm->budget > 0) && --vm->budget == 0) {
+    scheduler_preempt_current(vm, code, ip);
+  }
+}
+
 static inline void handle_op_jz(VM *vm, const Bytecode *restrict code,
                                 uint8_t *restrict *ip)
 {
@@ -557,6 +842,26 @@ static inline void handle_op_jz(VM *vm, const Bytecode *restrict code,
   *ip += offset * !AS_BOOL(obj);
 }
 
+/* OP_JNZ is OP_JZ, except that it jumps if and only if
+ * the popped object was 'true'. The peephole pass makes
+ * it out of OP_NOT followed by OP_JZ, so it rejects non-
+ * bools the way OP_NOT would have. */
+static inline void handle_op_jnz(VM *vm, const Bytecode *restrict code,
+                                 uint8_t *restrict *ip)
+{
+  int16_t offset = READ_INT16();
+
+  Object obj = pop(vm);
+
+  if (!IS_BOOL(obj)) {
+    const char *type = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("cannot '!' objects of type: '%s'", type);
+  }
+
+  *ip += offset * AS_BOOL(obj);
+}
+
 /* OP_JMP reads a signed 2-byte offset (that could be ne-
  * gative), and increments the instruction pointer by the
  * offset. Unlike OP_JZ, which is a conditional jump, the
@@ -566,11 +871,28 @@ static inline void handle_op_jmp(VM *vm, const Bytecode *restrict code,
 {
   int16_t offset = READ_INT16();
   *ip += offset;
+
+  /* Loops are compiled to backward jumps. */
+  if (offset < 0) {
+    safe_point(vm);
+    charge_budget(vm, code, ip);
+  }
+}
+
+/* The globals get a slot for every string in the pool before the code
+ * starts running (see exec()), since the pointers to them must stay
+ * put. The strings that the functions defined at the top level add
+ * to the pool once they get compiled are never names of globals, as
+ * those are all added along with the code of the script. */
+static inline Object *global_slot(VM *vm, uint16_t name_idx)
+{
+  assert(name_idx < vm->globals.count);
+  return &vm->globals.data[name_idx];
 }
 
 /* OP_SET_GLOBAL reads a 4-byte index of the variable name
- * in the chunk's sp, pops an object off the stack and in-
- * serts it into the vm's globals table under that name.
+ * in the chunk's sp, pops an object off the stack and st-
+ * ores it in the vm's globals at that index.
  *
  * REFCOUNTING: We do NOT need to increment the refcount of
  * the object we are inserting into the table because we're
@@ -582,47 +904,45 @@ static inline void handle_op_jmp(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_set_global(VM *vm, const Bytecode *restrict code,
                                         uint8_t *restrict *ip)
 {
-  uint8_t name_idx = READ_UINT8();
+  uint16_t name_idx = READ_UINT16();
 
   Object obj = pop(vm);
 
-  Object *target = table_get(&vm->globals, code->sp.data[name_idx]);
-  if (target) {
-    objdecref(target);
-  }
+  Object *target = global_slot(vm, name_idx);
+  objdecref(target);
 
-  table_insert(&vm->globals, code->sp.data[name_idx], obj);
+  to_heap(&obj);
+  *target = obj;
 }
 
 /* OP_GET_GLOBAL reads a 4-byte index of the variable name
- * in the chunk's sp, looks up an object with that name in
- * the vm's globals table, and pushes it on the stack.
+ * in the chunk's sp, looks up the object at that index in
+ * the vm's globals, and pushes it on the stack.
  *
  * REFCOUNTING: Since the object will be present in yet an-
  * other location, the refcount must be incremented. */
 static inline void handle_op_get_global(VM *vm, const Bytecode *restrict code,
                                         uint8_t *restrict *ip)
 {
-  uint8_t name_idx = READ_UINT8();
+  uint16_t name_idx = READ_UINT16();
 
-  Object *obj = table_get_unchecked(&vm->globals, code->sp.data[name_idx]);
+  Object *obj = global_slot(vm, name_idx);
   push(vm, *obj);
 
-  objincref(obj);
+  stack_incref(obj);
 }
 
 /* OP_GET_GLOBAL_PTR reads a 4-byte index of the variable
- * name in the chunk's sp, looks up the object under that
- * name in in the vm's globals table, and pushes its add-
- * ress on the stack. */
+ * name in the chunk's sp, looks up the object at that in-
+ * dex in the vm's globals, and pushes its address on the
+ * stack. */
 static inline void handle_op_get_global_ptr(VM *vm,
                                             const Bytecode *restrict code,
                                             uint8_t *restrict *ip)
 {
-  uint8_t name_idx = READ_UINT8();
+  uint16_t name_idx = READ_UINT16();
 
-  Object *object_ptr =
-      table_get_unchecked(&vm->globals, code->sp.data[name_idx]);
+  Object *object_ptr = global_slot(vm, name_idx);
 
   push(vm, PTR_VAL(object_ptr));
 }
@@ -637,11 +957,11 @@ static inline void handle_op_get_global_ptr(VM *vm,
 static inline void handle_op_deepset(VM *vm, const Bytecode *restrict code,
                                      uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
   size_t adjusted_idx = adjust_idx(vm, idx);
 
   Object obj = pop(vm);
-  objdecref(&vm->stack[adjusted_idx]);
+  stack_decref(&vm->stack[adjusted_idx]);
 
   vm->stack[adjusted_idx] = obj;
 }
@@ -662,6 +982,10 @@ static inline void handle_op_derefset(VM *vm, const Bytecode *restrict code,
   Object item = pop(vm);
   Object ptr = pop(vm);
 
+  if (AS_PTR(ptr) < vm->stack || AS_PTR(ptr) >= vm->stack + STACK_MAX) {
+    to_heap(&item);
+  }
+
   *AS_PTR(ptr) = item;
 }
 
@@ -675,13 +999,26 @@ static inline void handle_op_derefset(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_deepget(VM *vm, const Bytecode *restrict code,
                                      uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
   size_t adjusted_idx = adjust_idx(vm, idx);
 
   Object obj = vm->stack[adjusted_idx];
   push(vm, obj);
 
-  objincref(&obj);
+  stack_incref(&obj);
+}
+
+/* OP_DEEPGET_BORROW is OP_DEEPGET for an object that the next ins-
+ * truction consumes (see elide_refcounts() in compiler.c).
+ *
+ * REFCOUNTING: The object is borrowed from the slot it lives in, so
+ * its refcount is left alone, and the consumer won't decrement it. */
+static inline void handle_op_deepget_borrow(VM *vm,
+                                            const Bytecode *restrict code,
+                                            uint8_t *restrict *ip)
+{
+  uint16_t idx = READ_UINT16();
+  push(vm, vm->stack[adjust_idx(vm, idx)]);
 }
 
 /* OP_DEEPGET_PTR reads a 4-byte index (1-based) of the
@@ -691,7 +1028,7 @@ static inline void handle_op_deepget(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_deepget_ptr(VM *vm, const Bytecode *restrict code,
                                          uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
   size_t adjusted_idx = adjust_idx(vm, idx);
 
   Object *object_ptr = &vm->stack[adjusted_idx];
@@ -714,14 +1051,14 @@ static inline void handle_op_deepget_ptr(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_setattr(VM *vm, const Bytecode *restrict code,
                                      uint8_t *restrict *ip)
 {
-  uint8_t property_name_idx = READ_UINT8();
+  uint16_t property_name_idx = READ_UINT16();
 
   Object value = pop(vm);
   Object obj = pop(vm);
 
   if (!IS_STRUCT(obj)) {
-    objdecref(&value);
-    objdecref(&obj);
+    stack_decref(&value);
+    stack_decref(&obj);
     RUNTIME_ERROR("cannot 'setattr()' objects of type: '%s'",
                   get_object_type(&obj));
   }
@@ -732,6 +1069,7 @@ static inline void handle_op_setattr(VM *vm, const Bytecode *restrict code,
     objdecref(target);
   }
 
+  to_heap(&value);
   table_insert(AS_STRUCT(obj)->properties, code->sp.data[property_name_idx],
                value);
 
@@ -754,12 +1092,42 @@ static inline void handle_op_setattr(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_getattr(VM *vm, const Bytecode *restrict code,
                                      uint8_t *restrict *ip)
 {
-  uint8_t property_name_idx = READ_UINT8();
+  uint16_t property_name_idx = READ_UINT16();
+
+  Object obj = pop(vm);
+
+  if (!IS_STRUCT(obj)) {
+    stack_decref(&obj);
+    RUNTIME_ERROR("cannot 'getattr()' objects of type: '%s'",
+                  get_object_type(&obj));
+  }
+
+  Object *property =
+      table_get(AS_STRUCT(obj)->properties, code->sp.data[property_name_idx]);
+  if (!property) {
+    RUNTIME_ERROR("Property '%s' is not defined on struct '%s'.",
+                  code->sp.data[property_name_idx], AS_STRUCT(obj)->name);
+  }
+  push(vm, *property);
+
+  stack_incref(property);
+  stack_decref(&obj);
+}
+
+/* OP_GETATTR_BORROW is OP_GETATTR for a borrowed object (see OP_DE-
+ * EPGET_BORROW).
+ *
+ * REFCOUNTING: Only the property's refcount is incremented, because
+ * the popped object was never counted in the first place. */
+static inline void handle_op_getattr_borrow(VM *vm,
+                                            const Bytecode *restrict code,
+                                            uint8_t *restrict *ip)
+{
+  uint16_t property_name_idx = READ_UINT16();
 
   Object obj = pop(vm);
 
   if (!IS_STRUCT(obj)) {
-    objdecref(&obj);
     RUNTIME_ERROR("cannot 'getattr()' objects of type: '%s'",
                   get_object_type(&obj));
   }
@@ -772,8 +1140,7 @@ static inline void handle_op_getattr(VM *vm, const Bytecode *restrict code,
   }
   push(vm, *property);
 
-  objincref(property);
-  objdecref(&obj);
+  stack_incref(property);
 }
 
 /* OP_GETATTR_PTR reads a 4-byte index of the property name
@@ -788,7 +1155,7 @@ static inline void handle_op_getattr(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_getattr_ptr(VM *vm, const Bytecode *restrict code,
                                          uint8_t *restrict *ip)
 {
-  uint8_t property_name_idx = READ_UINT8();
+  uint16_t property_name_idx = READ_UINT16();
 
   Object object = pop(vm);
 
@@ -806,7 +1173,7 @@ static inline void handle_op_getattr_ptr(VM *vm, const Bytecode *restrict code,
 
   push(vm, PTR_VAL(property));
 
-  objdecref(&object);
+  stack_decref(&object);
 }
 
 /* OP_STRUCT reads a 4-byte index of the struct name in the
@@ -819,7 +1186,8 @@ static inline void handle_op_getattr_ptr(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_struct(VM *vm, const Bytecode *restrict code,
                                     uint8_t *restrict *ip)
 {
-  uint8_t structname = READ_UINT8();
+  const uint8_t *site = *ip;
+  uint16_t structname = READ_UINT16();
 
   StructBlueprint *sb = table_get(vm->blueprints, code->sp.data[structname]);
   if (!sb) {
@@ -829,24 +1197,23 @@ static inline void handle_op_struct(VM *vm, const Bytecode *restrict code,
   Struct s = {.name = code->sp.data[structname],
               .propcount = sb->property_indexes->count,
               .refcount = 1,
+              .type = OBJ_STRUCT,
               .properties = calloc(1, sizeof(Table_Object))};
 
   for (size_t i = 0; i < sb->methods->count; i++) {
-    Function f = {
-        .location = sb->methods->items[i]->location,
-        .name = sb->methods->items[i]->name,
-        .paramcount = sb->methods->items[i]->paramcount,
-        .upvalue_count = 0,
-    };
-
     Closure c = {
-        .func = ALLOC(f), .refcount = 1, .upvalue_count = 0, .upvalues = NULL};
+        .proto = sb->methods->items[i],
+        .refcount = 1,
+        .type = OBJ_CLOSURE,
+        .upvalue_count = 0,
+        .upvalues = NULL};
 
     table_insert(s.properties, sb->methods->items[i]->name,
-                 CLOSURE_VAL(ALLOC(c)));
+                 CLOSURE_VAL(SLAB_ALLOC(SLAB_CLOSURE, c)));
   }
 
-  push(vm, STRUCT_VAL(ALLOC(s)));
+  push_new(vm, STRUCT_VAL(SLAB_ALLOC(SLAB_STRUCT, s)));
+  profile_alloc(vm, code, site);
 }
 
 /* OP_STRUCT_BLUEPRINT reads a 4-byte name index of the
@@ -863,19 +1230,23 @@ static inline void handle_op_struct_blueprint(VM *vm,
                                               const Bytecode *restrict code,
                                               uint8_t *restrict *ip)
 {
-  uint8_t name_idx = READ_UINT8();
+  uint16_t name_idx = READ_UINT16();
   uint8_t propcount = READ_UINT8();
 
+  if (vm->pool) {
+    RUNTIME_ERROR("struct declarations cannot run on the worker threads");
+  }
+
   DynArray_char_ptr properties = {0};
   DynArray_uint8_t prop_indexes = {0};
   for (size_t i = 0; i < propcount; i++) {
-    dynarray_insert(&properties, code->sp.data[READ_UINT8()]);
+    dynarray_insert(&properties, code->sp.data[READ_UINT16()]);
     dynarray_insert(&prop_indexes, READ_UINT8());
   }
 
   StructBlueprint sb = {.name = code->sp.data[name_idx],
                         .property_indexes = calloc(1, sizeof(Table_int)),
-                        .methods = calloc(1, sizeof(Table_Function))};
+                        .methods = calloc(1, sizeof(Table_FunctionProtoPtr))};
 
   for (size_t i = 0; i < properties.count; i++) {
     table_insert(sb.property_indexes, properties.data[i], prop_indexes.data[i]);
@@ -887,19 +1258,21 @@ static inline void handle_op_struct_blueprint(VM *vm,
   dynarray_free(&prop_indexes);
 }
 
-/* OP_IMPL reads a 4-byte blueprint name idx in the sp,
- * and a 4-byte method count. Then, for each method, it
- * reads a 4-byte method name index, a 4-byte param co-
- * unt for the method, and a 4-byte location of the me-
- * thod in the bytecode. Then, it constructs a Function
- * object with all this information and inserts it into
- * the blueprint's methods Table. */
+/* OP_IMPL reads a 2-byte blueprint name idx in the sp,
+ * and a 1-byte method count. Then, for each method, it
+ * reads the 2-byte index of the method's proto, which
+ * it inserts into the blueprint's methods Table under
+ * the method's name. */
 static inline void handle_op_impl(VM *vm, const Bytecode *restrict code,
                                   uint8_t *restrict *ip)
 {
-  uint8_t blueprint_name_idx = READ_UINT8();
+  uint16_t blueprint_name_idx = READ_UINT16();
   uint8_t method_count = READ_UINT8();
 
+  if (vm->pool) {
+    RUNTIME_ERROR("impl blocks cannot run on the worker threads");
+  }
+
   StructBlueprint *sb =
       table_get(vm->blueprints, code->sp.data[blueprint_name_idx]);
   if (!sb) {
@@ -908,23 +1281,14 @@ static inline void handle_op_impl(VM *vm, const Bytecode *restrict code,
   }
 
   for (size_t i = 0; i < method_count; i++) {
-    uint8_t method_name_idx = READ_UINT8();
-    uint8_t paramcount = READ_UINT8();
-    uint8_t location = READ_UINT8();
-
-    Function method = {
-        .location = location,
-        .paramcount = paramcount,
-        .name = code->sp.data[method_name_idx],
-    };
-
-    table_insert(sb->methods, code->sp.data[method_name_idx], ALLOC(method));
+    const FunctionProto *method = code->protos.data[READ_UINT16()];
+    table_insert(sb->methods, method->name, method);
   }
 }
 
 static Upvalue *new_upvalue(Object *slot)
 {
-  Upvalue *upvalue = malloc(sizeof(Upvalue));
+  Upvalue *upvalue = slab_alloc(SLAB_UPVALUE);
   upvalue->location = slot;
   upvalue->next = NULL;
   return upvalue;
@@ -962,47 +1326,47 @@ static void close_upvalues(VM *vm, Object *last)
     Upvalue *upvalue = vm->upvalues;
     upvalue->closed = *upvalue->location;
     upvalue->location = &upvalue->closed;
+    to_heap(&upvalue->closed);
     vm->upvalues = upvalue->next;
   }
 }
 
-/* OP_CLOSURE reads a function name idx in the sp, a parameter
- * count, a function location in the bytecode, and the upvalue
- * count. Then, for each upvalue, it reads the upvalue index,
- * and captures it. Then, it constructs a Closure object with
- * all this information and pushes it on the stack. */
+/* OP_CLOSURE reads the index of a function's proto, and the
+ * upvalue count. Then, for each upvalue, it reads the stack slot
+ * of the variable it captures, and captures it. Then, it const-
+ * ructs a Closure object pointing at the proto, and pushes it on
+ * the stack. The upvalues are laid out in the order they're read
+ * in, which is what OP_GET_UPVALUE and friends index them by. */
 static inline void handle_op_closure(VM *vm, const Bytecode *restrict code,
                                      uint8_t *restrict *ip)
 {
-  uint8_t name_idx, paramcount, location, upvalue_count;
-
-  Function f;
-  Closure c;
-
-  name_idx = READ_UINT8();
-  paramcount = READ_UINT8();
-  location = READ_UINT8();
-  upvalue_count = READ_UINT8();
-
-  f = (Function){.name = code->sp.data[name_idx],
-                 .paramcount = paramcount,
-                 .location = location,
-                 .upvalue_count = upvalue_count};
-
-  c = (Closure){
-      .upvalues = malloc(sizeof(Upvalue *) * f.upvalue_count),
-      .upvalue_count = f.upvalue_count,
+  const uint8_t *site = *ip;
+  uint16_t proto_idx = READ_UINT16();
+  uint8_t upvalue_count = READ_UINT8();
+  const FunctionProto *proto = code->protos.data[proto_idx];
+
+  /* The closure gets as many upvalues as its proto says it has, and
+   * the operand can't make it write past them. */
+  assert(upvalue_count == proto->upvalue_count);
+
+  Closure c = {
+      .upvalues = malloc(sizeof(Upvalue *) * proto->upvalue_count),
+      .upvalue_count = proto->upvalue_count,
       .refcount = 1,
-      .func = ALLOC(f),
+      .type = OBJ_CLOSURE,
+      .proto = proto,
   };
 
-  for (int i = 0; i < c.upvalue_count; i++) {
-    uint8_t idx = READ_UINT8();
-    c.upvalues[idx] = capture_upvalue(vm, &vm->stack[adjust_idx(vm, idx)]);
+  for (int i = 0; i < upvalue_count; i++) {
+    uint16_t idx = READ_UINT16();
+    if (i < c.upvalue_count) {
+      c.upvalues[i] = capture_upvalue(vm, &vm->stack[adjust_idx(vm, idx)]);
+    }
   }
 
-  Object obj = CLOSURE_VAL(ALLOC(c));
-  push(vm, obj);
+  Object obj = CLOSURE_VAL(SLAB_ALLOC(SLAB_CLOSURE, c));
+  push_new(vm, obj);
+  profile_alloc(vm, code, site);
 }
 
 /* OP_CALL reads a 4-byte number, argcount, and uses it to construct a
@@ -1022,17 +1386,16 @@ static inline void handle_op_closure(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_call(VM *vm, const Bytecode *restrict code,
                                   uint8_t *restrict *ip)
 {
+  safe_point(vm);
+
   uint8_t argcount = READ_UINT8();
 
   Object obj = pop(vm);
-  objdecref(&obj);
-
-  Closure *f = AS_CLOSURE(obj);
+  stack_decref(&obj);
 
-  BytecodePtr ip_obj = {.addr = *(ip), .location = vm->tos - argcount, .fn = f};
-  push_frame(vm, ip_obj);
+  enter_closure(vm, code, AS_CLOSURE(obj), vm->tos - argcount, ip);
 
-  *ip = &code->code.data[f->func->location - 1];
+  charge_budget(vm, code, ip);
 }
 
 /* OP_CALL_METHOD reads a 4-byte number, method_name_idx, which is the
@@ -1047,7 +1410,9 @@ static inline void handle_op_call(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_call_method(VM *vm, const Bytecode *restrict code,
                                          uint8_t *restrict *ip)
 {
-  uint8_t method_name_idx = READ_UINT8();
+  safe_point(vm);
+
+  uint16_t method_name_idx = READ_UINT16();
   uint8_t argcount = READ_UINT8();
 
   Object object = peek(vm, argcount);
@@ -1068,14 +1433,9 @@ static inline void handle_op_call_method(VM *vm, const Bytecode *restrict code,
 
   Closure *c = AS_CLOSURE(*methodobj);
 
-  /* Push the instruction pointer on the frame ptr stack.
-   * No need to take into account the jump sequence (+3). */
-  BytecodePtr ip_obj = {
-      .addr = *ip, .location = vm->tos - c->func->paramcount, .fn = c};
-  push_frame(vm, ip_obj);
+  enter_closure(vm, code, c, vm->tos - c->proto->paramcount, ip);
 
-  /* Direct jump to one byte before the method location. */
-  *ip = &code->code.data[c->func->location - 1];
+  charge_budget(vm, code, ip);
 }
 
 static void scheduler_complete_current(VM *vm, const Bytecode *restrict code,
@@ -1087,13 +1447,13 @@ static void scheduler_complete_current(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_ret(VM *vm, const Bytecode *restrict code,
                                  uint8_t *restrict *ip)
 {
-  if (vm->scheduler_running && vm->current_task) {
-    Generator *gen = vm->current_task->gen;
-    if (vm->fp_count > 0 && vm->fp_stack[vm->fp_count - 1].fn != gen->fn) {
-      BytecodePtr ptr = pop_frame(vm);
-      *ip = ptr.addr;
-    }
+  safe_point(vm);
 
+  /* A coroutine only finishes when its own frame returns. Anything
+   * above that frame is an ordinary call it made, which returns the
+   * usual way below. */
+  if (vm->scheduler_running && vm->current_task &&
+      vm->fp_stack[vm->fp_count - 1].fn == vm->current_task->gen->fn) {
     Object returned = pop(vm);
     scheduler_complete_current(vm, code, ip, returned);
     return;
@@ -1101,12 +1461,9 @@ static inline void handle_op_ret(VM *vm, const Bytecode *restrict code,
 
   (void) code;
 
-  if (vm->gen_count > 0) {
+  if (vm->gen_count > 0 && vm->fp_stack[vm->fp_count - 1].fn ==
+                               vm->gen_stack[vm->gen_count - 1]->fn) {
     Generator *gen = vm->gen_stack[vm->gen_count - 1];
-    if (vm->fp_count > 0 && vm->fp_stack[vm->fp_count - 1].fn != gen->fn) {
-      BytecodePtr ptr = pop_frame(vm);
-      *ip = ptr.addr;
-    }
 
     --vm->gen_count;
     FrameSnapshot *fs = vm->fs_stack[--vm->fs_count];
@@ -1126,7 +1483,7 @@ static inline void handle_op_ret(VM *vm, const Bytecode *restrict code,
 
     push(vm, returned);
 
-    free(fs);
+    slab_free(SLAB_FRAME_SNAPSHOT, fs);
 
     Object gen_obj = GENERATOR_VAL(gen);
     objdecref(&gen_obj);
@@ -1147,7 +1504,7 @@ static inline void handle_op_pop(VM *vm, const Bytecode *restrict code,
                                  uint8_t *restrict *ip)
 {
   Object obj = pop(vm);
-  objdecref(&obj);
+  stack_decref(&obj);
 }
 
 /* OP_DEREF pops an object off the stack, dereferences it
@@ -1161,7 +1518,7 @@ static inline void handle_op_deref(VM *vm, const Bytecode *restrict code,
   Object ptrobj = pop(vm);
   push(vm, *AS_PTR(ptrobj));
 
-  objincref(&*AS_PTR(ptrobj));
+  stack_incref(&*AS_PTR(ptrobj));
 }
 
 /* OP_STRCAT pops two objects off the stack, checks whether they
@@ -1177,6 +1534,7 @@ static inline void handle_op_deref(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_strcat(VM *vm, const Bytecode *restrict code,
                                     uint8_t *restrict *ip)
 {
+  const uint8_t *site = *ip;
   Object b = pop(vm);
   Object a = pop(vm);
 
@@ -1184,15 +1542,16 @@ static inline void handle_op_strcat(VM *vm, const Bytecode *restrict code,
     char *result =
         concatenate_strings(AS_STRING(a)->value, AS_STRING(b)->value);
 
-    String s = {.refcount = 1, .value = result};
+    String s = {.refcount = 1, .type = OBJ_STRING, .value = result};
 
-    push(vm, STRING_VAL(ALLOC(s)));
+    push_new(vm, STRING_VAL(SLAB_ALLOC(SLAB_STRING, s)));
+    profile_alloc(vm, code, site);
 
-    objdecref(&b);
-    objdecref(&a);
+    stack_decref(&b);
+    stack_decref(&a);
   } else {
-    objdecref(&b);
-    objdecref(&a);
+    stack_decref(&b);
+    stack_decref(&a);
 
     RUNTIME_ERROR("cannot '++' objects of types: '%s' and '%s'",
                   get_object_type(&a), get_object_type(&b));
@@ -1207,15 +1566,18 @@ static inline void handle_op_strcat(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_array(VM *vm, const Bytecode *restrict code,
                                    uint8_t *restrict *ip)
 {
+  const uint8_t *site = *ip;
   uint8_t count = READ_UINT8();
 
   DynArray_Object elements = {0};
   for (size_t i = 0; i < count; i++) {
     dynarray_insert(&elements, pop(vm));
   }
+  slots_to_heap(elements.data, elements.count);
 
-  Array array = {.refcount = 1, .elements = elements};
-  push(vm, ARRAY_VAL(ALLOC(array)));
+  Array array = {.refcount = 1, .type = OBJ_ARRAY, .elements = elements};
+  push_new(vm, ARRAY_VAL(SLAB_ALLOC(SLAB_ARRAY, array)));
+  profile_alloc(vm, code, site);
 }
 
 /* OP_ARRAYSET pops three objects off the stack: the index, the array object,
@@ -1232,27 +1594,28 @@ static inline void handle_op_arrayset(VM *vm, const Bytecode *restrict code,
   Object subscriptee = pop(vm);
 
   if (!IS_ARRAY(subscriptee)) {
-    objdecref(&value);
-    objdecref(&index);
-    objdecref(&subscriptee);
+    stack_decref(&value);
+    stack_decref(&index);
+    stack_decref(&subscriptee);
 
     RUNTIME_ERROR("cannot '[]' objects of type: '%s'",
                   get_object_type(&subscriptee));
   }
 
   if (!IS_NUM(index)) {
-    objdecref(&value);
-    objdecref(&index);
-    objdecref(&subscriptee);
+    stack_decref(&value);
+    stack_decref(&index);
+    stack_decref(&subscriptee);
 
     RUNTIME_ERROR("array index must be a number, got: '%s'",
                   get_object_type(&index));
   }
 
   Array *array = AS_ARRAY(subscriptee);
+  to_heap(&value);
   array->elements.data[(int) AS_NUM(index)] = value;
 
-  objdecref(&subscriptee);
+  stack_decref(&subscriptee);
 }
 
 /* OP_SUBSCRIPT pops two objects off the stack, index, and the subscriptee
@@ -1269,15 +1632,15 @@ static inline void handle_op_subscript(VM *vm, const Bytecode *restrict code,
   Object object = pop(vm);
 
   if (!IS_ARRAY(object)) {
-    objdecref(&index);
-    objdecref(&object);
+    stack_decref(&index);
+    stack_decref(&object);
     RUNTIME_ERROR("cannot '[]' objects of type: '%s'",
                   get_object_type(&object));
   }
 
   if (!IS_NUM(index)) {
-    objdecref(&index);
-    objdecref(&object);
+    stack_decref(&index);
+    stack_decref(&object);
     RUNTIME_ERROR("array index must be a number, got: '%s'",
                   get_object_type(&index));
   }
@@ -1285,8 +1648,38 @@ static inline void handle_op_subscript(VM *vm, const Bytecode *restrict code,
   Object value = AS_ARRAY(object)->elements.data[(int) AS_NUM(index)];
   push(vm, value);
 
-  objincref(&value);
-  objdecref(&object);
+  stack_incref(&value);
+  stack_decref(&object);
+}
+
+/* OP_SUBSCRIPT_BORROW is OP_SUBSCRIPT for a borrowed array (see OP_DE-
+ * EPGET_BORROW).
+ *
+ * REFCOUNTING: Only the refcount of the element is incremented, since
+ * the popped array was never counted. */
+static inline void handle_op_subscript_borrow(VM *vm,
+                                              const Bytecode *restrict code,
+                                              uint8_t *restrict *ip)
+{
+  Object index = pop(vm);
+  Object object = pop(vm);
+
+  if (!IS_ARRAY(object)) {
+    stack_decref(&index);
+    RUNTIME_ERROR("cannot '[]' objects of type: '%s'",
+                  get_object_type(&object));
+  }
+
+  if (!IS_NUM(index)) {
+    stack_decref(&index);
+    RUNTIME_ERROR("array index must be a number, got: '%s'",
+                  get_object_type(&index));
+  }
+
+  Object value = AS_ARRAY(object)->elements.data[(int) AS_NUM(index)];
+  push(vm, value);
+
+  stack_incref(&value);
 }
 
 /* OP_GET_UPVALUE reads a 4-byte index of the upvalue and pushes it on the
@@ -1297,10 +1690,10 @@ static inline void handle_op_subscript(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_get_upvalue(VM *vm, const Bytecode *restrict code,
                                          uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
 
   Object *obj = vm->fp_stack[vm->fp_count - 1].fn->upvalues[idx]->location;
-  objincref(obj);
+  stack_incref(obj);
   push(vm, *obj);
 }
 
@@ -1311,7 +1704,7 @@ static inline void handle_op_get_upvalue_ptr(VM *vm,
                                              const Bytecode *restrict code,
                                              uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
 
   Object *obj = vm->fp_stack[vm->fp_count - 1].fn->upvalues[idx]->location;
   push(vm, PTR_VAL(obj));
@@ -1325,12 +1718,22 @@ static inline void handle_op_get_upvalue_ptr(VM *vm,
 static inline void handle_op_set_upvalue(VM *vm, const Bytecode *restrict code,
                                          uint8_t *restrict *ip)
 {
-  uint8_t idx = READ_UINT8();
+  uint16_t idx = READ_UINT16();
 
   Object obj = pop(vm);
 
-  objdecref(vm->fp_stack[vm->fp_count - 1].fn->upvalues[idx]->location);
-  *vm->fp_stack[vm->fp_count - 1].fn->upvalues[idx]->location = obj;
+  Upvalue *upvalue = vm->fp_stack[vm->fp_count - 1].fn->upvalues[idx];
+
+  /* An open upvalue still points into the stack, a closed one does
+   * not, which matters when stack slots aren't counted. */
+  if (upvalue->location != &upvalue->closed) {
+    stack_decref(upvalue->location);
+  } else {
+    objdecref(upvalue->location);
+    to_heap(&obj);
+  }
+
+  *upvalue->location = obj;
 }
 
 /* OP_CLOSE_UPVALUE is a part of the stack cleanup procedure and runs upon
@@ -1349,10 +1752,15 @@ static inline void handle_op_close_upvalue(VM *vm,
 
 static FrameSnapshot *snapshot_frame(VM *vm, uint8_t *ip)
 {
-  FrameSnapshot fs = {.tos = vm->tos, .ip = ip, .fp_count = vm->fp_count};
-  memcpy(fs.stack, vm->stack, sizeof(Object) * vm->tos);
-  memcpy(fs.fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
-  return ALLOC(fs);
+  /* Snapshots are large, so they're filled in place rather than
+   * copied into the slot. */
+  FrameSnapshot *fs = slab_alloc(SLAB_FRAME_SNAPSHOT);
+  fs->tos = vm->tos;
+  fs->ip = ip;
+  fs->fp_count = vm->fp_count;
+  memcpy(fs->stack, vm->stack, sizeof(Object) * vm->tos);
+  memcpy(fs->fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
+  return fs;
 }
 
 static void restore_frame(VM *vm, FrameSnapshot *fs, uint8_t *restrict *ip)
@@ -1361,118 +1769,1137 @@ static void restore_frame(VM *vm, FrameSnapshot *fs, uint8_t *restrict *ip)
   vm->tos = fs->tos;
   memcpy(vm->fp_stack, fs->fp_stack, sizeof(BytecodePtr) * fs->fp_count);
   vm->fp_count = fs->fp_count;
+  vm->fp_base = vm->fp_stack[vm->fp_count - 1].location;
   *ip = fs->ip;
-  free(fs);
+  slab_free(SLAB_FRAME_SNAPSHOT, fs);
 }
 
-static Task *vm_create_task(VM *vm, Generator *gen)
+/* Drops the finished tasks nobody holds a reference to any more,
+ * other than the VM itself. */
+static void scheduler_reap(VM *vm)
 {
-  if (vm->task_count >= STACK_MAX) {
-    return NULL;
+  size_t kept = 0;
+  for (size_t i = 0; i < vm->task_count; i++) {
+    Task *task = vm->tasks[i];
+    if (task->done && task->refcount == 1 && task != vm->scheduler_root) {
+      Object task_obj = TASK_VAL(task);
+      objdecref(&task_obj);
+    } else {
+      vm->tasks[kept++] = task;
+    }
   }
-
-  Object gen_obj = GENERATOR_VAL(gen);
-  objincref(&gen_obj);
-
-  Task task = {.refcount = 1,
-               .id = ++vm->next_task_id,
-               .gen = gen,
-               .done = false,
-               .has_result = false,
-               .result = NULL_VAL,
-               .waiting_on = NULL,
-               .wake_tick = vm->scheduler_tick,
-               .has_send = false,
-               .send_value = NULL_VAL};
-
-  Task *task_ptr = ALLOC(task);
-  vm->tasks[vm->task_count++] = task_ptr;
-  return task_ptr;
+  vm->task_count = kept;
+  vm->scheduler_cursor = 0;
 }
 
-static void task_set_send_move(Task *task, Object value)
+static uint64_t thread_cpu_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (uint64_t) ts.tv_sec * NSEC_PER_SEC + (uint64_t) ts.tv_nsec;
+}
+
+/* Charges the time since the task entered its current phase to that
+ * phase, and moves it on to 'next'. A sleeping task only sleeps un-
+ * til its deadline, and is merely runnable after that. The time it
+ * spends running is measured in CPU time instead, see below. */
+static void task_stats_enter(Task *task, TaskPhase next, uint64_t now)
+{
+  TaskStats *stats = &task->stats;
+  uint64_t since = stats->since;
+
+  switch (stats->phase) {
+    case PHASE_RUNNABLE:
+      stats->runnable_ns += now - since;
+      break;
+    case PHASE_BLOCKED:
+      stats->blocked_ns += now - since;
+      break;
+    case PHASE_SLEEPING: {
+      uint64_t woke = task->wake_at < now ? task->wake_at : now;
+      if (woke < since) {
+        woke = since;
+      }
+      stats->sleeping_ns += woke - since;
+      stats->runnable_ns += now - woke;
+      break;
+    }
+    case PHASE_RUNNING:
+    case PHASE_DONE:
+      break;
+    default:
+      assert(0);
+  }
+
+  stats->phase = next;
+  stats->since = now;
+}
+
+static void task_stats_record(VM *vm, const Task *task)
+{
+  TaskReport report = {.id = task->id,
+                       .worker = pool_worker_index(vm),
+                       .stats = task->stats};
+  dynarray_insert(&vm->task_reports, report);
+}
+
+static void task_stats_resume(VM *vm, Task *task)
+{
+  if (!task->stats.enabled) {
+    return;
+  }
+
+  task_stats_enter(task, PHASE_RUNNING, eventloop_now());
+  ++task->stats.switches;
+  task->stats.cpu_since = thread_cpu_now();
+  task->stats.instructions_since = vm->instructions;
+  vm->peak_tos = vm->tos;
+}
+
+/* Called once the task that was running has been switched out, and
+ * whatever it awaited has been dealt with, so it's known what it's
+ * waiting for next, if anything. */
+static void task_stats_switch_out(VM *vm, Task *task)
+{
+  TaskStats *stats = &task->stats;
+  if (!stats->enabled || stats->phase != PHASE_RUNNING) {
+    return;
+  }
+
+  stats->instructions += vm->instructions - stats->instructions_since;
+  stats->cpu_ns += thread_cpu_now() - stats->cpu_since;
+  if (vm->peak_tos > stats->peak_stack) {
+    stats->peak_stack = vm->peak_tos;
+  }
+
+  uint64_t now = eventloop_now();
+  if (task->done) {
+    task_stats_enter(task, PHASE_DONE, now);
+    task_stats_record(vm, task);
+  } else if (task->pending > 0 || task->io || task->blocked_on) {
+    task_stats_enter(task, PHASE_BLOCKED, now);
+  } else if (task->wake_at > now) {
+    task_stats_enter(task, PHASE_SLEEPING, now);
+  } else {
+    task_stats_enter(task, PHASE_RUNNABLE, now);
+  }
+}
+
+/* Called when whatever the task was blocked on lets it go. */
+static void task_stats_ready(Task *task)
+{
+  if (task->stats.enabled && task->stats.phase == PHASE_BLOCKED) {
+    task_stats_enter(task, PHASE_RUNNABLE, eventloop_now());
+  }
+}
+
+/* Records the tasks that never finished, as they are right now. */
+static void task_stats_flush(VM *vm)
+{
+  for (size_t i = 0; i < vm->task_count; i++) {
+    Task *task = vm->tasks[i];
+    if (!task->stats.enabled) {
+      continue;
+    }
+    task_stats_switch_out(vm, task);
+    if (task->stats.phase != PHASE_DONE) {
+      task_stats_enter(task, PHASE_DONE, eventloop_now());
+      task_stats_record(vm, task);
+    }
+  }
+}
+
+static int compare_task_reports(const void *a, const void *b)
+{
+  const TaskReport *x = a, *y = b;
+  if (x->worker != y->worker) {
+    return x->worker < y->worker ? -1 : 1;
+  }
+  return (x->id > y->id) - (x->id < y->id);
+}
+
+void print_task_reports(VM *vm, bool json)
+{
+  /* The workers' reports are merged into ours once they stop. */
+  if (vm->pool) {
+    pool_stop(vm);
+  }
+  task_stats_flush(vm);
+
+  qsort(vm->task_reports.data, vm->task_reports.count, sizeof(TaskReport),
+        compare_task_reports);
+
+  if (json) {
+    printf("{\"tasks\": [");
+  }
+
+  for (size_t i = 0; i < vm->task_reports.count; i++) {
+    const TaskReport *r = &vm->task_reports.data[i];
+    const TaskStats *s = &r->stats;
+    if (json) {
+      printf("%s{\"id\": %d, \"worker\": %u, \"instructions\": %lu, "
+             "\"switches\": %lu, \"peak_stack\": %zu, \"cpu\": %.9f, "
+             "\"runnable\": %.9f, \"blocked\": %.9f, \"sleeping\": %.9f}",
+             i > 0 ? ", " : "", r->id, r->worker, s->instructions,
+             s->switches, s->peak_stack, (double) s->cpu_ns / NSEC_PER_SEC,
+             (double) s->runnable_ns / NSEC_PER_SEC,
+             (double) s->blocked_ns / NSEC_PER_SEC,
+             (double) s->sleeping_ns / NSEC_PER_SEC);
+    } else {
+      printf("task %d (worker %u): %lu instructions, %lu switches, peak "
+             "stack %zu, cpu %.9f sec, runnable %.9f sec, blocked %.9f sec, "
+             "sleeping %.9f sec\n",
+             r->id, r->worker, s->instructions, s->switches, s->peak_stack,
+             (double) s->cpu_ns / NSEC_PER_SEC,
+             (double) s->runnable_ns / NSEC_PER_SEC,
+             (double) s->blocked_ns / NSEC_PER_SEC,
+             (double) s->sleeping_ns / NSEC_PER_SEC);
+    }
+  }
+
+  if (json) {
+    printf("]}\n");
+  }
+}
+
+static Task *vm_create_task(VM *vm, Generator *gen)
+{
+  if (vm->task_count >= STACK_MAX) {
+    scheduler_reap(vm);
+    if (vm->task_count >= STACK_MAX) {
+      return NULL;
+    }
+  }
+
+  if (gen) {
+    Object gen_obj = GENERATOR_VAL(gen);
+    objincref(&gen_obj);
+  }
+
+  Task task = {.refcount = 1,
+               .type = OBJ_TASK,
+               .id = ++vm->next_task_id,
+               .gen = gen,
+               .done = false,
+               .has_result = false,
+               .result = NULL_VAL,
+               .waiters = {0},
+               .pending = 0,
+               .wait_kind = WAIT_ONE,
+               .wait_epoch = 0,
+               .gathered = NULL_VAL,
+               .io = NULL,
+               .wake_at = 0,
+               .has_send = false,
+               .send_value = NULL_VAL,
+               .preempted = false,
+               .blocked_on = NULL,
+               .next_waiter = NULL,
+               .chan_value = NULL_VAL,
+               .remote = false,
+               .job = NULL,
+               .stats = {.enabled = vm->measure_tasks && gen,
+                         .phase = PHASE_RUNNABLE}};
+
+  if (task.stats.enabled) {
+    task.stats.since = eventloop_now();
+  }
+
+  Task *task_ptr = SLAB_ALLOC(SLAB_TASK, task);
+  vm->tasks[vm->task_count++] = task_ptr;
+  return task_ptr;
+}
+
+static void task_set_send_move(Task *task, Object value)
 {
   if (task->has_send) {
     objdecref(&task->send_value);
   }
-  task->send_value = value;
-  task->has_send = true;
+  task->send_value = value;
+  task->has_send = true;
+}
+
+static void task_set_send_copy(Task *task, Object value)
+{
+  objincref(&value);
+  task_set_send_move(task, value);
+}
+
+static Object task_result(const Task *task)
+{
+  Object result = task->has_result ? task->result : NULL_VAL;
+  objincref(&result);
+  return result;
+}
+
+/* Starts a new wait for the current task. Waiters registered for
+ * any of the previous waits are recognized as stale by the epoch. */
+static void task_begin_wait(Task *task, WaitKind kind, size_t pending)
+{
+  ++task->wait_epoch;
+  task->wait_kind = kind;
+  task->pending = pending;
+}
+
+static void task_add_waiter(Task *task, Task *waiter, size_t index)
+{
+  /* The entry keeps the waiter alive, since the entries a select(...)
+   * leaves behind can outlive the wait. */
+  Object waiter_obj = TASK_VAL(waiter);
+  objincref(&waiter_obj);
+
+  Waiter w = {.task = waiter, .epoch = waiter->wait_epoch, .index = index};
+  dynarray_insert(&task->waiters, w);
+}
+
+/* Called once 'finished' is done. Instead of scanning all the tasks
+ * for those that await it, only the ones that registered themselves
+ * as its waiters are looked at, and each of them only becomes run-
+ * nable once its count of pending tasks drops to zero. */
+static void scheduler_unblock_waiters(VM *vm, Task *finished)
+{
+  (void) vm;
+
+  for (size_t i = 0; i < finished->waiters.count; i++) {
+    Waiter w = finished->waiters.data[i];
+    Task *task = w.task;
+    Object task_obj = TASK_VAL(task);
+    if (task->done || task->pending == 0 || w.epoch != task->wait_epoch) {
+      objdecref(&task_obj);
+      continue;
+    }
+
+    switch (task->wait_kind) {
+      case WAIT_ONE: {
+        task->pending = 0;
+        task_set_send_move(task, task_result(finished));
+        break;
+      }
+      case WAIT_ALL: {
+        Array *gathered = AS_ARRAY(task->gathered);
+        gathered->elements.data[w.index] = task_result(finished);
+        if (--task->pending == 0) {
+          task_set_send_move(task, task->gathered);
+          task->gathered = NULL_VAL;
+        }
+        break;
+      }
+      case WAIT_ANY: {
+        task->pending = 0;
+        Object winner = TASK_VAL(finished);
+        task_set_send_copy(task, winner);
+        break;
+      }
+      default:
+        assert(0);
+    }
+
+    if (task->pending == 0) {
+      task_stats_ready(task);
+    }
+
+    objdecref(&task_obj);
+  }
+
+  finished->waiters.count = 0;
+}
+
+static bool scheduler_has_live_tasks(VM *vm)
+{
+  for (size_t i = 0; i < vm->task_count; i++) {
+    if (!vm->tasks[i]->done) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool scheduler_task_runnable(Task *task, uint64_t now)
+{
+  return !task->done && !task->remote && task->pending == 0 &&
+         task->io == NULL && task->blocked_on == NULL && task->wake_at <= now;
+}
+
+typedef enum {
+  IO_DONE,
+  IO_PENDING,
+  IO_FAILED,
+} IoStatus;
+
+static const char *io_builtin_name(const Io *io)
+{
+  switch (io->kind) {
+    case IO_READ:
+      return "read_fd";
+    case IO_WRITE:
+      return "write_fd";
+    case IO_ACCEPT:
+      return "accept";
+    default:
+      assert(0);
+  }
+}
+
+static bool would_block(int err)
+{
+  return err == EAGAIN || err == EWOULDBLOCK;
+}
+
+static bool set_nonblocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+/* Makes a single non-blocking attempt at 'io'. On IO_DONE, the out-
+ * come of the operation is stored in 'result'. On IO_FAILED, errno
+ * is whatever the failed syscall left in it. */
+static IoStatus io_attempt(Io *io, Object *result)
+{
+  switch (io->kind) {
+    case IO_READ: {
+      /* The buffer is kept across the attempts that would block, and
+       * handed over to the resulting string once one goes through. */
+      if (io->buf == NULL) {
+        io->buf = malloc(io->count + 1);
+        if (io->buf == NULL) {
+          errno = ENOMEM;
+          return IO_FAILED;
+        }
+      }
+
+      ssize_t n;
+      do {
+        n = read(io->fd, io->buf, io->count);
+      } while (n == -1 && errno == EINTR);
+
+      if (n == -1) {
+        return would_block(errno) ? IO_PENDING : IO_FAILED;
+      }
+
+      /* Strings are NUL-terminated, so reading zero bytes (i.e., the
+       * other end was closed) yields an empty string. */
+      char *buf = io->buf;
+      io->buf = NULL;
+      buf[n] = '\0';
+      String s = {.refcount = 1, .type = OBJ_STRING, .value = buf};
+      *result = STRING_VAL(SLAB_ALLOC(SLAB_STRING, s));
+      return IO_DONE;
+    }
+    case IO_WRITE: {
+      const char *data = AS_STRING(io->data)->value;
+      size_t len = strlen(data);
+      while (io->written < len) {
+        ssize_t n = write(io->fd, data + io->written, len - io->written);
+        if (n == -1) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return would_block(errno) ? IO_PENDING : IO_FAILED;
+        }
+        io->written += n;
+      }
+      *result = NUM_VAL((double) len);
+      return IO_DONE;
+    }
+    case IO_ACCEPT: {
+      int fd;
+      do {
+        fd = accept(io->fd, NULL, NULL);
+      } while (fd == -1 && errno == EINTR);
+
+      if (fd == -1) {
+        return would_block(errno) ? IO_PENDING : IO_FAILED;
+      }
+
+      if (!set_nonblocking(fd)) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return IO_FAILED;
+      }
+
+      *result = NUM_VAL(fd);
+      return IO_DONE;
+    }
+    default:
+      assert(0);
+  }
+}
+
+/* Called with the reference to the awaited Io that the task now
+ * owns. Either completes the operation right away, or parks the
+ * task in the event loop until the descriptor becomes ready. */
+static void scheduler_begin_io(VM *vm, Task *task, Object awaited)
+{
+  Io *io = AS_IO(awaited);
+
+  Object result;
+  IoStatus status = io_attempt(io, &result);
+  if (status == IO_DONE) {
+    task_set_send_move(task, result);
+    objdecref(&awaited);
+    return;
+  }
+
+  if (status == IO_PENDING &&
+      eventloop_watch(&vm->loop, io->fd, io->kind == IO_WRITE, task)) {
+    task->io = io;
+    ++vm->io_waiting;
+    return;
+  }
+
+  int err = errno;
+  int fd = io->fd;
+  const char *name = io_builtin_name(io);
+  objdecref(&awaited);
+  if (err == EEXIST) {
+    RUNTIME_ERROR("%s(...): fd %d is already awaited by another task", name,
+                  fd);
+  }
+  RUNTIME_ERROR("%s(...): %s", name, strerror(err));
+}
+
+/* Retries the operation the task is parked on after the event loop
+ * reported its descriptor as ready, and makes the task runnable
+ * again if it went through. */
+static void scheduler_complete_io(VM *vm, Task *task)
+{
+  Io *io = task->io;
+
+  Object result;
+  IoStatus status = io_attempt(io, &result);
+  if (status == IO_PENDING) {
+    return;
+  }
+
+  int err = errno;
+  eventloop_unwatch(&vm->loop, io->fd);
+  task->io = NULL;
+  --vm->io_waiting;
+
+  const char *name = io_builtin_name(io);
+  Object io_obj = IO_VAL(io);
+  objdecref(&io_obj);
+
+  if (status == IO_FAILED) {
+    RUNTIME_ERROR("%s(...): %s", name, strerror(err));
+  }
+
+  task_set_send_move(task, result);
+  task_stats_ready(task);
+}
+
+/* The parallel scheduler, which run(...) uses when the interpreter
+ * is started with --workers=N (N > 1), runs the tasks on N threads,
+ * each with a VM of its own that has its own stack, copy of the gl-
+ * obals, and event loop. The VM that called run(...) is worker 0.
+ *
+ * Under it, spawn(...) makes a job out of a copy of the coroutine
+ * (see copy_object()), so that the job shares nothing with the sp-
+ * awner, pushes it on the spawner's deque, and hands the spawner a
+ * 'remote' task standing in for it. Workers take jobs off their own
+ * deque when they run out of runnable tasks, and steal them off the
+ * others' when that's empty too. Whoever ran a job posts it back to
+ * the spawner's mailbox, along with a copy of the result, which the
+ * spawner then completes the stand-in with.
+ *
+ * Channels are shared instead (see SharedChannel): send(...) puts a
+ * copy of the value in the channel, and tasks parked on it are woken
+ * up through their worker's mailbox.
+ *
+ * Since objects only ever cross threads as fresh copies, the ref-
+ * counts don't have to be atomic. */
+typedef enum {
+  MAIL_JOB,
+  MAIL_WAKEUP,
+} MailKind;
+
+typedef struct Job {
+  MailKind kind;
+  Object gen;    /* the coroutine, until some worker takes the job */
+  Object result; /* a copy of what it returned, once it's done */
+  Task *proxy;   /* the stand-in task on 'origin' */
+  struct Worker *origin;
+} Job;
+
+/* Hands the result of a send(...) or recv(...) to a task that's
+ * parked on a shared channel. */
+typedef struct {
+  MailKind kind;
+  Task *task;
+  Object value;
+} Wakeup;
+
+typedef struct Worker {
+  struct Pool *pool;
+  VM *vm;
+  size_t index;
+  pthread_t thread;
+  bool started;
+  WorkDeque deque;
+  Mailbox mailbox; /* our finished jobs, and wake-ups */
+} Worker;
+
+/* The eventfd wake-ups of the pool: 'wake_efd' is shared by all the
+ * workers, so whoever drains it may be taking the wake-up away from
+ * some other worker. That's fine for new jobs, since the drainer will
+ * go looking for jobs itself, but anything meant for one worker in
+ * particular (its jobs coming back, being stopped) goes through the
+ * worker's own mailbox instead. */
+typedef struct Pool {
+  Worker *workers;
+  size_t count;
+  const Bytecode *code;
+  int wake_efd;              /* readable when there may be jobs to steal */
+  atomic_size_t outstanding; /* jobs spawned, but not finished yet */
+  atomic_bool stop;
+  pthread_mutex_t lock; /* guards 'err_msg' and 'idle' */
+  char *err_msg;        /* the first error that happened in a worker */
+  size_t idle;          /* workers waiting for mail or jobs */
+} Pool;
+
+static void pool_fail(Pool *pool, const char *msg)
+{
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->err_msg) {
+    pool->err_msg = own_string(msg);
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  atomic_store(&pool->stop, true);
+  for (size_t i = 0; i < pool->count; i++) {
+    notify_fd(pool->workers[i].mailbox.efd);
+  }
+}
+
+static void *worker_main(void *arg)
+{
+  Worker *worker = arg;
+  ExecResult result = exec(worker->vm, worker->pool->code);
+  if (!result.is_ok) {
+    pool_fail(worker->pool, result.msg);
+    free(result.msg);
+  }
+#ifdef DEFERRED_RC
+  zct_flush();
+#endif
+#ifdef CYCLE_GC
+  cycle_flush();
+#endif
+  set_lazy_release(false);
+  slab_flush_thread();
+  return NULL;
+}
+
+/* Copies the globals at the same indexes, so that the compiled code
+ * can find them in the copy, too. */
+static bool copy_globals(const Bytecode *code, const DynArray_Object *from,
+                         DynArray_Object *to, const char **failed)
+{
+  for (size_t i = 0; i < from->count; i++) {
+    dynarray_insert(to, NULL_VAL);
+  }
+
+  for (size_t i = 0; i < from->count; i++) {
+    if (!copy_object(&from->data[i], &to->data[i])) {
+      *failed = code->sp.data[i];
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static void pool_start(VM *vm, const Bytecode *restrict code)
+{
+  /* The workers share the code, which they only ever read, so whatever
+   * is yet to be compiled is compiled before they start. */
+  CompileResult compile_result = compile_all_deferred((Bytecode *) code);
+  if (!compile_result.is_ok) {
+    COMPILE_ERROR(compile_result);
+  }
+
+  Pool *pool = calloc(1, sizeof(Pool));
+  pool->workers = calloc(vm->workers, sizeof(Worker));
+  pool->count = vm->workers;
+  pool->code = code;
+  pool->wake_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  atomic_init(&pool->outstanding, 0);
+  atomic_init(&pool->stop, false);
+  pthread_mutex_init(&pool->lock, NULL);
+
+  vm->pool = pool;
+  vm->worker = &pool->workers[0];
+
+  if (pool->wake_efd == -1) {
+    RUNTIME_ERROR("run(...): cannot start the workers: %s", strerror(errno));
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    Worker *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i;
+    init_workdeque(&worker->deque);
+    if (!init_mailbox(&worker->mailbox)) {
+      worker->mailbox.efd = -1;
+      RUNTIME_ERROR("run(...): cannot start the workers: %s", strerror(errno));
+    }
+
+    if (i == 0) {
+      worker->vm = vm;
+    } else {
+      worker->vm = malloc(sizeof(VM));
+      init_vm(worker->vm);
+      worker->vm->quantum = vm->quantum;
+      worker->vm->free_budget = vm->free_budget;
+      worker->vm->measure_tasks = vm->measure_tasks;
+      worker->vm->pool = pool;
+      worker->vm->worker = worker;
+
+      /* The blueprints are only read once the workers are running
+       * (see handle_op_struct_blueprint()), so they're shared. */
+      free(worker->vm->blueprints);
+      worker->vm->blueprints = vm->blueprints;
+
+      const char *failed;
+      if (!copy_globals(code, &vm->globals, &worker->vm->globals,
+                        &failed)) {
+        RUNTIME_ERROR("run(...): global '%s' cannot be copied to the workers",
+                      failed);
+      }
+    }
+
+    /* Mail and new jobs wake the worker up just like timers do. */
+    if (!eventloop_watch(&worker->vm->loop, worker->mailbox.efd, false,
+                         &worker->mailbox) ||
+        !eventloop_watch(&worker->vm->loop, pool->wake_efd, false, pool)) {
+      RUNTIME_ERROR("run(...): cannot start the workers: %s", strerror(errno));
+    }
+  }
+
+  for (size_t i = 1; i < pool->count; i++) {
+    Worker *worker = &pool->workers[i];
+    if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+      RUNTIME_ERROR("run(...): cannot start the workers");
+    }
+    worker->started = true;
+  }
+}
+
+/* 0 for the VM that called run(...), or when there's no pool. */
+static uint32_t pool_worker_index(const VM *vm)
+{
+  return vm->worker ? vm->worker->index : 0;
+}
+
+static void free_job(Job *job)
+{
+  objdecref(&job->gen);
+  objdecref(&job->result);
+  free(job);
+}
+
+static void free_mail(void *item)
+{
+  if (*(MailKind *) item == MAIL_WAKEUP) {
+    Wakeup *wakeup = item;
+    objdecref(&wakeup->value);
+    free(wakeup);
+  } else {
+    free_job(item);
+  }
+}
+
+/* Stops the worker threads and tears the pool down. Jobs nobody got
+ * to are dropped, as is anything the other workers were running. */
+static void pool_stop(VM *vm)
+{
+  Pool *pool = vm->pool;
+
+  atomic_store(&pool->stop, true);
+  for (size_t i = 1; i < pool->count; i++) {
+    if (pool->workers[i].started) {
+      notify_fd(pool->workers[i].mailbox.efd);
+    }
+  }
+
+  for (size_t i = 1; i < pool->count; i++) {
+    if (pool->workers[i].started) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    Worker *worker = &pool->workers[i];
+    if (!worker->pool) {
+      break; /* pool_start() bailed out before getting to it */
+    }
+
+    Job *job;
+    while ((job = workdeque_pop(&worker->deque))) {
+      free_job(job);
+    }
+    free_workdeque(&worker->deque);
+
+    if (worker->mailbox.efd != -1) {
+      DynArray_void_ptr mail = {0};
+      mailbox_take(&worker->mailbox, &mail);
+      for (size_t j = 0; j < mail.count; j++) {
+        free_mail(mail.data[j]);
+      }
+      dynarray_free(&mail);
+      free_mailbox(&worker->mailbox);
+    }
+
+    if (worker->vm) {
+      for (size_t j = 0; j < worker->vm->task_count; j++) {
+        Task *task = worker->vm->tasks[j];
+        if (task->job) {
+          free_job(task->job);
+          task->job = NULL;
+        }
+        /* Nobody is left to wake it up through its mailbox. */
+        if (task->blocked_on && task->blocked_on->shared) {
+          shared_channel_forget(task);
+        }
+      }
+    }
+
+    if (i > 0 && worker->vm) {
+      task_stats_flush(worker->vm);
+      DynArray_TaskReport *reports = &worker->vm->task_reports;
+      for (size_t j = 0; j < reports->count; j++) {
+        dynarray_insert(&vm->task_reports, reports->data[j]);
+      }
+
+      worker->vm->blueprints = NULL; /* borrowed from worker 0 */
+      worker->vm->pool = NULL;
+      free_vm(worker->vm);
+      free(worker->vm);
+    }
+  }
+
+  if (pool->wake_efd != -1) {
+    close(pool->wake_efd);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  free(pool->err_msg);
+  free(pool->workers);
+  free(pool);
+
+  vm->pool = NULL;
+  vm->worker = NULL;
+}
+
+static void pool_spawn(VM *vm, Object gen_obj)
+{
+  Object copy;
+  if (!copy_object(&gen_obj, &copy)) {
+    stack_decref(&gen_obj);
+    RUNTIME_ERROR("spawn(...) can only hand a coroutine that hasn't started, "
+                  "with arguments that can be copied, to another worker");
+  }
+  stack_decref(&gen_obj);
+
+  Task *proxy = vm_create_task(vm, NULL);
+  if (!proxy) {
+    objdecref(&copy);
+    RUNTIME_ERROR("scheduler task limit exceeded");
+  }
+  proxy->remote = true;
+
+  Job job = {.kind = MAIL_JOB,
+             .gen = copy,
+             .result = NULL_VAL,
+             .proxy = proxy,
+             .origin = vm->worker};
+  atomic_fetch_add(&vm->pool->outstanding, 1);
+  workdeque_push(&vm->worker->deque, ALLOC(job));
+  notify_fd(vm->pool->wake_efd);
+
+  Object task_obj = TASK_VAL(proxy);
+  stack_incref(&task_obj);
+  push(vm, task_obj);
+}
+
+/* Completes the stand-ins of the jobs that came back, and wakes up
+ * the tasks somebody took off a shared channel. */
+static void pool_collect(VM *vm)
+{
+  DynArray_void_ptr mail = {0};
+  mailbox_take(&vm->worker->mailbox, &mail);
+
+  for (size_t i = 0; i < mail.count; i++) {
+    if (*(MailKind *) mail.data[i] == MAIL_WAKEUP) {
+      Wakeup *wakeup = mail.data[i];
+      channel_wake(wakeup->task, wakeup->value);
+      free(wakeup);
+      continue;
+    }
+
+    Job *job = mail.data[i];
+    Task *proxy = job->proxy;
+    proxy->remote = false;
+    proxy->done = true;
+    proxy->has_result = true;
+    proxy->result = job->result;
+    free(job);
+    scheduler_unblock_waiters(vm, proxy);
+  }
+
+  dynarray_free(&mail);
+}
+
+/* Takes a job, preferably off our own deque, and makes a task out
+ * of it. */
+static Task *pool_adopt(VM *vm)
+{
+  Pool *pool = vm->pool;
+  Worker *worker = vm->worker;
+
+  Job *job = workdeque_pop(&worker->deque);
+  for (size_t i = 1; !job && i < pool->count; i++) {
+    Worker *victim = &pool->workers[(worker->index + i) % pool->count];
+    job = workdeque_steal(&victim->deque);
+  }
+
+  if (!job) {
+    return NULL;
+  }
+
+  /* Whoever drained the wake-up that announced this job may have
+   * done so before the other idle workers got to see it, so pass it
+   * on in case there are more. */
+  notify_fd(pool->wake_efd);
+
+  Task *task = vm_create_task(vm, AS_GENERATOR(job->gen));
+  if (!task) {
+    workdeque_push(&worker->deque, job);
+    RUNTIME_ERROR("scheduler task limit exceeded");
+  }
+
+  objdecref(&job->gen);
+  job->gen = NULL_VAL;
+  task->job = job;
+  return task;
+}
+
+static void pool_finish_job(VM *vm, Task *task)
+{
+  Pool *pool = vm->pool;
+  Job *job = task->job;
+  task->job = NULL;
+
+  Object result = task->has_result ? task->result : NULL_VAL;
+  bool copied = copy_object(&result, &job->result);
+  if (!copied) {
+    job->result = NULL_VAL;
+  }
+
+  mailbox_post(&job->origin->mailbox, job);
+
+  /* Worker 0 may be waiting for the last job to finish. */
+  if (atomic_fetch_sub(&pool->outstanding, 1) == 1) {
+    notify_fd(pool->workers[0].mailbox.efd);
+  }
+
+  if (!copied) {
+    RUNTIME_ERROR("a task spawned on a worker cannot return a '%s'",
+                  get_object_type(&result));
+  }
 }
 
-static void task_set_send_copy(Task *task, Object value)
+/* Tells the workers other than worker 0 to quit once the pool is
+ * stopped. It's only ever stopped early when some worker fails, in
+ * which case worker 0 reports the error. */
+static bool pool_stopping(VM *vm)
 {
-  objincref(&value);
-  task_set_send_move(task, value);
+  Pool *pool = vm->pool;
+  if (!atomic_load(&pool->stop)) {
+    return false;
+  }
+
+  if (vm->worker->index > 0) {
+    return true;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  alloc_err_str(&vm->err_msg, "%s", pool->err_msg);
+  pthread_mutex_unlock(&pool->lock);
+  dealloc_stack(vm);
+  longjmp(vm->trap, -1);
 }
 
-static void scheduler_unblock_waiters(VM *vm, Task *finished)
+/* Whether every worker is waiting for mail or jobs, with none on the
+ * way to any of them, in which case none is ever coming. Called with
+ * the pool's lock held. */
+static bool pool_all_idle(Pool *pool)
 {
-  for (size_t i = 0; i < vm->task_count; i++) {
-    Task *task = vm->tasks[i];
-    if (!task->done && task->waiting_on == finished) {
-      task->waiting_on = NULL;
-      if (finished->has_result) {
-        task_set_send_copy(task, finished->result);
-      } else {
-        task_set_send_move(task, NULL_VAL);
-      }
+  if (pool->idle < pool->count) {
+    return false;
+  }
+
+  for (size_t i = 0; i < pool->count; i++) {
+    Worker *worker = &pool->workers[i];
+    if (!workdeque_empty(&worker->deque) ||
+        !mailbox_empty(&worker->mailbox)) {
+      return false;
     }
   }
+
+  return true;
 }
 
-static bool scheduler_has_live_tasks(VM *vm)
+static bool pool_is_wakeup(VM *vm, void *data)
 {
-  for (size_t i = 0; i < vm->task_count; i++) {
-    if (!vm->tasks[i]->done) {
-      return true;
+  return vm->pool && (data == vm->pool || data == &vm->worker->mailbox);
+}
+
+static void scheduler_poll(VM *vm, uint64_t deadline)
+{
+  void *ready[EVENTLOOP_MAX_EVENTS];
+  int n = eventloop_wait(&vm->loop, deadline, ready, EVENTLOOP_MAX_EVENTS);
+  if (n == -1) {
+    RUNTIME_ERROR("scheduler: event loop failed: %s", strerror(errno));
+  }
+
+  for (int i = 0; i < n; i++) {
+    if (pool_is_wakeup(vm, ready[i])) {
+      /* What woke us up gets looked at by the caller's next round. */
+      drain_fd(ready[i] == vm->pool ? vm->pool->wake_efd
+                                    : vm->worker->mailbox.efd);
+      continue;
     }
+    scheduler_complete_io(vm, ready[i]);
   }
-  return false;
 }
 
-static bool scheduler_task_runnable(VM *vm, Task *task)
+/* Waits for mail or jobs. Returns false instead if the other workers
+ * are all doing the same, since then nothing is ever going to come.
+ *
+ * Once every job is finished, though, only worker 0 may have tasks
+ * left, and it may have only just been told that the last job is done
+ * (see pool_finish_job()), without any mail for it. So the others wake
+ * it up to decide for itself, rather than report a deadlock. */
+static bool pool_wait(VM *vm)
 {
-  return !task->done && task->waiting_on == NULL &&
-         task->wake_tick <= vm->scheduler_tick;
+  Pool *pool = vm->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->idle++;
+  bool stuck = pool_all_idle(pool);
+  if (stuck && vm->worker->index > 0 &&
+      atomic_load(&pool->outstanding) == 0) {
+    notify_fd(pool->workers[0].mailbox.efd);
+    stuck = false;
+  } else if (stuck) {
+    pool->idle--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  if (stuck) {
+    return false;
+  }
+
+  scheduler_poll(vm, EVENTLOOP_FOREVER);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->idle--;
+  pthread_mutex_unlock(&pool->lock);
+  return true;
 }
 
 static Task *scheduler_next_runnable(VM *vm, bool *deadlocked)
 {
   *deadlocked = false;
 
+  /* Tasks blocked on I/O are polled for without blocking on every
+   * switch, so that they don't starve behind the runnable ones. */
+  if (vm->io_waiting > 0) {
+    scheduler_poll(vm, EVENTLOOP_NOW);
+  }
+
   for (;;) {
+    if (vm->pool) {
+      if (pool_stopping(vm)) {
+        return NULL;
+      }
+      pool_collect(vm);
+    }
+
+    uint64_t now = eventloop_now();
+
     for (size_t n = 0; n < vm->task_count; n++) {
       size_t i = (vm->scheduler_cursor + n) % vm->task_count;
       Task *task = vm->tasks[i];
-      if (scheduler_task_runnable(vm, task)) {
+      if (scheduler_task_runnable(task, now)) {
         vm->scheduler_cursor = (i + 1) % vm->task_count;
         return task;
       }
     }
 
+    if (vm->pool) {
+      Task *adopted = pool_adopt(vm);
+      if (adopted) {
+        return adopted;
+      }
+    }
+
     bool live = false;
+    bool remote = false;
     bool found_timer = false;
-    int next_wake = 0;
+    uint64_t next_wake = 0;
     for (size_t i = 0; i < vm->task_count; i++) {
       Task *task = vm->tasks[i];
       if (task->done) {
         continue;
       }
       live = true;
-      if (task->waiting_on == NULL && task->wake_tick > vm->scheduler_tick) {
-        if (!found_timer || task->wake_tick < next_wake) {
+      /* Tasks parked on a shared channel may be woken up by other
+       * workers, just like stand-ins are completed by them. */
+      remote |= task->remote ||
+                (task->blocked_on && task->blocked_on->shared);
+      if (task->pending == 0 && task->wake_at > now) {
+        if (!found_timer || task->wake_at < next_wake) {
           found_timer = true;
-          next_wake = task->wake_tick;
+          next_wake = task->wake_at;
         }
       }
     }
 
+    if (vm->pool) {
+      Pool *pool = vm->pool;
+
+      /* Worker 0 is done once all the jobs are, the others keep on
+       * looking for jobs until they're stopped. */
+      if (!live && vm->worker->index == 0 &&
+          atomic_load(&pool->outstanding) == 0) {
+        return NULL;
+      }
+
+      if (found_timer || vm->io_waiting > 0) {
+        scheduler_poll(vm, found_timer ? next_wake : EVENTLOOP_FOREVER);
+        continue;
+      }
+
+      if ((!live || remote) && pool_wait(vm)) {
+        continue;
+      }
+
+      *deadlocked = true;
+      return NULL;
+    }
+
     if (!live) {
       return NULL;
     }
 
-    if (found_timer) {
-      vm->scheduler_tick = next_wake;
+    /* Nothing is runnable right now, but somebody is sleeping or
+     * waiting on a descriptor, so block in the event loop until the
+     * earliest timer expires or some descriptor becomes ready. */
+    if (found_timer || vm->io_waiting > 0) {
+      scheduler_poll(vm, found_timer ? next_wake : EVENTLOOP_FOREVER);
       continue;
     }
 
@@ -1491,24 +2918,39 @@ static void scheduler_resume_task(VM *vm, const Bytecode *restrict code,
     task->done = true;
   }
 
+  /* The values are the VM's until the generator is suspended again,
+   * so that an error releases them only once. */
   memcpy(vm->stack, gen->stack, sizeof(Object) * gen->tos);
   vm->tos = gen->tos;
+  gen->tos = 0;
+  slots_to_stack(vm->stack, vm->tos);
   memcpy(vm->fp_stack, gen->fp_stack, sizeof(BytecodePtr) * gen->fp_count);
   vm->fp_count = gen->fp_count;
 
   if (gen->state == STATE_NEW) {
     BytecodePtr ptr = {.addr = *ip, .location = 0, .fn = gen->fn};
     vm->fp_stack[vm->fp_count++] = ptr;
+  } else if (task->preempted) {
+    /* The task didn't ask to be suspended, so there's no operation
+     * waiting for a result. */
+    task->preempted = false;
   } else if (gen->state == STATE_SUSPENDED) {
     Object sent = task->has_send ? task->send_value : NULL_VAL;
     task->has_send = false;
     push(vm, sent);
+    to_stack(&vm->stack[vm->tos - 1]);
   }
 
+  /* The previous task may have been switched out in the middle of a
+   * call, so the cached frame pointer has to be brought up to date. */
+  vm->fp_base = vm->fp_stack[vm->fp_count - 1].location;
+
   *ip = gen->ip;
   gen->state = STATE_ACTIVE;
   vm->current_task = task;
   vm->gen_stack[vm->gen_count++] = gen;
+  vm->budget = vm->quantum;
+  task_stats_resume(vm, task);
 }
 
 static void scheduler_finish(VM *vm, const Bytecode *restrict code,
@@ -1519,20 +2961,33 @@ static void scheduler_finish(VM *vm, const Bytecode *restrict code,
   Object result = NULL_VAL;
   if (vm->scheduler_root && vm->scheduler_root->has_result) {
     result = vm->scheduler_root->result;
-    objincref(&result);
+    stack_incref(&result);
+  }
+
+  /* The other workers have no run(...) to return from. */
+  bool is_worker = vm->pool && vm->worker->index > 0;
+  if (vm->pool && !is_worker) {
+    pool_stop(vm);
   }
 
   restore_frame(vm, vm->scheduler_frame, ip);
   vm->scheduler_frame = NULL;
   vm->scheduler_running = false;
   vm->current_task = NULL;
+  vm->budget = 0;
   vm->scheduler_root = NULL;
-  push(vm, result);
+  if (!is_worker) {
+    push(vm, result);
+  }
 }
 
 static void scheduler_schedule_next(VM *vm, const Bytecode *restrict code,
                                     uint8_t *restrict *ip)
 {
+  if (vm->current_task) {
+    task_stats_switch_out(vm, vm->current_task);
+  }
+
   bool deadlocked = false;
   Task *next = scheduler_next_runnable(vm, &deadlocked);
   if (next) {
@@ -1552,48 +3007,46 @@ static void scheduler_process_awaited(VM *vm, const Bytecode *restrict code,
 {
   Task *task = vm->current_task;
   if (IS_SLEEP(awaited)) {
-    int ticks = AS_SLEEP(awaited)->ticks;
-    if (ticks < 0) {
-      ticks = 0;
-    }
-    task->wake_tick = vm->scheduler_tick + ticks;
+    /* A sleep too long for the clock to get to is a sleep forever. */
+    uint64_t now = eventloop_now();
+    uint64_t ns = clamp(AS_SLEEP(awaited)->ms * NSEC_PER_MSEC);
+    task->wake_at =
+        ns < EVENTLOOP_FOREVER - now ? now + ns : EVENTLOOP_FOREVER;
     task_set_send_move(task, NULL_VAL);
-    objdecref(&awaited);
+    stack_decref(&awaited);
+  } else if (IS_IO(awaited)) {
+    to_heap(&awaited);
+    scheduler_begin_io(vm, task, awaited);
   } else if (IS_TASK(awaited)) {
     Task *other = AS_TASK(awaited);
     if (other->done) {
-      if (other->has_result) {
-        task_set_send_copy(task, other->result);
-      } else {
-        task_set_send_move(task, NULL_VAL);
-      }
+      task_set_send_move(task, task_result(other));
     } else {
-      task->waiting_on = other;
+      task_begin_wait(task, WAIT_ONE, 1);
+      task_add_waiter(other, task, 0);
     }
-    objdecref(&awaited);
+    stack_decref(&awaited);
   } else if (IS_GENERATOR(awaited)) {
     Task *child = vm_create_task(vm, AS_GENERATOR(awaited));
     if (!child) {
-      objdecref(&awaited);
+      stack_decref(&awaited);
       RUNTIME_ERROR("scheduler task limit exceeded");
     }
-    task->waiting_on = child;
-    objdecref(&awaited);
+    task_begin_wait(task, WAIT_ONE, 1);
+    task_add_waiter(child, task, 0);
+    stack_decref(&awaited);
   } else {
+    to_heap(&awaited);
     task_set_send_move(task, awaited);
   }
 
   scheduler_schedule_next(vm, code, ip);
 }
 
-static void scheduler_suspend_current(VM *vm, const Bytecode *restrict code,
-                                      uint8_t *restrict *ip, Object awaited)
+/* Saves the state of the current task into its generator, so that
+ * scheduler_resume_task() can pick up right where it left off. */
+static void scheduler_park_current(VM *vm, uint8_t *restrict *ip)
 {
-  if (!vm->current_task) {
-    objdecref(&awaited);
-    RUNTIME_ERROR("scheduler has no current task");
-  }
-
   Generator *gen = vm->current_task->gen;
   if (vm->gen_count > 0) {
     --vm->gen_count;
@@ -1601,23 +3054,60 @@ static void scheduler_suspend_current(VM *vm, const Bytecode *restrict code,
 
   memcpy(gen->stack, vm->stack, sizeof(Object) * vm->tos);
   gen->tos = vm->tos;
+  slots_to_heap(gen->stack, gen->tos);
   memcpy(gen->fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
   gen->fp_count = vm->fp_count;
   gen->ip = *ip;
   gen->state = STATE_SUSPENDED;
 
+  /* The generator owns the saved values now, so they must not be
+   * released again if the scheduler bails out before another task
+   * gets to overwrite the stack. */
+  vm->tos = 0;
+}
+
+static void scheduler_suspend_current(VM *vm, const Bytecode *restrict code,
+                                      uint8_t *restrict *ip, Object awaited)
+{
+  if (!vm->current_task) {
+    stack_decref(&awaited);
+    RUNTIME_ERROR("scheduler has no current task");
+  }
+
+  scheduler_park_current(vm, ip);
   scheduler_process_awaited(vm, code, ip, awaited);
 }
 
+static void scheduler_preempt_current(VM *vm, const Bytecode *restrict code,
+                                      uint8_t *restrict *ip)
+{
+  Task *task = vm->current_task;
+
+  /* Only the task's own frames get saved, so if it's in the middle
+   * of running some other generator, try again at the next back-
+   * edge or call. */
+  if (!task || vm->gen_count == 0 ||
+      vm->gen_stack[vm->gen_count - 1] != task->gen) {
+    vm->budget = 1;
+    return;
+  }
+
+  task->preempted = true;
+  scheduler_park_current(vm, ip);
+  scheduler_schedule_next(vm, code, ip);
+}
+
 static void scheduler_complete_current(VM *vm, const Bytecode *restrict code,
                                        uint8_t *restrict *ip, Object returned)
 {
   Task *task = vm->current_task;
   if (!task) {
-    objdecref(&returned);
+    stack_decref(&returned);
     RUNTIME_ERROR("scheduler has no current task");
   }
 
+  to_heap(&returned);
+
   if (vm->gen_count > 0) {
     --vm->gen_count;
   }
@@ -1633,9 +3123,12 @@ static void scheduler_complete_current(VM *vm, const Bytecode *restrict code,
   task->result = returned;
   task->has_result = true;
   task->done = true;
-  task->waiting_on = NULL;
+  task->pending = 0;
 
   scheduler_unblock_waiters(vm, task);
+  if (task->job) {
+    pool_finish_job(vm, task);
+  }
   scheduler_schedule_next(vm, code, ip);
 }
 
@@ -1647,18 +3140,22 @@ static void scheduler_complete_current(VM *vm, const Bytecode *restrict code,
 static inline void handle_op_mkgen(VM *vm, const Bytecode *restrict code,
                                    uint8_t *restrict *ip)
 {
+  const uint8_t *site = *ip;
   Object closure = pop(vm);
   Closure *closure_ptr = AS_CLOSURE(closure);
-  size_t paramcount = closure_ptr->func->paramcount;
+  size_t paramcount = closure_ptr->proto->paramcount;
+
+  ensure_compiled(vm, code, closure_ptr->proto);
 
   Generator gen = {.refcount = 1,
+                   .type = OBJ_GENERATOR,
                    .fn = closure_ptr,
                    .tos = 0,
                    .fp_count = 0,
                    .state = STATE_NEW};
 
   if (paramcount > vm->tos) {
-    objdecref(&closure);
+    stack_decref(&closure);
     RUNTIME_ERROR("not enough arguments to create generator");
   }
 
@@ -1667,55 +3164,454 @@ static inline void handle_op_mkgen(VM *vm, const Bytecode *restrict code,
     gen.stack[i] = vm->stack[arg_base + i];
   }
   gen.tos = paramcount;
+  slots_to_heap(gen.stack, gen.tos);
   vm->tos -= paramcount;
 
-  gen.ip = &code->code.data[closure_ptr->func->location - 1];
+  gen.ip = closure_ptr->proto->code.data - 1;
+
+  push_new(vm, GENERATOR_VAL(SLAB_ALLOC(SLAB_GENERATOR, gen)));
+  profile_alloc(vm, code, site);
+  stack_decref(&closure);
+}
+
+/* OP_YIELD takes a snapshot of the running generator's stacks (main stack
+ * and frame pointer stack), and then restores the caller's context onto the
+ * main VM stack.  Finally, it continues the execution from where the caller
+ * was suspended. */
+static inline void handle_op_yield(VM *vm, const Bytecode *restrict code,
+                                   uint8_t *restrict *ip)
+{
+  safe_point(vm);
+
+  Object yielded = pop(vm);
+
+  if (vm->scheduler_running) {
+    scheduler_suspend_current(vm, code, ip, yielded);
+    return;
+  }
+
+  Generator *gen = vm->gen_stack[--vm->gen_count];
+  FrameSnapshot *fs = vm->fs_stack[--vm->fs_count];
+
+  memcpy(gen->stack, vm->stack, sizeof(Object) * vm->tos);
+  gen->tos = vm->tos;
+  slots_to_heap(gen->stack, gen->tos);
+
+  memcpy(gen->fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
+  gen->fp_count = vm->fp_count;
+
+  memcpy(vm->stack, fs->stack, sizeof(Object) * fs->tos);
+  vm->tos = fs->tos;
+
+  memcpy(vm->fp_stack, fs->fp_stack, sizeof(BytecodePtr) * fs->fp_count);
+  vm->fp_count = fs->fp_count;
+
+  uint8_t *tmp = *ip;
+  *ip = gen->ip;
+  gen->ip = tmp;
+
+  push(vm, yielded);
+
+  gen->state = STATE_SUSPENDED;
+
+  slab_free(SLAB_FRAME_SNAPSHOT, fs);
+
+  Object gen_obj = GENERATOR_VAL(gen);
+  objdecref(&gen_obj);
+}
+
+static void task_queue_push(TaskQueue *queue, Task *task)
+{
+  task->next_waiter = NULL;
+  if (queue->tail) {
+    queue->tail->next_waiter = task;
+  } else {
+    queue->head = task;
+  }
+  queue->tail = task;
+}
+
+static Task *task_queue_pop(TaskQueue *queue)
+{
+  Task *task = queue->head;
+  if (task) {
+    queue->head = task->next_waiter;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+    task->next_waiter = NULL;
+  }
+  return task;
+}
+
+/* Takes a task off the channel's wait queue and makes it runnable
+ * again, with 'value' as the result of the send(...) or recv(...)
+ * it was parked in. */
+static void channel_wake(Task *task, Object value)
+{
+  Object chan_obj = CHANNEL_VAL(task->blocked_on);
+  task->blocked_on = NULL;
+  task->chan_value = NULL_VAL;
+  task_set_send_move(task, value);
+  task_stats_ready(task);
+  objdecref(&chan_obj);
+}
+
+/* Why the current task can't be parked on a channel, or NULL if it
+ * can be. */
+static const char *channel_cannot_park(const VM *vm)
+{
+  Task *task = vm->current_task;
+  if (!vm->scheduler_running || !task) {
+    return "would block outside of the run(...) scheduler";
+  }
+
+  /* Only the task's own frames get saved when it's parked, so it
+   * can't block while it's running some other generator. */
+  if (vm->gen_count == 0 || vm->gen_stack[vm->gen_count - 1] != task->gen) {
+    return "cannot block inside a generator";
+  }
+
+  return NULL;
+}
+
+/* Parks the current task on one of the channel's wait queues, to be
+ * woken up with channel_wake() by a task on the other end. The re-
+ * ference to the channel is handed over to the task, as is 'value',
+ * which is what a sender is trying to send (NULL_VAL for receivers). */
+static void channel_park(VM *vm, const Bytecode *restrict code,
+                         uint8_t *restrict *ip, Object chan_obj,
+                         TaskQueue *queue, const char *builtin, Object value)
+{
+  Task *task = vm->current_task;
+  const char *why = channel_cannot_park(vm);
+  if (why) {
+    objdecref(&value);
+    stack_decref(&chan_obj);
+    RUNTIME_ERROR("%s(...) %s", builtin, why);
+  }
+
+  to_heap(&chan_obj);
+  task->blocked_on = AS_CHANNEL(chan_obj);
+  task->chan_value = value;
+  task_queue_push(queue, task);
+
+  scheduler_park_current(vm, ip);
+  scheduler_schedule_next(vm, code, ip);
+}
+
+static void waiter_queue_push(ChannelWaiterQueue *queue,
+                              ChannelWaiter *waiter)
+{
+  waiter->next = NULL;
+  if (queue->tail) {
+    queue->tail->next = waiter;
+  } else {
+    queue->head = waiter;
+  }
+  queue->tail = waiter;
+}
+
+static ChannelWaiter *waiter_queue_pop(ChannelWaiterQueue *queue)
+{
+  ChannelWaiter *waiter = queue->head;
+  if (waiter) {
+    queue->head = waiter->next;
+    if (!queue->head) {
+      queue->tail = NULL;
+    }
+  }
+  return waiter;
+}
+
+/* Wakes up a task somebody took off a shared channel's wait queue:
+ * directly if it's one of ours, or else through its worker's mail-
+ * box, since only the worker running a task may touch it. */
+static void shared_channel_wake(VM *vm, ChannelWaiter *waiter, Object value)
+{
+  if (waiter->worker == vm->worker) {
+    channel_wake(waiter->task, value);
+  } else {
+    Wakeup wakeup = {
+        .kind = MAIL_WAKEUP, .task = waiter->task, .value = value};
+    mailbox_post(&waiter->worker->mailbox, ALLOC(wakeup));
+  }
+  free(waiter);
+}
+
+/* Like channel_park(), except that the caller holds the lock of the
+ * shared channel, which is released here. */
+static void shared_channel_park(VM *vm, const Bytecode *restrict code,
+                                uint8_t *restrict *ip, Object chan_obj,
+                                ChannelWaiterQueue *queue,
+                                const char *builtin, Object value)
+{
+  SharedChannel *shared = AS_CHANNEL(chan_obj)->shared;
+  Task *task = vm->current_task;
+  const char *why = channel_cannot_park(vm);
+  if (why) {
+    pthread_mutex_unlock(&shared->lock);
+    objdecref(&value);
+    stack_decref(&chan_obj);
+    RUNTIME_ERROR("%s(...) %s", builtin, why);
+  }
+
+  ChannelWaiter waiter = {.task = task, .worker = vm->worker, .value = value};
+  waiter_queue_push(queue, ALLOC(waiter));
+  pthread_mutex_unlock(&shared->lock);
+
+  to_heap(&chan_obj);
+  task->blocked_on = AS_CHANNEL(chan_obj);
+  task->chan_value = NULL_VAL;
+
+  scheduler_park_current(vm, ip);
+  scheduler_schedule_next(vm, code, ip);
+}
+
+/* The receiver may be running on another worker, so it gets a copy
+ * of the value, which is made before taking the lock. */
+static void shared_channel_send(VM *vm, const Bytecode *restrict code,
+                                uint8_t *restrict *ip, Object chan_obj,
+                                Object value)
+{
+  SharedChannel *shared = AS_CHANNEL(chan_obj)->shared;
+
+  Object copy;
+  if (!copy_object(&value, &copy)) {
+    const char *type_name = get_object_type(&value);
+    stack_decref(&value);
+    stack_decref(&chan_obj);
+    RUNTIME_ERROR("send(...) cannot hand a '%s' to another worker",
+                  type_name);
+  }
+  stack_decref(&value);
+
+  pthread_mutex_lock(&shared->lock);
+  ChannelWaiter *receiver = waiter_queue_pop(&shared->receivers);
+  if (receiver) {
+    pthread_mutex_unlock(&shared->lock);
+    shared_channel_wake(vm, receiver, copy);
+  } else if (shared->count < shared->capacity) {
+    shared->buffer[(shared->head + shared->count++) % shared->capacity] =
+        copy;
+    pthread_mutex_unlock(&shared->lock);
+  } else {
+    shared_channel_park(vm, code, ip, chan_obj, &shared->senders, "send",
+                        copy);
+    return;
+  }
+
+  stack_decref(&chan_obj);
+  push(vm, NULL_VAL);
+}
+
+static void shared_channel_recv(VM *vm, const Bytecode *restrict code,
+                                uint8_t *restrict *ip, Object chan_obj)
+{
+  SharedChannel *shared = AS_CHANNEL(chan_obj)->shared;
+
+  pthread_mutex_lock(&shared->lock);
+  Object value;
+  ChannelWaiter *sender = waiter_queue_pop(&shared->senders);
+  if (shared->count > 0) {
+    value = shared->buffer[shared->head];
+    shared->head = (shared->head + 1) % shared->capacity;
+    --shared->count;
+    if (sender) {
+      shared->buffer[(shared->head + shared->count++) % shared->capacity] =
+          sender->value;
+    }
+  } else if (sender) {
+    value = sender->value;
+  } else {
+    shared_channel_park(vm, code, ip, chan_obj, &shared->receivers, "recv",
+                        NULL_VAL);
+    return;
+  }
+  pthread_mutex_unlock(&shared->lock);
+
+  if (sender) {
+    shared_channel_wake(vm, sender, NULL_VAL);
+  }
+
+  stack_decref(&chan_obj);
+  push(vm, value);
+  to_stack(&vm->stack[vm->tos - 1]);
+}
+
+static void channel_send(VM *vm, const Bytecode *restrict code,
+                         uint8_t *restrict *ip, Object chan_obj, Object value)
+{
+  Channel *chan = AS_CHANNEL(chan_obj);
+  if (chan->shared) {
+    shared_channel_send(vm, code, ip, chan_obj, value);
+    return;
+  }
+
+  to_heap(&value);
+
+  Task *receiver = task_queue_pop(&chan->receivers);
+  if (receiver) {
+    /* Somebody is already waiting, which means that the buffer is
+     * empty, so the value goes straight to them. */
+    channel_wake(receiver, value);
+  } else if (chan->count < chan->capacity) {
+    chan->buffer[(chan->head + chan->count++) % chan->capacity] = value;
+  } else {
+    channel_park(vm, code, ip, chan_obj, &chan->senders, "send", value);
+    return;
+  }
+
+  stack_decref(&chan_obj);
+  push(vm, NULL_VAL);
+}
+
+static void channel_recv(VM *vm, const Bytecode *restrict code,
+                         uint8_t *restrict *ip, Object chan_obj)
+{
+  Channel *chan = AS_CHANNEL(chan_obj);
+  if (chan->shared) {
+    shared_channel_recv(vm, code, ip, chan_obj);
+    return;
+  }
+
+  if (chan->count > 0) {
+    Object value = chan->buffer[chan->head];
+    chan->head = (chan->head + 1) % chan->capacity;
+    --chan->count;
+
+    /* A slot just freed up, so the longest waiting sender can put
+     * its value in the buffer and carry on. */
+    Task *sender = task_queue_pop(&chan->senders);
+    if (sender) {
+      chan->buffer[(chan->head + chan->count++) % chan->capacity] =
+          sender->chan_value;
+      channel_wake(sender, NULL_VAL);
+    }
+
+    stack_decref(&chan_obj);
+    push(vm, value);
+    to_stack(&vm->stack[vm->tos - 1]);
+    return;
+  }
+
+  /* An unbuffered channel has no slots, so the value is taken from
+   * the sender directly. */
+  Task *sender = task_queue_pop(&chan->senders);
+  if (sender) {
+    Object value = sender->chan_value;
+    channel_wake(sender, NULL_VAL);
+    stack_decref(&chan_obj);
+    push(vm, value);
+    to_stack(&vm->stack[vm->tos - 1]);
+    return;
+  }
 
-  push(vm, GENERATOR_VAL(ALLOC(gen)));
-  objdecref(&closure);
+  channel_park(vm, code, ip, chan_obj, &chan->receivers, "recv", NULL_VAL);
 }
 
-/* OP_YIELD takes a snapshot of the running generator's stacks (main stack
- * and frame pointer stack), and then restores the caller's context onto the
- * main VM stack.  Finally, it continues the execution from where the caller
- * was suspended. */
-static inline void handle_op_yield(VM *vm, const Bytecode *restrict code,
-                                   uint8_t *restrict *ip)
+/* Implements gather(...) (WAIT_ALL) and select(...) (WAIT_ANY). The
+ * current task registers itself as a waiter on each of the tasks in
+ * the array and is parked with the number of tasks it's waiting for
+ * as its pending count, which scheduler_unblock_waiters() counts down
+ * as the tasks finish, so no task ever has to be polled. Generators
+ * in the array are spawned as tasks first, just like with await. */
+static void scheduler_wait_many(VM *vm, const Bytecode *restrict code,
+                                uint8_t *restrict *ip, Object arr_obj,
+                                WaitKind kind, const char *builtin)
 {
-  Object yielded = pop(vm);
-
-  if (vm->scheduler_running) {
-    scheduler_suspend_current(vm, code, ip, yielded);
-    return;
+  Task *task = vm->current_task;
+  if (!IS_ARRAY(arr_obj)) {
+    const char *type_name = get_object_type(&arr_obj);
+    stack_decref(&arr_obj);
+    RUNTIME_ERROR("%s(...) requires an array of tasks, got '%s'", builtin,
+                  type_name);
   }
 
-  Generator *gen = vm->gen_stack[--vm->gen_count];
-  FrameSnapshot *fs = vm->fs_stack[--vm->fs_count];
+  DynArray_Object *elements = &AS_ARRAY(arr_obj)->elements;
+  for (size_t i = 0; i < elements->count; i++) {
+    Object element = elements->data[i];
+    if (!IS_TASK(element) && !IS_GENERATOR(element)) {
+      const char *type_name = get_object_type(&element);
+      stack_decref(&arr_obj);
+      RUNTIME_ERROR("%s(...) requires an array of tasks, got '%s' element",
+                    builtin, type_name);
+    }
+  }
 
-  memcpy(gen->stack, vm->stack, sizeof(Object) * vm->tos);
-  gen->tos = vm->tos;
+  if (kind == WAIT_ANY && elements->count == 0) {
+    stack_decref(&arr_obj);
+    RUNTIME_ERROR("select(...) requires a non-empty array");
+  }
 
-  memcpy(gen->fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
-  gen->fp_count = vm->fp_count;
+  if (!vm->scheduler_running || !task) {
+    stack_decref(&arr_obj);
+    RUNTIME_ERROR("%s(...) would block outside of the run(...) scheduler",
+                  builtin);
+  }
 
-  memcpy(vm->stack, fs->stack, sizeof(Object) * fs->tos);
-  vm->tos = fs->tos;
+  /* Only the task's own frames get saved when it's parked, so it
+   * can't block while it's running some other generator. */
+  if (vm->gen_count == 0 || vm->gen_stack[vm->gen_count - 1] != task->gen) {
+    stack_decref(&arr_obj);
+    RUNTIME_ERROR("%s(...) cannot block inside a generator", builtin);
+  }
 
-  memcpy(vm->fp_stack, fs->fp_stack, sizeof(BytecodePtr) * fs->fp_count);
-  vm->fp_count = fs->fp_count;
+  DynArray_Object gathered = {0};
+  task_begin_wait(task, kind, 0);
 
-  uint8_t *tmp = *ip;
-  *ip = gen->ip;
-  gen->ip = tmp;
+  for (size_t i = 0; i < elements->count; i++) {
+    Object element = elements->data[i];
+    Task *other;
+    if (IS_TASK(element)) {
+      other = AS_TASK(element);
+    } else {
+      other = vm_create_task(vm, AS_GENERATOR(element));
+      if (!other) {
+        task->pending = 0;
+        dynarray_free(&gathered);
+        stack_decref(&arr_obj);
+        RUNTIME_ERROR("scheduler task limit exceeded");
+      }
+    }
 
-  push(vm, yielded);
+    if (kind == WAIT_ALL) {
+      if (other->done) {
+        dynarray_insert(&gathered, task_result(other));
+      } else {
+        dynarray_insert(&gathered, NULL_VAL);
+        task_add_waiter(other, task, i);
+        ++task->pending;
+      }
+    } else if (other->done) {
+      /* Some task is already done, so select(...) has its winner,
+       * and the waiters registered so far are left to go stale. */
+      task->pending = 0;
+      Object winner = TASK_VAL(other);
+      stack_incref(&winner);
+      stack_decref(&arr_obj);
+      push(vm, winner);
+      return;
+    } else {
+      task_add_waiter(other, task, i);
+      task->pending = 1;
+    }
+  }
 
-  gen->state = STATE_SUSPENDED;
+  stack_decref(&arr_obj);
 
-  free(fs);
+  if (kind == WAIT_ALL) {
+    Array array = {.refcount = 1, .type = OBJ_ARRAY, .elements = gathered};
+    Object gathered_obj = ARRAY_VAL(SLAB_ALLOC(SLAB_ARRAY, array));
+    if (task->pending == 0) {
+      push_new(vm, gathered_obj);
+      return;
+    }
+    task->gathered = gathered_obj;
+  }
 
-  Object gen_obj = GENERATOR_VAL(gen);
-  objdecref(&gen_obj);
+  scheduler_park_current(vm, ip);
+  scheduler_schedule_next(vm, code, ip);
 }
 
 static inline void resume_generator(VM *vm, const Bytecode *restrict code,
@@ -1726,34 +3622,33 @@ static inline void resume_generator(VM *vm, const Bytecode *restrict code,
 
   if (!IS_GENERATOR(obj)) {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
-    objdecref(&sent);
+    stack_decref(&obj);
+    stack_decref(&sent);
     RUNTIME_ERROR("cannot resume objects of type: '%s'", type_name);
   }
 
   Generator *gen = AS_GENERATOR(obj);
 
   if (gen->state == STATE_DONE) {
-    objdecref(&obj);
-    objdecref(&sent);
+    stack_decref(&obj);
+    stack_decref(&sent);
     RUNTIME_ERROR("cannot resume a completed generator");
   }
 
   if (gen->state == STATE_NEW && !IS_NULL(sent)) {
-    objdecref(&obj);
-    objdecref(&sent);
+    stack_decref(&obj);
+    stack_decref(&sent);
     RUNTIME_ERROR("can't send non-null value to a just-started generator");
   }
 
-  FrameSnapshot fs = {.tos = vm->tos, .ip = *ip, .fp_count = vm->fp_count};
-
-  memcpy(fs.stack, vm->stack, sizeof(Object) * vm->tos);
-  memcpy(fs.fp_stack, vm->fp_stack, sizeof(BytecodePtr) * vm->fp_count);
-
-  vm->fs_stack[vm->fs_count++] = ALLOC(fs);
+  vm->fs_stack[vm->fs_count++] = snapshot_frame(vm, *ip);
 
+  /* The values are the VM's until the generator is suspended again,
+   * so that an error releases them only once. */
   memcpy(vm->stack, gen->stack, sizeof(Object) * gen->tos);
   vm->tos = gen->tos;
+  gen->tos = 0;
+  slots_to_stack(vm->stack, vm->tos);
 
   memcpy(vm->fp_stack, gen->fp_stack, sizeof(BytecodePtr) * gen->fp_count);
   vm->fp_count = gen->fp_count;
@@ -1766,7 +3661,7 @@ static inline void resume_generator(VM *vm, const Bytecode *restrict code,
   if (gen->state == STATE_SUSPENDED) {
     push(vm, sent);
   } else {
-    objdecref(&sent);
+    stack_decref(&sent);
   }
 
   uint8_t *tmp_ip = *ip;
@@ -1778,7 +3673,7 @@ static inline void resume_generator(VM *vm, const Bytecode *restrict code,
   objincref(&obj);
   vm->gen_stack[vm->gen_count++] = gen;
 
-  objdecref(&obj);
+  stack_decref(&obj);
 }
 
 /* OP_RESUME implements next(gen).  It resumes a generator without sending a
@@ -1797,6 +3692,11 @@ static inline void handle_op_send(VM *vm, const Bytecode *restrict code,
 {
   Object sent = pop(vm);
   Object obj = pop(vm);
+
+  if (IS_CHANNEL(obj)) {
+    return channel_send(vm, code, ip, obj, sent);
+  }
+
   return resume_generator(vm, code, ip, obj, sent);
 }
 
@@ -1807,7 +3707,7 @@ static inline void handle_op_await(VM *vm, const Bytecode *restrict code,
 {
   Object awaited = pop(vm);
   if (!vm->scheduler_running) {
-    objdecref(&awaited);
+    stack_decref(&awaited);
     RUNTIME_ERROR("'await' requires run(...) scheduler context");
   }
 
@@ -1823,22 +3723,44 @@ static inline void handle_op_spawn(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
   if (!IS_GENERATOR(obj)) {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("spawn(...) requires an async coroutine/generator, got '%s'",
                   type_name);
   }
 
+  if (vm->pool) {
+    pool_spawn(vm, obj);
+    return;
+  }
+
   Task *task = vm_create_task(vm, AS_GENERATOR(obj));
-  objdecref(&obj);
+  stack_decref(&obj);
   if (!task) {
     RUNTIME_ERROR("scheduler task limit exceeded");
   }
 
   Object task_obj = TASK_VAL(task);
-  objincref(&task_obj);
+  stack_incref(&task_obj);
   push(vm, task_obj);
 }
 
+/* Where the threads of the pool other than worker 0 start off: they
+ * don't run the program, they go straight into the scheduler to wait
+ * for jobs, and when it's done with them, they "return" to the OP_HLT
+ * at the end of the program. */
+static void worker_enter(VM *vm, const Bytecode *restrict code,
+                         uint8_t *restrict *ip)
+{
+  vm->scheduler_running = true;
+  vm->scheduler_root = NULL;
+  vm->current_task = NULL;
+  vm->scheduler_frame =
+      snapshot_frame(vm, &code->code.data[code->code.count - 2]);
+  vm->scheduler_cursor = 0;
+
+  scheduler_schedule_next(vm, code, ip);
+}
+
 static inline void handle_op_run(VM *vm, const Bytecode *restrict code,
                                  uint8_t *restrict *ip)
 {
@@ -1851,16 +3773,16 @@ static inline void handle_op_run(VM *vm, const Bytecode *restrict code,
 
   if (IS_GENERATOR(obj)) {
     root = vm_create_task(vm, AS_GENERATOR(obj));
-    objdecref(&obj);
+    stack_decref(&obj);
     if (!root) {
       RUNTIME_ERROR("scheduler task limit exceeded");
     }
   } else if (IS_TASK(obj)) {
     root = AS_TASK(obj);
-    objdecref(&obj);
+    stack_decref(&obj);
   } else {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR(
         "run(...) requires an async coroutine/generator or task, got '%s'",
         type_name);
@@ -1872,6 +3794,10 @@ static inline void handle_op_run(VM *vm, const Bytecode *restrict code,
   vm->scheduler_frame = snapshot_frame(vm, *ip);
   vm->scheduler_cursor = 0;
 
+  if (vm->workers > 1) {
+    pool_start(vm, code);
+  }
+
   if (!scheduler_has_live_tasks(vm)) {
     scheduler_finish(vm, code, ip);
     return;
@@ -1880,6 +3806,65 @@ static inline void handle_op_run(VM *vm, const Bytecode *restrict code,
   scheduler_schedule_next(vm, code, ip);
 }
 
+static inline void handle_op_channel(VM *vm, const Bytecode *restrict code,
+                                     uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  Object obj = pop(vm);
+  if (!IS_NUM(obj) || AS_NUM(obj) < 0 || AS_NUM(obj) != (size_t) AS_NUM(obj)) {
+    const char *type_name = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("channel(...) requires a non-negative capacity, got '%s'",
+                  type_name);
+  }
+
+  size_t capacity = (size_t) AS_NUM(obj);
+  if (vm->workers > 1 || vm->pool) {
+    /* Any of the workers may end up with a handle to it. */
+    push_new(vm, CHANNEL_VAL(new_shared_channel(capacity)));
+    return;
+  }
+
+  Channel chan = {.refcount = 1,
+                  .type = OBJ_CHANNEL,
+                  .buffer = malloc(sizeof(Object) * capacity),
+                  .capacity = capacity,
+                  .head = 0,
+                  .count = 0,
+                  .senders = {0},
+                  .receivers = {0}};
+  push_new(vm, CHANNEL_VAL(SLAB_ALLOC(SLAB_CHANNEL, chan)));
+}
+
+static inline void handle_op_recv(VM *vm, const Bytecode *restrict code,
+                                  uint8_t *restrict *ip)
+{
+  Object obj = pop(vm);
+  if (!IS_CHANNEL(obj)) {
+    const char *type_name = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("recv(...) requires a channel, got '%s'", type_name);
+  }
+
+  channel_recv(vm, code, ip, obj);
+}
+
+static inline void handle_op_gather(VM *vm, const Bytecode *restrict code,
+                                    uint8_t *restrict *ip)
+{
+  Object obj = pop(vm);
+  scheduler_wait_many(vm, code, ip, obj, WAIT_ALL, "gather");
+}
+
+static inline void handle_op_select(VM *vm, const Bytecode *restrict code,
+                                    uint8_t *restrict *ip)
+{
+  Object obj = pop(vm);
+  scheduler_wait_many(vm, code, ip, obj, WAIT_ANY, "select");
+}
+
 static inline void handle_op_sleep(VM *vm, const Bytecode *restrict code,
                                    uint8_t *restrict *ip)
 {
@@ -1889,17 +3874,17 @@ static inline void handle_op_sleep(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
   if (!IS_NUM(obj)) {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
-    RUNTIME_ERROR("sleep(...) requires a number of scheduler ticks, got '%s'",
+    stack_decref(&obj);
+    RUNTIME_ERROR("sleep(...) requires a number of milliseconds, got '%s'",
                   type_name);
   }
 
-  int ticks = (int) AS_NUM(obj);
-  if (ticks < 0) {
-    ticks = 0;
+  double ms = AS_NUM(obj);
+  if (!(ms > 0)) {
+    ms = 0;
   }
-  Sleep sleep = {.refcount = 1, .ticks = ticks};
-  push(vm, SLEEP_VAL(ALLOC(sleep)));
+  Sleep sleep = {.refcount = 1, .type = OBJ_SLEEP, .ms = ms};
+  push_new(vm, SLEEP_VAL(SLAB_ALLOC(SLAB_SLEEP, sleep)));
 }
 
 static inline void handle_op_done(VM *vm, const Bytecode *restrict code,
@@ -1911,12 +3896,12 @@ static inline void handle_op_done(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
   if (!IS_TASK(obj)) {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("done(...) requires a task, got '%s'", type_name);
   }
 
   bool done = AS_TASK(obj)->done;
-  objdecref(&obj);
+  stack_decref(&obj);
   push(vm, BOOL_VAL(done));
 }
 
@@ -1929,22 +3914,266 @@ static inline void handle_op_result(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
   if (!IS_TASK(obj)) {
     const char *type_name = get_object_type(&obj);
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("result(...) requires a task, got '%s'", type_name);
   }
 
   Task *task = AS_TASK(obj);
   if (!task->done) {
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("result(...) cannot read a pending task");
   }
 
   Object result = task->has_result ? task->result : NULL_VAL;
-  objincref(&result);
-  objdecref(&obj);
+  stack_incref(&result);
+  stack_decref(&obj);
   push(vm, result);
 }
 
+static int pop_fd(VM *vm, const char *builtin)
+{
+  Object obj = pop(vm);
+  if (!IS_NUM(obj) || AS_NUM(obj) < 0 || AS_NUM(obj) != (int) AS_NUM(obj)) {
+    const char *type_name = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("%s(...) requires a file descriptor, got '%s'", builtin,
+                  type_name);
+  }
+  return (int) AS_NUM(obj);
+}
+
+static Object fd_pair(int fds[2])
+{
+  DynArray_Object elements = {0};
+  dynarray_insert(&elements, NUM_VAL(fds[0]));
+  dynarray_insert(&elements, NUM_VAL(fds[1]));
+  Array array = {.refcount = 1, .type = OBJ_ARRAY, .elements = elements};
+  return ARRAY_VAL(SLAB_ALLOC(SLAB_ARRAY, array));
+}
+
+/* Opens a Unix stream socket bound (if 'listening') or connected
+ * to 'path'. Returns -1 with errno set on failure. */
+static int unix_socket(const char *path, bool listening)
+{
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    return -1;
+  }
+
+  bool ok;
+  if (listening) {
+    ok = bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0 &&
+         listen(fd, SOMAXCONN) == 0;
+  } else {
+    /* Connecting to a Unix socket doesn't wait on the network, so
+     * it's done before switching the socket to non-blocking mode. */
+    ok = connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+  }
+
+  if (!ok || !set_nonblocking(fd)) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+static inline void handle_op_pipe(VM *vm, const Bytecode *restrict code,
+                                  uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  int fds[2];
+  if (pipe(fds) == -1) {
+    RUNTIME_ERROR("pipe(): %s", strerror(errno));
+  }
+
+  if (!set_nonblocking(fds[0]) || !set_nonblocking(fds[1])) {
+    int err = errno;
+    close(fds[0]);
+    close(fds[1]);
+    RUNTIME_ERROR("pipe(): %s", strerror(err));
+  }
+
+  push_new(vm, fd_pair(fds));
+}
+
+static inline void handle_op_socketpair(VM *vm, const Bytecode *restrict code,
+                                        uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                 fds) == -1) {
+    RUNTIME_ERROR("socketpair(): %s", strerror(errno));
+  }
+
+  push_new(vm, fd_pair(fds));
+}
+
+static inline void handle_op_listen_unix(VM *vm, const Bytecode *restrict code,
+                                         uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  Object obj = pop(vm);
+  if (!IS_STRING(obj)) {
+    const char *type_name = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("listen_unix(...) requires a path string, got '%s'",
+                  type_name);
+  }
+
+  int fd = unix_socket(AS_STRING(obj)->value, true);
+  int err = errno;
+  stack_decref(&obj);
+  if (fd == -1) {
+    RUNTIME_ERROR("listen_unix(...): %s", strerror(err));
+  }
+
+  push(vm, NUM_VAL(fd));
+}
+
+static inline void handle_op_connect_unix(VM *vm, const Bytecode *restrict code,
+                                          uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  Object obj = pop(vm);
+  if (!IS_STRING(obj)) {
+    const char *type_name = get_object_type(&obj);
+    stack_decref(&obj);
+    RUNTIME_ERROR("connect_unix(...) requires a path string, got '%s'",
+                  type_name);
+  }
+
+  int fd = unix_socket(AS_STRING(obj)->value, false);
+  int err = errno;
+  stack_decref(&obj);
+  if (fd == -1) {
+    RUNTIME_ERROR("connect_unix(...): %s", strerror(err));
+  }
+
+  push(vm, NUM_VAL(fd));
+}
+
+static inline void handle_op_accept(VM *vm, const Bytecode *restrict code,
+                                    uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  int fd = pop_fd(vm, "accept");
+
+  Io io = {.refcount = 1,
+           .type = OBJ_IO,
+           .kind = IO_ACCEPT,
+           .fd = fd,
+           .data = NULL_VAL};
+  push_new(vm, IO_VAL(SLAB_ALLOC(SLAB_IO, io)));
+}
+
+static inline void handle_op_read_fd(VM *vm, const Bytecode *restrict code,
+                                     uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  Object count = pop(vm);
+  if (!IS_NUM(count)) {
+    const char *type_name = get_object_type(&count);
+    stack_decref(&count);
+    RUNTIME_ERROR("read_fd(...) requires a positive byte count, got '%s'",
+                  type_name);
+  }
+
+  /* Checked before the cast to size_t, which is undefined for NaN
+   * and for anything out of its range. */
+  double n = AS_NUM(count);
+  if (!(n >= 1 && n <= (double) SSIZE_MAX) || (double) (size_t) n != n) {
+    RUNTIME_ERROR(
+        "read_fd(...) requires an integer byte count between 1 and %zd, "
+        "got %g",
+        (ssize_t) SSIZE_MAX, n);
+  }
+
+  int fd = pop_fd(vm, "read_fd");
+
+  /* The descriptor may not have been created by venom (e.g., stdin),
+   * in which case it has to be made non-blocking here, or the first
+   * attempt at reading from it would stall the whole scheduler. */
+  if (!set_nonblocking(fd)) {
+    RUNTIME_ERROR("read_fd(...): %s", strerror(errno));
+  }
+
+  Io io = {.refcount = 1,
+           .type = OBJ_IO,
+           .kind = IO_READ,
+           .fd = fd,
+           .count = (size_t) n,
+           .buf = NULL,
+           .data = NULL_VAL};
+  push_new(vm, IO_VAL(SLAB_ALLOC(SLAB_IO, io)));
+}
+
+static inline void handle_op_write_fd(VM *vm, const Bytecode *restrict code,
+                                      uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  Object data = pop(vm);
+  if (!IS_STRING(data)) {
+    const char *type_name = get_object_type(&data);
+    stack_decref(&data);
+    RUNTIME_ERROR("write_fd(...) requires a string, got '%s'", type_name);
+  }
+
+  int fd = pop_fd(vm, "write_fd");
+  if (!set_nonblocking(fd)) {
+    int err = errno;
+    stack_decref(&data);
+    RUNTIME_ERROR("write_fd(...): %s", strerror(err));
+  }
+
+  to_heap(&data);
+  Io io = {.refcount = 1,
+           .type = OBJ_IO,
+           .kind = IO_WRITE,
+           .fd = fd,
+           .data = data,
+           .written = 0};
+  push_new(vm, IO_VAL(SLAB_ALLOC(SLAB_IO, io)));
+}
+
+static inline void handle_op_close_fd(VM *vm, const Bytecode *restrict code,
+                                      uint8_t *restrict *ip)
+{
+  (void) code;
+  (void) ip;
+
+  int fd = pop_fd(vm, "close_fd");
+  if (close(fd) == -1) {
+    RUNTIME_ERROR("close_fd(...): %s", strerror(errno));
+  }
+
+  push(vm, NULL_VAL);
+}
+
 static inline void handle_op_len(VM *vm, const Bytecode *restrict code,
                                  uint8_t *restrict *ip)
 {
@@ -1955,12 +4184,29 @@ static inline void handle_op_len(VM *vm, const Bytecode *restrict code,
   } else if (IS_ARRAY(obj)) {
     push(vm, NUM_VAL(AS_ARRAY(obj)->elements.count));
   } else {
-    objdecref(&obj);
+    stack_decref(&obj);
     RUNTIME_ERROR("cannot 'len()' objects of type: '%s'",
                   get_object_type(&obj));
   }
 
-  objdecref(&obj);
+  stack_decref(&obj);
+}
+
+/* OP_LEN_BORROW is OP_LEN for a borrowed object (see OP_DEEPGET_BOR-
+ * ROW), so there's nothing to decrement. */
+static inline void handle_op_len_borrow(VM *vm, const Bytecode *restrict code,
+                                        uint8_t *restrict *ip)
+{
+  Object obj = pop(vm);
+
+  if (IS_STRING(obj)) {
+    push(vm, NUM_VAL(strlen(AS_STRING(obj)->value)));
+  } else if (IS_ARRAY(obj)) {
+    push(vm, NUM_VAL(AS_ARRAY(obj)->elements.count));
+  } else {
+    RUNTIME_ERROR("cannot 'len()' objects of type: '%s'",
+                  get_object_type(&obj));
+  }
 }
 
 static inline void handle_op_hasattr(VM *vm, const Bytecode *restrict code,
@@ -1970,8 +4216,8 @@ static inline void handle_op_hasattr(VM *vm, const Bytecode *restrict code,
   Object obj = pop(vm);
 
   if (!IS_STRUCT(obj)) {
-    objdecref(&obj);
-    objdecref(&attr);
+    stack_decref(&obj);
+    stack_decref(&attr);
 
     RUNTIME_ERROR("cannot 'hasattr()' objects of type: '%s'",
                   get_object_type(&obj));
@@ -1980,8 +4226,8 @@ static inline void handle_op_hasattr(VM *vm, const Bytecode *restrict code,
   Object *found = table_get(AS_STRUCT(obj)->properties, AS_STRING(attr)->value);
   push(vm, !found ? BOOL_VAL(false) : BOOL_VAL(true));
 
-  objdecref(&obj);
-  objdecref(&attr);
+  stack_decref(&obj);
+  stack_decref(&attr);
 }
 
 static inline void handle_op_assert(VM *vm, const Bytecode *restrict code,
@@ -1990,13 +4236,13 @@ static inline void handle_op_assert(VM *vm, const Bytecode *restrict code,
   Object assertion = pop(vm);
 
   if (!IS_BOOL(assertion)) {
-    objdecref(&assertion);
+    stack_decref(&assertion);
     RUNTIME_ERROR("cannot 'assert()' objects of type: '%s'",
                   get_object_type(&assertion));
   }
 
   if (!AS_BOOL(assertion)) {
-    objdecref(&assertion);
+    stack_decref(&assertion);
     RUNTIME_ERROR("assertion failed");
   }
 }
@@ -2006,6 +4252,42 @@ static inline const char *print_current_instruction(uint8_t opcode)
 {
   return disassemble_handler[opcode].opcode;
 }
+
+/* The offset of 'ip' in the code of the function it's in. */
+static long ip_offset(const Bytecode *code, const uint8_t *ip)
+{
+  const FunctionProto *proto;
+  return locate_code(code, ip, &proto);
+}
+#endif
+
+#ifdef REFCHECK
+/* Checks the counts against the references from the objects and the
+ * VM itself: the stack, the globals, and the tasks that never fin-
+ * ished, see refcheck_verify(). */
+static void refcheck(VM *vm)
+{
+  /* The workers' VMs hold objects of their own, which are gone along
+   * with the pool, and the program is done with it by now anyway. */
+  if (vm->pool) {
+    pool_stop(vm);
+  }
+
+  DynArray_Object roots = {0};
+#ifndef DEFERRED_RC
+  for (size_t i = 0; i < vm->tos; i++) {
+    dynarray_insert(&roots, vm->stack[i]);
+  }
+#endif
+  for (size_t i = 0; i < vm->globals.count; i++) {
+    dynarray_insert(&roots, vm->globals.data[i]);
+  }
+  for (size_t i = 0; i < vm->task_count; i++) {
+    dynarray_insert(&roots, TASK_VAL(vm->tasks[i]));
+  }
+  refcheck_verify(roots.data, roots.count);
+  dynarray_free(&roots);
+}
 #endif
 
 ExecResult exec(VM *restrict vm, const Bytecode *code)
@@ -2023,11 +4305,13 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
       &&op_not,
       &&op_neg,
       &&op_true,
+      &&op_false,
       &&op_null,
       &&op_const,
       &&op_str,
       &&op_jmp,
       &&op_jz,
+      &&op_jnz,
       &&op_bitand,
       &&op_bitor,
       &&op_bitxor,
@@ -2040,9 +4324,11 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
       &&op_deepset,
       &&op_deepget,
       &&op_deepget_ptr,
+      &&op_deepget_borrow,
       &&op_setattr,
       &&op_getattr,
       &&op_getattr_ptr,
+      &&op_getattr_borrow,
       &&op_struct,
       &&op_struct_blueprint,
       &&op_closure,
@@ -2056,6 +4342,7 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
       &&op_array,
       &&op_arrayset,
       &&op_subscript,
+      &&op_subscript_borrow,
       &&op_get_upvalue,
       &&op_get_upvalue_ptr,
       &&op_set_upvalue,
@@ -2071,22 +4358,52 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
       &&op_sleep,
       &&op_done,
       &&op_result,
+      &&op_pipe,
+      &&op_socketpair,
+      &&op_listen_unix,
+      &&op_connect_unix,
+      &&op_accept,
+      &&op_read_fd,
+      &&op_write_fd,
+      &&op_close_fd,
+      &&op_channel,
+      &&op_recv,
+      &&op_gather,
+      &&op_select,
       &&op_len,
+      &&op_len_borrow,
       &&op_hasattr,
       &&op_assert,
       &&op_hlt,
   };
 
+  while (vm->globals.count < code->sp.count) {
+    dynarray_insert(&vm->globals, NULL_VAL);
+  }
+
+  /* With --measure=tasks, every instruction makes a detour through
+   * 'op_count' on its way to the handler, so that it can be charged
+   * to the task that runs it. Otherwise, the table is the dispatch
+   * table itself, and the detour costs nothing. */
+  void *counting_table[sizeof(dispatch_table) / sizeof(dispatch_table[0])];
+  for (size_t i = 0; vm->measure_tasks && i < sizeof(counting_table) /
+                                                 sizeof(counting_table[0]);
+       i++) {
+    counting_table[i] = &&op_count;
+  }
+  void *const *const table =
+      vm->measure_tasks ? counting_table : dispatch_table;
+
 #ifndef venom_debug_vm
-#define DISPATCH() goto *dispatch_table[*++ip]
+#define DISPATCH() goto *table[*++ip]
 #else
 #define DISPATCH()                                                         \
   do {                                                                     \
     PRINT_STACK();                                                         \
     PRINT_FPSTACK();                                                       \
-    printf("%ld: ", ip - code->code.data + 1);                             \
+    printf("%ld: ", ip_offset(code, ip + 1));                              \
     printf("current instruction: %s\n", print_current_instruction(*++ip)); \
-    goto *dispatch_table[*ip];                                             \
+    goto *table[*ip];                                                      \
   } while (0)
 #endif
 
@@ -2100,6 +4417,12 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
 
   clock_gettime(CLOCK_MONOTONIC, &start);
 
+  /* The objects that die are only freed at the safe points, see
+   * safe_point(). */
+  if (vm->free_budget) {
+    set_lazy_release(true);
+  }
+
   int status = setjmp(vm->trap);
   if (status != 0) {
     goto bail;
@@ -2107,6 +4430,19 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
 
   uint8_t *restrict ip = code->code.data;
 
+  if (vm->worker && vm->worker->index > 0) {
+    /* Like any handler, this leaves 'ip' right before what's next. */
+    worker_enter(vm, code, &ip);
+    DISPATCH();
+  }
+
+  goto *table[*ip];
+
+op_count:
+  ++vm->instructions;
+  if (vm->tos > vm->peak_tos) {
+    vm->peak_tos = vm->tos;
+  }
   goto *dispatch_table[*ip];
 
   HANDLE(print)
@@ -2121,11 +4457,13 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
   HANDLE(not )
   HANDLE(neg)
   HANDLE(true)
+  HANDLE(false)
   HANDLE(null)
   HANDLE(const)
   HANDLE(str)
   HANDLE(jmp)
   HANDLE(jz)
+  HANDLE(jnz)
   HANDLE(bitand)
   HANDLE(bitor)
   HANDLE(bitxor)
@@ -2138,9 +4476,11 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
   HANDLE(deepset)
   HANDLE(deepget)
   HANDLE(deepget_ptr)
+  HANDLE(deepget_borrow)
   HANDLE(setattr)
   HANDLE(getattr)
   HANDLE(getattr_ptr)
+  HANDLE(getattr_borrow)
   HANDLE(struct)
   HANDLE(struct_blueprint)
   HANDLE(closure)
@@ -2154,6 +4494,7 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
   HANDLE(array)
   HANDLE(arrayset)
   HANDLE(subscript)
+  HANDLE(subscript_borrow)
   HANDLE(get_upvalue)
   HANDLE(get_upvalue_ptr)
   HANDLE(set_upvalue)
@@ -2169,12 +4510,32 @@ ExecResult exec(VM *restrict vm, const Bytecode *code)
   HANDLE(sleep)
   HANDLE(done)
   HANDLE(result)
+  HANDLE(pipe)
+  HANDLE(socketpair)
+  HANDLE(listen_unix)
+  HANDLE(connect_unix)
+  HANDLE(accept)
+  HANDLE(read_fd)
+  HANDLE(write_fd)
+  HANDLE(close_fd)
+  HANDLE(channel)
+  HANDLE(recv)
+  HANDLE(gather)
+  HANDLE(select)
   HANDLE(len)
+  HANDLE(len_borrow)
   HANDLE(hasattr)
   HANDLE(assert)
 
 op_hlt:
   assert(vm->tos == 0);
+#ifdef REFCHECK
+  /* The worker threads halt, too, but only the main one gets to walk
+   * the slabs, once they're gone. */
+  if (pool_worker_index(vm) == 0) {
+    refcheck(vm);
+  }
+#endif
   clock_gettime(CLOCK_MONOTONIC, &end);
   r.time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
   return r;
@@ -2185,6 +4546,8 @@ bail:
   r.is_ok = false;
   r.errcode = -1;
   r.msg = vm->err_msg;
+  r.in_compiler = vm->err_in_compiler;
+  r.span = vm->err_span;
   return r;
 
 #undef HANDLE
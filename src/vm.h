@@ -9,6 +9,8 @@
 #include <stdint.h>
 
 #include "compiler.h"
+#include "dynarray.h"
+#include "eventloop.h"
 #include "object.h"
 
 typedef struct {
@@ -19,10 +21,23 @@ typedef struct {
   uint8_t *ip;
 } FrameSnapshot;
 
+/* A task's counters, as --measure=tasks reports them once it's done
+ * (or once the VM goes away, if it never finishes). */
+typedef struct {
+  int id;
+  uint32_t worker;
+  TaskStats stats;
+} TaskReport;
+
+typedef DynArray(TaskReport) DynArray_TaskReport;
+
 typedef struct {
   Object stack[STACK_MAX];
   size_t tos; /* top of stack */
-  Table_Object globals;
+  /* The globals are at the index of their name in the string pool of
+   * the code, which is what OP_GET_GLOBAL and friends refer to them
+   * by. The slots of the names that aren't globals are null. */
+  DynArray_Object globals;
   Table_StructBlueprint *blueprints;
   BytecodePtr fp_stack[STACK_MAX]; /* a stack for frame pointers */
   size_t fp_count;
@@ -34,26 +49,43 @@ typedef struct {
   Task *tasks[STACK_MAX];
   size_t task_count;
   int next_task_id;
-  int scheduler_tick;
   bool scheduler_running;
   Task *current_task;
   Task *scheduler_root;
   FrameSnapshot *scheduler_frame;
   size_t scheduler_cursor;
+  EventLoop loop;
+  size_t io_waiting; /* number of tasks blocked on an Io */
+  uint32_t quantum;  /* back-edges and calls per time slice, 0 if off */
+  uint32_t budget;   /* what's left of the current task's time slice */
+  uint32_t workers;  /* threads a run(...) uses, see "parallel scheduler" */
+  uint32_t free_budget; /* objects freed per safe point, 0 if not lazy */
+  struct Pool *pool; /* the worker threads, while a run(...) uses them */
+  struct Worker *worker; /* this VM's worker, if 'pool' is set */
+  bool measure_tasks;     /* see --measure=tasks */
+  uint64_t instructions;  /* executed so far, if 'measure_tasks' */
+  size_t peak_tos;        /* the deepest the running task's stack got */
+  DynArray_TaskReport task_reports;
   uint32_t fp_base;
   jmp_buf trap;
   char *err_msg;
+  bool err_in_compiler; /* see compile_deferred() */
+  Span err_span;
 } VM;
 
 typedef struct {
   int errcode;
   bool is_ok;
   char *msg;
+  bool in_compiler; /* the error is a compile error, at 'span' */
+  Span span;
   double time;
 } ExecResult;
 
 void init_vm(VM *vm);
 void free_vm(VM *vm);
 ExecResult exec(VM *restrict vm, const Bytecode *code);
+void collect_garbage(VM *vm);
+void print_task_reports(VM *vm, bool json);
 
 #endif
@@ -0,0 +1,384 @@
+#include "vnmc.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+#ifndef VENOM_BUILD_ID
+/* Built without the Makefile, which is left to tell the builds apart
+ * by when this file was compiled. */
+#define VENOM_BUILD_ID __DATE__ " " __TIME__
+#endif
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t hash_bytes(uint64_t hash, const void *data, size_t size)
+{
+  const unsigned char *p = data;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= p[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+uint64_t hash_source(const char *source)
+{
+  return hash_bytes(FNV_OFFSET, source, strlen(source));
+}
+
+uint64_t vnmc_build_id(void)
+{
+  return hash_source(VENOM_BUILD_ID);
+}
+
+uint32_t vnmc_flags(uint32_t passes)
+{
+  uint32_t flags = passes ? VNMC_OPTIMIZED | (passes << VNMC_PASSES_SHIFT) : 0;
+#ifdef NAN_BOXING
+  flags |= VNMC_NAN_BOXING;
+#endif
+  return flags;
+}
+
+bool is_vnmc_path(const char *path)
+{
+  size_t len = strlen(path);
+  return len >= 5 && strcmp(path + len - 5, ".vnmc") == 0;
+}
+
+char *vnmc_path(const char *source_path)
+{
+  size_t len = strlen(source_path);
+  bool is_vnm = len >= 4 && strcmp(source_path + len - 4, ".vnm") == 0;
+  const char *suffix = is_vnm ? "c" : ".vnmc";
+  char *path = malloc(len + strlen(suffix) + 1);
+  strcpy(path, source_path);
+  strcat(path, suffix);
+  return path;
+}
+
+char *vnmc_cache_path(uint64_t source_hash, uint32_t flags)
+{
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char *dir;
+
+  /* XDG says a relative $XDG_CACHE_HOME is to be ignored. */
+  if (xdg && xdg[0] == '/') {
+    alloc_err_str(&dir, "%s/venom", xdg);
+    mkdir(xdg, 0700);
+  } else if (home && home[0] == '/') {
+    alloc_err_str(&dir, "%s/.cache", home);
+    mkdir(dir, 0700);
+    free(dir);
+    alloc_err_str(&dir, "%s/.cache/venom", home);
+  } else {
+    return NULL;
+  }
+
+  if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+    free(dir);
+    return NULL;
+  }
+
+  /* The flags go into the key, so that, e.g., the optimized and the
+   * unoptimized code of the same source get an entry each, and so does
+   * the build, so that builds sharing a cache don't evict each other. */
+  uint64_t key = source_hash;
+  uint64_t build_id = vnmc_build_id();
+  uint32_t salt[] = {flags, VNMC_VERSION, OP_HLT + 1, (uint32_t) build_id,
+                     (uint32_t) (build_id >> 32)};
+  key = hash_bytes(key, salt, sizeof(salt));
+
+  char *path;
+  alloc_err_str(&path, "%s/%016llx.vnmc", dir, (unsigned long long) key);
+  free(dir);
+  return path;
+}
+
+/* The instructions are padded, so that the line table of the code that
+ * follows them is aligned. */
+static size_t padded(size_t size)
+{
+  return (size + 3) & ~(size_t) 3;
+}
+
+static size_t code_record_size(const DynArray_uint8_t *code,
+                               const DynArray_LineRun *lines)
+{
+  return sizeof(VnmcCode) + sizeof(LineRun) * lines->count +
+         padded(code->count);
+}
+
+/* Writes what comes after the header, adding it to the checksum. */
+static bool write_payload(FILE *f, const void *data, size_t size,
+                          uint64_t *checksum)
+{
+  *checksum = hash_bytes(*checksum, data, size);
+  return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+static bool write_code(FILE *f, VnmcCode record, const DynArray_uint8_t *code,
+                       const DynArray_LineRun *lines, uint64_t *checksum)
+{
+  static const uint8_t padding[4] = {0};
+  size_t pad = padded(code->count) - code->count;
+
+  record.size = code->count;
+  record.line_count = lines->count;
+
+  return write_payload(f, &record, sizeof(record), checksum) &&
+         write_payload(f, lines->data, sizeof(LineRun) * lines->count,
+                       checksum) &&
+         write_payload(f, code->data, code->count, checksum) &&
+         write_payload(f, padding, pad, checksum);
+}
+
+/* The names of the functions are in the sp already, so only their in-
+ * dexes are saved. */
+static uint32_t name_index(const Bytecode *code, const char *name)
+{
+  for (size_t i = 0; i < code->sp.count; i++) {
+    if (code->sp.data[i] == name) {
+      return i;
+    }
+  }
+  return UINT32_MAX;
+}
+
+bool write_vnmc(const char *path, const Bytecode *code, uint64_t source_hash,
+                uint32_t flags)
+{
+  VnmcHeader header = {
+      .magic = {'V', 'N', 'M', 'C'},
+      .version = VNMC_VERSION,
+      .flags = flags,
+      .opcode_count = OP_HLT + 1,
+      .source_hash = source_hash,
+      .build_id = vnmc_build_id(),
+      .sp_count = code->sp.count,
+      .proto_count = code->protos.count,
+      .code_size = code_record_size(&code->code, &code->lines),
+      .sp_size = 0,
+      .checksum = FNV_OFFSET,
+  };
+  for (size_t i = 0; i < code->protos.count; i++) {
+    header.code_size += code_record_size(&code->protos.data[i]->code,
+                                         &code->protos.data[i]->lines);
+  }
+  for (size_t i = 0; i < code->sp.count; i++) {
+    header.sp_size += strlen(code->sp.data[i]) + 1;
+  }
+
+  char *tmp_path;
+  alloc_err_str(&tmp_path, "%s.%ld.tmp", path, (long) getpid());
+
+  FILE *f = fopen(tmp_path, "wb");
+  if (!f) {
+    free(tmp_path);
+    return false;
+  }
+
+  /* The header is written again at the end, once the checksum of the
+   * rest is known. */
+  VnmcCode script = {.name = UINT32_MAX};
+  bool ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+            write_code(f, script, &code->code, &code->lines, &header.checksum);
+
+  for (size_t i = 0; ok && i < code->protos.count; i++) {
+    const FunctionProto *proto = code->protos.data[i];
+    VnmcCode record = {
+        .name = name_index(code, proto->name),
+        .paramcount = proto->paramcount,
+        .upvalue_count = proto->upvalue_count,
+        .local_count = proto->local_count,
+        .max_stack = proto->max_stack,
+    };
+    ok = write_code(f, record, &proto->code, &proto->lines, &header.checksum);
+  }
+
+  for (size_t i = 0; ok && i < code->sp.count; i++) {
+    ok = write_payload(f, code->sp.data[i], strlen(code->sp.data[i]) + 1,
+                       &header.checksum);
+  }
+
+  ok = ok && fseek(f, 0, SEEK_SET) == 0 &&
+       fwrite(&header, sizeof(header), 1, f) == 1;
+
+  if (fclose(f) != 0) {
+    ok = false;
+  }
+  if (ok && rename(tmp_path, path) != 0) {
+    ok = false;
+  }
+  if (!ok) {
+    int saved_errno = errno;
+    unlink(tmp_path);
+    errno = saved_errno;
+  }
+  free(tmp_path);
+  return ok;
+}
+
+static LoadVnmcResult vnmc_error(const char *path, const char *why)
+{
+  LoadVnmcResult result = {.is_ok = false, .errcode = -1, .msg = NULL};
+  alloc_err_str(&result.msg, "%s: %s\n", path, why);
+  return result;
+}
+
+LoadVnmcResult load_vnmc(const char *path, bool verify)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return vnmc_error(path, strerror(errno));
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return vnmc_error(path, strerror(errno));
+  }
+
+  size_t size = (size_t) st.st_size;
+  if (size < sizeof(VnmcHeader)) {
+    close(fd);
+    return vnmc_error(path, "not a .vnmc file");
+  }
+
+  /* The mapping outlives the descriptor. */
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    return vnmc_error(path, strerror(errno));
+  }
+
+  const VnmcHeader *header = mapping;
+  const char *why = NULL;
+
+  if (memcmp(header->magic, VNMC_MAGIC, sizeof(header->magic)) != 0) {
+    why = "not a .vnmc file";
+  } else if (header->version != VNMC_VERSION ||
+             header->opcode_count != OP_HLT + 1) {
+    why = "compiled by a different version of venom";
+  } else if ((header->flags & VNMC_NAN_BOXING) !=
+             (vnmc_flags(0) & VNMC_NAN_BOXING)) {
+    why = "compiled for a different value representation (opt=nan_boxing)";
+  } else if (header->code_size == 0 ||
+             header->code_size > size - sizeof(VnmcHeader) ||
+             header->sp_size !=
+                 size - sizeof(VnmcHeader) - header->code_size) {
+    why = "truncated";
+  } else if (header->sp_count > header->sp_size) {
+    why = "corrupt string pool";
+  } else if (header->proto_count >= header->code_size / sizeof(VnmcCode)) {
+    why = "corrupt code";
+  } else if (verify &&
+             hash_bytes(FNV_OFFSET, header + 1, size - sizeof(VnmcHeader)) !=
+                 header->checksum) {
+    why = "checksum mismatch";
+  }
+
+  if (why) {
+    munmap(mapping, size);
+    return vnmc_error(path, why);
+  }
+
+  uint8_t *code = (uint8_t *) mapping + sizeof(VnmcHeader);
+  char *strings = (char *) code + header->code_size;
+
+  Bytecode *chunk = malloc(sizeof(Bytecode));
+  init_chunk(chunk);
+  chunk->mapping = mapping;
+  chunk->mapping_size = size;
+
+  /* Only the array of pointers to the strings is allocated; the strings
+   * stay in the mapping. */
+  chunk->sp.data = malloc(sizeof(char *) * (header->sp_count + 1));
+  char *s = strings;
+  char *end = strings + header->sp_size;
+  while (s < end && chunk->sp.count < header->sp_count) {
+    char *nul = memchr(s, '\0', (size_t) (end - s));
+    if (!nul) {
+      break;
+    }
+    chunk->sp.data[chunk->sp.count++] = s;
+    s = nul + 1;
+  }
+
+  if (chunk->sp.count != header->sp_count || s != end) {
+    free_chunk(chunk);
+    free(chunk);
+    return vnmc_error(path, "corrupt string pool");
+  }
+
+  /* The script's code comes first, and then that of every proto. */
+  size_t pos = 0;
+  for (uint64_t i = 0; i <= header->proto_count; i++) {
+    const VnmcCode *record = (const VnmcCode *) (code + pos);
+    if (header->code_size - pos < sizeof(VnmcCode) ||
+        (header->code_size - pos - sizeof(VnmcCode)) / sizeof(LineRun) <
+            record->line_count ||
+        header->code_size - pos - sizeof(VnmcCode) -
+                sizeof(LineRun) * record->line_count <
+            padded(record->size) ||
+        (i > 0 && record->name >= chunk->sp.count)) {
+      why = "corrupt code";
+      break;
+    }
+
+    LineRun *lines = (LineRun *) (code + pos + sizeof(VnmcCode));
+    uint8_t *instructions = (uint8_t *) (lines + record->line_count);
+
+    if (i == 0) {
+      chunk->code.data = instructions;
+      chunk->code.count = record->size;
+      chunk->lines.data = lines;
+      chunk->lines.count = record->line_count;
+    } else {
+      FunctionProto *proto = calloc(1, sizeof(FunctionProto));
+      proto->name = chunk->sp.data[record->name];
+      proto->code.data = instructions;
+      proto->code.count = record->size;
+      proto->lines.data = lines;
+      proto->lines.count = record->line_count;
+      proto->paramcount = record->paramcount;
+      proto->upvalue_count = record->upvalue_count;
+      proto->local_count = record->local_count;
+      proto->max_stack = record->max_stack;
+      dynarray_insert(&chunk->protos, proto);
+    }
+
+    pos += sizeof(VnmcCode) + sizeof(LineRun) * record->line_count +
+           padded(record->size);
+  }
+
+  if (!why && (pos != header->code_size || chunk->code.count == 0)) {
+    why = "corrupt code";
+  }
+
+  if (why) {
+    free_chunk(chunk);
+    free(chunk);
+    return vnmc_error(path, why);
+  }
+
+  return (LoadVnmcResult){
+      .chunk = chunk,
+      .source_hash = header->source_hash,
+      .build_id = header->build_id,
+      .flags = header->flags,
+      .is_ok = true,
+      .errcode = 0,
+      .msg = NULL,
+  };
+}
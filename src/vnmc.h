@@ -0,0 +1,107 @@
+#ifndef venom_vnmc_h
+#define venom_vnmc_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "compiler.h"
+
+/* A .vnmc file is a compiled program, i.e., a Bytecode, saved so that
+ * it can be run without going through the front end again. It starts
+ * with a VnmcHeader, which is followed by the code of the script, and
+ * the code of each of the functions, in the order of their protos, and
+ * then by the strings of the string pool, each terminated by a NUL.
+ * Each piece of code is a VnmcCode, followed by its line table, then
+ * by the instructions themselves, padded to a multiple of 4 bytes. Ev-
+ * erything is in the byte order of the machine that wrote it.
+ *
+ * A .vnmc file is run by mapping it read-only, and pointing the code,
+ * the line tables and the string pool of the Bytecode straight into the
+ * mapping (see load_vnmc()). The code is trusted just like the compi-
+ * ler's output is, and only the header and the sizes are checked, ex-
+ * cept for the entries of the compile cache, which anyone who can
+ * write to it may have changed, and whose checksum is checked too. */
+#define VNMC_MAGIC "VNMC"
+#define VNMC_VERSION 6
+
+/* What went into making the code, besides the source. */
+#define VNMC_NAN_BOXING (1 << 0)
+#define VNMC_OPTIMIZED (1 << 1)
+#define VNMC_PASSES_SHIFT 8 /* the passes that ran are kept above it */
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t opcode_count; /* so that adding an opcode invalidates them */
+  uint64_t source_hash;
+  uint64_t build_id; /* see vnmc_build_id() */
+  uint64_t sp_count;
+  uint64_t proto_count;
+  uint64_t code_size; /* the bytes all of the code takes */
+  uint64_t sp_size;   /* the bytes the strings take, NULs included */
+  uint64_t checksum;  /* FNV-1a of everything after the header */
+} VnmcHeader;
+
+typedef struct {
+  uint32_t name; /* the index of the name in the sp, unless the script */
+  uint32_t size;
+  uint32_t line_count;
+  uint8_t paramcount;
+  uint8_t upvalue_count;
+  uint16_t local_count;
+  uint16_t max_stack;
+  uint16_t reserved;
+} VnmcCode;
+
+typedef struct {
+  Bytecode *chunk;
+  uint64_t source_hash;
+  uint64_t build_id;
+  uint32_t flags;
+  bool is_ok;
+  int errcode;
+  char *msg;
+} LoadVnmcResult;
+
+/* FNV-1a, which is what the .vnmc files identify their source by. */
+uint64_t hash_source(const char *source);
+
+/* Tells this build of venom apart from the others, by a hash of its
+ * sources and flags, which the Makefile passes in as VENOM_BUILD_ID.
+ * The code in the compile cache is only ever run by the build that
+ * compiled it, as the compiler may have changed in ways that neither
+ * VNMC_VERSION nor the opcodes show. */
+uint64_t vnmc_build_id(void);
+
+/* The flags of the code this build compiles, with the optimizer pass-
+ * es in 'passes' (see optimizer.h). */
+uint32_t vnmc_flags(uint32_t passes);
+
+/* Whether 'path' names a .vnmc file. */
+bool is_vnmc_path(const char *path);
+
+/* Returns the path to save the compiled 'source_path' to, which is
+ * the same path with a "c" appended, for a .vnm file, or with .vnmc
+ * appended, otherwise. The caller frees it. */
+char *vnmc_path(const char *source_path);
+
+/* Returns the path of the entry of the compile cache for a source that
+ * hashes to 'source_hash', compiled with 'flags', which is a file in
+ * $XDG_CACHE_HOME/venom (~/.cache/venom by default), making the dir-
+ * ectory if need be. Returns NULL if there's nowhere to cache. The
+ * caller frees it. */
+char *vnmc_cache_path(uint64_t source_hash, uint32_t flags);
+
+/* Saves 'code' to 'path', by writing a temporary file next to it and
+ * renaming it, so that whoever reads 'path' at the same time sees ei-
+ * ther all of it, or none. Returns false (and sets errno) on failure. */
+bool write_vnmc(const char *path, const Bytecode *code, uint64_t source_hash,
+                uint32_t flags);
+
+/* Maps the .vnmc file at 'path', checking the checksum if 'verify' is
+ * set. The chunk it returns is freed with free_chunk(), which also un-
+ * maps it. */
+LoadVnmcResult load_vnmc(const char *path, bool verify);
+
+#endif
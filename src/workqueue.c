@@ -0,0 +1,143 @@
+#include "workqueue.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+void init_workdeque(WorkDeque *deque)
+{
+  pthread_mutex_init(&deque->lock, NULL);
+  deque->items = NULL;
+  deque->head = 0;
+  deque->count = 0;
+  deque->capacity = 0;
+}
+
+void free_workdeque(WorkDeque *deque)
+{
+  pthread_mutex_destroy(&deque->lock);
+  free(deque->items);
+}
+
+void workdeque_push(WorkDeque *deque, void *item)
+{
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->count == deque->capacity) {
+    size_t capacity = deque->capacity == 0 ? 16 : deque->capacity * 2;
+    void **items = malloc(sizeof(void *) * capacity);
+    for (size_t i = 0; i < deque->count; i++) {
+      items[i] = deque->items[(deque->head + i) % deque->capacity];
+    }
+    free(deque->items);
+    deque->items = items;
+    deque->head = 0;
+    deque->capacity = capacity;
+  }
+
+  deque->items[(deque->head + deque->count++) % deque->capacity] = item;
+
+  pthread_mutex_unlock(&deque->lock);
+}
+
+void *workdeque_pop(WorkDeque *deque)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->count > 0) {
+    item = deque->items[(deque->head + --deque->count) % deque->capacity];
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return item;
+}
+
+void *workdeque_steal(WorkDeque *deque)
+{
+  void *item = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+
+  if (deque->count > 0) {
+    item = deque->items[deque->head];
+    deque->head = (deque->head + 1) % deque->capacity;
+    --deque->count;
+  }
+
+  pthread_mutex_unlock(&deque->lock);
+
+  return item;
+}
+
+bool workdeque_empty(WorkDeque *deque)
+{
+  pthread_mutex_lock(&deque->lock);
+  bool empty = deque->count == 0;
+  pthread_mutex_unlock(&deque->lock);
+
+  return empty;
+}
+
+bool init_mailbox(Mailbox *mailbox)
+{
+  mailbox->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (mailbox->efd == -1) {
+    return false;
+  }
+  pthread_mutex_init(&mailbox->lock, NULL);
+  mailbox->items = (DynArray_void_ptr){0};
+  return true;
+}
+
+void free_mailbox(Mailbox *mailbox)
+{
+  pthread_mutex_destroy(&mailbox->lock);
+  dynarray_free(&mailbox->items);
+  close(mailbox->efd);
+}
+
+void mailbox_post(Mailbox *mailbox, void *item)
+{
+  pthread_mutex_lock(&mailbox->lock);
+  dynarray_insert(&mailbox->items, item);
+  pthread_mutex_unlock(&mailbox->lock);
+
+  notify_fd(mailbox->efd);
+}
+
+void mailbox_take(Mailbox *mailbox, DynArray_void_ptr *out)
+{
+  pthread_mutex_lock(&mailbox->lock);
+  DynArray_void_ptr items = mailbox->items;
+  mailbox->items = *out;
+  *out = items;
+  pthread_mutex_unlock(&mailbox->lock);
+}
+
+bool mailbox_empty(Mailbox *mailbox)
+{
+  pthread_mutex_lock(&mailbox->lock);
+  bool empty = mailbox->items.count == 0;
+  pthread_mutex_unlock(&mailbox->lock);
+
+  return empty;
+}
+
+void notify_fd(int efd)
+{
+  uint64_t one = 1;
+  if (write(efd, &one, sizeof(one)) == -1) {
+    /* EAGAIN, i.e., the counter is about to overflow, which only
+     * happens if it's readable already, so there's nothing to do. */
+  }
+}
+
+void drain_fd(int efd)
+{
+  uint64_t count;
+  while (read(efd, &count, sizeof(count)) > 0) {
+  }
+}
@@ -0,0 +1,62 @@
+#ifndef venom_workqueue_h
+#define venom_workqueue_h
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "dynarray.h"
+
+/* The queues the worker threads of the parallel scheduler use to
+ * hand work to each other. They only ever move opaque pointers, and
+ * whatever those point to is owned by whoever took them out.
+ *
+ * A WorkDeque belongs to a worker, which pushes and pops at the bot-
+ * tom, so that it keeps running the work it made most recently (the
+ * one most likely to still be in the cache), while the other work-
+ * ers steal from the top, taking the oldest work instead. The deque
+ * is guarded by a mutex, which is uncontended unless somebody is
+ * stealing, and is cheap compared to the work items themselves. */
+typedef struct {
+  pthread_mutex_t lock;
+  void **items;
+  size_t head; /* index of the top */
+  size_t count;
+  size_t capacity;
+} WorkDeque;
+
+void init_workdeque(WorkDeque *deque);
+void free_workdeque(WorkDeque *deque);
+void workdeque_push(WorkDeque *deque, void *item);
+void *workdeque_pop(WorkDeque *deque);
+void *workdeque_steal(WorkDeque *deque);
+bool workdeque_empty(WorkDeque *deque);
+
+typedef DynArray(void *) DynArray_void_ptr;
+
+/* A Mailbox is a many-to-one queue. Posting to it also makes its
+ * eventfd readable, so that the owner can wait for mail in its ev-
+ * ent loop along with everything else. */
+typedef struct {
+  pthread_mutex_t lock;
+  DynArray_void_ptr items;
+  int efd;
+} Mailbox;
+
+bool init_mailbox(Mailbox *mailbox);
+void free_mailbox(Mailbox *mailbox);
+void mailbox_post(Mailbox *mailbox, void *item);
+
+/* Moves everything posted so far into 'out', which must be empty.
+ * The eventfd is left alone, so that checking for mail doesn't cost
+ * a syscall; drain it once the event loop reports it readable, and
+ * before taking the mail, so that no post goes unnoticed. */
+void mailbox_take(Mailbox *mailbox, DynArray_void_ptr *out);
+bool mailbox_empty(Mailbox *mailbox);
+
+/* Wake-ups through an eventfd: notify_fd() makes it readable and
+ * drain_fd() resets it. */
+void notify_fd(int efd);
+void drain_fd(int efd);
+
+#endif
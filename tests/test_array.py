@@ -1,6 +1,7 @@
 import subprocess
+import pytest
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output
 
 
@@ -8,7 +9,7 @@ def test_array():
     input_file = CASES_PATH / "array.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -16,3 +17,32 @@ def test_array():
     output = process.stdout.decode("utf-8")
 
     assert_output(output, [128, "Hello, world!", 11])
+
+
+def test_array_borrow():
+    input_file = CASES_PATH / "array_borrow.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [7, 3, 3, 4, 2, 1, 3, 3, 3, 3, 2, 5, 4, 6])
+
+
+@pytest.mark.parametrize("flags", [[], ["--free-budget=16"]])
+def test_array_deep(flags):
+    input_file = CASES_PATH / "array_deep.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + flags + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [99999, 100000])
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import assert_output, assert_error
 from tests.util import CASES_PATH
 
@@ -9,7 +9,7 @@ def test_assignment_global():
     input_file = CASES_PATH / "assign_global.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -19,11 +19,32 @@ def test_assignment_global():
     assert_output(output, [16, 32])
 
 
+def test_assignment_many_globals(tmp_path):
+    # More globals than the VM used to have room for, with the ones
+    # past the old limit read from a function and assigned to.
+    source = "".join(f"let g{i} = {i};\n" for i in range(1500))
+    source += "fn total() {\n    return g0 + g1024 + g1499;\n}\n"
+    source += "g1499 += 1;\nprint total();\n"
+
+    input_file = tmp_path / "many_globals.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [0 + 1024 + 1500])
+
+
 def test_assignment_local():
     input_file = CASES_PATH / "assign_local.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -37,7 +58,7 @@ def test_assignment_invalid():
     input_file = CASES_PATH / "assign_invalid.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
     )
 
@@ -51,7 +72,7 @@ def test_assignment_property():
     input_file = CASES_PATH / "assign_property.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -65,7 +86,7 @@ def test_assignment_property_nested():
     input_file = CASES_PATH / "assign_property_nested.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -0,0 +1,434 @@
+import json
+import os
+import re
+import shutil
+import subprocess
+import tempfile
+import time
+
+import pytest
+
+from tests.util import VENOM_CMD, CASES_PATH
+from tests.util import assert_output, assert_error
+
+
+def test_async_sleep():
+    input_file = CASES_PATH / "async_sleep.vnm"
+
+    start = time.monotonic()
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+    elapsed = time.monotonic() - start
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["fast", "slow", 80])
+
+    # sleep() is measured in wall-clock milliseconds, so the program
+    # can't finish before the longest sleep has elapsed.
+    assert elapsed >= 0.06
+
+
+def test_async_sleep_forever():
+    input_file = CASES_PATH / "async_sleep_forever.vnm"
+
+    # A sleep that'd take the deadline past what the clock can count
+    # to must not wrap around to one that has already passed.
+    process = subprocess.Popen(
+        VENOM_CMD + [input_file],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.PIPE,
+    )
+    try:
+        process.wait(timeout=0.5)
+    except subprocess.TimeoutExpired:
+        pass
+    finally:
+        process.kill()
+        output, _ = process.communicate()
+
+    assert "woke up" not in output.decode("utf-8")
+    assert process.returncode == -9
+
+
+def test_async_sleep_invalid():
+    input_file = CASES_PATH / "async_sleep_invalid.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(error, ["vm: sleep(...) requires a number of milliseconds, got 'string'"])
+    assert process.returncode == 255
+
+
+def test_async_socketpair():
+    input_file = CASES_PATH / "async_socketpair.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["ping!"])
+
+
+def test_async_pipe():
+    input_file = CASES_PATH / "async_pipe.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["spam", 0])
+
+
+def test_async_unix_socket():
+    # The socket goes in a directory of its own, so that tests running
+    # at the same time don't take each other's path. It's made with
+    # mkdtemp() rather than under tmp_path, as the path of a unix
+    # socket has to fit in 108 bytes.
+    directory = tempfile.mkdtemp(prefix="venom")
+    socket_path = os.path.join(directory, "unix_socket.sock")
+
+    source = (CASES_PATH / "async_unix_socket.vnm").read_text()
+    input_file = os.path.join(directory, "async_unix_socket.vnm")
+    with open(input_file, "w") as f:
+        f.write(source.replace("/tmp/venom_async_unix_socket.sock", socket_path))
+
+    try:
+        process = subprocess.run(
+            VENOM_CMD + [input_file],
+            capture_output=True,
+            check=True,
+        )
+    finally:
+        shutil.rmtree(directory)
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["hello, a", "hello, b", "hello, c"])
+
+
+def test_async_read_fd_invalid():
+    input_file = CASES_PATH / "async_read_fd_invalid.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(error, ["vm: read_fd(...): Bad file descriptor"])
+    assert process.returncode == 255
+
+
+def test_async_read_fd_count():
+    input_file = CASES_PATH / "async_read_fd_count.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(
+        error,
+        [
+            "vm: read_fd(...) requires an integer byte count between 1 and "
+            "9223372036854775807, got 1e+20"
+        ],
+    )
+    assert process.returncode == 255
+
+
+def test_async_channel():
+    input_file = CASES_PATH / "async_channel.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # With room for two values in the buffer, the producer gets two
+    # sends ahead of the consumer before it's parked.
+    expected = ["sent", "sent", 0, 1, 2, "sent", "sent", "sent", 3, 4, 10]
+
+    # The unbuffered channel hands every value over directly.
+    expected += [0, "sent", "sent", 1, 1]
+
+    assert_output(output, expected)
+
+
+def test_async_channel_workers():
+    input_file = CASES_PATH / "async_channel.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--workers=4", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    prints = re.findall(r"dbg print :: (.*)", output)
+
+    # The producers run on workers of their own, so when they get to
+    # print is up to the threads, but the values still come out of the
+    # channels in the order they were sent.
+    assert prints.count("sent") == 7
+    assert [p for p in prints if p != "sent"] == ["0", "1", "2", "3", "4", "10", "0", "1", "1"]
+
+
+def test_async_channel_reply_workers():
+    input_file = CASES_PATH / "async_channel_workers.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--workers=4", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Every request carries a channel of its own for the reply, which
+    # the worker that takes the request gets a handle to.
+    assert_output(output, [2870])
+
+
+def test_async_channel_workers_invalid():
+    input_file = CASES_PATH / "async_channel_workers_invalid.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--workers=4", input_file],
+        capture_output=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    error = process.stderr.decode("utf-8")
+
+    assert_output(output, [1])
+    assert_error(error, ["vm: send(...) cannot hand a 'array' to another worker"])
+    assert process.returncode == 255
+
+
+@pytest.mark.parametrize("flags", [[], ["--workers=4"]])
+def test_async_channel_deadlock(flags):
+    input_file = CASES_PATH / "async_channel_deadlock.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + flags + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(error, ["vm: scheduler deadlock: no runnable tasks"])
+    assert process.returncode == 255
+
+
+@pytest.mark.parametrize("flags", [[], ["--workers=4"]])
+def test_async_channel_outside_run(flags):
+    input_file = CASES_PATH / "async_channel_outside_run.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + flags + [input_file],
+        capture_output=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    error = process.stderr.decode("utf-8")
+
+    assert_output(output, [1])
+    assert_error(error, ["vm: recv(...) would block outside of the run(...) scheduler"])
+    assert process.returncode == 255
+
+
+def test_async_cooperative():
+    input_file = CASES_PATH / "async_preempt.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Without a quantum, the spinning task keeps the CPU until it's
+    # done, since it never awaits anything.
+    assert_output(output, ["spin", "ping"])
+
+
+def test_async_preempt():
+    input_file = CASES_PATH / "async_preempt.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--quantum=100", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["ping", "spin"])
+
+
+def test_async_gather():
+    input_file = CASES_PATH / "async_gather.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # The results come back in the order of the array, no matter
+    # the order the tasks finished in.
+    assert_output(output, [1, 3, 2, [20, 10, 30]])
+
+
+def test_async_gather_invalid():
+    input_file = CASES_PATH / "async_gather_invalid.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    error = process.stderr.decode("utf-8")
+
+    assert_output(output, [1])
+    assert_error(
+        error, ["vm: gather(...) requires an array of tasks, got 'number' element"]
+    )
+    assert process.returncode == 255
+
+
+def test_async_select():
+    input_file = CASES_PATH / "async_select.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [2, False, 1, 1])
+
+
+def test_async_workers():
+    input_file = CASES_PATH / "async_workers.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--workers=4", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(
+        output,
+        [
+            [
+                [100000, 4999950000],
+                [200000, 19999900000],
+                [300000, 44999850000],
+                [400000, 79999800000],
+            ],
+            64,
+        ],
+    )
+
+
+def test_async_workers_invalid():
+    input_file = CASES_PATH / "async_workers_invalid.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--workers=2", input_file],
+        capture_output=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    error = process.stderr.decode("utf-8")
+
+    assert_output(output, [1])
+    assert_error(
+        error,
+        [
+            "vm: spawn(...) can only hand a coroutine that hasn't started, "
+            "with arguments that can be copied, to another worker"
+        ],
+    )
+    assert process.returncode == 255
+
+
+def test_async_call():
+    input_file = CASES_PATH / "async_call.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    # Returning from an ordinary call must not finish the task that
+    # made it.
+    assert_output(output, [10, 20, 2001, 2001])
+
+
+def test_async_measure_tasks():
+    input_file = CASES_PATH / "async_sleep.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--measure=tasks-json", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["fast", "slow", 80])
+
+    report = next(
+        line for line in output.splitlines() if line.startswith('{"tasks"')
+    )
+    tasks = {task["id"]: task for task in json.loads(report)["tasks"]}
+
+    assert sorted(tasks) == [1, 2, 3]
+    for task in tasks.values():
+        assert task["worker"] == 0
+        assert task["instructions"] > 0
+        assert task["switches"] == 2 or task["switches"] == 3
+        assert task["peak_stack"] > 0
+
+    # main() waits on the two workers, which sleep for 60 and 20 ms
+    # (give or take the time it takes them to get to sleep).
+    assert tasks[1]["blocked"] >= 0.05
+    assert tasks[2]["sleeping"] >= 0.05
+    assert tasks[3]["sleeping"] >= 0.01
@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import assert_output
 
 
@@ -31,7 +31,7 @@ def test_bitwise(tmp_path, a, op, b, expected):
     input_file.write_text(source)
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -55,7 +55,7 @@ def test_bitwise_not(tmp_path):
     input_file.write_text(source)
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output, assert_error
 
 
@@ -8,7 +8,7 @@ def test_block_inherited_param():
     input_file = CASES_PATH / "block_inherited_param.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -22,7 +22,7 @@ def test_block_inherited_local():
     input_file = CASES_PATH / "block_inherited_local.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -36,7 +36,7 @@ def test_block_undefined_var():
     input_file = CASES_PATH / "block_undefined_var.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
     )
 
@@ -50,7 +50,7 @@ def test_block_retval_remains_on_stack():
     input_file = CASES_PATH / "block_retval_remains_on_stack.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -64,7 +64,7 @@ def test_block_retval_gets_popped():
     input_file = CASES_PATH / "block_retval_gets_popped.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
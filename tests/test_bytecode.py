@@ -0,0 +1,166 @@
+import subprocess
+
+from tests.util import VENOM_CMD
+from tests.util import assert_output
+
+SOURCE = """
+struct point {
+  x;
+  y;
+}
+fn dist(p) {
+  return p.x * p.x + p.y * p.y;
+}
+let greeting = "hello, ";
+print(greeting ++ "world");
+print(dist(point { x: 3, y: 4 }));
+"""
+
+
+def test_emit_and_run_bytecode(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+
+    subprocess.run(VENOM_CMD + ["--emit-bytecode", source_file], check=True)
+
+    bytecode_file = tmp_path / "prog.vnmc"
+    assert bytecode_file.read_bytes()[:4] == b"VNMC"
+
+    # Deleting the source proves nothing goes through the front end.
+    source_file.unlink()
+    process = subprocess.run(
+        VENOM_CMD + [bytecode_file],
+        capture_output=True,
+        check=True,
+    )
+    assert_output(process.stdout.decode("utf-8"), ["hello, world", 25])
+
+
+def test_emit_bytecode_to_path(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text("let x = 2 + 3;\nprint(x * 5);\n")
+    bytecode_file = tmp_path / "other.vnmc"
+
+    subprocess.run(
+        VENOM_CMD + ["--optimize", f"--emit-bytecode={bytecode_file}", source_file],
+        check=True,
+    )
+
+    process = subprocess.run(
+        VENOM_CMD + [bytecode_file],
+        capture_output=True,
+        check=True,
+    )
+    assert_output(process.stdout.decode("utf-8"), [25])
+
+
+def test_bad_bytecode(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+    subprocess.run(VENOM_CMD + ["--emit-bytecode", source_file], check=True)
+
+    bytecode_file = tmp_path / "prog.vnmc"
+    data = bytecode_file.read_bytes()
+
+    bytecode_file.write_bytes(data[:-3])
+    process = subprocess.run(VENOM_CMD + [bytecode_file], capture_output=True)
+    assert process.returncode != 0
+    assert b"corrupt string pool" in process.stderr or b"truncated" in process.stderr
+
+    bytecode_file.write_bytes(b"XXXX" + data[4:])
+    process = subprocess.run(VENOM_CMD + [bytecode_file], capture_output=True)
+    assert process.returncode != 0
+    assert b"not a .vnmc file" in process.stderr
+
+
+def run_cached(args, cache_dir):
+    return subprocess.run(
+        VENOM_CMD + args,
+        capture_output=True,
+        check=True,
+        env={"XDG_CACHE_HOME": str(cache_dir)},
+    )
+
+
+def test_compile_cache(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+    cache_dir = tmp_path / "cache"
+
+    process = run_cached(["--measure=all", source_file], cache_dir)
+    output = process.stdout.decode("utf-8")
+    assert_output(output, ["hello, world", 25])
+    assert "compile stage took" in output
+
+    entries = list((cache_dir / "venom").glob("*.vnmc"))
+    assert len(entries) == 1
+
+    # The second run comes straight from the cache.
+    process = run_cached(["--measure=all", source_file], cache_dir)
+    output = process.stdout.decode("utf-8")
+    assert_output(output, ["hello, world", 25])
+    assert "compile stage took" not in output
+    assert "exec stage took" in output
+
+    # A change to the source is a miss, and so is the optimizer.
+    source_file.write_text("print(1 + 2);\n")
+    process = run_cached([source_file], cache_dir)
+    assert_output(process.stdout.decode("utf-8"), [3])
+    process = run_cached(["--optimize", source_file], cache_dir)
+    assert_output(process.stdout.decode("utf-8"), [3])
+    assert len(list((cache_dir / "venom").glob("*.vnmc"))) == 3
+    assert not list((cache_dir / "venom").glob("*.tmp"))
+
+
+def test_compile_cache_other_build(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+    cache_dir = tmp_path / "cache"
+
+    run_cached([source_file], cache_dir)
+    (entry,) = (cache_dir / "venom").glob("*.vnmc")
+
+    # An entry made by some other build of venom (the build id comes
+    # right after the source hash in the header) is compiled over, as
+    # the compiler may have changed in the meantime.
+    data = bytearray(entry.read_bytes())
+    data[24] ^= 0xFF
+    entry.write_bytes(bytes(data))
+
+    process = run_cached(["--measure=all", source_file], cache_dir)
+    output = process.stdout.decode("utf-8")
+    assert_output(output, ["hello, world", 25])
+    assert "compile stage took" in output
+
+
+def test_no_cache(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+    cache_dir = tmp_path / "cache"
+
+    process = run_cached(["--no-cache", source_file], cache_dir)
+    assert_output(process.stdout.decode("utf-8"), ["hello, world", 25])
+    assert not list(cache_dir.glob("**/*.vnmc"))
+
+
+def test_compile_cache_corrupt(tmp_path):
+    source_file = tmp_path / "prog.vnm"
+    source_file.write_text(SOURCE)
+    cache_dir = tmp_path / "cache"
+
+    run_cached([source_file], cache_dir)
+    (entry,) = (cache_dir / "venom").glob("*.vnmc")
+    original = entry.read_bytes()
+
+    # Anyone who can write to the cache can change the code in it, which
+    # the checksum catches, so that the entry is compiled over instead
+    # of being run. The header is 72 bytes.
+    for offset in range(72, len(original), 7):
+        data = bytearray(original)
+        data[offset] ^= 0xA5
+        entry.write_bytes(bytes(data))
+
+        process = run_cached(["--measure=all", source_file], cache_dir)
+        output = process.stdout.decode("utf-8")
+        assert_output(output, ["hello, world", 25])
+        assert "compile stage took" in output
@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 
 
 @pytest.mark.parametrize(
@@ -23,7 +23,7 @@ def test_comparison(tmp_path, x, y):
         input_file.write_text(source)
 
         process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
             capture_output=True,
             check=True,
         )
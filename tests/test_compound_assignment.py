@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import assert_output
 
 
@@ -37,7 +37,7 @@ def test_compound_assignment(tmp_path, start, cond_op, end, step, op, intermedia
     input_file.write_text(source)
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -73,7 +73,7 @@ def test_compound_assignment_other(tmp_path, left, op, right, expected):
     input_file.write_text(source)
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
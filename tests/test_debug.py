@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import CASES_PATH
 
 RESULTS = {
@@ -10,9 +10,9 @@ RESULTS = {
         "return_code": 255,
     },
     "big.vnm": {
-        "debug_prints": [],
-        "ends_with": "compiler: Maximum 256 locals.",
-        "return_code": 255,
+        "debug_prints": ["dbg print :: 613"],
+        "ends_with": "current instruction: OP_HLT",
+        "return_code": 0,
     },
     "break.vnm": {
         "debug_prints": [],
@@ -100,6 +100,15 @@ RESULTS = {
         "ends_with": "current instruction: OP_HLT",
         "return_code": 0,
     },
+    "gen_call.vnm": {
+        "debug_prints": [
+            "dbg print :: 10",
+            "dbg print :: 5",
+            "dbg print :: 12",
+        ],
+        "ends_with": "current instruction: OP_HLT",
+        "return_code": 0,
+    },
     "getattr.vnm": {
         "debug_prints": [
             "dbg print :: 26",
@@ -227,7 +236,7 @@ RESULTS = {
 def test_debug():
     for file, info in RESULTS.items():
         process = subprocess.run(
-            VALGRIND_CMD + [CASES_PATH / file],
+            VENOM_CMD + [CASES_PATH / file],
             capture_output=True,
         )
         print(file)
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output
 
 
@@ -8,7 +8,7 @@ def test_first_class_citizen():
     input_file = CASES_PATH / "deco1.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -22,7 +22,7 @@ def test_first_class_citizen2():
     input_file = CASES_PATH / "deco2.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -36,7 +36,7 @@ def test_first_class_citizen3():
     input_file = CASES_PATH / "deco3.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -50,7 +50,7 @@ def test_first_class_citizen4():
     input_file = CASES_PATH / "deco4.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -64,7 +64,7 @@ def test_first_class_citizen5():
     input_file = CASES_PATH / "deco5.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -78,7 +78,7 @@ def test_proper_decorator():
     input_file = CASES_PATH / "proper_deco.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
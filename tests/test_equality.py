@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD, Struct
+from tests.util import VENOM_CMD, Struct
 
 
 @pytest.mark.parametrize(
@@ -69,7 +69,7 @@ def test_equality(tmp_path, a, b):
     input_file.write_text(current_source % (a, b))
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -99,7 +99,7 @@ def test_equality_same_object(tmp_path):
     input_file.write_text(source)
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -2,7 +2,7 @@ import textwrap
 import subprocess
 import pytest
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import typestr
 from tests.util import Object
 from tests.util import Struct
@@ -66,7 +66,7 @@ def test_binary_op_leak(tmp_path, lhs, rhs):
         input_file.write_text(current_source)
 
         process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
             capture_output=True,
         )
 
@@ -122,7 +122,7 @@ def test_unary_leak(tmp_path, x):
         input_file.write_text(current_source)
 
         process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
             capture_output=True,
         )
 
@@ -168,7 +168,7 @@ def test_len_leak(tmp_path, x):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -215,7 +215,7 @@ def test_hasattr_leak(tmp_path, obj, attr):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -264,7 +264,7 @@ def test_getattr_leak(tmp_path, obj, attr):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -317,7 +317,7 @@ def test_setattr_leak(tmp_path, obj, attr, val):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -367,7 +367,7 @@ def test_assert_leak(tmp_path, obj):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -409,7 +409,7 @@ def test_assert_leak_failed_assertion(tmp_path):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -458,7 +458,7 @@ def test_callmethod_leak(tmp_path, obj):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -500,7 +500,7 @@ def test_callmethod_leak2(tmp_path):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -542,7 +542,7 @@ def test_subscript_leak(tmp_path):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-       VALGRIND_CMD + [input_file],
+       VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -584,7 +584,7 @@ def test_arrayset_leak(tmp_path):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -633,7 +633,7 @@ def test_subscript_leak2(tmp_path, obj):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -682,7 +682,7 @@ def test_arrayset_leak2(tmp_path, obj):
     input_file.write_text(current_source)
  
     process = subprocess.run(
-            VALGRIND_CMD + [input_file],
+            VENOM_CMD + [input_file],
        capture_output=True,
     )
  
@@ -716,7 +716,7 @@ def test_clean_exit_upon_tokenizer_failure(tmp_path):
     input_file.write_text(source)
  
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
     )
  
@@ -726,3 +726,75 @@ def test_clean_exit_upon_tokenizer_failure(tmp_path):
  
     assert error_msg in decoded
     assert process.returncode == 255
+
+
+def test_error_in_task_leak(tmp_path):
+    source = textwrap.dedent(
+        """\
+        async fn task(a) {
+            print a + 1;
+            return 0;
+        }
+        async fn main() {
+            spawn(task([1, 2, 3]));
+            await sleep(10);
+            return 0;
+        }
+        run(main());
+        """
+    )
+
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    # The argument was on the stack of the running task when the error
+    # happened, and has to be released once, not twice.
+    error_msg = "vm: cannot '+' objects of types: 'array' and 'number'"
+
+    decoded = process.stderr.decode("utf-8")
+
+    assert error_msg in decoded
+    assert process.returncode == 255
+
+
+def test_error_in_generator_leak(tmp_path):
+    source = textwrap.dedent(
+        """\
+        fn inner(a) {
+            yield 1;
+            print a + 1;
+        }
+        fn outer(a) {
+            let g = inner(a);
+            yield next(g);
+            yield next(g);
+        }
+        let g = outer([1, 2, 3]);
+        print next(g);
+        print next(g);
+        """
+    )
+
+    input_file = tmp_path / "input.vnm"
+    input_file.write_text(source)
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    # Both generators were running when the error happened, and so was
+    # the frame that resumed each of them, all of which have to be re-
+    # leased, or refcheck reports them as leaked (and venom exits with
+    # 1 instead).
+    error_msg = "vm: cannot '+' objects of types: 'array' and 'number'"
+
+    decoded = process.stderr.decode("utf-8")
+
+    assert error_msg in decoded
+    assert process.returncode == 255
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output, assert_error
 
 
@@ -8,7 +8,7 @@ def test_func_undefined():
     input_file = CASES_PATH / "func_undefined.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
     )
 
@@ -22,7 +22,7 @@ def test_func_wrong_argcount():
     input_file = CASES_PATH / "func_wrong_argcount.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
     )
 
@@ -36,7 +36,7 @@ def test_method():
     input_file = CASES_PATH / "method.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -44,3 +44,101 @@ def test_method():
     output = process.stdout.decode("utf-8")
 
     assert_output(output, ["Hello, Jane. I'm Jimmy."])
+
+
+def test_func_no_return():
+    input_file = CASES_PATH / "func_no_return.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, ["hi", None])
+
+
+def test_func_deep_recursion():
+    input_file = CASES_PATH / "func_deep_recursion.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    error = process.stderr.decode("utf-8")
+
+    assert_error(error, ["vm: stack overflow in 'down'"])
+    assert process.returncode == 255
+
+
+def test_func_lazy():
+    input_file = CASES_PATH / "func_lazy.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [2])
+
+
+def test_func_lazy_error():
+    input_file = CASES_PATH / "func_lazy_error.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+    error = process.stderr.decode("utf-8")
+
+    assert_output(output, ["before"])
+    assert_error(error, ["compiler: Variable 'nope' is not defined.\n"])
+    assert process.returncode == 255
+
+
+def test_func_upvalue():
+    input_file = CASES_PATH / "func_upvalue.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + [input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [14])
+
+
+def test_func_max_params(tmp_path):
+    # OP_CALL has a byte for the argument count, so 255 parameters is
+    # as many as a function can have.
+    def run(params, args):
+        source = "fn f(%s) {\n    return p%d;\n}\nprint f(%s);\n" % (
+            ", ".join(f"p{i}" for i in range(params)),
+            params - 1,
+            ", ".join(str(i) for i in range(args)),
+        )
+        input_file = tmp_path / "params.vnm"
+        input_file.write_text(source)
+        return subprocess.run(VENOM_CMD + [input_file], capture_output=True)
+
+    process = run(255, 255)
+    assert process.returncode == 0
+    assert_output(process.stdout.decode("utf-8"), [254])
+
+    process = run(256, 256)
+    assert_error(process.stderr.decode("utf-8"), ["compiler: Maximum 255 parameters per function.\n"])
+    assert process.returncode == 255
+
+    process = run(1, 256)
+    assert_error(process.stderr.decode("utf-8"), ["compiler: Maximum 255 arguments per call.\n"])
+    assert process.returncode == 255
@@ -0,0 +1,50 @@
+import re
+import subprocess
+
+from tests.util import VENOM_CMD, CASES_PATH
+from tests.util import assert_output
+
+
+def test_heap():
+    input_file = CASES_PATH / "heap.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--measure=heap", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [5050])
+
+    report = {}
+    for m in re.finditer(
+        r"heap site \d+: (OP_\w+).*: (\w+), (\d+) allocations, "
+        r"(\d+) bytes peak, (\d+) bytes live, (\d+) bytes total",
+        output,
+    ):
+        opcode, typ, allocations, peak, live, total = m.groups()
+        report[opcode] = (typ, int(allocations), int(peak), int(live), int(total))
+
+    # Each of the arrays is dead before the next one is made, so the
+    # peak is the size of one, unless venom was built with deferred
+    # refcounting (make opt=deferred_rc), which leaves the dead ones in
+    # its table until it fills up. Either way, they're all gone by the
+    # time the report is taken.
+    typ, allocations, peak, live, total = report["OP_ARRAY"]
+    size = total // 100
+    assert typ == "array"
+    assert allocations == 100
+    assert live == 0
+    assert total == 100 * size
+    assert peak in (size, total)
+
+    # The sites say what function and line they're in.
+    assert "OP_ARRAY (count: 3) in make at line 2: array" in output
+
+    # The concatenated string is still held by the global at the end.
+    typ, allocations, peak, live, total = report["OP_STRCAT"]
+    assert typ == "string"
+    assert allocations == 1
+    assert live == peak == total > 0
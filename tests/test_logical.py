@@ -2,7 +2,7 @@ import subprocess
 import pytest
 import textwrap
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 
 
 @pytest.mark.parametrize(
@@ -40,7 +40,7 @@ def test_logical(tmp_path, a, b, if_a_equals, op, if_b_equals, should_print):
     input_file.write_text(source % (a, b, if_a_equals, op, if_b_equals))
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import CASES_PATH
 
 import pytest
@@ -15,7 +15,7 @@ import pytest
 )
 def test_loop_label_error_stmt(path, errmsg):
     process = subprocess.run(
-        VALGRIND_CMD + [CASES_PATH / "errors" / "loop_label" / path],
+        VENOM_CMD + [CASES_PATH / "errors" / "loop_label" / path],
         capture_output=True,
     )
     
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output
 
 
@@ -8,7 +8,7 @@ def test_negate_variable():
     input_file = CASES_PATH / "negate.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
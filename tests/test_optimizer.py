@@ -0,0 +1,135 @@
+import re
+import subprocess
+
+from tests.util import CASES_PATH
+from tests.util import VENOM_CMD
+from tests.util import assert_output
+
+
+def test_optimizer():
+    input_file = CASES_PATH / "optimizer.vnm"
+
+    for flags in ([], ["-O"]):
+        process = subprocess.run(
+            VENOM_CMD + ["--no-cache"] + flags + [input_file],
+            capture_output=True,
+            check=True,
+            timeout=60,
+        )
+        output = process.stdout.decode("utf-8")
+        assert_output(output, [40, 6, 6, 7, 12, -6] + [0] * 9 + [16, 2])
+
+
+def test_optimizer_ast():
+    input_file = CASES_PATH / "optimizer.vnm"
+
+    def parse(flags):
+        process = subprocess.run(
+            VENOM_CMD + flags + ["--parse", input_file],
+            capture_output=True,
+            check=True,
+            timeout=60,
+        )
+        return process.stdout.decode("utf-8")
+
+    dead_store = re.compile(r"\*\s+Literal\(\s+3\s+\)")
+    assert dead_store.search(parse([]))
+
+    output = parse(["-O"])
+
+    # `t = a * 3` goes, but `t = bump()` still calls bump().
+    assert not dead_store.search(output)
+    assert "name: bump" in output
+
+    # `factor` is a copy of `scale`, which is a copy of 10.
+    assert not re.search(r"Variable\(\s+name: (scale|factor)\s+\)", output)
+
+    # `len(xs) - 1` and `cfg.weight` are computed once, before the loop.
+    assert "name: $licm" not in parse([])
+    assert len(re.findall(r"Let\(\s+name: \$licm\d+", output)) == 2
+    assert re.search(r"\) < Variable\(\s+name: \$licm\d+\s+\)", output)
+
+
+def test_optimizer_levels():
+    input_file = CASES_PATH / "optimizer.vnm"
+
+    for flags in (["-O0"], ["-O1"], ["-O2"], ["--passes=fold,dse"]):
+        process = subprocess.run(
+            VENOM_CMD + ["--no-cache"] + flags + [input_file],
+            capture_output=True,
+            check=True,
+            timeout=60,
+        )
+        output = process.stdout.decode("utf-8")
+        assert_output(output, [40, 6, 6, 7, 12, -6] + [0] * 9 + [16, 2])
+
+
+def test_optimizer_measure():
+    input_file = CASES_PATH / "optimizer.vnm"
+
+    def measure(flags):
+        process = subprocess.run(
+            VENOM_CMD
+            + ["--no-cache", "--measure=optimize"]
+            + flags
+            + [input_file],
+            capture_output=True,
+            check=True,
+            timeout=60,
+        )
+        output = process.stdout.decode("utf-8")
+        return dict(
+            (name, int(changes))
+            for name, changes in re.findall(
+                r"optimize pass (\w+) took [0-9.]+ sec, changed (\d+) nodes",
+                output,
+            )
+        ), output
+
+    passes, output = measure(["-O2"])
+    assert list(passes) == ["fold", "copyprop", "unreachable", "dse", "licm"]
+    assert all(changes > 0 for changes in passes.values())
+    assert "peephole removed" in output
+
+    # dse and licm are only on at -O2.
+    passes, _ = measure(["-O1"])
+    assert list(passes) == ["fold", "copyprop", "unreachable"]
+
+    passes, output = measure(["--passes=copyprop"])
+    assert list(passes) == ["copyprop"]
+    assert "peephole removed" not in output
+
+    _, output = measure(["-O", "--optimize-rounds=1"])
+    assert "optimize ran 1 rounds (capped)" in output
+
+
+def test_optimizer_bad_passes():
+    input_file = CASES_PATH / "optimizer.vnm"
+
+    for flags in (["--passes=fold,bogus"], ["-O3"], ["--optimize-rounds=0"]):
+        process = subprocess.run(
+            VENOM_CMD + flags + [input_file],
+            capture_output=True,
+            timeout=60,
+        )
+        assert process.returncode != 0
+
+
+def test_optimizer_preempt():
+    input_file = CASES_PATH / "optimizer_preempt.vnm"
+
+    # The spinning task reads a property and a global that the other
+    # task sets while it's preempted, so -O2 must not read them once,
+    # before the loop, and must print the same as -O0.
+    outputs = []
+    for flags in (["-O0"], ["-O2"]):
+        process = subprocess.run(
+            VENOM_CMD + ["--no-cache", "--quantum=100"] + flags + [input_file],
+            capture_output=True,
+            check=True,
+            timeout=60,
+        )
+        output = process.stdout.decode("utf-8")
+        outputs.append(re.findall(r"dbg print :: (.*)", output))
+
+    assert outputs[0] == outputs[1] == ["done"]
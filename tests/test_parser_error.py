@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD
+from tests.util import VENOM_CMD
 from tests.util import CASES_PATH
 
 import pytest
@@ -53,7 +53,7 @@ import pytest
 )
 def test_parser_error_stmt(path, errmsg):
     process = subprocess.run(
-        VALGRIND_CMD + [CASES_PATH / "errors" / "parser" / path],
+        VENOM_CMD + [CASES_PATH / "errors" / "parser" / path],
         capture_output=True,
     )
     
@@ -0,0 +1,53 @@
+import re
+import subprocess
+
+from tests.util import CASES_PATH
+from tests.util import VENOM_CMD
+from tests.util import assert_output
+
+
+def test_peephole():
+    input_file = CASES_PATH / "peephole.vnm"
+
+    for flags in ([], ["-O"]):
+        process = subprocess.run(
+            VENOM_CMD + ["--no-cache"] + flags + [input_file],
+            capture_output=True,
+            check=True,
+        )
+        output = process.stdout.decode("utf-8")
+        assert_output(output, [2, 1, True, False, 4])
+
+
+def test_peephole_ir():
+    input_file = CASES_PATH / "peephole.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["-O", "--ir", input_file],
+        capture_output=True,
+        check=True,
+    )
+    output = process.stdout.decode("utf-8")
+
+    # `true !` is folded, and so is OP_NOT into the jump after it.
+    assert "OP_FALSE" in output
+    assert "OP_JNZ" in output
+    assert "OP_NOT" not in output
+
+    # The return after the if/else that returns either way is gone.
+    pick = output[output.index("fn pick") : output.index("fn both")]
+    assert pick.count("OP_RET") == 2
+
+
+def test_peephole_measure():
+    input_file = CASES_PATH / "peephole.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--no-cache", "-O", "--measure=optimize", input_file],
+        capture_output=True,
+        check=True,
+    )
+    output = process.stdout.decode("utf-8")
+
+    removed = re.search(r"peephole removed (\d+) instructions", output)
+    assert removed and int(removed.group(1)) > 0
@@ -1,6 +1,6 @@
 import subprocess
 
-from tests.util import VALGRIND_CMD, CASES_PATH
+from tests.util import VENOM_CMD, CASES_PATH
 from tests.util import assert_output
 
 
@@ -8,7 +8,7 @@ def test_pointers_01():
     input_file = CASES_PATH / "ptr01.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -22,7 +22,7 @@ def test_pointers_02():
     input_file = CASES_PATH / "ptr02.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -36,7 +36,7 @@ def test_pointers_03():
     input_file = CASES_PATH / "ptr03.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -50,7 +50,7 @@ def test_pointers_04():
     input_file = CASES_PATH / "ptr04.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -78,7 +78,7 @@ def test_pointers_05():
     input_file = CASES_PATH / "ptr05.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -92,7 +92,7 @@ def test_pointers_06():
     input_file = CASES_PATH / "ptr06.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -106,7 +106,7 @@ def test_pointers_07():
     input_file = CASES_PATH / "ptr07.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -120,7 +120,7 @@ def test_pointers_08():
     input_file = CASES_PATH / "ptr08.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -134,7 +134,7 @@ def test_pointers_09():
     input_file = CASES_PATH / "ptr09.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -148,7 +148,7 @@ def test_pointers_10():
     input_file = CASES_PATH / "ptr10.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -162,7 +162,7 @@ def test_pointers_linked_list():
     input_file = CASES_PATH / "linked_list.vnm"
 
     process = subprocess.run(
-        VALGRIND_CMD + [input_file],
+        VENOM_CMD + [input_file],
         capture_output=True,
         check=True,
     )
@@ -0,0 +1,43 @@
+import re
+import signal
+import subprocess
+from pathlib import Path
+
+# No venom program can make the VM release an object twice (that'd be
+# a bug in the VM), so the object is released twice by a small driver
+# that is linked against the VM's sources, built with debug=refcheck.
+DRIVER = """\
+#include <string.h>
+
+#include "object.h"
+#include "slab.h"
+
+int main(void)
+{
+  String s = {.refcount = 1, .type = OBJ_STRING, .value = strdup("x")};
+  Object obj = STRING_VAL(SLAB_ALLOC(SLAB_STRING, s));
+
+  objdecref(&obj);
+  objdecref(&obj); /* the second release */
+  return 0;
+}
+"""
+
+
+def test_double_decref_is_reported(tmp_path):
+    driver = tmp_path / "double_decref.c"
+    driver.write_text(DRIVER)
+
+    sources = [str(p) for p in sorted(Path("src").glob("*.c")) if p.name != "main.c"]
+    subprocess.run(
+        ["cc", "-DREFCHECK", "-Isrc", str(driver), *sources, "-o", str(tmp_path / "driver"), "-lm", "-lpthread"],
+        check=True,
+    )
+
+    process = subprocess.run([str(tmp_path / "driver")], capture_output=True)
+
+    # Reported and aborted, rather than left to corrupt the slab.
+    assert process.returncode == -signal.SIGABRT
+
+    error = process.stderr.decode("utf-8")
+    assert re.search(r"refcheck: string at 0x[0-9a-f]+ used after it was freed, at .*double_decref\.c:12", error)
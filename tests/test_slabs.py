@@ -0,0 +1,35 @@
+import re
+import subprocess
+
+from tests.util import VENOM_CMD, CASES_PATH
+from tests.util import assert_output
+
+
+def test_slabs():
+    input_file = CASES_PATH / "slabs.vnm"
+
+    process = subprocess.run(
+        VENOM_CMD + ["--measure=slabs", input_file],
+        capture_output=True,
+        check=True,
+    )
+
+    output = process.stdout.decode("utf-8")
+
+    assert_output(output, [50005000])
+
+    report = {}
+    for m in re.finditer(
+        r"slab (\w+): (\d+) slabs, (\d+) slots of \d+ bytes, "
+        r"(-?\d+) in use, (\d+) allocations",
+        output,
+    ):
+        name, slabs, slots, in_use, allocations = m.groups()
+        report[name] = (int(slabs), int(slots), int(in_use), int(allocations))
+
+    # Every one of the arrays is freed before the next one is made, so
+    # a single slab is enough for all of them.
+    assert report["Array"][0] == 1
+    assert report["Array"][3] == 10000
+
+    assert all(in_use == 0 for _, _, in_use, _ in report.values())
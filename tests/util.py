@@ -1,15 +1,21 @@
+import atexit
+import os
+import shutil
+import tempfile
 import textwrap
 from pathlib import Path
 from types import NoneType
 
-VALGRIND_CMD = [
-    "valgrind",
-    "--leak-check=full",
-    "--show-leak-kinds=all",
-    "--errors-for-leak-kinds=all",
-    "--error-exitcode=1",
-    "./venom",
-]
+# venom is expected to be built with debug=vm,refcheck, in which case it
+# exits with an error of its own on a leak or a double free.
+VENOM_CMD = ["./venom"]
+
+# The programs are compiled into a cache of their own, rather than into
+# the user's (~/.cache/venom), which the tests would otherwise fill up,
+# and run whatever some other build of venom left there.
+CACHE_HOME = tempfile.mkdtemp(prefix="venom-cache")
+os.environ["XDG_CACHE_HOME"] = CACHE_HOME
+atexit.register(shutil.rmtree, CACHE_HOME, ignore_errors=True)
 
 CASES_PATH = Path(".") / "tests" / "cases"
 